@@ -0,0 +1,198 @@
+/*
+ * Receive path benchmark : a local server thread streams PRIVMSG lines, the
+ * client dispatches them to an event_channel callback.
+ *
+ *   conn_bench [lines] [irc_conn|libircclient]
+ *
+ * The libircclient path is only built with -DBENCH_LIBIRCCLIENT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#ifdef BENCH_LIBIRCCLIENT
+#include <libircclient/libircclient.h>
+#endif
+
+#include "event_loop.h"
+#include "irc_conn.h"
+
+#define BENCH_CHUNK (64 * 1024)
+
+
+// ---
+
+typedef struct {
+	int listen_fd;
+	long lines;
+} bench_server_t;
+
+static long g_channel_lines = 0;
+
+
+// -----
+
+static void * serverThread(void * arg) {
+	bench_server_t * server = (bench_server_t *) arg;
+	int fd = accept(server->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	char * chunk = malloc(BENCH_CHUNK);
+	size_t len = snprintf(chunk, BENCH_CHUNK, ":bench.local 001 bench :Welcome\r\n");
+	long i;
+	for (i = 0; i < server->lines; i++) {
+		if (len > BENCH_CHUNK - 512) {
+			if (write(fd, chunk, len) < 0) {
+				break;
+			}
+			len = 0;
+		}
+		len += snprintf(chunk + len, BENCH_CHUNK - len,
+				":nick%ld!user@host.example.org PRIVMSG #chan%ld :Accepted package-%ld (1.%ld-1) source all\r\n",
+				i % 97, i % 13, i, i);
+	}
+	if (len && write(fd, chunk, len) < 0) {
+		// the client stops counting
+	}
+	free(chunk);
+	shutdown(fd, SHUT_WR);
+	char c;
+	while (read(fd, &c, 1) > 0) {
+		// wait for the client to close
+	}
+	close(fd);
+	return NULL;
+}
+
+static int listenLocal(int * port) {
+	struct sockaddr_in address;
+	socklen_t address_len = sizeof(address);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) || listen(fd, 1)
+			|| getsockname(fd, (struct sockaddr *) &address, &address_len)) {
+		perror("listen");
+		return -1;
+	}
+	*port = ntohs(address.sin_port);
+	return fd;
+}
+
+// ----- irc_conn
+
+static void onConnChannel(irc_conn_t * conn, const char * event, const char * origin, const char ** params, unsigned int count) {
+	g_channel_lines++;
+}
+
+static void onConnEvent(event_loop_t * loop, int fd, int events, void * data) {
+	if (!irc_conn_process((irc_conn_t *) data, events)) {
+		*(int *) irc_conn_get_ctx((irc_conn_t *) data) = 1;
+	}
+}
+
+static void runConn(int port) {
+	irc_conn_callbacks_t callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.event_channel = onConnChannel;
+
+	int done = 0;
+	event_loop_t * loop = event_loop_new();
+	irc_conn_t * conn = irc_conn_new(&callbacks, IRC_CONN_OPTION_STRIPNICKS);
+	irc_conn_set_ctx(conn, &done);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if (!irc_conn_connect(conn, "127.0.0.1", (struct sockaddr *) &address, sizeof(address), NULL, "bench", NULL, NULL)) {
+		return;
+	}
+	event_watch_t * watch = event_loop_watch(loop, irc_conn_get_fd(conn), onConnEvent, conn);
+	while (!done && event_loop_run_once(loop, -1)) {
+	}
+	event_loop_unwatch(loop, watch);
+	irc_conn_free(conn);
+	event_loop_free(loop);
+}
+
+// ----- libircclient
+
+#ifdef BENCH_LIBIRCCLIENT
+static void onSessionChannel(irc_session_t * session, const char * event, const char * origin, const char ** params, unsigned int count) {
+	g_channel_lines++;
+}
+
+static void runLibircclient(int port) {
+	irc_callbacks_t callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.event_channel = onSessionChannel;
+
+	irc_session_t * session = irc_create_session(&callbacks);
+	irc_option_set(session, LIBIRC_OPTION_STRIPNICKS);
+	if (irc_connect(session, "127.0.0.1", port, NULL, "bench", NULL, NULL)) {
+		fprintf(stderr, "irc_connect : %s\n", irc_strerror(irc_errno(session)));
+		return;
+	}
+	while (irc_is_connected(session)) {
+		fd_set in_set, out_set;
+		int maxfd = 0;
+		FD_ZERO(&in_set);
+		FD_ZERO(&out_set);
+		irc_add_select_descriptors(session, &in_set, &out_set, &maxfd);
+		if (select(maxfd + 1, &in_set, &out_set, NULL, NULL) < 0
+				|| irc_process_select_descriptors(session, &in_set, &out_set)) {
+			break;
+		}
+	}
+	irc_destroy_session(session);
+}
+#endif
+
+// -----
+
+int main(int argc, char ** argv) {
+	bench_server_t server;
+	const char * path = argc > 2 ? argv[2] : "irc_conn";
+	int port;
+
+	server.lines = argc > 1 ? atol(argv[1]) : 1000000;
+	server.listen_fd = listenLocal(&port);
+	if (server.listen_fd < 0) {
+		return 1;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, serverThread, &server);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!strcmp(path, "irc_conn")) {
+		runConn(port);
+#ifdef BENCH_LIBIRCCLIENT
+	} else if (!strcmp(path, "libircclient")) {
+		runLibircclient(port);
+#endif
+	} else {
+		fprintf(stderr, "unknown path %s\n", path);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_join(thread, NULL);
+	close(server.listen_fd);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s : %ld/%ld lines in %.3f s, %.0f lines/s\n", path, g_channel_lines, server.lines, seconds,
+			g_channel_lines / seconds);
+	return g_channel_lines == server.lines ? 0 : 1;
+}
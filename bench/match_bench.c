@@ -0,0 +1,406 @@
+/*
+ * Matching and dispatch benchmarks : synthetic PRIVMSG streams go through
+ * irc_message_parse(), the channel index and the filter sets, the way
+ * irc_conn_dispatch() and event_channel do it.
+ *
+ *   match_bench [-N messages]     run the standard scenarios
+ *   match_bench [options]         run one scenario
+ *     -c channels   channels of the server (default 10)
+ *     -f filters    filters per channel (default 10)
+ *     -r regex      literal, alternation or backtrack (default literal)
+ *     -n percent    messages from the nicks of the nickfilter, 100 without nickfilter (default 100)
+ *     -w nicks      nicks in the nickfilter (default 1)
+ *     -m percent    messages matching one of the filters (default 10)
+ *     -N messages   messages per scenario (default 200000)
+ *
+ * Reports messages/s and the p50/p99 latency of a message, then the time to
+ * load the configuration and to walk it with the conf_* accessors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "conf.h"
+#include "filter.h"
+#include "channel_index.h"
+#include "irc_message.h"
+#include "stats.h"
+#include "log.h"
+
+#define BENCH_NICK "Sid"
+#define BENCH_CONF_TEMPLATE "/tmp/match_bench.XXXXXX"
+
+
+// ---
+
+typedef enum {
+	REGEX_LITERAL = 0,
+	REGEX_ALTERNATION = 1,
+	REGEX_BACKTRACK = 2
+} bench_regex_t;
+
+static const char * regex_names[] = { "literal", "alternation", "backtrack" };
+
+typedef struct {
+	int channels;
+	int filters;
+	bench_regex_t regex;
+	int nick_hit;
+	int match_rate;
+	long messages;
+	int watched;
+} bench_scenario_t;
+
+typedef struct {
+	channel_index_t * channel_index;
+	normalized_line_t line;
+	long matches;
+} bench_ctx_t;
+
+static const bench_scenario_t g_scenarios[] = {
+	{ 1, 1, REGEX_LITERAL, 100, 10, 0, 1 },
+	{ 100, 10, REGEX_LITERAL, 100, 10, 0, 1 },
+	{ 1000, 10, REGEX_LITERAL, 100, 10, 0, 1 },
+	{ 10, 100, REGEX_LITERAL, 100, 10, 0, 1 },
+	{ 10, 100, REGEX_ALTERNATION, 100, 10, 0, 1 },
+	{ 10, 20, REGEX_BACKTRACK, 100, 10, 0, 1 },
+	{ 100, 10, REGEX_LITERAL, 10, 10, 0, 1 },
+	{ 100, 10, REGEX_LITERAL, 10, 10, 0, 500 },
+	{ 100, 10, REGEX_LITERAL, 50, 50, 0, 1 },
+};
+
+
+// ----- configuration
+
+static void writeRegex(FILE * file, bench_regex_t regex, int filter_idx) {
+	switch (regex) {
+	case REGEX_LITERAL:
+		fprintf(file, "{\"regex\": \"^Upload%d: ([^ ]+)\", \"vars\": [\"package\"]}", filter_idx);
+		break;
+	case REGEX_ALTERNATION:
+		fprintf(file, "{\"regex\": \"(Upload|Accept|Install)%d: ([^ ]+)( \\\\(([^)]*)\\\\))?\","
+				" \"vars\": [\"action\", \"package\", \"paren\", \"version\"]}", filter_idx);
+		break;
+	case REGEX_BACKTRACK:
+		// no literal outside of a group : every line runs the regex
+		fprintf(file, "{\"regex\": \"^([A-Za-z]+)(%d)[:]+ *([^ ]+)\", \"vars\": [\"action\", \"id\", \"package\"]}",
+				filter_idx);
+		break;
+	}
+}
+
+/*
+ * Write the configuration of scenario to a temporary file, return its name.
+ */
+static char * writeConf(const bench_scenario_t * scenario) {
+	char * filename = strdup(BENCH_CONF_TEMPLATE);
+	int fd = mkstemp(filename);
+	FILE * file = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!file) {
+		perror("mkstemp");
+		free(filename);
+		return NULL;
+	}
+
+	fprintf(file, "{\"servers\": [{\"name\": \"bench\", \"ip\": \"127.0.0.1\", \"port\": 6667, \"nick\": \"bench\","
+			" \"channels\": [\n");
+	int chan_idx, filter_idx;
+	for (chan_idx = 0; chan_idx < scenario->channels; chan_idx++) {
+		fprintf(file, "%s{\"name\": \"#chan%d\"", chan_idx ? ",\n" : "", chan_idx);
+		if (scenario->nick_hit < 100) {
+			fprintf(file, ", \"nickfilter\": [\"%s\"", BENCH_NICK);
+			int nick_idx;
+			for (nick_idx = 1; nick_idx < scenario->watched; nick_idx++) {
+				fprintf(file, ", \"watched%d\"", nick_idx);
+			}
+			fprintf(file, "]");
+		}
+		fprintf(file, ", \"filters\": [");
+		for (filter_idx = 0; filter_idx < scenario->filters; filter_idx++) {
+			fprintf(file, "%s{\"name\": \"filter%d\", \"regexes\": [", filter_idx ? ", " : "", filter_idx);
+			writeRegex(file, scenario->regex, filter_idx);
+			fprintf(file, "]}");
+		}
+		fprintf(file, "]}");
+	}
+	fprintf(file, "]}]}\n");
+	fclose(file);
+	return filename;
+}
+
+// ----- messages
+
+/*
+ * Raw lines of the stream, without CR LF, one every IRC_LINE_SIZE bytes.
+ */
+#define IRC_LINE_SIZE 512
+
+static char * generateLines(const bench_scenario_t * scenario) {
+	char * lines = malloc((size_t) scenario->messages * IRC_LINE_SIZE);
+	unsigned int seed = 42;
+	long i;
+	for (i = 0; i < scenario->messages; i++) {
+		char * line = lines + (size_t) i * IRC_LINE_SIZE;
+		int chan_idx = rand_r(&seed) % scenario->channels;
+		int from_nick = rand_r(&seed) % 100 < scenario->nick_hit;
+		int matching = rand_r(&seed) % 100 < scenario->match_rate;
+		int filter_idx = rand_r(&seed) % scenario->filters;
+		char nick[32];
+		int watched_idx = rand_r(&seed) % scenario->watched;
+		if (from_nick && watched_idx == 0) {
+			snprintf(nick, sizeof(nick), "%s", BENCH_NICK);
+		} else if (from_nick) {
+			snprintf(nick, sizeof(nick), "watched%d", watched_idx);
+		} else {
+			snprintf(nick, sizeof(nick), "user%d", rand_r(&seed) % 1000);
+		}
+		if (matching && i % 2) {
+			// bots announcing in colors
+			snprintf(line, IRC_LINE_SIZE, ":%s!~%s@host.example.org PRIVMSG #chan%d :\x02\x03" "03Upload%d\x03\x02: package-%ld (1.%ld-1)",
+					nick, nick, chan_idx, filter_idx, i, i % 97);
+		} else if (matching) {
+			snprintf(line, IRC_LINE_SIZE, ":%s!~%s@host.example.org PRIVMSG #chan%d :Upload%d: package-%ld (1.%ld-1)",
+					nick, nick, chan_idx, filter_idx, i, i % 97);
+		} else {
+			snprintf(line, IRC_LINE_SIZE, ":%s!~%s@host.example.org PRIVMSG #chan%d :some chatter about package-%ld, nothing to see",
+					nick, nick, chan_idx, i);
+		}
+	}
+	return lines;
+}
+
+// ----- dispatch
+
+static void onMatch(compiled_filter_t * filter, const char ** lines, int lines_count, void * data) {
+	((bench_ctx_t *) data)->matches++;
+}
+
+/*
+ * What irc_conn_dispatch() and event_channel do with a PRIVMSG to a channel.
+ */
+static void dispatchLine(bench_ctx_t * ctx, char * line) {
+	irc_message_t message;
+	if (!irc_message_parse(line, &message) || message.params_count != 2) {
+		return;
+	}
+	channel_entry_t * entry = channel_index_find(ctx->channel_index, message.params[0]);
+	const uint64_t * filters;
+	if (entry && channel_entry_accept(entry, message.prefix, &filters)) {
+		normalize_line(&ctx->line, message.params[1]);
+		filter_set_feed(channel_entry_get_filter_set(entry), &ctx->line, filters, onMatch, ctx);
+	}
+}
+
+static int runScenario(const bench_scenario_t * scenario) {
+	char * filename = writeConf(scenario);
+	if (!filename) {
+		return 0;
+	}
+	irc_conf_t * irc_conf = irc_conf_new();
+	int loaded = irc_conf_load(irc_conf, filename);
+	unlink(filename);
+	free(filename);
+	if (!loaded) {
+		irc_conf_free(irc_conf);
+		return 0;
+	}
+
+	const server_conf_t * server_conf = irc_conf_get_server_at(irc_conf, 0);
+	int channels_count = server_conf_get_channels_count(server_conf);
+	filter_set_t ** channel_filters = calloc(channels_count, sizeof(filter_set_t *));
+	bench_ctx_t ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.channel_index = channel_index_new(channels_count, CASEMAPPING_RFC1459);
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < channels_count; chan_idx++) {
+		const channel_conf_t * channel_conf = server_conf_get_channel_at(server_conf, chan_idx);
+		channel_filters[chan_idx] = filter_set_new(channel_conf);
+		channel_index_add(ctx.channel_index, channel_conf, channel_filters[chan_idx]);
+	}
+
+	char * lines = generateLines(scenario);
+	char line[IRC_LINE_SIZE];
+	stats_histogram_t * latency = calloc(1, sizeof(stats_histogram_t));
+
+	uint64_t start = stats_now_ns();
+	long i;
+	for (i = 0; i < scenario->messages; i++) {
+		// the parser splits the line in place, like the receive buffer
+		strcpy(line, lines + (size_t) i * IRC_LINE_SIZE);
+		uint64_t message_start = stats_now_ns();
+		dispatchLine(&ctx, line);
+		stats_histogram_record(latency, stats_now_ns() - message_start);
+	}
+	double seconds = (stats_now_ns() - start) / 1e9;
+
+	char label[96];
+	snprintf(label, sizeof(label), "%d chan x %d filters, %s, %d nicks %d%%, match %d%%",
+			scenario->channels, scenario->filters, regex_names[scenario->regex], scenario->watched, scenario->nick_hit,
+			scenario->match_rate);
+	printf("%-60s %10.0f msg/s  p50 %7llu ns  p99 %7llu ns  %ld matches\n", label, scenario->messages / seconds,
+			(unsigned long long) stats_histogram_percentile(latency, 50),
+			(unsigned long long) stats_histogram_percentile(latency, 99), ctx.matches);
+
+	free(latency);
+	free(lines);
+	channel_index_free(ctx.channel_index);
+	for (chan_idx = 0; chan_idx < channels_count; chan_idx++) {
+		filter_set_free(channel_filters[chan_idx]);
+	}
+	free(channel_filters);
+	irc_conf_free(irc_conf);
+	return 1;
+}
+
+// ----- configuration loading and accessors
+
+/*
+ * Visit every node through the accessors, return a checksum so nothing is optimized out.
+ */
+static unsigned long walkConf(const irc_conf_t * irc_conf, long * nodes) {
+	unsigned long checksum = 0;
+	int server_idx, chan_idx, filter_idx, regex_idx, var_idx;
+	for (server_idx = 0; server_idx < irc_conf_get_servers_count(irc_conf); server_idx++) {
+		const server_conf_t * server_conf = irc_conf_get_server_at(irc_conf, server_idx);
+		checksum += (unsigned long) server_conf_get_name(server_conf) + server_conf_get_port(server_conf);
+		(*nodes)++;
+		for (chan_idx = 0; chan_idx < server_conf_get_channels_count(server_conf); chan_idx++) {
+			const channel_conf_t * channel_conf = server_conf_get_channel_at(server_conf, chan_idx);
+			checksum += (unsigned long) channel_conf_get_name(channel_conf)
+					+ channel_conf_get_nickfilters_count(channel_conf);
+			(*nodes)++;
+			for (filter_idx = 0; filter_idx < channel_conf_get_filters_count(channel_conf); filter_idx++) {
+				const filter_conf_t * filter_conf = channel_conf_get_filter_at(channel_conf, filter_idx);
+				checksum += (unsigned long) filter_conf_get_name(filter_conf);
+				(*nodes)++;
+				for (regex_idx = 0; regex_idx < filter_conf_get_regexes_count(filter_conf); regex_idx++) {
+					const regex_conf_t * regex_conf = filter_conf_get_regex_at(filter_conf, regex_idx);
+					checksum += (unsigned long) regex_conf_get_regex(regex_conf);
+					(*nodes)++;
+					for (var_idx = 0; var_idx < regex_conf_get_vars_count(regex_conf); var_idx++) {
+						checksum += (unsigned long) regex_conf_get_var_at(regex_conf, var_idx);
+						(*nodes)++;
+					}
+				}
+			}
+		}
+	}
+	return checksum;
+}
+
+static int runConf() {
+	bench_scenario_t scenario = { 4000, 5, REGEX_ALTERNATION, 50, 0, 0 };
+	char * filename = writeConf(&scenario);
+	if (!filename) {
+		return 0;
+	}
+	char image_filename[64];
+	snprintf(image_filename, sizeof(image_filename), "%s.bin", filename);
+
+	uint64_t start = stats_now_ns();
+	irc_conf_t * irc_conf = irc_conf_new();
+	int ok = irc_conf_load(irc_conf, filename);
+	uint64_t json_ns = stats_now_ns() - start;
+
+	uint64_t image_ns = 0;
+	if (ok && irc_conf_write_image(irc_conf, image_filename)) {
+		start = stats_now_ns();
+		irc_conf_t * image_conf = irc_conf_new();
+		ok = irc_conf_load_image(image_conf, filename, image_filename);
+		image_ns = stats_now_ns() - start;
+		irc_conf_free(image_conf);
+		unlink(image_filename);
+	}
+	unlink(filename);
+	free(filename);
+	if (!ok) {
+		irc_conf_free(irc_conf);
+		return 0;
+	}
+	printf("conf load, %d channels x %d filters : json %.2f ms, image %.2f ms\n",
+			scenario.channels, scenario.filters, json_ns / 1e6, image_ns / 1e6);
+
+	long nodes = 0;
+	unsigned long checksum = 0;
+	int rounds = 100;
+	start = stats_now_ns();
+	int i;
+	for (i = 0; i < rounds; i++) {
+		checksum += walkConf(irc_conf, &nodes);
+	}
+	double walk_ns = stats_now_ns() - start;
+	printf("conf walk : %ld nodes in %.2f ms, %.2f ns/node (checksum %lx)\n", nodes, walk_ns / 1e6,
+			walk_ns / nodes, checksum & 0xffff);
+
+	irc_conf_free(irc_conf);
+	return 1;
+}
+
+// -----
+
+int main(int argc, char ** argv) {
+	bench_scenario_t scenario = { 10, 10, REGEX_LITERAL, 100, 10, 200000, 1 };
+	int custom = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:r:n:m:N:w:")) != -1) {
+		// -N alone keeps the standard scenarios
+		custom |= opt != 'N';
+		switch (opt) {
+		case 'c':
+			scenario.channels = atoi(optarg);
+			break;
+		case 'f':
+			scenario.filters = atoi(optarg);
+			break;
+		case 'r':
+			if (!strcmp(optarg, "literal")) {
+				scenario.regex = REGEX_LITERAL;
+			} else if (!strcmp(optarg, "alternation")) {
+				scenario.regex = REGEX_ALTERNATION;
+			} else if (!strcmp(optarg, "backtrack")) {
+				scenario.regex = REGEX_BACKTRACK;
+			} else {
+				fprintf(stderr, "unknown regex %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			scenario.nick_hit = atoi(optarg);
+			break;
+		case 'm':
+			scenario.match_rate = atoi(optarg);
+			break;
+		case 'N':
+			scenario.messages = atol(optarg);
+			break;
+		case 'w':
+			scenario.watched = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c channels] [-f filters] [-r literal|alternation|backtrack]"
+					" [-n nick%%] [-w nicks] [-m match%%] [-N messages]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (scenario.channels < 1 || scenario.filters < 1 || scenario.messages < 1 || scenario.watched < 1) {
+		fprintf(stderr, "channels, filters, nicks and messages must be positive\n");
+		return 1;
+	}
+	log_set_level(LOG_LEVEL_WARN);
+
+	if (custom) {
+		return runScenario(&scenario) ? 0 : 1;
+	}
+	size_t i;
+	for (i = 0; i < sizeof(g_scenarios) / sizeof(g_scenarios[0]); i++) {
+		bench_scenario_t standard = g_scenarios[i];
+		standard.messages = scenario.messages;
+		if (!runScenario(&standard)) {
+			return 1;
+		}
+	}
+	return runConf() ? 0 : 1;
+}
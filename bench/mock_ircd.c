@@ -0,0 +1,565 @@
+/*
+ * End-to-end load test : a fake IRC server floods the bot with PRIVMSG lines,
+ * and reads back the match events the bot writes to its UNIX socket output.
+ *
+ *   mock_ircd -w testIrc.conf [options]   write the bot configuration for the options
+ *   mock_ircd [options]                   serve the bot, then report
+ *     -p port        TCP port of the server (default 16667)
+ *     -o path        UNIX socket the bot writes its match events to (default mock_ircd.sock)
+ *     -c count       sessions of the bot, one server each (default 4)
+ *     -C count       channels per session (default 10)
+ *     -f count       filters per channel, only the first one can match (default 1)
+ *     -t threads     worker threads of the bot (default 1)
+ *     -r rate        lines/s sent per session, 0 for as fast as the bot reads (default 0)
+ *     -n percent     lines from the nick of the nickfilter, 100 without nickfilter (default 100)
+ *     -m percent     lines matching the filters (default 10)
+ *     -d seconds     duration of the flood (default 10)
+ *     -L limit       channels a connection can join, advertised in CHANLIMIT (default none)
+ *
+ * Every matching line carries the monotonic time it was sent at, captured by
+ * the filter : the latency of a match is measured from the server sending the
+ * line to the server reading the match event back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "event_loop.h"
+#include "irc_message.h"
+#include "stats.h"
+#include "log.h"
+
+#define MOCK_NICK "Sid"
+#define MOCK_TICK_MS 10
+// matches still in flight are waited for that long after the flood
+#define MOCK_DRAIN_MS 1000
+// lines are not generated while that much is waiting to be sent
+#define MOCK_SEND_MAX (256 * 1024)
+#define MOCK_RECV_SIZE 16384
+#define MOCK_LINE_MAX 512
+
+
+// ---
+
+typedef struct {
+	int port;
+	const char * output_path;
+	int sessions;
+	int channels;
+	int filters;
+	int threads;
+	long rate;
+	int nick_hit;
+	int match_rate;
+	int duration_s;
+	int chanlimit;
+} mock_options_t;
+
+typedef struct _mock_t mock_t;
+
+/*
+ * A connection from the bot, either a session or its match output.
+ */
+typedef struct {
+	mock_t * mock;
+	int fd;
+	event_watch_t * watch;
+	int is_output;
+
+	char recv_buffer[MOCK_RECV_SIZE];
+	size_t recv_len;
+
+	char * send_buffer;
+	size_t send_len;
+	size_t send_size;
+
+	char nick[64];
+	int got_user;
+	int registered;
+	char ** channels;
+	int channels_count;
+	unsigned int seed;
+	// fraction of a line carried over to the next tick
+	double credit;
+} mock_client_t;
+
+struct _mock_t {
+	mock_options_t options;
+	event_loop_t * loop;
+	int listen_fd;
+	int output_fd;
+	event_watch_t * listen_watch;
+	event_watch_t * output_watch;
+
+	mock_client_t ** clients;
+	int clients_count;
+	int clients_capacity;
+
+	int flooding;
+	int done;
+	long seq;
+	uint64_t flood_end_ns;
+	uint64_t progress_ns;
+
+	long lines_sent;
+	long matching_sent;
+	long events;
+	long events_last;
+	stats_histogram_t latency;
+};
+
+
+// ----- configuration
+
+static int writeConf(const mock_options_t * options, const char * filename) {
+	FILE * file = fopen(filename, "w");
+	if (!file) {
+		perror(filename);
+		return 0;
+	}
+	fprintf(file, "{\n    \"threads\": %d,\n", options->threads);
+	fprintf(file, "    \"output\": { \"type\": \"unix\", \"path\": \"%s\" },\n", options->output_path);
+	fprintf(file, "    \"log\": { \"level\": \"warn\" },\n");
+	fprintf(file, "    \"servers\": [\n");
+	int session_idx, chan_idx, filter_idx;
+	for (session_idx = 0; session_idx < options->sessions; session_idx++) {
+		fprintf(file, "    %s{\"name\": \"mock%d\", \"ip\": \"127.0.0.1\", \"port\": %d, \"nick\": \"bot%d\",\n",
+				session_idx ? "," : "", session_idx, options->port, session_idx);
+		fprintf(file, "     \"flood\": { \"burst\": 100, \"interval_ms\": 0 },\n");
+		fprintf(file, "     \"channels\": [\n");
+		for (chan_idx = 0; chan_idx < options->channels; chan_idx++) {
+			fprintf(file, "      %s{\"name\": \"#load%d\"", chan_idx ? "," : "", chan_idx);
+			if (options->nick_hit < 100) {
+				fprintf(file, ", \"nickfilter\": \"%s\"", MOCK_NICK);
+			}
+			fprintf(file, ", \"filters\": [");
+			for (filter_idx = 0; filter_idx < options->filters; filter_idx++) {
+				if (filter_idx == 0) {
+					fprintf(file, "{\"name\": \"accepted\", \"regexes\": [{\"regex\": \"^Accepted ([^ ]+) \\\\(([0-9]+)\\\\)\","
+							" \"vars\": [\"package\", \"sent_ns\"]}]}");
+				} else {
+					fprintf(file, ", {\"name\": \"rejected%d\", \"regexes\": [{\"regex\": \"^Rejected%d ([^ ]+)\","
+							" \"vars\": [\"package\"]}]}", filter_idx, filter_idx);
+				}
+			}
+			fprintf(file, "]}\n");
+		}
+		fprintf(file, "     ]}\n");
+	}
+	fprintf(file, "    ]\n}\n");
+	return fclose(file) == 0;
+}
+
+// ----- clients
+
+static void mockClientFree(mock_client_t * client) {
+	mock_t * mock = client->mock;
+	int i;
+	for (i = 0; i < mock->clients_count; i++) {
+		if (mock->clients[i] == client) {
+			mock->clients[i] = mock->clients[--mock->clients_count];
+			break;
+		}
+	}
+	event_loop_unwatch(mock->loop, client->watch);
+	close(client->fd);
+	for (i = 0; i < client->channels_count; i++) {
+		free(client->channels[i]);
+	}
+	free(client->channels);
+	free(client->send_buffer);
+	free(client);
+}
+
+/*
+ * Send what the socket accepts. Return 0 on error.
+ */
+static int mockClientFlush(mock_client_t * client) {
+	size_t sent = 0;
+	while (sent < client->send_len) {
+		ssize_t result = send(client->fd, client->send_buffer + sent, client->send_len - sent, MSG_NOSIGNAL);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return 0;
+		}
+		sent += result;
+	}
+	memmove(client->send_buffer, client->send_buffer + sent, client->send_len - sent);
+	client->send_len -= sent;
+	return 1;
+}
+
+static void mockClientSend(mock_client_t * client, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void mockClientSend(mock_client_t * client, const char * fmt, ...) {
+	if (client->send_len + MOCK_LINE_MAX > client->send_size) {
+		client->send_size = client->send_size ? client->send_size * 2 : 4096;
+		client->send_buffer = realloc(client->send_buffer, client->send_size);
+	}
+	va_list va_alist;
+	va_start(va_alist, fmt);
+	int len = vsnprintf(client->send_buffer + client->send_len, MOCK_LINE_MAX - 2, fmt, va_alist);
+	va_end(va_alist);
+	if (len > MOCK_LINE_MAX - 3) {
+		len = MOCK_LINE_MAX - 3;
+	}
+	memcpy(client->send_buffer + client->send_len + len, "\r\n", 2);
+	client->send_len += len + 2;
+}
+
+static void mockClientJoin(mock_client_t * client, const char * channels) {
+	char * list = strdup(channels);
+	char * save = NULL;
+	char * channel;
+	for (channel = strtok_r(list, ",", &save); channel; channel = strtok_r(NULL, ",", &save)) {
+		if (client->mock->options.chanlimit > 0 && client->channels_count >= client->mock->options.chanlimit) {
+			mockClientSend(client, ":mock.local 405 %s %s :You have joined too many channels", client->nick, channel);
+			continue;
+		}
+		client->channels = realloc(client->channels, (client->channels_count + 1) * sizeof(char *));
+		client->channels[client->channels_count++] = strdup(channel);
+		mockClientSend(client, ":%s!~%s@bot.example.org JOIN %s", client->nick, client->nick, channel);
+	}
+	free(list);
+}
+
+static void mockClientLine(mock_client_t * client, char * line) {
+	irc_message_t message;
+	if (!irc_message_parse(line, &message)) {
+		return;
+	}
+	const char * command = message.command;
+	if (!strcmp(command, "NICK") && message.params_count > 0) {
+		snprintf(client->nick, sizeof(client->nick), "%s", message.params[0]);
+	} else if (!strcmp(command, "USER")) {
+		client->got_user = 1;
+	} else if (!strcmp(command, "JOIN") && message.params_count > 0) {
+		mockClientJoin(client, message.params[0]);
+	} else if (!strcmp(command, "PING")) {
+		mockClientSend(client, "PONG :%s", message.params_count ? message.params[message.params_count - 1] : "");
+	}
+
+	if (!client->registered && client->nick[0] && client->got_user) {
+		client->registered = 1;
+		mockClientSend(client, ":mock.local 001 %s :Welcome to the mock network %s", client->nick, client->nick);
+		if (client->mock->options.chanlimit > 0) {
+			mockClientSend(client, ":mock.local 005 %s CHANLIMIT=#:%d NICKLEN=30 :are supported by this server",
+					client->nick, client->mock->options.chanlimit);
+		} else {
+			mockClientSend(client, ":mock.local 005 %s NICKLEN=30 :are supported by this server", client->nick);
+		}
+		mockClientSend(client, ":mock.local 376 %s :End of /MOTD command.", client->nick);
+	}
+}
+
+/*
+ * A match event of the bot : {"time":...,"vars":{"package":"...","sent_ns":"..."}}
+ */
+static void mockOutputLine(mock_client_t * client, char * line) {
+	mock_t * mock = client->mock;
+	mock->events++;
+	const char * sent = strstr(line, "\"sent_ns\":\"");
+	if (sent) {
+		uint64_t sent_ns = strtoull(sent + 11, NULL, 10);
+		uint64_t now = stats_now_ns();
+		if (now > sent_ns) {
+			stats_histogram_record(&mock->latency, now - sent_ns);
+		}
+	}
+}
+
+/*
+ * Read until the socket is drained. Return 0 once closed.
+ */
+static int mockClientRead(mock_client_t * client) {
+	for (;;) {
+		ssize_t result = recv(client->fd, client->recv_buffer + client->recv_len,
+				MOCK_RECV_SIZE - 1 - client->recv_len, 0);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (result == 0) {
+			return 0;
+		}
+		client->recv_len += result;
+		client->recv_buffer[client->recv_len] = '\0';
+
+		char * start = client->recv_buffer;
+		char * end;
+		while ((end = strchr(start, '\n'))) {
+			*end = '\0';
+			if (end > start && end[-1] == '\r') {
+				end[-1] = '\0';
+			}
+			if (client->is_output) {
+				mockOutputLine(client, start);
+			} else {
+				mockClientLine(client, start);
+			}
+			start = end + 1;
+		}
+		client->recv_len -= start - client->recv_buffer;
+		memmove(client->recv_buffer, start, client->recv_len);
+		if (client->recv_len == MOCK_RECV_SIZE - 1) {
+			// a line too long : drop it
+			client->recv_len = 0;
+		}
+	}
+}
+
+static void onClientEvent(event_loop_t * loop, int fd, int events, void * data) {
+	mock_client_t * client = (mock_client_t *) data;
+	if (!mockClientRead(client) || !mockClientFlush(client)) {
+		if (!client->is_output) {
+			fprintf(stderr, "session of %s closed\n", client->nick[0] ? client->nick : "?");
+		}
+		mockClientFree(client);
+	}
+}
+
+static void onAccept(event_loop_t * loop, int fd, int events, void * data) {
+	mock_t * mock = (mock_t *) data;
+	for (;;) {
+		int client_fd = accept(fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+		mock_client_t * client = calloc(1, sizeof(mock_client_t));
+		client->mock = mock;
+		client->fd = client_fd;
+		client->is_output = fd == mock->output_fd;
+		client->seed = mock->clients_count * 2654435761u + 1;
+		if (mock->clients_count == mock->clients_capacity) {
+			mock->clients_capacity = mock->clients_capacity ? mock->clients_capacity * 2 : 16;
+			mock->clients = realloc(mock->clients, mock->clients_capacity * sizeof(mock_client_t *));
+		}
+		mock->clients[mock->clients_count++] = client;
+		client->watch = event_loop_watch(loop, client_fd, onClientEvent, client);
+		if (!client->watch) {
+			mockClientFree(client);
+		}
+	}
+}
+
+// ----- flood
+
+static void floodClient(mock_t * mock, mock_client_t * client) {
+	long lines;
+	if (mock->options.rate > 0) {
+		client->credit += mock->options.rate * MOCK_TICK_MS / 1000.0;
+		lines = (long) client->credit;
+		client->credit -= lines;
+	} else {
+		lines = (MOCK_SEND_MAX - (long) client->send_len) / MOCK_LINE_MAX;
+	}
+
+	long i;
+	for (i = 0; i < lines && client->send_len < MOCK_SEND_MAX; i++) {
+		const char * channel = client->channels[rand_r(&client->seed) % client->channels_count];
+		int from_nick = rand_r(&client->seed) % 100 < mock->options.nick_hit;
+		int matching = rand_r(&client->seed) % 100 < mock->options.match_rate;
+		char nick[32];
+		if (from_nick) {
+			snprintf(nick, sizeof(nick), "%s", MOCK_NICK);
+		} else {
+			snprintf(nick, sizeof(nick), "user%u", rand_r(&client->seed) % 1000);
+		}
+		long seq = mock->seq++;
+		if (matching) {
+			mockClientSend(client, ":%s!~%s@host.example.org PRIVMSG %s :Accepted package-%ld (%llu) source all",
+					nick, nick, channel, seq, (unsigned long long) stats_now_ns());
+			if (from_nick) {
+				mock->matching_sent++;
+			}
+		} else {
+			mockClientSend(client, ":%s!~%s@host.example.org PRIVMSG %s :chatter about package-%ld, nothing to see",
+					nick, nick, channel, seq);
+		}
+		mock->lines_sent++;
+	}
+}
+
+static void onTick(event_loop_t * loop, void * data) {
+	mock_t * mock = (mock_t *) data;
+	uint64_t now = stats_now_ns();
+
+	if (!mock->flooding) {
+		// start once every session joined its channels, over as many connections as it takes
+		int joined = 0;
+		int connections = 0;
+		int i;
+		for (i = 0; i < mock->clients_count; i++) {
+			if (!mock->clients[i]->is_output) {
+				joined += mock->clients[i]->channels_count;
+				connections++;
+			}
+		}
+		if (joined == mock->options.sessions * mock->options.channels) {
+			printf("%d sessions joined over %d connections, flooding for %d s\n", mock->options.sessions, connections,
+					mock->options.duration_s);
+			mock->flooding = 1;
+			mock->flood_end_ns = now + mock->options.duration_s * 1000000000ULL;
+			mock->progress_ns = now + 1000000000;
+		}
+	} else if (now >= mock->flood_end_ns + MOCK_DRAIN_MS * 1000000ULL) {
+		mock->done = 1;
+		return;
+	}
+
+	int i;
+	for (i = mock->clients_count - 1; i >= 0; i--) {
+		mock_client_t * client = mock->clients[i];
+		if (client->is_output) {
+			continue;
+		}
+		if (mock->flooding && now < mock->flood_end_ns && client->channels_count) {
+			floodClient(mock, client);
+		}
+		if (!mockClientFlush(client)) {
+			mockClientFree(client);
+		}
+	}
+
+	if (mock->flooding && now >= mock->progress_ns && now < mock->flood_end_ns) {
+		mock->progress_ns += 1000000000;
+		printf("  %ld lines sent, %ld match events, +%ld/s\n", mock->lines_sent, mock->events,
+				mock->events - mock->events_last);
+		mock->events_last = mock->events;
+	}
+	event_loop_add_timer(loop, MOCK_TICK_MS, onTick, mock);
+}
+
+// ----- sockets
+
+static int listenTcp(int port) {
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+			|| bind(fd, (struct sockaddr *) &address, sizeof(address)) || listen(fd, 128)) {
+		perror("listen");
+		return -1;
+	}
+	return fd;
+}
+
+static int listenUnix(const char * path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "socket path too long : %s\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) || listen(fd, 4)) {
+		perror(path);
+		return -1;
+	}
+	return fd;
+}
+
+// -----
+
+static void report(mock_t * mock) {
+	double seconds = mock->options.duration_s;
+	printf("%ld lines sent in %.0f s, %.0f lines/s\n", mock->lines_sent, seconds, mock->lines_sent / seconds);
+	printf("%ld match events for %ld matching lines, %.0f matches/s\n", mock->events, mock->matching_sent,
+			mock->events / seconds);
+	printf("match latency : p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			stats_histogram_percentile(&mock->latency, 50) / 1e6, stats_histogram_percentile(&mock->latency, 90) / 1e6,
+			stats_histogram_percentile(&mock->latency, 99) / 1e6, mock->latency.max / 1e6);
+}
+
+int main(int argc, char ** argv) {
+	mock_options_t options = { 16667, "mock_ircd.sock", 4, 10, 1, 1, 0, 100, 10, 10, 0 };
+	const char * conf_filename = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:p:o:c:C:f:t:r:n:m:d:L:")) != -1) {
+		switch (opt) {
+		case 'w': conf_filename = optarg; break;
+		case 'p': options.port = atoi(optarg); break;
+		case 'o': options.output_path = optarg; break;
+		case 'c': options.sessions = atoi(optarg); break;
+		case 'C': options.channels = atoi(optarg); break;
+		case 'f': options.filters = atoi(optarg); break;
+		case 't': options.threads = atoi(optarg); break;
+		case 'r': options.rate = atol(optarg); break;
+		case 'n': options.nick_hit = atoi(optarg); break;
+		case 'm': options.match_rate = atoi(optarg); break;
+		case 'd': options.duration_s = atoi(optarg); break;
+		case 'L': options.chanlimit = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-w conf] [-p port] [-o output socket] [-c sessions] [-C channels] [-f filters]"
+					" [-t threads] [-r lines/s] [-n nick%%] [-m match%%] [-d seconds] [-L chanlimit]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (options.sessions < 1 || options.channels < 1 || options.filters < 1 || options.threads < 1
+			|| options.duration_s < 1) {
+		fprintf(stderr, "sessions, channels, filters, threads and duration must be positive\n");
+		return 1;
+	}
+	if (conf_filename) {
+		return writeConf(&options, conf_filename) ? 0 : 1;
+	}
+
+	mock_t mock;
+	memset(&mock, 0, sizeof(mock));
+	mock.options = options;
+	mock.loop = event_loop_new();
+	mock.listen_fd = listenTcp(options.port);
+	mock.output_fd = listenUnix(options.output_path);
+	if (!mock.loop || mock.listen_fd < 0 || mock.output_fd < 0) {
+		return 1;
+	}
+	mock.listen_watch = event_loop_watch(mock.loop, mock.listen_fd, onAccept, &mock);
+	mock.output_watch = event_loop_watch(mock.loop, mock.output_fd, onAccept, &mock);
+	event_loop_add_timer(mock.loop, MOCK_TICK_MS, onTick, &mock);
+	printf("waiting for %d sessions on port %d\n", options.sessions, options.port);
+
+	while (!mock.done && event_loop_run_once(mock.loop, -1)) {
+	}
+	report(&mock);
+
+	while (mock.clients_count) {
+		mockClientFree(mock.clients[0]);
+	}
+	free(mock.clients);
+	event_loop_unwatch(mock.loop, mock.listen_watch);
+	event_loop_unwatch(mock.loop, mock.output_watch);
+	close(mock.listen_fd);
+	close(mock.output_fd);
+	unlink(options.output_path);
+	event_loop_free(mock.loop);
+	return 0;
+}
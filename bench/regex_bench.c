@@ -0,0 +1,186 @@
+/*
+ * Regex backend benchmark : every pattern runs over the same channel lines
+ * with the posix backend and with the backend regex_backend_select() picks,
+ * case insensitively like a raw filter and case sensitively on the folded
+ * text like a normalized one.
+ *
+ *   regex_bench [-N lines]
+ *
+ * Reports ns/line for both backends and the speedup per pattern class. Exits
+ * with 1 if the two backends disagree on a line, whole match offsets included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "regex_backend.h"
+#include "normalize.h"
+#include "stats.h"
+
+// Bytes per line of the corpus.
+#define BENCH_LINE_SIZE 512
+// Distinct lines, replayed : the filters match lines that are in cache.
+#define BENCH_DISTINCT_LINES 1024
+
+
+// ---
+
+typedef struct {
+	// as written in the configuration, before fold_regex()
+	const char * regex;
+	const char * description;
+} bench_pattern_t;
+
+static const bench_pattern_t g_patterns[] = {
+	{ "Upload7:", "keyword" },
+	{ "package-424,", "rare keyword" },
+	{ "^Upload7:", "anchored keyword" },
+	{ "nothing to see$", "line end" },
+	{ "^some chatter about package-42, nothing to see$", "whole line" },
+	{ "^Upload7: .*", "keyword, rest of line" },
+	{ "^Upload7: ([^ ]+)", "capture" },
+	{ "(Upload|Accept)7: ", "alternation" },
+};
+
+typedef struct {
+	long matches;
+	double ns_per_line;
+} bench_result_t;
+
+
+// -----
+
+/*
+ * BENCH_DISTINCT_LINES lines, the texts of normalized channel messages if folded.
+ */
+static char * generateLines(int folded) {
+	long count = BENCH_DISTINCT_LINES;
+	char * lines = malloc((size_t) count * BENCH_LINE_SIZE);
+	normalized_line_t * normalized = malloc(sizeof(normalized_line_t));
+	unsigned int seed = 42;
+	long i;
+	for (i = 0; i < count; i++) {
+		char * line = lines + (size_t) i * BENCH_LINE_SIZE;
+		if (rand_r(&seed) % 100 < 10) {
+			snprintf(line, BENCH_LINE_SIZE, "%s%d: package-%ld (1.%ld-1)", i % 2 ? "UPLOAD" : "Upload",
+					rand_r(&seed) % 10, i, i % 97);
+		} else {
+			snprintf(line, BENCH_LINE_SIZE, "some chatter about package-%ld, nothing to see", i);
+		}
+		if (folded) {
+			normalize_line(normalized, line);
+			memcpy(line, normalized->folded, normalized->len + 1);
+		}
+	}
+	free(normalized);
+	return lines;
+}
+
+static void foldRegex(const char * regex, char * folded, size_t size) {
+	// the bench patterns have no escaped letter nor bracket
+	size_t i;
+	for (i = 0; regex[i] && i + 1 < size; i++) {
+		folded[i] = (regex[i] >= 'A' && regex[i] <= 'Z') ? regex[i] + ('a' - 'A') : regex[i];
+	}
+	folded[i] = '\0';
+}
+
+static int runBackend(const regex_backend_t * backend, const char * regex, int icase, const char * lines,
+		long count, regmatch_t * offsets, bench_result_t * result) {
+	regex_program_t program;
+	char error[256];
+	if (!regex_program_compile(&program, backend, regex, icase, error, sizeof(error))) {
+		fprintf(stderr, "%s : %s\n", regex, error);
+		return 0;
+	}
+	regmatch_t groups[8];
+	size_t ngroups = program.nsub + 1 < 8 ? program.nsub + 1 : 8;
+	result->matches = 0;
+	uint64_t start = stats_now_ns();
+	long i;
+	for (i = 0; i < count; i++) {
+		if (regex_program_exec(&program, lines + (size_t) (i % BENCH_DISTINCT_LINES) * BENCH_LINE_SIZE, ngroups,
+				groups)) {
+			result->matches++;
+			offsets[i] = groups[0];
+		} else {
+			offsets[i].rm_so = -1;
+			offsets[i].rm_eo = -1;
+		}
+	}
+	result->ns_per_line = (double) (stats_now_ns() - start) / count;
+	regex_program_free(&program);
+	return 1;
+}
+
+static int runPattern(const bench_pattern_t * pattern, int icase, const char * lines, long count) {
+	char folded[BENCH_LINE_SIZE];
+	const char * regex = pattern->regex;
+	if (!icase) {
+		foldRegex(pattern->regex, folded, sizeof(folded));
+		regex = folded;
+	}
+	char literal[BENCH_LINE_SIZE];
+	regex_class_t regex_class = regex_classify(regex, literal, sizeof(literal));
+	const regex_backend_t * backend = regex_backend_select(regex);
+
+	regmatch_t * posix_offsets = calloc(count, sizeof(regmatch_t));
+	regmatch_t * offsets = calloc(count, sizeof(regmatch_t));
+	bench_result_t posix_result, result;
+	int ok = runBackend(&regex_backend_posix, regex, icase, lines, count, posix_offsets, &posix_result)
+			&& runBackend(backend, regex, icase, lines, count, offsets, &result);
+	long i;
+	for (i = 0; ok && i < count; i++) {
+		if (offsets[i].rm_so != posix_offsets[i].rm_so || offsets[i].rm_eo != posix_offsets[i].rm_eo) {
+			fprintf(stderr, "%s disagrees with posix on \"%s\"\n", backend->name,
+					lines + (size_t) (i % BENCH_DISTINCT_LINES) * BENCH_LINE_SIZE);
+			ok = 0;
+		}
+	}
+	if (ok) {
+		char label[96];
+		snprintf(label, sizeof(label), "%s (%s), %s", pattern->description, regex_class_get_name(regex_class),
+				icase ? "raw" : "folded");
+		printf("%-44s posix %7.1f ns/line  %-7s %7.1f ns/line  x%5.1f  %ld matches\n", label,
+				posix_result.ns_per_line, backend->name, result.ns_per_line,
+				posix_result.ns_per_line / result.ns_per_line, result.matches);
+	}
+	free(posix_offsets);
+	free(offsets);
+	return ok;
+}
+
+// -----
+
+int main(int argc, char ** argv) {
+	long count = 200000;
+	int opt;
+	while ((opt = getopt(argc, argv, "N:")) != -1) {
+		switch (opt) {
+		case 'N':
+			count = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-N lines]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (count < 1) {
+		fprintf(stderr, "lines must be positive\n");
+		return 1;
+	}
+
+	char * raw_lines = generateLines(0);
+	char * folded_lines = generateLines(1);
+	int ok = 1;
+	size_t i;
+	for (i = 0; ok && i < sizeof(g_patterns) / sizeof(g_patterns[0]); i++) {
+		ok = runPattern(&g_patterns[i], 1, raw_lines, count) && runPattern(&g_patterns[i], 0, folded_lines, count);
+	}
+	free(raw_lines);
+	free(folded_lines);
+	return ok ? 0 : 1;
+}
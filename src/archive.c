@@ -0,0 +1,812 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mpsc_queue.h"
+#include "mpsc_wait.h"
+#include "archive.h"
+#include "casemap.h"
+#include "log.h"
+
+#define ARCHIVE_ARC_MAGIC "TIRCARC1"
+#define ARCHIVE_IDX_MAGIC "TIRCIDX1"
+#define ARCHIVE_MAGIC_SIZE 8
+// A batch is written when that many bytes are pending, or when its first line is that old.
+#define ARCHIVE_BATCH_SIZE (256 * 1024)
+#define ARCHIVE_FLUSH_MS 1000
+// Age limit checked that often when no segment is closed.
+#define ARCHIVE_RETENTION_CHECK_MS (60 * 60 * 1000)
+// Lines are timestamped by the workers and written in queue order, not quite in time order.
+#define ARCHIVE_CLOCK_SLACK_NS 1000000000ULL
+#define ARCHIVE_NAME_MAX 0xffff
+// varints of a record : time, 3 ids and the text length
+#define ARCHIVE_RECORD_HEADER_MAX (5 * 10)
+
+// dictionary entry of the index : type, length on 2 bytes, name
+#define ARCHIVE_ENTRY_NAME 'N'
+// batch entry of the index : type, then the fields of archive_block_t
+#define ARCHIVE_ENTRY_BLOCK 'B'
+
+
+// ---
+
+typedef struct {
+	mpsc_node_t node;
+	uint64_t time_ns;
+	uint16_t server_len;
+	uint16_t channel_len;
+	uint16_t origin_len;
+	uint16_t text_len;
+	// server, channel, origin and text, not NUL terminated
+	char buf[];
+} archive_record_t;
+
+typedef struct {
+	uint64_t offset;
+	uint64_t length;
+	// time of the first record, the others are deltas from the previous one
+	uint64_t base_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	// bit id % 64 for the id of each channel of the batch
+	uint64_t channels_mask;
+} archive_block_t;
+
+/*
+ * Names of a segment, by id in order of appearance.
+ */
+typedef struct {
+	char ** names;
+	uint16_t * lens;
+	uint32_t count;
+	uint32_t capacity;
+	// open addressing, id + 1, kept at most half full
+	uint32_t * slots;
+	size_t slots_mask;
+} archive_dict_t;
+
+typedef struct {
+	char * buf;
+	size_t len;
+	size_t size;
+} archive_buffer_t;
+
+struct _archive_t {
+	char * path;
+	// written by archive_set_limits(), read by the archive thread
+	uint64_t segment_size;
+	uint64_t max_size;
+	uint64_t max_age_s;
+
+	mpsc_queue_t queue;
+	mpsc_wait_t wait;
+	int stopping;
+	pthread_t thread;
+	int started;
+
+	// current segment, the fds are -1 when none is open
+	int arc_fd;
+	int idx_fd;
+	uint64_t segment_ns;
+	uint64_t arc_size;
+	archive_dict_t dict;
+
+	// batch being built, its dictionary entries then its block entry go to the index
+	archive_buffer_t batch;
+	archive_buffer_t index;
+	archive_block_t block;
+	uint64_t prev_ns;
+	// monotonic time of the first line of the batch
+	uint64_t batch_start_ns;
+	uint64_t retention_ns;
+	// a segment could not be opened : lines are dropped until the next attempt
+	uint64_t open_failed_ns;
+	uint64_t dropped;
+};
+
+
+// ----- encoding
+
+static void buffer_reserve(archive_buffer_t * buffer, size_t len) {
+	if (buffer->len + len > buffer->size) {
+		buffer->size = buffer->size ? buffer->size : 4096;
+		while (buffer->len + len > buffer->size) {
+			buffer->size *= 2;
+		}
+		buffer->buf = realloc(buffer->buf, buffer->size);
+	}
+}
+
+static void buffer_append(archive_buffer_t * buffer, const void * data, size_t len) {
+	buffer_reserve(buffer, len);
+	memcpy(buffer->buf + buffer->len, data, len);
+	buffer->len += len;
+}
+
+static void buffer_append_varint(archive_buffer_t * buffer, uint64_t value) {
+	buffer_reserve(buffer, 10);
+	unsigned char * dest = (unsigned char *) buffer->buf + buffer->len;
+	while (value >= 0x80) {
+		*dest++ = (unsigned char) value | 0x80;
+		value >>= 7;
+	}
+	*dest++ = (unsigned char) value;
+	buffer->len = (char *) dest - buffer->buf;
+}
+
+/*
+ * Read a varint at *p, before end. Return 0 if it is truncated.
+ */
+static int read_varint(const unsigned char ** p, const unsigned char * end, uint64_t * value) {
+	uint64_t result = 0;
+	int shift;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+		result |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*value = result;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint64_t zigzag(int64_t value) {
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static size_t hash_name(const char * name, size_t len) {
+	size_t hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int same_name(const char * name, size_t len, const char * other) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (irc_tolower(CASEMAPPING_RFC1459, name[i]) != irc_tolower(CASEMAPPING_RFC1459, other[i])) {
+			return 0;
+		}
+	}
+	return other[len] == '\0';
+}
+
+// ----- dictionary
+
+static void dict_clear(archive_dict_t * dict) {
+	uint32_t i;
+	for (i = 0; i < dict->count; i++) {
+		free(dict->names[i]);
+	}
+	free(dict->names);
+	free(dict->lens);
+	free(dict->slots);
+	memset(dict, 0, sizeof(archive_dict_t));
+}
+
+static void dict_insert_slot(archive_dict_t * dict, uint32_t id) {
+	size_t slot = hash_name(dict->names[id], dict->lens[id]) & dict->slots_mask;
+	while (dict->slots[slot]) {
+		slot = (slot + 1) & dict->slots_mask;
+	}
+	dict->slots[slot] = id + 1;
+}
+
+/*
+ * Id of name in the dictionary of the segment. A new name is added to the
+ * index along with the next batch.
+ */
+static uint32_t archive_intern(archive_t * archive, const char * name, size_t len) {
+	archive_dict_t * dict = &archive->dict;
+	if (dict->slots) {
+		size_t slot = hash_name(name, len) & dict->slots_mask;
+		while (dict->slots[slot]) {
+			uint32_t id = dict->slots[slot] - 1;
+			if (dict->lens[id] == len && !memcmp(dict->names[id], name, len)) {
+				return id;
+			}
+			slot = (slot + 1) & dict->slots_mask;
+		}
+	}
+
+	if (dict->count == dict->capacity) {
+		dict->capacity = dict->capacity ? dict->capacity * 2 : 64;
+		dict->names = realloc(dict->names, dict->capacity * sizeof(char *));
+		dict->lens = realloc(dict->lens, dict->capacity * sizeof(uint16_t));
+	}
+	uint32_t id = dict->count++;
+	dict->names[id] = malloc(len + 1);
+	memcpy(dict->names[id], name, len);
+	dict->names[id][len] = '\0';
+	dict->lens[id] = len;
+
+	if (dict->count * 2 > dict->slots_mask) {
+		free(dict->slots);
+		dict->slots_mask = dict->slots_mask ? dict->slots_mask * 2 + 1 : 255;
+		dict->slots = calloc(dict->slots_mask + 1, sizeof(uint32_t));
+		uint32_t i;
+		for (i = 0; i < dict->count; i++) {
+			dict_insert_slot(dict, i);
+		}
+	} else {
+		dict_insert_slot(dict, id);
+	}
+
+	unsigned char entry[3] = { ARCHIVE_ENTRY_NAME, len & 0xff, len >> 8 };
+	buffer_append(&archive->index, entry, sizeof(entry));
+	buffer_append(&archive->index, name, len);
+	return id;
+}
+
+// ----- segments
+
+static uint64_t realtime_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// for the flush and retention delays, which must not follow clock changes
+static uint64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void segment_filename(const char * path, uint64_t segment_ns, const char * extension, char * filename,
+		size_t size) {
+	snprintf(filename, size, "%s/%020llu.%s", path, (unsigned long long) segment_ns, extension);
+}
+
+static int compare_segments(const void * a, const void * b) {
+	uint64_t first = *(const uint64_t *) a;
+	uint64_t second = *(const uint64_t *) b;
+	return first < second ? -1 : first > second;
+}
+
+/*
+ * Times of the segments at path, oldest first, in a malloc()ed array. Return
+ * -1 if the directory could not be read.
+ */
+static int list_segments(const char * path, uint64_t ** segments) {
+	DIR * dir = opendir(path);
+	if (!dir) {
+		log_error("could not read archive %s : %s.", path, strerror(errno));
+		return -1;
+	}
+	int count = 0;
+	int capacity = 0;
+	*segments = NULL;
+	struct dirent * entry;
+	while ((entry = readdir(dir))) {
+		char * end;
+		unsigned long long segment_ns = strtoull(entry->d_name, &end, 10);
+		if (end - entry->d_name != 20 || strcmp(end, ".arc")) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			*segments = realloc(*segments, capacity * sizeof(uint64_t));
+		}
+		(*segments)[count++] = segment_ns;
+	}
+	closedir(dir);
+	if (count) {
+		qsort(*segments, count, sizeof(uint64_t), compare_segments);
+	}
+	return count;
+}
+
+static uint64_t file_size(const char * filename) {
+	struct stat st;
+	return stat(filename, &st) ? 0 : (uint64_t) st.st_size;
+}
+
+/*
+ * Delete the oldest segments past the limits, never the current one.
+ */
+static void archive_retain(archive_t * archive) {
+	uint64_t max_size = __atomic_load_n(&archive->max_size, __ATOMIC_RELAXED);
+	uint64_t max_age_s = __atomic_load_n(&archive->max_age_s, __ATOMIC_RELAXED);
+	archive->retention_ns = monotonic_ns();
+	if (!max_size && !max_age_s) {
+		return;
+	}
+	uint64_t * segments;
+	int count = list_segments(archive->path, &segments);
+	if (count <= 0) {
+		return;
+	}
+	char arc_filename[PATH_MAX];
+	char idx_filename[PATH_MAX];
+	uint64_t * sizes = calloc(count, sizeof(uint64_t));
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		segment_filename(archive->path, segments[i], "arc", arc_filename, sizeof(arc_filename));
+		segment_filename(archive->path, segments[i], "idx", idx_filename, sizeof(idx_filename));
+		sizes[i] = file_size(arc_filename) + file_size(idx_filename);
+		total += sizes[i];
+	}
+
+	uint64_t now = realtime_ns();
+	for (i = 0; i < count && segments[i] != archive->segment_ns; i++) {
+		// a segment ends when the next one starts
+		uint64_t end_ns = i + 1 < count ? segments[i + 1] : now;
+		if (!(max_size && total > max_size) && !(max_age_s && end_ns + max_age_s * 1000000000ULL < now)) {
+			break;
+		}
+		segment_filename(archive->path, segments[i], "arc", arc_filename, sizeof(arc_filename));
+		segment_filename(archive->path, segments[i], "idx", idx_filename, sizeof(idx_filename));
+		if (unlink(arc_filename) && errno != ENOENT) {
+			log_error("could not delete %s : %s.", arc_filename, strerror(errno));
+			break;
+		}
+		unlink(idx_filename);
+		total -= sizes[i];
+		log_info("Deleted archive segment %s.", arc_filename);
+	}
+	free(sizes);
+	free(segments);
+}
+
+static void archive_close_segment(archive_t * archive) {
+	if (archive->arc_fd >= 0) {
+		close(archive->arc_fd);
+		close(archive->idx_fd);
+	}
+	archive->arc_fd = -1;
+	archive->idx_fd = -1;
+	archive->index.len = 0;
+	dict_clear(&archive->dict);
+}
+
+static int write_all(int fd, const char * buf, size_t len) {
+	size_t written = 0;
+	while (written < len) {
+		ssize_t result = write(fd, buf + written, len - written);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		written += result;
+	}
+	return 1;
+}
+
+static int archive_open_segment(archive_t * archive) {
+	uint64_t segment_ns = realtime_ns();
+	// named after its time, which must be after the time of the previous one
+	if (segment_ns <= archive->segment_ns) {
+		segment_ns = archive->segment_ns + 1;
+	}
+	char arc_filename[PATH_MAX];
+	char idx_filename[PATH_MAX];
+	segment_filename(archive->path, segment_ns, "arc", arc_filename, sizeof(arc_filename));
+	segment_filename(archive->path, segment_ns, "idx", idx_filename, sizeof(idx_filename));
+	archive->arc_fd = open(arc_filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	archive->idx_fd = archive->arc_fd < 0 ? -1
+			: open(idx_filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	if (archive->idx_fd < 0 || !write_all(archive->arc_fd, ARCHIVE_ARC_MAGIC, ARCHIVE_MAGIC_SIZE)
+			|| !write_all(archive->idx_fd, ARCHIVE_IDX_MAGIC, ARCHIVE_MAGIC_SIZE)) {
+		log_error("could not create archive segment %s : %s.", arc_filename, strerror(errno));
+		if (archive->arc_fd >= 0) {
+			close(archive->arc_fd);
+			unlink(arc_filename);
+		}
+		if (archive->idx_fd >= 0) {
+			close(archive->idx_fd);
+			unlink(idx_filename);
+		}
+		archive->arc_fd = -1;
+		archive->idx_fd = -1;
+		return 0;
+	}
+	archive->segment_ns = segment_ns;
+	archive->arc_size = ARCHIVE_MAGIC_SIZE;
+	return 1;
+}
+
+// ----- archive thread
+
+/*
+ * Write the batch, then its entries to the index.
+ */
+static void archive_flush(archive_t * archive) {
+	if (!archive->batch.len) {
+		return;
+	}
+	archive->block.offset = archive->arc_size;
+	archive->block.length = archive->batch.len;
+	unsigned char type = ARCHIVE_ENTRY_BLOCK;
+	buffer_append(&archive->index, &type, 1);
+	buffer_append(&archive->index, &archive->block, sizeof(archive_block_t));
+
+	if (!write_all(archive->arc_fd, archive->batch.buf, archive->batch.len)
+			|| !write_all(archive->idx_fd, archive->index.buf, archive->index.len)) {
+		log_error("could not write to archive %s : %s, %zu bytes dropped.", archive->path, strerror(errno),
+				archive->batch.len);
+		// the ids of the batch may be missing from the index : start a new segment
+		archive_close_segment(archive);
+	} else {
+		archive->arc_size += archive->batch.len;
+		archive->index.len = 0;
+		if (archive->arc_size >= __atomic_load_n(&archive->segment_size, __ATOMIC_RELAXED)) {
+			archive_close_segment(archive);
+			archive_retain(archive);
+		}
+	}
+	archive->batch.len = 0;
+}
+
+static void archive_write(archive_t * archive, const archive_record_t * record) {
+	if (archive->batch.len + ARCHIVE_RECORD_HEADER_MAX + record->text_len > ARCHIVE_BATCH_SIZE) {
+		archive_flush(archive);
+	}
+	if (archive->arc_fd < 0) {
+		uint64_t now = monotonic_ns();
+		if ((archive->open_failed_ns && now - archive->open_failed_ns < ARCHIVE_FLUSH_MS * 1000000ULL)
+				|| !archive_open_segment(archive)) {
+			archive->open_failed_ns = archive->open_failed_ns ? archive->open_failed_ns : now;
+			archive->dropped++;
+			return;
+		}
+		archive->open_failed_ns = 0;
+	}
+	if (archive->dropped) {
+		log_warn("%llu channel lines were not archived.", (unsigned long long) archive->dropped);
+		archive->dropped = 0;
+	}
+
+	const char * name = record->buf;
+	uint32_t server_id = archive_intern(archive, name, record->server_len);
+	name += record->server_len;
+	uint32_t channel_id = archive_intern(archive, name, record->channel_len);
+	name += record->channel_len;
+	uint32_t origin_id = archive_intern(archive, name, record->origin_len);
+	name += record->origin_len;
+
+	if (!archive->batch.len) {
+		memset(&archive->block, 0, sizeof(archive_block_t));
+		archive->block.base_ns = record->time_ns;
+		archive->block.min_ns = record->time_ns;
+		archive->block.max_ns = record->time_ns;
+		archive->prev_ns = record->time_ns;
+		archive->batch_start_ns = monotonic_ns();
+	}
+	buffer_append_varint(&archive->batch, zigzag((int64_t) (record->time_ns - archive->prev_ns)));
+	buffer_append_varint(&archive->batch, server_id);
+	buffer_append_varint(&archive->batch, channel_id);
+	buffer_append_varint(&archive->batch, origin_id);
+	buffer_append_varint(&archive->batch, record->text_len);
+	buffer_append(&archive->batch, name, record->text_len);
+
+	archive->prev_ns = record->time_ns;
+	if (record->time_ns < archive->block.min_ns) {
+		archive->block.min_ns = record->time_ns;
+	}
+	if (record->time_ns > archive->block.max_ns) {
+		archive->block.max_ns = record->time_ns;
+	}
+	archive->block.channels_mask |= 1ULL << (channel_id % 64);
+}
+
+static void * archive_run(void * arg) {
+	archive_t * archive = (archive_t *) arg;
+	for (;;) {
+		mpsc_node_t * node;
+		while ((node = mpsc_queue_pop(&archive->queue))) {
+			archive_write(archive, (archive_record_t *) node);
+			free(node);
+		}
+
+		uint64_t now = monotonic_ns();
+		int stopping = __atomic_load_n(&archive->stopping, __ATOMIC_SEQ_CST);
+		if (stopping || (archive->batch.len && now - archive->batch_start_ns >= ARCHIVE_FLUSH_MS * 1000000ULL)) {
+			archive_flush(archive);
+		}
+		if (now - archive->retention_ns >= ARCHIVE_RETENTION_CHECK_MS * 1000000ULL) {
+			archive_retain(archive);
+		}
+		if (stopping) {
+			break;
+		}
+
+		uint64_t wait_ms = archive->batch.len
+				? ARCHIVE_FLUSH_MS - (now - archive->batch_start_ns) / 1000000 : ARCHIVE_RETENTION_CHECK_MS;
+		node = mpsc_wait_pop(&archive->wait, &archive->queue, (int) wait_ms);
+		if (node) {
+			archive_write(archive, (archive_record_t *) node);
+			free(node);
+		}
+	}
+	return NULL;
+}
+
+// ----- archive
+
+archive_t * archive_new(const char * path, const archive_limits_t * limits) {
+	archive_t * result = calloc(1, sizeof(struct _archive_t));
+	result->path = strdup(path);
+	result->arc_fd = -1;
+	result->idx_fd = -1;
+	archive_set_limits(result, limits);
+	mpsc_queue_init(&result->queue);
+	if (!mpsc_wait_init(&result->wait)) {
+		log_error("eventfd() : %s.", strerror(errno));
+		free(result->path);
+		free(result);
+		return NULL;
+	}
+	return result;
+}
+
+void archive_free(archive_t * archive) {
+	if (!archive) {
+		return;
+	}
+	archive_stop(archive);
+
+	// lines appended after the thread stopped
+	mpsc_node_t * node;
+	while ((node = mpsc_queue_pop(&archive->queue))) {
+		free(node);
+	}
+	archive_close_segment(archive);
+	mpsc_wait_destroy(&archive->wait);
+	free(archive->batch.buf);
+	free(archive->index.buf);
+	free(archive->path);
+	memset(archive, 0, sizeof(struct _archive_t));
+	free(archive);
+}
+
+int archive_start(archive_t * archive) {
+	if (mkdir(archive->path, 0755) && errno != EEXIST) {
+		log_error("could not create archive %s : %s.", archive->path, strerror(errno));
+		return 0;
+	}
+	// never appended to the segment of a previous run, whose dictionary is not known
+	if (!archive_open_segment(archive)) {
+		return 0;
+	}
+	archive_retain(archive);
+	int result = pthread_create(&archive->thread, NULL, archive_run, archive);
+	if (result) {
+		log_error("could not start the archive thread : %s.", strerror(result));
+		return 0;
+	}
+	archive->started = 1;
+	return 1;
+}
+
+void archive_stop(archive_t * archive) {
+	if (!archive->started) {
+		return;
+	}
+	__atomic_store_n(&archive->stopping, 1, __ATOMIC_SEQ_CST);
+	mpsc_wait_signal(&archive->wait);
+	pthread_join(archive->thread, NULL);
+	archive->started = 0;
+}
+
+void archive_set_limits(archive_t * archive, const archive_limits_t * limits) {
+	__atomic_store_n(&archive->segment_size, limits->segment_size, __ATOMIC_RELAXED);
+	__atomic_store_n(&archive->max_size, limits->max_size, __ATOMIC_RELAXED);
+	__atomic_store_n(&archive->max_age_s, limits->max_age_s, __ATOMIC_RELAXED);
+}
+
+void archive_append(archive_t * archive, const char * server, const char * channel, const char * origin,
+		const char * text) {
+	size_t server_len = strnlen(server, ARCHIVE_NAME_MAX);
+	size_t channel_len = strnlen(channel, ARCHIVE_NAME_MAX);
+	size_t origin_len = strnlen(origin, ARCHIVE_NAME_MAX);
+	size_t text_len = strnlen(text, ARCHIVE_NAME_MAX);
+	archive_record_t * record = malloc(sizeof(archive_record_t) + server_len + channel_len + origin_len + text_len);
+	if (!record) {
+		log_error("channel line not archived, out of memory.");
+		return;
+	}
+	record->time_ns = realtime_ns();
+	record->server_len = server_len;
+	record->channel_len = channel_len;
+	record->origin_len = origin_len;
+	record->text_len = text_len;
+	char * dest = record->buf;
+	memcpy(dest, server, server_len);
+	dest += server_len;
+	memcpy(dest, channel, channel_len);
+	dest += channel_len;
+	memcpy(dest, origin, origin_len);
+	dest += origin_len;
+	memcpy(dest, text, text_len);
+
+	mpsc_queue_push(&archive->queue, &record->node);
+	mpsc_wait_wake(&archive->wait);
+}
+
+// ----- query
+
+typedef struct {
+	const char * server;
+	const char * channel;
+	uint64_t from_ns;
+	uint64_t to_ns;
+	archive_record_handler_t handler;
+	void * data;
+
+	// dictionary of the segment, pointing into its index, with the names matching the query
+	archive_dict_t dict;
+	char * server_match;
+	char * channel_match;
+	uint64_t channels_mask;
+} archive_query_t;
+
+/*
+ * Map filename, NULL if it is empty or could not be read.
+ */
+static const unsigned char * map_file(const char * filename, size_t * size) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		log_error("could not map %s : %s.", filename, strerror(errno));
+		return NULL;
+	}
+	*size = st.st_size;
+	return data;
+}
+
+static void query_add_name(archive_query_t * query, const unsigned char * name, size_t len) {
+	archive_dict_t * dict = &query->dict;
+	if (dict->count == dict->capacity) {
+		dict->capacity = dict->capacity ? dict->capacity * 2 : 64;
+		dict->names = realloc(dict->names, dict->capacity * sizeof(char *));
+		dict->lens = realloc(dict->lens, dict->capacity * sizeof(uint16_t));
+		query->server_match = realloc(query->server_match, dict->capacity);
+		query->channel_match = realloc(query->channel_match, dict->capacity);
+	}
+	uint32_t id = dict->count++;
+	dict->names[id] = malloc(len + 1);
+	memcpy(dict->names[id], name, len);
+	dict->names[id][len] = '\0';
+	dict->lens[id] = len;
+	query->server_match[id] = !query->server || !strcmp(dict->names[id], query->server);
+	query->channel_match[id] = same_name(query->channel, strlen(query->channel), dict->names[id]);
+	if (query->channel_match[id]) {
+		query->channels_mask |= 1ULL << (id % 64);
+	}
+}
+
+static void query_block(archive_query_t * query, const archive_block_t * block, const unsigned char * arc,
+		size_t arc_size) {
+	if (block->max_ns < query->from_ns || block->min_ns > query->to_ns || !(block->channels_mask & query->channels_mask)
+			|| block->offset > arc_size || block->length > arc_size - block->offset) {
+		return;
+	}
+	const unsigned char * p = arc + block->offset;
+	const unsigned char * end = p + block->length;
+	uint64_t time_ns = block->base_ns;
+	const char ** names = (const char **) query->dict.names;
+	while (p < end) {
+		uint64_t delta, server_id, channel_id, origin_id, text_len;
+		if (!read_varint(&p, end, &delta) || !read_varint(&p, end, &server_id) || !read_varint(&p, end, &channel_id)
+				|| !read_varint(&p, end, &origin_id) || !read_varint(&p, end, &text_len)
+				|| server_id >= query->dict.count || channel_id >= query->dict.count || origin_id >= query->dict.count
+				|| text_len > (uint64_t) (end - p)) {
+			log_warn("corrupted archive batch at %llu.", (unsigned long long) block->offset);
+			return;
+		}
+		time_ns += unzigzag(delta);
+		if (query->channel_match[channel_id] && query->server_match[server_id]
+				&& time_ns >= query->from_ns && time_ns <= query->to_ns) {
+			query->handler(time_ns, names[server_id], names[channel_id], names[origin_id], (const char *) p, text_len,
+					query->data);
+		}
+		p += text_len;
+	}
+}
+
+static void query_segment(archive_query_t * query, const char * path, uint64_t segment_ns) {
+	char arc_filename[PATH_MAX];
+	char idx_filename[PATH_MAX];
+	segment_filename(path, segment_ns, "arc", arc_filename, sizeof(arc_filename));
+	segment_filename(path, segment_ns, "idx", idx_filename, sizeof(idx_filename));
+	size_t idx_size, arc_size;
+	const unsigned char * idx = map_file(idx_filename, &idx_size);
+	const unsigned char * arc = idx ? map_file(arc_filename, &arc_size) : NULL;
+	if (!arc || idx_size < ARCHIVE_MAGIC_SIZE || memcmp(idx, ARCHIVE_IDX_MAGIC, ARCHIVE_MAGIC_SIZE)
+			|| arc_size < ARCHIVE_MAGIC_SIZE || memcmp(arc, ARCHIVE_ARC_MAGIC, ARCHIVE_MAGIC_SIZE)) {
+		if (idx) {
+			munmap((void *) idx, idx_size);
+		}
+		if (arc) {
+			munmap((void *) arc, arc_size);
+		}
+		return;
+	}
+	madvise((void *) arc, arc_size, MADV_RANDOM);
+
+	query->channels_mask = 0;
+	// an entry cut by a crash ends the index
+	const unsigned char * p = idx + ARCHIVE_MAGIC_SIZE;
+	const unsigned char * end = idx + idx_size;
+	while (p < end) {
+		if (*p == ARCHIVE_ENTRY_NAME && end - p >= 3) {
+			size_t len = p[1] | (p[2] << 8);
+			if ((size_t) (end - p - 3) < len) {
+				break;
+			}
+			query_add_name(query, p + 3, len);
+			p += 3 + len;
+		} else if (*p == ARCHIVE_ENTRY_BLOCK && (size_t) (end - p) >= 1 + sizeof(archive_block_t)) {
+			archive_block_t block;
+			memcpy(&block, p + 1, sizeof(block));
+			query_block(query, &block, arc, arc_size);
+			p += 1 + sizeof(archive_block_t);
+		} else {
+			break;
+		}
+	}
+
+	dict_clear(&query->dict);
+	munmap((void *) idx, idx_size);
+	munmap((void *) arc, arc_size);
+}
+
+int archive_query(const char * path, const char * server, const char * channel, uint64_t from_ns, uint64_t to_ns,
+		archive_record_handler_t handler, void * data) {
+	uint64_t * segments;
+	int count = list_segments(path, &segments);
+	if (count < 0) {
+		return 0;
+	}
+	archive_query_t query;
+	memset(&query, 0, sizeof(query));
+	query.server = server;
+	query.channel = channel;
+	query.from_ns = from_ns;
+	query.to_ns = to_ns;
+	query.handler = handler;
+	query.data = data;
+
+	uint64_t to_slack_ns = to_ns < UINT64_MAX - ARCHIVE_CLOCK_SLACK_NS ? to_ns + ARCHIVE_CLOCK_SLACK_NS : UINT64_MAX;
+	int i;
+	for (i = 0; i < count; i++) {
+		// a segment spans from its time to the time of the next one
+		if (segments[i] > to_slack_ns
+				|| (i + 1 < count && segments[i + 1] + ARCHIVE_CLOCK_SLACK_NS < from_ns)) {
+			continue;
+		}
+		query_segment(&query, path, segments[i]);
+	}
+	free(query.server_match);
+	free(query.channel_match);
+	free(segments);
+	return 1;
+}
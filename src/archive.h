@@ -0,0 +1,87 @@
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Append-only archive of the channel traffic, for audits and to run filters
+ * again on it.
+ *
+ * Worker threads queue the channel lines through a lock-free queue, an
+ * archive thread writes them in batches, at least every second, to segments
+ * in a directory. A segment is two append-only files named after the time it
+ * was opened at, in ns :
+ *
+ *   <time>.arc  its records : time, server, channel, sender and text
+ *   <time>.idx  its dictionary of server, channel and sender names, and an
+ *               entry per batch of the .arc : offset, length, time range and
+ *               the channels it holds, as a mask of their ids
+ *
+ * Records are varints : the time as a delta from the previous record of the
+ * batch, the names as ids in the dictionary of the segment, then the text.
+ * The sender is its whole prefix, nick!user@host, so that the nickfilter
+ * masks match the archived lines as they matched the live ones.
+ * A batch is only referenced by the index once written, so a crash loses the
+ * batch being written and nothing else. A new segment is opened on start and
+ * once the current one reaches its size, the oldest ones are deleted past the
+ * size or age limits of the archive.
+ *
+ * archive_query() only maps the segments whose time span overlaps the range
+ * asked for, and only decodes their batches that overlap it too and can hold
+ * the channel.
+ */
+
+typedef struct _archive_t archive_t;
+
+typedef struct {
+	uint64_t segment_size;
+	// of all the segments, 0 for no limit
+	uint64_t max_size;
+	// 0 for no limit
+	uint64_t max_age_s;
+} archive_limits_t;
+
+/*
+ * Called by archive_query() for each record, origin is the prefix of the
+ * sender, text is not NUL terminated.
+ */
+typedef void (*archive_record_handler_t)(uint64_t time_ns, const char * server, const char * channel,
+		const char * origin, const char * text, size_t text_len, void * data);
+
+archive_t * archive_new(const char * path, const archive_limits_t * limits);
+
+void archive_free(archive_t * archive);
+
+/*
+ * Create the directory, open a new segment and start the archive thread. Return 0 on error.
+ */
+int archive_start(archive_t * archive);
+
+/*
+ * Write the queued lines, then stop the archive thread.
+ */
+void archive_stop(archive_t * archive);
+
+/*
+ * Apply new limits from the next batch on, e.g. after a reload.
+ */
+void archive_set_limits(archive_t * archive, const archive_limits_t * limits);
+
+/*
+ * Queue a channel line from origin, nick!user@host, timestamped now. Can be
+ * called from any thread.
+ */
+void archive_append(archive_t * archive, const char * server, const char * channel, const char * origin,
+		const char * text);
+
+/*
+ * Call handler for the records of channel, case insensitively, on
+ * server or any if NULL, timestamped from from_ns to to_ns included.
+ * Return 0 if the archive at path could not be read.
+ */
+int archive_query(const char * path, const char * server, const char * channel, uint64_t from_ns, uint64_t to_ns,
+		archive_record_handler_t handler, void * data);
+
+
+#endif /* ARCHIVE_H_ */
@@ -0,0 +1,12 @@
+#include "casemap.h"
+
+int irc_strcasecmp(irc_casemapping_t casemapping, const char * s1, const char * s2) {
+	const unsigned char * p1 = (const unsigned char *) s1;
+	const unsigned char * p2 = (const unsigned char *) s2;
+	int c1, c2;
+	do {
+		c1 = irc_tolower(casemapping, *p1++);
+		c2 = irc_tolower(casemapping, *p2++);
+	} while (c1 && c1 == c2);
+	return c1 - c2;
+}
@@ -0,0 +1,31 @@
+#ifndef CASEMAP_H_
+#define CASEMAP_H_
+
+/*
+ * IRC case mappings, as advertised by the CASEMAPPING token of RPL_ISUPPORT.
+ * RFC1459 is the default : "{}|^" are the lower case of "[]\~".
+ */
+typedef enum {
+	CASEMAPPING_ASCII = 0,
+	CASEMAPPING_RFC1459 = 1,
+	CASEMAPPING_STRICT_RFC1459 = 2
+} irc_casemapping_t;
+
+static inline int irc_tolower(irc_casemapping_t casemapping, int c) {
+	if (c >= 'A' && c <= 'Z') {
+		return c + ('a' - 'A');
+	}
+	if (casemapping != CASEMAPPING_ASCII && c >= '[' && c <= ']') {
+		// '[' -> '{', '\' -> '|', ']' -> '}'
+		return c + ('{' - '[');
+	}
+	if (casemapping == CASEMAPPING_RFC1459 && c == '~') {
+		return '^';
+	}
+	return c;
+}
+
+int irc_strcasecmp(irc_casemapping_t casemapping, const char * s1, const char * s2);
+
+
+#endif /* CASEMAP_H_ */
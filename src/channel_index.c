@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel_index.h"
+#include "log.h"
+
+
+// ---
+
+struct _channel_entry_t {
+	size_t hash;
+	const channel_conf_t * channel_conf;
+	const char * name;
+	filter_set_t * filter_set;
+
+	// NULL if neither the channel nor its filters watch nicks
+	nick_filter_t * nick_filter;
+	// filter i is group i, the nickfilter of the channel is channel_group, -1 if it has none
+	int channel_group;
+	// filters restricted to nicks, NULL if there is none
+	uint64_t * restricted;
+	int all_restricted;
+	// groups of the last sender
+	uint64_t * groups;
+};
+
+struct _channel_index_t {
+	irc_casemapping_t casemapping;
+
+	// open addressing, kept at most half full
+	channel_entry_t ** slots;
+	size_t slots_mask;
+
+	channel_entry_t * entries;
+	int entries_count;
+	int entries_capacity;
+};
+
+
+// ----- channel_entry
+
+const channel_conf_t * channel_entry_get_conf(const channel_entry_t * entry) {
+	return entry->channel_conf;
+}
+
+filter_set_t * channel_entry_get_filter_set(const channel_entry_t * entry) {
+	return entry->filter_set;
+}
+
+int channel_entry_accept(channel_entry_t * entry, const char * prefix, const uint64_t ** filters) {
+	*filters = NULL;
+	if (!entry->nick_filter) {
+		return 1;
+	}
+	int matched = nick_filter_match(entry->nick_filter, prefix, entry->groups);
+	int group = entry->channel_group;
+	if (group >= 0 && !((entry->groups[group / 64] >> (group % 64)) & 1)) {
+		return 0;
+	}
+	if (!entry->restricted) {
+		return 1;
+	}
+	// the nicks of the filters are the nickfilter of a channel without one
+	if (group < 0 && entry->all_restricted && !matched) {
+		return 0;
+	}
+	int i;
+	for (i = 0; i < nick_filter_get_words_count(entry->nick_filter); i++) {
+		entry->groups[i] |= ~entry->restricted[i];
+	}
+	*filters = entry->groups;
+	return 1;
+}
+
+static void channel_entry_init_nicks(channel_entry_t * entry, const channel_conf_t * channel_conf,
+		irc_casemapping_t casemapping) {
+	int filters_count = channel_conf_get_filters_count(channel_conf);
+	int nickfilters_count = channel_conf_get_nickfilters_count(channel_conf);
+	int restricted_count = 0;
+	int i, j;
+	for (i = 0; i < filters_count; i++) {
+		restricted_count += filter_conf_get_nicks_count(channel_conf_get_filter_at(channel_conf, i)) > 0;
+	}
+	entry->channel_group = -1;
+	if (!nickfilters_count && !restricted_count) {
+		return;
+	}
+
+	entry->nick_filter = nick_filter_new(filters_count + 1, casemapping);
+	int words_count = nick_filter_get_words_count(entry->nick_filter);
+	entry->groups = calloc(words_count, sizeof(uint64_t));
+	if (nickfilters_count) {
+		entry->channel_group = filters_count;
+		for (i = 0; i < nickfilters_count; i++) {
+			nick_filter_add(entry->nick_filter, channel_conf_get_nickfilter_at(channel_conf, i), filters_count);
+		}
+	}
+	if (restricted_count) {
+		entry->restricted = calloc(words_count, sizeof(uint64_t));
+		entry->all_restricted = restricted_count == filters_count;
+		for (i = 0; i < filters_count; i++) {
+			const filter_conf_t * filter_conf = channel_conf_get_filter_at(channel_conf, i);
+			if (filter_conf_get_nicks_count(filter_conf) > 0) {
+				entry->restricted[i / 64] |= (uint64_t) 1 << (i % 64);
+			}
+			for (j = 0; j < filter_conf_get_nicks_count(filter_conf); j++) {
+				nick_filter_add(entry->nick_filter, filter_conf_get_nick_at(filter_conf, j), i);
+			}
+		}
+	}
+}
+
+// ----- channel_index
+
+static size_t channel_hash(irc_casemapping_t casemapping, const char * name) {
+	// FNV-1a on the case folded name
+	size_t hash = 2166136261u;
+	const unsigned char * p;
+	for (p = (const unsigned char *) name; *p; p++) {
+		hash ^= (unsigned char) irc_tolower(casemapping, *p);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+channel_index_t * channel_index_new(int channels_count, irc_casemapping_t casemapping) {
+	channel_index_t * result = calloc(1, sizeof(struct _channel_index_t));
+	result->casemapping = casemapping;
+
+	size_t slots_count = 1;
+	while (slots_count < (size_t) channels_count * 2) {
+		slots_count <<= 1;
+	}
+	result->slots = calloc(slots_count, sizeof(channel_entry_t *));
+	result->slots_mask = slots_count - 1;
+
+	result->entries_capacity = channels_count;
+	result->entries = calloc(channels_count ? channels_count : 1, sizeof(channel_entry_t));
+	return result;
+}
+
+void channel_index_free(channel_index_t * channel_index) {
+	if (!channel_index) {
+		return;
+	}
+	int i;
+	for (i = 0; i < channel_index->entries_count; i++) {
+		channel_entry_t * entry = &channel_index->entries[i];
+		nick_filter_free(entry->nick_filter);
+		free(entry->restricted);
+		free(entry->groups);
+	}
+	free(channel_index->slots);
+	free(channel_index->entries);
+	memset(channel_index, 0, sizeof(struct _channel_index_t));
+	free(channel_index);
+}
+
+int channel_index_add(channel_index_t * channel_index, const channel_conf_t * channel_conf, filter_set_t * filter_set) {
+	const char * name = channel_conf_get_name(channel_conf);
+	if (channel_index->entries_count == channel_index->entries_capacity) {
+		log_error("channel index is full, %s not added.", name);
+		return 0;
+	}
+
+	size_t hash = channel_hash(channel_index->casemapping, name);
+	size_t idx = hash & channel_index->slots_mask;
+	while (channel_index->slots[idx]) {
+		channel_entry_t * entry = channel_index->slots[idx];
+		if (entry->hash == hash && !irc_strcasecmp(channel_index->casemapping, entry->name, name)) {
+			log_warn("channel %s is configured twice, only the first one is used.", name);
+			return 0;
+		}
+		idx = (idx + 1) & channel_index->slots_mask;
+	}
+
+	channel_entry_t * entry = &channel_index->entries[channel_index->entries_count++];
+	entry->hash = hash;
+	entry->channel_conf = channel_conf;
+	entry->name = name;
+	entry->filter_set = filter_set;
+	channel_entry_init_nicks(entry, channel_conf, channel_index->casemapping);
+	channel_index->slots[idx] = entry;
+	return 1;
+}
+
+channel_entry_t * channel_index_find(const channel_index_t * channel_index, const char * name) {
+	size_t hash = channel_hash(channel_index->casemapping, name);
+	size_t idx = hash & channel_index->slots_mask;
+	while (channel_index->slots[idx]) {
+		channel_entry_t * entry = channel_index->slots[idx];
+		if (entry->hash == hash && !irc_strcasecmp(channel_index->casemapping, entry->name, name)) {
+			return entry;
+		}
+		idx = (idx + 1) & channel_index->slots_mask;
+	}
+	return NULL;
+}
+
+irc_casemapping_t channel_index_get_casemapping(const channel_index_t * channel_index) {
+	return channel_index->casemapping;
+}
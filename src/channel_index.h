@@ -0,0 +1,54 @@
+#ifndef CHANNEL_INDEX_H_
+#define CHANNEL_INDEX_H_
+
+#include "conf.h"
+#include "filter.h"
+#include "casemap.h"
+#include "nick_filter.h"
+
+/*
+ * Hash index of the channels of a server, keyed on the case folded channel name.
+ * It does not own the filter sets it references. Each entry indexes the nicks
+ * watched by its channel and its filters, see nick_filter.h.
+ */
+
+typedef struct _channel_entry_t channel_entry_t;
+typedef struct _channel_index_t channel_index_t;
+
+// ----- channel_entry
+
+const channel_conf_t * channel_entry_get_conf(const channel_entry_t * entry);
+
+filter_set_t * channel_entry_get_filter_set(const channel_entry_t * entry);
+
+/*
+ * Check the sender of a line, nick!user@host or a bare nick, against the
+ * nickfilter of the channel and the nicks of its filters. Return 0 if the line
+ * is not for the filters, otherwise set *filters to the ones it is fed to, see
+ * filter_set_feed(). *filters stays valid until the next call.
+ */
+int channel_entry_accept(channel_entry_t * entry, const char * prefix, const uint64_t ** filters);
+
+// ----- channel_index
+
+/*
+ * Create an index able to hold channels_count channels.
+ */
+channel_index_t * channel_index_new(int channels_count, irc_casemapping_t casemapping);
+
+void channel_index_free(channel_index_t * channel_index);
+
+/*
+ * Return 0 if the index is full or if the channel is already indexed.
+ */
+int channel_index_add(channel_index_t * channel_index, const channel_conf_t * channel_conf, filter_set_t * filter_set);
+
+/*
+ * Return the entry of channel name, or NULL if it is not indexed.
+ */
+channel_entry_t * channel_index_find(const channel_index_t * channel_index, const char * name);
+
+irc_casemapping_t channel_index_get_casemapping(const channel_index_t * channel_index);
+
+
+#endif /* CHANNEL_INDEX_H_ */
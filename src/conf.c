@@ -1,228 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <jansson.h>
 
 #include "conf.h"
+#include "log.h"
 
 /*
- * servers[]/@{ip,port,nick,password}
+ * @{threads}
+ * output/@{type,path}
+ * log/@{level,path}
+ * stats/@{socket,dump_path,dump_interval_s}
+ * archive/@{path,segment_size_mb,max_size_mb,max_age_days}
+ * servers[]/@{ip,port,nick,password,connections_max}
+ *          /flood/@{burst,interval_ms}
  *          /cmds[]/@{name,arg1,arg2}
  *          /channels[]/@{name,password,nickfilter}
+ *                     /filters[]/@{name,nicks,text}
+ *                               /regexes[]/@{regex}
+ *                                         /vars[]
  */
 
 
+// Sending 5 lines at once, then 1 per second, is accepted by most servers.
+#define FLOOD_BURST_DEFAULT 5
+#define FLOOD_INTERVAL_MS_DEFAULT 1000
+// Most networks accept a few connections from the same host.
+#define CONNECTIONS_MAX_DEFAULT 4
+#define STATS_DUMP_INTERVAL_S_DEFAULT 60
+#define ARCHIVE_SEGMENT_SIZE_MB_DEFAULT 64
+
+
 // ---
 
 struct _regex_conf_t {
-    json_t * regex_node;
-    json_t * vars_node;
+    const char * regex;
+    const char ** vars;
+    int vars_count;
 };
 
 struct _filter_conf_t {
-    json_t * filter_node;
-    json_t * regexes_node;
-    regex_conf_t current_regex;
+    const char * name;
+    regex_conf_t * regexes;
+    int regexes_count;
+    const char ** nicks;
+    int nicks_count;
+    filter_text_t text;
 };
 
 struct _channel_conf_t {
-//     char *name;
-//     char *passwd;
-
-    json_t * node;
-    json_t * filters_node;
-    filter_conf_t current_filter;
+    const char * name;
+    const char * passwd;
+    const char ** nickfilters;
+    int nickfilters_count;
+    filter_conf_t * filters;
+    int filters_count;
 };
 
 struct _cmd_conf_t {
-//     char* cmd;
-//     char* arg1;
-//     char* arg2;
-
-    json_t * node;
+    const char * name;
+    const char * arg1;
+    const char * arg2;
 };
 
 struct _server_conf_t {
-//     char * name;
-//     char * ip;
-//     int port;
-//     char * passwd;
-//     char * nick;
-//     channel_conf_t * channels;
-//     int channels_count;
-//     cmd_t * cmds;
-//     int cmds_count;
-
-    json_t * node;
-    json_t * channels_node;
-    json_t * cmds_node;
-
-    channel_conf_t current_channel;
-    cmd_conf_t current_cmd;
+    const char * name;
+    const char * ip;
+    int port;
+    const char * passwd;
+    const char * nick;
+    int flood_burst;
+    int flood_interval_ms;
+    int connections_max;
+    channel_conf_t * channels;
+    int channels_count;
+    cmd_conf_t * cmds;
+    int cmds_count;
 };
 
+/*
+ * Interned strings : every distinct string of the configuration is stored once
+ * in a single buffer.
+ */
+typedef struct {
+    char * buf;
+    size_t size;
+    size_t used;
+    const char ** slots;
+    size_t slots_count;
+} str_pool_t;
+
+/*
+ * The configuration is materialized at load time : each kind of node is stored
+ * in one contiguous array, children are slices of those arrays.
+ */
 struct _irc_conf_t {
-	json_t * root;
-    json_t * servers_root;
-    server_conf_t current_server;
+    int refcount;
+    int loaded;
+
+    int threads_count;
+    output_type_t output_type;
+    const char * output_path;
+    log_level_t log_level;
+    const char * log_path;
+    const char * stats_socket;
+    const char * stats_dump_path;
+    int stats_dump_interval_s;
+    const char * archive_path;
+    int archive_segment_size_mb;
+    int archive_max_size_mb;
+    int archive_max_age_days;
+
+    server_conf_t * servers;
+    int servers_count;
+
+    channel_conf_t * channels;
+    int channels_count;
+    cmd_conf_t * cmds;
+    int cmds_count;
+    filter_conf_t * filters;
+    int filters_count;
+    regex_conf_t * regexes;
+    int regexes_count;
+    // string lists : regex vars, nickfilters and filter nicks
+    const char ** lists;
+    int lists_count;
+
+    str_pool_t strings;
+
+    // size and modification time of the JSON file, stamped on the binary image
+    off_t source_size;
+    struct timespec source_mtime;
+    // mapped binary image the strings point into, NULL if loaded from JSON
+    void * image;
+    size_t image_size;
 };
 
 
+// ---
+
+/*
+ * NULL only equals NULL.
+ */
+static int str_equal(const char * a, const char * b) {
+    return a == b || (a && b && !strcmp(a, b));
+}
+
 // ----- regex_conf
 
-const char * regex_conf_get_regex(regex_conf_t * regex_conf) {
-    json_t * jValue = json_object_get(regex_conf->regex_node, "regex");
-    return json_string_value(jValue);
+const char * regex_conf_get_regex(const regex_conf_t * regex_conf) {
+    return regex_conf->regex;
 }
 
-int regex_conf_get_vars_count(regex_conf_t * regex_conf) {
-    return json_array_size(regex_conf->vars_node);
+int regex_conf_get_vars_count(const regex_conf_t * regex_conf) {
+    return regex_conf->vars_count;
 }
 
-const char * regex_conf_get_var_at(regex_conf_t * regex_conf, int index) {
-    json_t * jValue = json_array_get(regex_conf->vars_node, index);
-    return json_string_value(jValue);
+const char * regex_conf_get_var_at(const regex_conf_t * regex_conf, int index) {
+    return regex_conf->vars[index];
 }
 
 // ----- filter_conf
 
-const char * filter_conf_get_name(filter_conf_t * filter_conf) {
-    json_t * jValue = json_object_get(filter_conf->filter_node, "name");
-    return json_string_value(jValue);
+const char * filter_conf_get_name(const filter_conf_t * filter_conf) {
+    return filter_conf->name;
 }
 
-int filter_conf_get_regexes_count(filter_conf_t * filter_conf) {
-    return json_array_size(filter_conf->regexes_node);
+int filter_conf_get_regexes_count(const filter_conf_t * filter_conf) {
+    return filter_conf->regexes_count;
 }
 
-regex_conf_t * filter_conf_get_regex_at(filter_conf_t * filter_conf, int index) {
-    json_t * regex_node = json_array_get(filter_conf->regexes_node, index);
-    filter_conf->current_regex.regex_node = regex_node;
-    filter_conf->current_regex.vars_node = json_object_get(regex_node, "vars");
-    return &filter_conf->current_regex;
+const regex_conf_t * filter_conf_get_regex_at(const filter_conf_t * filter_conf, int index) {
+    return &filter_conf->regexes[index];
+}
+
+filter_text_t filter_conf_get_text(const filter_conf_t * filter_conf) {
+    return filter_conf->text;
+}
+
+int filter_conf_get_nicks_count(const filter_conf_t * filter_conf) {
+    return filter_conf->nicks_count;
+}
+
+const char * filter_conf_get_nick_at(const filter_conf_t * filter_conf, int index) {
+    return filter_conf->nicks[index];
 }
 
 // ----- cmd_conf
 
-const char * cmd_conf_get_name(cmd_conf_t * cmd_conf) {
-    json_t *jValue = json_object_get(cmd_conf->node, "name");
-    if (!json_is_string(jValue)) {
-        fprintf(stderr, "ERROR: cmd_conf_get_name() : could not find command 'name' or it's not a string.\n",
-            cmd_conf, cmd_conf->node);
-    }
-    return json_string_value(jValue);
+const char * cmd_conf_get_name(const cmd_conf_t * cmd_conf) {
+    return cmd_conf->name;
 }
 
-const char * cmd_conf_get_arg1(cmd_conf_t * cmd_conf) {
-    json_t *jValue = json_object_get(cmd_conf->node, "arg1");
-    return json_string_value(jValue);
+const char * cmd_conf_get_arg1(const cmd_conf_t * cmd_conf) {
+    return cmd_conf->arg1;
 }
 
-const char * cmd_conf_get_arg2(cmd_conf_t * cmd_conf) {
-    json_t *jValue = json_object_get(cmd_conf->node, "arg2");
-    return json_string_value(jValue);
+const char * cmd_conf_get_arg2(const cmd_conf_t * cmd_conf) {
+    return cmd_conf->arg2;
 }
 
 // ---- channel_conf
 
-const char * channel_conf_get_name(channel_conf_t * channel_conf) {
-    json_t *jValue = json_object_get(channel_conf->node, "name");
-    return json_string_value(jValue);
+const char * channel_conf_get_name(const channel_conf_t * channel_conf) {
+    return channel_conf->name;
+}
+
+const char * channel_conf_get_passwd(const channel_conf_t * channel_conf) {
+    return channel_conf->passwd;
+}
+
+int channel_conf_get_nickfilters_count(const channel_conf_t * channel_conf) {
+    return channel_conf->nickfilters_count;
 }
 
-const char * channel_conf_get_passwd(channel_conf_t * channel_conf) {
-    json_t *jValue = json_object_get(channel_conf->node, "passwd");
-    return json_string_value(jValue);
+const char * channel_conf_get_nickfilter_at(const channel_conf_t * channel_conf, int index) {
+    return channel_conf->nickfilters[index];
 }
 
-const char * channel_conf_get_nickfilter(channel_conf_t * channel_conf) {
-    json_t *jValue = json_object_get(channel_conf->node, "nickfilter");
-    return json_string_value(jValue);
+int channel_conf_get_filters_count(const channel_conf_t * channel_conf) {
+    return channel_conf->filters_count;
 }
 
-int channel_conf_get_filters_count(channel_conf_t * channel_conf) {
-    if (!json_is_array(channel_conf->filters_node)) {
-    	fprintf(stderr, "ERROR: filters is not an array.\n");
+const filter_conf_t * channel_conf_get_filter_at(const channel_conf_t * channel_conf, int index) {
+    return &channel_conf->filters[index];
+}
+
+int channel_conf_same_filters(const channel_conf_t * channel_conf, const channel_conf_t * other) {
+    if (channel_conf->filters_count != other->filters_count) {
         return 0;
     }
-    return json_array_size(channel_conf->filters_node);
+    int i, j, k;
+    for (i = 0; i < channel_conf->filters_count; i++) {
+        const filter_conf_t * filter = &channel_conf->filters[i];
+        const filter_conf_t * other_filter = &other->filters[i];
+        if (!str_equal(filter->name, other_filter->name) || filter->regexes_count != other_filter->regexes_count
+                || filter->text != other_filter->text) {
+            return 0;
+        }
+        for (j = 0; j < filter->regexes_count; j++) {
+            const regex_conf_t * regex = &filter->regexes[j];
+            const regex_conf_t * other_regex = &other_filter->regexes[j];
+            if (!str_equal(regex->regex, other_regex->regex) || regex->vars_count != other_regex->vars_count) {
+                return 0;
+            }
+            for (k = 0; k < regex->vars_count; k++) {
+                if (!str_equal(regex->vars[k], other_regex->vars[k])) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
 }
 
-filter_conf_t * channel_conf_get_filter_at(channel_conf_t * channel_conf, int index) {
-	json_t * filter_node = json_array_get(channel_conf->filters_node, index);;
-	channel_conf->current_filter.filter_node = filter_node;
-	channel_conf->current_filter.regexes_node = json_object_get(filter_node, "regexes");
-    return &channel_conf->current_filter;
+// -----
+
+const char * server_conf_get_name(const server_conf_t * server_conf) {
+    return server_conf->name;
 }
 
-// -----
+const char * server_conf_get_ip(const server_conf_t * server_conf) {
+    return server_conf->ip;
+}
 
-const char * server_conf_get_name(server_conf_t * server_conf) {
-    json_t *jValue = json_object_get(server_conf->node, "name");
-    return json_string_value(jValue);
+int server_conf_get_port(const server_conf_t * server_conf) {
+    return server_conf->port;
 }
 
-const char * server_conf_get_ip(server_conf_t * server_conf) {
-    json_t *jValue = json_object_get(server_conf->node, "ip");
-    return json_string_value(jValue);
+const char * server_conf_get_passwd(const server_conf_t * server_conf) {
+    return server_conf->passwd;
 }
 
-int server_conf_get_port(server_conf_t * server_conf) {
-    json_t *jValue = json_object_get(server_conf->node, "port");
-    return json_integer_value(jValue);
+const char * server_conf_get_nick(const server_conf_t * server_conf) {
+    return server_conf->nick;
 }
 
-const char * server_conf_get_passwd(server_conf_t * server_conf) {
-    json_t *jValue = json_object_get(server_conf->node, "passwd");
-    return json_string_value(jValue);
+int server_conf_get_flood_burst(const server_conf_t * server_conf) {
+    return server_conf->flood_burst;
 }
 
-const char * server_conf_get_nick(server_conf_t * server_conf) {
-    json_t *jValue = json_object_get(server_conf->node, "nick");
-    return json_string_value(jValue);
+int server_conf_get_flood_interval_ms(const server_conf_t * server_conf) {
+    return server_conf->flood_interval_ms;
 }
 
-int server_conf_get_channels_count(server_conf_t * server_conf) {
-    return json_array_size(server_conf->channels_node);
+int server_conf_get_connections_max(const server_conf_t * server_conf) {
+    return server_conf->connections_max;
 }
 
-channel_conf_t * server_conf_get_channel_at(server_conf_t * server_conf, int index) {
-	json_t * channel_node = json_array_get(server_conf->channels_node, index);
-    if (!json_is_object(channel_node)) {
-        fprintf(stderr, "ERROR: channels[%d] is not an object.\n", index);
-    }
-    server_conf->current_channel.node = channel_node;
-    server_conf->current_channel.filters_node = json_object_get(channel_node, "filters");
-    return &server_conf->current_channel;
+int server_conf_get_channels_count(const server_conf_t * server_conf) {
+    return server_conf->channels_count;
 }
 
-int server_conf_get_cmds_count(server_conf_t * server_conf) {
-    if (!json_is_array(server_conf->cmds_node)) {
-    	fprintf(stderr, "ERROR: cmds is not an array.\n");
+const channel_conf_t * server_conf_get_channel_at(const server_conf_t * server_conf, int index) {
+    return &server_conf->channels[index];
+}
+
+int server_conf_get_cmds_count(const server_conf_t * server_conf) {
+    return server_conf->cmds_count;
+}
+
+const cmd_conf_t * server_conf_get_cmd_at(const server_conf_t * server_conf, int index) {
+    return &server_conf->cmds[index];
+}
+
+int server_conf_same_connection(const server_conf_t * server_conf, const server_conf_t * other) {
+    if (!str_equal(server_conf->ip, other->ip) || server_conf->port != other->port
+            || !str_equal(server_conf->passwd, other->passwd) || !str_equal(server_conf->nick, other->nick)
+            || server_conf->cmds_count != other->cmds_count) {
         return 0;
     }
-    return json_array_size(server_conf->cmds_node);
+    int i;
+    for (i = 0; i < server_conf->cmds_count; i++) {
+        const cmd_conf_t * cmd = &server_conf->cmds[i];
+        const cmd_conf_t * other_cmd = &other->cmds[i];
+        if (!str_equal(cmd->name, other_cmd->name) || !str_equal(cmd->arg1, other_cmd->arg1)
+                || !str_equal(cmd->arg2, other_cmd->arg2)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ----- str_pool
+
+static size_t str_hash(const char * str) {
+    // FNV-1a
+    size_t hash = 2166136261u;
+    for (; *str; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-cmd_conf_t * server_conf_get_cmd_at(server_conf_t * server_conf, int index) {
-    json_t* cmdNode = json_array_get(server_conf->cmds_node, index);
-    if (!json_is_object(cmdNode)) {
-        fprintf(stderr, "ERROR: cmds[%d] is not an object.\n", index);
+static void str_pool_init(str_pool_t * pool, size_t size, size_t strings_count) {
+    pool->size = size;
+    pool->used = 0;
+    pool->buf = size ? malloc(size) : NULL;
+    // keep the table at most half full
+    pool->slots_count = 1;
+    while (pool->slots_count < strings_count * 2) {
+        pool->slots_count <<= 1;
     }
-    server_conf->current_cmd.node = cmdNode;
-    return &server_conf->current_cmd;
+    pool->slots = calloc(pool->slots_count, sizeof(const char *));
+}
+
+static void str_pool_release_index(str_pool_t * pool) {
+    free(pool->slots);
+    pool->slots = NULL;
+    pool->slots_count = 0;
+}
+
+static void str_pool_destroy(str_pool_t * pool) {
+    str_pool_release_index(pool);
+    free(pool->buf);
+    memset(pool, 0, sizeof(str_pool_t));
+}
+
+static const char * str_pool_intern(str_pool_t * pool, const char * str) {
+    if (!str) {
+        return NULL;
+    }
+    size_t mask = pool->slots_count - 1;
+    size_t idx = str_hash(str) & mask;
+    while (pool->slots[idx]) {
+        if (!strcmp(pool->slots[idx], str)) {
+            return pool->slots[idx];
+        }
+        idx = (idx + 1) & mask;
+    }
+
+    size_t len = strlen(str) + 1;
+    char * result = pool->buf + pool->used;
+    memcpy(result, str, len);
+    pool->used += len;
+    pool->slots[idx] = result;
+    return result;
 }
 
 // -----
 
 irc_conf_t * irc_conf_new() {
 	irc_conf_t * result = calloc(1, sizeof(struct _irc_conf_t));
+	result->refcount = 1;
 	return result;
 }
 
+irc_conf_t * irc_conf_ref(irc_conf_t * irc_conf) {
+	__atomic_add_fetch(&irc_conf->refcount, 1, __ATOMIC_RELAXED);
+	return irc_conf;
+}
+
+static void irc_conf_clear(irc_conf_t * irc_conf) {
+    free(irc_conf->servers);
+    free(irc_conf->channels);
+    free(irc_conf->cmds);
+    free(irc_conf->filters);
+    free(irc_conf->regexes);
+    free(irc_conf->lists);
+    if (irc_conf->image) {
+        // the strings belong to the mapping
+        irc_conf->strings.buf = NULL;
+        munmap(irc_conf->image, irc_conf->image_size);
+    }
+    str_pool_destroy(&irc_conf->strings);
+    memset(irc_conf, 0, sizeof(struct _irc_conf_t));
+}
+
 void irc_conf_free(irc_conf_t * irc_conf) {
-	if (irc_conf->root) {
-		json_decref(irc_conf->root);
+	if (__atomic_sub_fetch(&irc_conf->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
 	}
-	memset(irc_conf, 0, sizeof(struct _irc_conf_t));
+	irc_conf_clear(irc_conf);
 	free(irc_conf);
 }
 
@@ -279,34 +475,976 @@ int validate(json_t * root) {
 }
 
 
+// ----- materialization
+
+typedef struct {
+    int servers;
+    int channels;
+    int cmds;
+    int filters;
+    int regexes;
+    int lists;
+    int strings;
+    size_t strings_size;
+} conf_counts_t;
+
+static void count_string(conf_counts_t * counts, json_t * node, const char * key) {
+    const char * str = json_string_value(json_object_get(node, key));
+    if (str) {
+        counts->strings++;
+        counts->strings_size += strlen(str) + 1;
+    }
+}
+
+/*
+ * A list of non empty strings, or a single one. Return 0 if it is neither.
+ */
+static int count_string_list(conf_counts_t * counts, json_t * node, const char * key) {
+    json_t *list = json_object_get(node, key);
+    int items_count = json_is_string(list) ? 1 : json_array_size(list);
+    if (list && !json_is_string(list) && !json_is_array(list)) {
+        return 0;
+    }
+    int i;
+    for (i = 0; i < items_count; i++) {
+        const char *str = json_string_value(json_is_string(list) ? list : json_array_get(list, i));
+        if (!str || !*str) {
+            return 0;
+        }
+        counts->strings++;
+        counts->strings_size += strlen(str) + 1;
+        counts->lists++;
+    }
+    return 1;
+}
+
+/*
+ * First pass : check the optional nodes and count everything to allocate.
+ */
+static int count_nodes(json_t * servers, conf_counts_t * counts) {
+    memset(counts, 0, sizeof(conf_counts_t));
+    counts->servers = json_array_size(servers);
+
+    int eachServer;
+    for (eachServer = 0; eachServer < counts->servers; eachServer++) {
+        json_t *server = json_array_get(servers, eachServer);
+        count_string(counts, server, "name");
+        count_string(counts, server, "ip");
+        count_string(counts, server, "passwd");
+        count_string(counts, server, "nick");
+
+        json_t *flood = json_object_get(server, "flood");
+        if (flood) {
+            json_t *burst = json_object_get(flood, "burst");
+            json_t *interval = json_object_get(flood, "interval_ms");
+            if (!json_is_object(flood) || (burst && (!json_is_integer(burst) || json_integer_value(burst) < 1))
+                    || (interval && (!json_is_integer(interval) || json_integer_value(interval) < 0))) {
+                fprintf(stderr, "error: servers[%d]/flood must have a positive burst and interval_ms.\n", eachServer);
+                return 0;
+            }
+        }
+        json_t *connections_max = json_object_get(server, "connections_max");
+        if (connections_max && (!json_is_integer(connections_max) || json_integer_value(connections_max) < 1)) {
+            fprintf(stderr, "error: servers[%d]/connections_max is not a positive integer.\n", eachServer);
+            return 0;
+        }
+
+        json_t *cmds = json_object_get(server, "cmds");
+        if (cmds && !json_is_array(cmds)) {
+            fprintf(stderr, "error: servers[%d]/cmds is not an array.\n", eachServer);
+            return 0;
+        }
+        int eachCmd;
+        for (eachCmd = 0; eachCmd < json_array_size(cmds); eachCmd++) {
+            json_t *cmd = json_array_get(cmds, eachCmd);
+            count_string(counts, cmd, "name");
+            count_string(counts, cmd, "arg1");
+            count_string(counts, cmd, "arg2");
+            counts->cmds++;
+        }
+
+        json_t *channels = json_object_get(server, "channels");
+        int eachChannel;
+        for (eachChannel = 0; eachChannel < json_array_size(channels); eachChannel++) {
+            json_t *channel = json_array_get(channels, eachChannel);
+            if (!json_is_object(channel)) {
+                fprintf(stderr, "error: servers[%d]/channels[%d] is not an object.\n", eachServer, eachChannel);
+                return 0;
+            }
+            count_string(counts, channel, "name");
+            count_string(counts, channel, "passwd");
+            if (!count_string_list(counts, channel, "nickfilter")) {
+                fprintf(stderr, "error: servers[%d]/channels[%d]/nickfilter is not a nick or a list of nicks.\n",
+                    eachServer, eachChannel);
+                return 0;
+            }
+            counts->channels++;
+
+            json_t *filters = json_object_get(channel, "filters");
+            if (filters && !json_is_array(filters)) {
+                fprintf(stderr, "error: servers[%d]/channels[%d]/filters is not an array.\n", eachServer, eachChannel);
+                return 0;
+            }
+            int eachFilter;
+            for (eachFilter = 0; eachFilter < json_array_size(filters); eachFilter++) {
+                json_t *filter = json_array_get(filters, eachFilter);
+                json_t *regexes = json_object_get(filter, "regexes");
+                if (!json_is_array(regexes)) {
+                    fprintf(stderr, "error: servers[%d]/channels[%d]/filters[%d]/regexes is not an array.\n",
+                        eachServer, eachChannel, eachFilter);
+                    return 0;
+                }
+                count_string(counts, filter, "name");
+                if (!count_string_list(counts, filter, "nicks")) {
+                    fprintf(stderr, "error: servers[%d]/channels[%d]/filters[%d]/nicks is not a nick or a list of nicks.\n",
+                        eachServer, eachChannel, eachFilter);
+                    return 0;
+                }
+                json_t *text = json_object_get(filter, "text");
+                if (text && (!json_is_string(text) || (strcmp(json_string_value(text), "normalized")
+                        && strcmp(json_string_value(text), "raw")))) {
+                    fprintf(stderr, "error: servers[%d]/channels[%d]/filters[%d]/text must be normalized or raw.\n",
+                        eachServer, eachChannel, eachFilter);
+                    return 0;
+                }
+                counts->filters++;
+
+                int eachRegex;
+                for (eachRegex = 0; eachRegex < json_array_size(regexes); eachRegex++) {
+                    json_t *regex = json_array_get(regexes, eachRegex);
+                    if (!json_is_string(json_object_get(regex, "regex"))) {
+                        fprintf(stderr, "error: servers[%d]/channels[%d]/filters[%d]/regexes[%d]/regex is not a string.\n",
+                            eachServer, eachChannel, eachFilter, eachRegex);
+                        return 0;
+                    }
+                    count_string(counts, regex, "regex");
+                    counts->regexes++;
+
+                    json_t *vars = json_object_get(regex, "vars");
+                    if (vars && !json_is_array(vars)) {
+                        fprintf(stderr, "error: servers[%d]/channels[%d]/filters[%d]/regexes[%d]/vars is not an array.\n",
+                            eachServer, eachChannel, eachFilter, eachRegex);
+                        return 0;
+                    }
+                    int eachVar;
+                    for (eachVar = 0; eachVar < json_array_size(vars); eachVar++) {
+                        const char *var = json_string_value(json_array_get(vars, eachVar));
+                        if (!var) {
+                            fprintf(stderr, "error: servers[%d]/channels[%d]/filters[%d]/regexes[%d]/vars[%d] is not a string.\n",
+                                eachServer, eachChannel, eachFilter, eachRegex, eachVar);
+                            return 0;
+                        }
+                        counts->strings++;
+                        counts->strings_size += strlen(var) + 1;
+                        counts->lists++;
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+static const char * intern_member(irc_conf_t * irc_conf, json_t * node, const char * key) {
+    return str_pool_intern(&irc_conf->strings, json_string_value(json_object_get(node, key)));
+}
+
+/*
+ * Intern the strings of a list checked by count_string_list() at *next, return its count.
+ */
+static int intern_list(irc_conf_t * irc_conf, json_t * node, const char * key, const char *** next) {
+    json_t *list = json_object_get(node, key);
+    int items_count = json_is_string(list) ? 1 : json_array_size(list);
+    int i;
+    for (i = 0; i < items_count; i++) {
+        *(*next)++ = str_pool_intern(&irc_conf->strings,
+            json_string_value(json_is_string(list) ? list : json_array_get(list, i)));
+    }
+    return items_count;
+}
+
+/*
+ * Second pass : fill the arrays allocated from the counts.
+ */
+static void materialize(irc_conf_t * irc_conf, json_t * servers, const conf_counts_t * counts) {
+    irc_conf->servers_count = counts->servers;
+    irc_conf->servers = calloc(counts->servers ? counts->servers : 1, sizeof(server_conf_t));
+    irc_conf->channels = calloc(counts->channels ? counts->channels : 1, sizeof(channel_conf_t));
+    irc_conf->cmds = calloc(counts->cmds ? counts->cmds : 1, sizeof(cmd_conf_t));
+    irc_conf->filters = calloc(counts->filters ? counts->filters : 1, sizeof(filter_conf_t));
+    irc_conf->regexes = calloc(counts->regexes ? counts->regexes : 1, sizeof(regex_conf_t));
+    irc_conf->lists = calloc(counts->lists ? counts->lists : 1, sizeof(const char *));
+    irc_conf->channels_count = counts->channels;
+    irc_conf->cmds_count = counts->cmds;
+    irc_conf->filters_count = counts->filters;
+    irc_conf->regexes_count = counts->regexes;
+    irc_conf->lists_count = counts->lists;
+    str_pool_init(&irc_conf->strings, counts->strings_size, counts->strings);
+
+    channel_conf_t * next_channel = irc_conf->channels;
+    cmd_conf_t * next_cmd = irc_conf->cmds;
+    filter_conf_t * next_filter = irc_conf->filters;
+    regex_conf_t * next_regex = irc_conf->regexes;
+    const char ** next_string = irc_conf->lists;
+
+    int eachServer;
+    for (eachServer = 0; eachServer < counts->servers; eachServer++) {
+        json_t *server = json_array_get(servers, eachServer);
+        server_conf_t * server_conf = &irc_conf->servers[eachServer];
+        server_conf->name = intern_member(irc_conf, server, "name");
+        server_conf->ip = intern_member(irc_conf, server, "ip");
+        server_conf->port = json_integer_value(json_object_get(server, "port"));
+        server_conf->passwd = intern_member(irc_conf, server, "passwd");
+        server_conf->nick = intern_member(irc_conf, server, "nick");
+
+        json_t *flood = json_object_get(server, "flood");
+        json_t *burst = json_object_get(flood, "burst");
+        json_t *interval = json_object_get(flood, "interval_ms");
+        server_conf->flood_burst = burst ? json_integer_value(burst) : FLOOD_BURST_DEFAULT;
+        server_conf->flood_interval_ms = interval ? json_integer_value(interval) : FLOOD_INTERVAL_MS_DEFAULT;
+        json_t *connections_max = json_object_get(server, "connections_max");
+        server_conf->connections_max = connections_max ? json_integer_value(connections_max) : CONNECTIONS_MAX_DEFAULT;
+
+        json_t *cmds = json_object_get(server, "cmds");
+        server_conf->cmds = next_cmd;
+        server_conf->cmds_count = json_array_size(cmds);
+        int eachCmd;
+        for (eachCmd = 0; eachCmd < server_conf->cmds_count; eachCmd++) {
+            json_t *cmd = json_array_get(cmds, eachCmd);
+            next_cmd->name = intern_member(irc_conf, cmd, "name");
+            next_cmd->arg1 = intern_member(irc_conf, cmd, "arg1");
+            next_cmd->arg2 = intern_member(irc_conf, cmd, "arg2");
+            next_cmd++;
+        }
+
+        json_t *channels = json_object_get(server, "channels");
+        server_conf->channels = next_channel;
+        server_conf->channels_count = json_array_size(channels);
+        int eachChannel;
+        for (eachChannel = 0; eachChannel < server_conf->channels_count; eachChannel++) {
+            json_t *channel = json_array_get(channels, eachChannel);
+            channel_conf_t * channel_conf = next_channel++;
+            channel_conf->name = intern_member(irc_conf, channel, "name");
+            channel_conf->passwd = intern_member(irc_conf, channel, "passwd");
+            channel_conf->nickfilters = next_string;
+            channel_conf->nickfilters_count = intern_list(irc_conf, channel, "nickfilter", &next_string);
+
+            json_t *filters = json_object_get(channel, "filters");
+            channel_conf->filters = next_filter;
+            channel_conf->filters_count = json_array_size(filters);
+            int eachFilter;
+            for (eachFilter = 0; eachFilter < channel_conf->filters_count; eachFilter++) {
+                json_t *filter = json_array_get(filters, eachFilter);
+                filter_conf_t * filter_conf = next_filter++;
+                filter_conf->name = intern_member(irc_conf, filter, "name");
+                filter_conf->nicks = next_string;
+                filter_conf->nicks_count = intern_list(irc_conf, filter, "nicks", &next_string);
+                const char *text = json_string_value(json_object_get(filter, "text"));
+                filter_conf->text = text && !strcmp(text, "raw") ? FILTER_TEXT_RAW : FILTER_TEXT_NORMALIZED;
+
+                json_t *regexes = json_object_get(filter, "regexes");
+                filter_conf->regexes = next_regex;
+                filter_conf->regexes_count = json_array_size(regexes);
+                int eachRegex;
+                for (eachRegex = 0; eachRegex < filter_conf->regexes_count; eachRegex++) {
+                    json_t *regex = json_array_get(regexes, eachRegex);
+                    regex_conf_t * regex_conf = next_regex++;
+                    regex_conf->regex = intern_member(irc_conf, regex, "regex");
+
+                    regex_conf->vars = next_string;
+                    regex_conf->vars_count = intern_list(irc_conf, regex, "vars", &next_string);
+                }
+            }
+        }
+    }
+
+}
+
+// ----- global settings
+
+/*
+ * Check and load the settings that are not strings, count the others.
+ */
+static int load_settings(irc_conf_t * irc_conf, json_t * root, conf_counts_t * counts) {
+    json_t *threads = json_object_get(root, "threads");
+    irc_conf->threads_count = 1;
+    if (threads) {
+        if (!json_is_integer(threads) || json_integer_value(threads) < 1) {
+            fprintf(stderr, "error: threads must be a positive integer.\n");
+            return 0;
+        }
+        irc_conf->threads_count = json_integer_value(threads);
+    }
+
+    json_t *output = json_object_get(root, "output");
+    irc_conf->output_type = OUTPUT_STDOUT;
+    if (output) {
+        const char *type = json_string_value(json_object_get(output, "type"));
+        if (!json_is_object(output) || !type) {
+            fprintf(stderr, "error: output must be an object with a 'type'.\n");
+            return 0;
+        }
+        if (!strcmp(type, "stdout")) {
+            irc_conf->output_type = OUTPUT_STDOUT;
+        } else if (!strcmp(type, "file")) {
+            irc_conf->output_type = OUTPUT_FILE;
+        } else if (!strcmp(type, "unix")) {
+            irc_conf->output_type = OUTPUT_UNIX;
+        } else {
+            fprintf(stderr, "error: unknown output type %s, expected stdout, file or unix.\n", type);
+            return 0;
+        }
+        if (irc_conf->output_type != OUTPUT_STDOUT && !json_is_string(json_object_get(output, "path"))) {
+            fprintf(stderr, "error: output of type %s needs a 'path'.\n", type);
+            return 0;
+        }
+        count_string(counts, output, "path");
+    }
+
+    json_t *log = json_object_get(root, "log");
+    irc_conf->log_level = LOG_LEVEL_INFO;
+    if (log) {
+        const char *level = json_string_value(json_object_get(log, "level"));
+        if (!json_is_object(log)) {
+            fprintf(stderr, "error: log must be an object.\n");
+            return 0;
+        }
+        if (level && !log_level_parse(level, &irc_conf->log_level)) {
+            fprintf(stderr, "error: unknown log level %s, expected debug, info, warn, error or none.\n", level);
+            return 0;
+        }
+        count_string(counts, log, "path");
+    }
+
+    json_t *stats = json_object_get(root, "stats");
+    irc_conf->stats_dump_interval_s = STATS_DUMP_INTERVAL_S_DEFAULT;
+    if (stats) {
+        json_t *stats_socket = json_object_get(stats, "socket");
+        json_t *dump_path = json_object_get(stats, "dump_path");
+        json_t *interval = json_object_get(stats, "dump_interval_s");
+        if (!json_is_object(stats) || (stats_socket && !json_is_string(stats_socket)) || (dump_path && !json_is_string(dump_path))
+                || (interval && (!json_is_integer(interval) || json_integer_value(interval) < 1))) {
+            fprintf(stderr, "error: stats must have a string socket and dump_path, and a positive dump_interval_s.\n");
+            return 0;
+        }
+        if (interval) {
+            irc_conf->stats_dump_interval_s = json_integer_value(interval);
+        }
+        count_string(counts, stats, "socket");
+        count_string(counts, stats, "dump_path");
+    }
+
+    json_t *archive = json_object_get(root, "archive");
+    irc_conf->archive_segment_size_mb = ARCHIVE_SEGMENT_SIZE_MB_DEFAULT;
+    if (archive) {
+        json_t *segment_size = json_object_get(archive, "segment_size_mb");
+        json_t *max_size = json_object_get(archive, "max_size_mb");
+        json_t *max_age = json_object_get(archive, "max_age_days");
+        if (!json_is_object(archive) || !json_is_string(json_object_get(archive, "path"))
+                || (segment_size && (!json_is_integer(segment_size) || json_integer_value(segment_size) < 1
+                        || json_integer_value(segment_size) > 4096))
+                || (max_size && (!json_is_integer(max_size) || json_integer_value(max_size) < 0
+                        || json_integer_value(max_size) > INT32_MAX))
+                || (max_age && (!json_is_integer(max_age) || json_integer_value(max_age) < 0
+                        || json_integer_value(max_age) > 36500))) {
+            fprintf(stderr, "error: archive must have a path, a segment_size_mb from 1 to 4096, and a max_size_mb and"
+                    " max_age_days 0 or more.\n");
+            return 0;
+        }
+        if (segment_size) {
+            irc_conf->archive_segment_size_mb = json_integer_value(segment_size);
+        }
+        irc_conf->archive_max_size_mb = max_size ? json_integer_value(max_size) : 0;
+        irc_conf->archive_max_age_days = max_age ? json_integer_value(max_age) : 0;
+        count_string(counts, archive, "path");
+    }
+    return 1;
+}
+
+static void intern_settings(irc_conf_t * irc_conf, json_t * root) {
+    json_t *output = json_object_get(root, "output");
+    irc_conf->output_path = intern_member(irc_conf, output, "path");
+    json_t *log = json_object_get(root, "log");
+    irc_conf->log_path = intern_member(irc_conf, log, "path");
+    json_t *stats = json_object_get(root, "stats");
+    irc_conf->stats_socket = intern_member(irc_conf, stats, "socket");
+    irc_conf->stats_dump_path = intern_member(irc_conf, stats, "dump_path");
+    json_t *archive = json_object_get(root, "archive");
+    irc_conf->archive_path = intern_member(irc_conf, archive, "path");
+}
+
+// -----
+
 int irc_conf_load(irc_conf_t * irc_conf, const char* filename) {
 	json_error_t error;
 
-	irc_conf->root = json_load_file(filename, 0, &error);
-	if (!irc_conf->root) {
+	if (irc_conf->loaded) {
+	    fprintf(stderr, "error: configuration already loaded, use a new irc_conf_t.\n");
+	    return 0;
+	}
+
+	struct stat source_stat;
+	if (stat(filename, &source_stat) < 0) {
+	    fprintf(stderr, "error: could not stat %s : %s\n", filename, strerror(errno));
+	    return 0;
+	}
+
+	json_t * root = json_load_file(filename, 0, &error);
+	if (!root) {
 	    fprintf(stderr, "error: on line %d column %d: %s\n", error.line, error.column, error.text);
 	    return 0;
 	}
 
-	if (!validate(irc_conf->root)) {
+	if (!validate(root)) {
+	    json_decref(root);
 	    return 0;
 	}
 
-    json_t *servers = json_object_get(irc_conf->root, "servers");
-    irc_conf->servers_root = servers;
+    json_t *servers = json_object_get(root, "servers");
+    conf_counts_t counts;
+    if (!count_nodes(servers, &counts) || !load_settings(irc_conf, root, &counts)) {
+        json_decref(root);
+        return 0;
+    }
+    materialize(irc_conf, servers, &counts);
+    intern_settings(irc_conf, root);
+    // the hash index is only needed while interning
+    str_pool_release_index(&irc_conf->strings);
+
+    // Everything has been copied, the json tree is not needed anymore.
+    json_decref(root);
+    irc_conf->source_size = source_stat.st_size;
+    irc_conf->source_mtime = source_stat.st_mtim;
+    irc_conf->loaded = 1;
+    return 1;
+}
+
+// ----- binary image
+//
+// Layout : the header, then the server, channel, cmd, filter and regex record
+// arrays, the string list array and the string table, each section aligned on 8 bytes.
+// Children are slices of the arrays, given by their first index and count,
+// strings are offsets in the string table. Everything is in host byte order :
+// an image is only meant for the machine that compiled it.
+
+#define CONF_IMAGE_MAGIC "TIRCCONF"
+#define CONF_IMAGE_VERSION 6
+// offset of a NULL string
+#define CONF_IMAGE_NONE UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t image_size;
+
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+
+    int32_t threads_count;
+    int32_t output_type;
+    int32_t log_level;
+    uint32_t output_path;
+    uint32_t log_path;
+    uint32_t stats_socket;
+    uint32_t stats_dump_path;
+    int32_t stats_dump_interval_s;
+    uint32_t archive_path;
+    int32_t archive_segment_size_mb;
+    int32_t archive_max_size_mb;
+    int32_t archive_max_age_days;
+
+    uint32_t servers_count;
+    uint32_t channels_count;
+    uint32_t cmds_count;
+    uint32_t filters_count;
+    uint32_t regexes_count;
+    uint32_t lists_count;
+
+    uint64_t servers_offset;
+    uint64_t channels_offset;
+    uint64_t cmds_offset;
+    uint64_t filters_offset;
+    uint64_t regexes_offset;
+    uint64_t lists_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} conf_image_header_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t ip;
+    uint32_t passwd;
+    uint32_t nick;
+    int32_t port;
+    int32_t flood_burst;
+    int32_t flood_interval_ms;
+    int32_t connections_max;
+    uint32_t channels_first;
+    uint32_t channels_count;
+    uint32_t cmds_first;
+    uint32_t cmds_count;
+} conf_image_server_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t passwd;
+    uint32_t nickfilters_first;
+    uint32_t nickfilters_count;
+    uint32_t filters_first;
+    uint32_t filters_count;
+} conf_image_channel_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t arg1;
+    uint32_t arg2;
+} conf_image_cmd_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t regexes_first;
+    uint32_t regexes_count;
+    uint32_t nicks_first;
+    uint32_t nicks_count;
+    int32_t text;
+} conf_image_filter_t;
+
+typedef struct {
+    uint32_t regex;
+    uint32_t vars_first;
+    uint32_t vars_count;
+} conf_image_regex_t;
+
+static uint64_t image_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t) 7;
+}
+
+static uint32_t image_string(const irc_conf_t * irc_conf, const char * str) {
+    return str ? (uint32_t) (str - irc_conf->strings.buf) : CONF_IMAGE_NONE;
+}
+
+int irc_conf_write_image(const irc_conf_t * irc_conf, const char * image_filename) {
+    if (!irc_conf->loaded) {
+        fprintf(stderr, "error: no configuration loaded to write to %s.\n", image_filename);
+        return 0;
+    }
+    conf_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CONF_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = CONF_IMAGE_VERSION;
+    header.header_size = sizeof(conf_image_header_t);
+    header.source_size = irc_conf->source_size;
+    header.source_mtime_sec = irc_conf->source_mtime.tv_sec;
+    header.source_mtime_nsec = irc_conf->source_mtime.tv_nsec;
+    header.threads_count = irc_conf->threads_count;
+    header.output_type = irc_conf->output_type;
+    header.log_level = irc_conf->log_level;
+    header.output_path = image_string(irc_conf, irc_conf->output_path);
+    header.log_path = image_string(irc_conf, irc_conf->log_path);
+    header.stats_socket = image_string(irc_conf, irc_conf->stats_socket);
+    header.stats_dump_path = image_string(irc_conf, irc_conf->stats_dump_path);
+    header.stats_dump_interval_s = irc_conf->stats_dump_interval_s;
+    header.archive_path = image_string(irc_conf, irc_conf->archive_path);
+    header.archive_segment_size_mb = irc_conf->archive_segment_size_mb;
+    header.archive_max_size_mb = irc_conf->archive_max_size_mb;
+    header.archive_max_age_days = irc_conf->archive_max_age_days;
+
+    header.servers_count = irc_conf->servers_count;
+    header.channels_count = irc_conf->channels_count;
+    header.cmds_count = irc_conf->cmds_count;
+    header.filters_count = irc_conf->filters_count;
+    header.regexes_count = irc_conf->regexes_count;
+    header.lists_count = irc_conf->lists_count;
+    header.strings_size = irc_conf->strings.used;
+
+    header.servers_offset = image_align(sizeof(conf_image_header_t));
+    header.channels_offset = image_align(header.servers_offset + header.servers_count * sizeof(conf_image_server_t));
+    header.cmds_offset = image_align(header.channels_offset + header.channels_count * sizeof(conf_image_channel_t));
+    header.filters_offset = image_align(header.cmds_offset + header.cmds_count * sizeof(conf_image_cmd_t));
+    header.regexes_offset = image_align(header.filters_offset + header.filters_count * sizeof(conf_image_filter_t));
+    header.lists_offset = image_align(header.regexes_offset + header.regexes_count * sizeof(conf_image_regex_t));
+    header.strings_offset = image_align(header.lists_offset + header.lists_count * sizeof(uint32_t));
+    header.image_size = header.strings_offset + header.strings_size;
+
+    char * image = calloc(1, header.image_size);
+    memcpy(image, &header, sizeof(header));
+
+    uint32_t i;
+    conf_image_server_t * servers = (conf_image_server_t *) (image + header.servers_offset);
+    for (i = 0; i < header.servers_count; i++) {
+        const server_conf_t * server = &irc_conf->servers[i];
+        servers[i].name = image_string(irc_conf, server->name);
+        servers[i].ip = image_string(irc_conf, server->ip);
+        servers[i].passwd = image_string(irc_conf, server->passwd);
+        servers[i].nick = image_string(irc_conf, server->nick);
+        servers[i].port = server->port;
+        servers[i].flood_burst = server->flood_burst;
+        servers[i].flood_interval_ms = server->flood_interval_ms;
+        servers[i].connections_max = server->connections_max;
+        servers[i].channels_first = server->channels - irc_conf->channels;
+        servers[i].channels_count = server->channels_count;
+        servers[i].cmds_first = server->cmds - irc_conf->cmds;
+        servers[i].cmds_count = server->cmds_count;
+    }
+    conf_image_channel_t * channels = (conf_image_channel_t *) (image + header.channels_offset);
+    for (i = 0; i < header.channels_count; i++) {
+        const channel_conf_t * channel = &irc_conf->channels[i];
+        channels[i].name = image_string(irc_conf, channel->name);
+        channels[i].passwd = image_string(irc_conf, channel->passwd);
+        channels[i].nickfilters_first = channel->nickfilters - irc_conf->lists;
+        channels[i].nickfilters_count = channel->nickfilters_count;
+        channels[i].filters_first = channel->filters - irc_conf->filters;
+        channels[i].filters_count = channel->filters_count;
+    }
+    conf_image_cmd_t * cmds = (conf_image_cmd_t *) (image + header.cmds_offset);
+    for (i = 0; i < header.cmds_count; i++) {
+        const cmd_conf_t * cmd = &irc_conf->cmds[i];
+        cmds[i].name = image_string(irc_conf, cmd->name);
+        cmds[i].arg1 = image_string(irc_conf, cmd->arg1);
+        cmds[i].arg2 = image_string(irc_conf, cmd->arg2);
+    }
+    conf_image_filter_t * filters = (conf_image_filter_t *) (image + header.filters_offset);
+    for (i = 0; i < header.filters_count; i++) {
+        const filter_conf_t * filter = &irc_conf->filters[i];
+        filters[i].name = image_string(irc_conf, filter->name);
+        filters[i].regexes_first = filter->regexes - irc_conf->regexes;
+        filters[i].regexes_count = filter->regexes_count;
+        filters[i].nicks_first = filter->nicks - irc_conf->lists;
+        filters[i].nicks_count = filter->nicks_count;
+        filters[i].text = filter->text;
+    }
+    conf_image_regex_t * regexes = (conf_image_regex_t *) (image + header.regexes_offset);
+    for (i = 0; i < header.regexes_count; i++) {
+        const regex_conf_t * regex = &irc_conf->regexes[i];
+        regexes[i].regex = image_string(irc_conf, regex->regex);
+        regexes[i].vars_first = regex->vars - irc_conf->lists;
+        regexes[i].vars_count = regex->vars_count;
+    }
+    uint32_t * lists = (uint32_t *) (image + header.lists_offset);
+    for (i = 0; i < header.lists_count; i++) {
+        lists[i] = image_string(irc_conf, irc_conf->lists[i]);
+    }
+    memcpy(image + header.strings_offset, irc_conf->strings.buf, header.strings_size);
+
+    // written aside then renamed, a running process never maps a partial image
+    char tmp_filename[4096];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", image_filename);
+    FILE * file = fopen(tmp_filename, "wb");
+    int ok = file && fwrite(image, 1, header.image_size, file) == header.image_size;
+    if (file && fclose(file)) {
+        ok = 0;
+    }
+    free(image);
+    if (!ok || rename(tmp_filename, image_filename) < 0) {
+        fprintf(stderr, "error: could not write %s : %s\n", image_filename, strerror(errno));
+        unlink(tmp_filename);
+        return 0;
+    }
     return 1;
 }
 
-int irc_conf_get_servers_count(irc_conf_t * irc_conf) {
-    return json_array_size(irc_conf->servers_root);
+/*
+ * Check that a record slice or a section is inside its array.
+ */
+static int image_slice_ok(uint64_t first, uint64_t count, uint64_t total) {
+    return first <= total && count <= total - first;
+}
+
+static int image_section_ok(const conf_image_header_t * header, uint64_t offset, uint64_t count, size_t record_size) {
+    return offset % 8 == 0 && offset >= sizeof(conf_image_header_t) && offset <= header->image_size
+        && count <= (header->image_size - offset) / record_size;
+}
+
+static int image_string_ok(const conf_image_header_t * header, uint32_t str) {
+    return str == CONF_IMAGE_NONE || str < header->strings_size;
+}
+
+static const char * image_string_at(const irc_conf_t * irc_conf, uint32_t str) {
+    return str == CONF_IMAGE_NONE ? NULL : irc_conf->strings.buf + str;
+}
+
+/*
+ * Check every offset and index of the image, nothing is read out of it afterwards.
+ */
+static int image_validate(const char * image, const conf_image_header_t * header) {
+    if (!image_section_ok(header, header->servers_offset, header->servers_count, sizeof(conf_image_server_t))
+            || !image_section_ok(header, header->channels_offset, header->channels_count, sizeof(conf_image_channel_t))
+            || !image_section_ok(header, header->cmds_offset, header->cmds_count, sizeof(conf_image_cmd_t))
+            || !image_section_ok(header, header->filters_offset, header->filters_count, sizeof(conf_image_filter_t))
+            || !image_section_ok(header, header->regexes_offset, header->regexes_count, sizeof(conf_image_regex_t))
+            || !image_section_ok(header, header->lists_offset, header->lists_count, sizeof(uint32_t))
+            || !image_section_ok(header, header->strings_offset, header->strings_size, 1)) {
+        return 0;
+    }
+    // every string ends inside the table
+    if (header->strings_size > 0 && image[header->strings_offset + header->strings_size - 1] != '\0') {
+        return 0;
+    }
+    if (header->threads_count < 1 || header->output_type < OUTPUT_STDOUT || header->output_type > OUTPUT_UNIX
+            || header->log_level < LOG_LEVEL_DEBUG || header->log_level > LOG_LEVEL_NONE
+            || !image_string_ok(header, header->output_path) || !image_string_ok(header, header->log_path)
+            || !image_string_ok(header, header->stats_socket) || !image_string_ok(header, header->stats_dump_path)
+            || header->stats_dump_interval_s < 1
+            || !image_string_ok(header, header->archive_path) || header->archive_segment_size_mb < 1
+            || header->archive_max_size_mb < 0 || header->archive_max_age_days < 0
+            || (header->output_type != OUTPUT_STDOUT && header->output_path == CONF_IMAGE_NONE)) {
+        return 0;
+    }
+
+    uint32_t i;
+    const conf_image_server_t * servers = (const conf_image_server_t *) (image + header->servers_offset);
+    for (i = 0; i < header->servers_count; i++) {
+        const conf_image_server_t * server = &servers[i];
+        if (!image_string_ok(header, server->name) || !image_string_ok(header, server->ip)
+                || !image_string_ok(header, server->passwd) || !image_string_ok(header, server->nick)
+                || server->name == CONF_IMAGE_NONE || server->ip == CONF_IMAGE_NONE || server->nick == CONF_IMAGE_NONE
+                || server->flood_burst < 1 || server->flood_interval_ms < 0 || server->connections_max < 1
+                || !image_slice_ok(server->channels_first, server->channels_count, header->channels_count)
+                || !image_slice_ok(server->cmds_first, server->cmds_count, header->cmds_count)) {
+            return 0;
+        }
+    }
+    const conf_image_channel_t * channels = (const conf_image_channel_t *) (image + header->channels_offset);
+    for (i = 0; i < header->channels_count; i++) {
+        const conf_image_channel_t * channel = &channels[i];
+        if (!image_string_ok(header, channel->name) || channel->name == CONF_IMAGE_NONE
+                || !image_string_ok(header, channel->passwd)
+                || !image_slice_ok(channel->nickfilters_first, channel->nickfilters_count, header->lists_count)
+                || !image_slice_ok(channel->filters_first, channel->filters_count, header->filters_count)) {
+            return 0;
+        }
+    }
+    const conf_image_cmd_t * cmds = (const conf_image_cmd_t *) (image + header->cmds_offset);
+    for (i = 0; i < header->cmds_count; i++) {
+        if (!image_string_ok(header, cmds[i].name) || cmds[i].name == CONF_IMAGE_NONE
+                || !image_string_ok(header, cmds[i].arg1) || !image_string_ok(header, cmds[i].arg2)) {
+            return 0;
+        }
+    }
+    const conf_image_filter_t * filters = (const conf_image_filter_t *) (image + header->filters_offset);
+    for (i = 0; i < header->filters_count; i++) {
+        if (!image_string_ok(header, filters[i].name)
+                || !image_slice_ok(filters[i].regexes_first, filters[i].regexes_count, header->regexes_count)
+                || !image_slice_ok(filters[i].nicks_first, filters[i].nicks_count, header->lists_count)
+                || filters[i].text < FILTER_TEXT_NORMALIZED || filters[i].text > FILTER_TEXT_RAW) {
+            return 0;
+        }
+    }
+    const conf_image_regex_t * regexes = (const conf_image_regex_t *) (image + header->regexes_offset);
+    for (i = 0; i < header->regexes_count; i++) {
+        if (!image_string_ok(header, regexes[i].regex) || regexes[i].regex == CONF_IMAGE_NONE
+                || !image_slice_ok(regexes[i].vars_first, regexes[i].vars_count, header->lists_count)) {
+            return 0;
+        }
+    }
+    const uint32_t * lists = (const uint32_t *) (image + header->lists_offset);
+    for (i = 0; i < header->lists_count; i++) {
+        if (!image_string_ok(header, lists[i]) || lists[i] == CONF_IMAGE_NONE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Fill irc_conf from a validated image. The strings are used in place.
+ */
+static void image_materialize(irc_conf_t * irc_conf, const char * image, const conf_image_header_t * header) {
+    irc_conf->threads_count = header->threads_count;
+    irc_conf->output_type = header->output_type;
+    irc_conf->log_level = header->log_level;
+    irc_conf->strings.buf = (char *) image + header->strings_offset;
+    irc_conf->strings.size = header->strings_size;
+    irc_conf->strings.used = header->strings_size;
+    irc_conf->output_path = image_string_at(irc_conf, header->output_path);
+    irc_conf->log_path = image_string_at(irc_conf, header->log_path);
+    irc_conf->stats_socket = image_string_at(irc_conf, header->stats_socket);
+    irc_conf->stats_dump_path = image_string_at(irc_conf, header->stats_dump_path);
+    irc_conf->stats_dump_interval_s = header->stats_dump_interval_s;
+    irc_conf->archive_path = image_string_at(irc_conf, header->archive_path);
+    irc_conf->archive_segment_size_mb = header->archive_segment_size_mb;
+    irc_conf->archive_max_size_mb = header->archive_max_size_mb;
+    irc_conf->archive_max_age_days = header->archive_max_age_days;
+
+    irc_conf->servers_count = header->servers_count;
+    irc_conf->servers = calloc(header->servers_count ? header->servers_count : 1, sizeof(server_conf_t));
+    irc_conf->channels = calloc(header->channels_count ? header->channels_count : 1, sizeof(channel_conf_t));
+    irc_conf->cmds = calloc(header->cmds_count ? header->cmds_count : 1, sizeof(cmd_conf_t));
+    irc_conf->filters = calloc(header->filters_count ? header->filters_count : 1, sizeof(filter_conf_t));
+    irc_conf->regexes = calloc(header->regexes_count ? header->regexes_count : 1, sizeof(regex_conf_t));
+    irc_conf->lists = calloc(header->lists_count ? header->lists_count : 1, sizeof(const char *));
+    irc_conf->channels_count = header->channels_count;
+    irc_conf->cmds_count = header->cmds_count;
+    irc_conf->filters_count = header->filters_count;
+    irc_conf->regexes_count = header->regexes_count;
+    irc_conf->lists_count = header->lists_count;
+
+    uint32_t i;
+    const conf_image_server_t * servers = (const conf_image_server_t *) (image + header->servers_offset);
+    for (i = 0; i < header->servers_count; i++) {
+        server_conf_t * server_conf = &irc_conf->servers[i];
+        server_conf->name = image_string_at(irc_conf, servers[i].name);
+        server_conf->ip = image_string_at(irc_conf, servers[i].ip);
+        server_conf->port = servers[i].port;
+        server_conf->passwd = image_string_at(irc_conf, servers[i].passwd);
+        server_conf->nick = image_string_at(irc_conf, servers[i].nick);
+        server_conf->flood_burst = servers[i].flood_burst;
+        server_conf->flood_interval_ms = servers[i].flood_interval_ms;
+        server_conf->connections_max = servers[i].connections_max;
+        server_conf->channels = irc_conf->channels + servers[i].channels_first;
+        server_conf->channels_count = servers[i].channels_count;
+        server_conf->cmds = irc_conf->cmds + servers[i].cmds_first;
+        server_conf->cmds_count = servers[i].cmds_count;
+    }
+    const conf_image_channel_t * channels = (const conf_image_channel_t *) (image + header->channels_offset);
+    for (i = 0; i < header->channels_count; i++) {
+        channel_conf_t * channel_conf = &irc_conf->channels[i];
+        channel_conf->name = image_string_at(irc_conf, channels[i].name);
+        channel_conf->passwd = image_string_at(irc_conf, channels[i].passwd);
+        channel_conf->nickfilters = irc_conf->lists + channels[i].nickfilters_first;
+        channel_conf->nickfilters_count = channels[i].nickfilters_count;
+        channel_conf->filters = irc_conf->filters + channels[i].filters_first;
+        channel_conf->filters_count = channels[i].filters_count;
+    }
+    const conf_image_cmd_t * cmds = (const conf_image_cmd_t *) (image + header->cmds_offset);
+    for (i = 0; i < header->cmds_count; i++) {
+        irc_conf->cmds[i].name = image_string_at(irc_conf, cmds[i].name);
+        irc_conf->cmds[i].arg1 = image_string_at(irc_conf, cmds[i].arg1);
+        irc_conf->cmds[i].arg2 = image_string_at(irc_conf, cmds[i].arg2);
+    }
+    const conf_image_filter_t * filters = (const conf_image_filter_t *) (image + header->filters_offset);
+    for (i = 0; i < header->filters_count; i++) {
+        irc_conf->filters[i].name = image_string_at(irc_conf, filters[i].name);
+        irc_conf->filters[i].regexes = irc_conf->regexes + filters[i].regexes_first;
+        irc_conf->filters[i].regexes_count = filters[i].regexes_count;
+        irc_conf->filters[i].nicks = irc_conf->lists + filters[i].nicks_first;
+        irc_conf->filters[i].nicks_count = filters[i].nicks_count;
+        irc_conf->filters[i].text = filters[i].text;
+    }
+    const conf_image_regex_t * regexes = (const conf_image_regex_t *) (image + header->regexes_offset);
+    for (i = 0; i < header->regexes_count; i++) {
+        irc_conf->regexes[i].regex = image_string_at(irc_conf, regexes[i].regex);
+        irc_conf->regexes[i].vars = irc_conf->lists + regexes[i].vars_first;
+        irc_conf->regexes[i].vars_count = regexes[i].vars_count;
+    }
+    const uint32_t * lists = (const uint32_t *) (image + header->lists_offset);
+    for (i = 0; i < header->lists_count; i++) {
+        irc_conf->lists[i] = image_string_at(irc_conf, lists[i]);
+    }
+}
+
+int irc_conf_load_image(irc_conf_t * irc_conf, const char * filename, const char * image_filename) {
+    if (irc_conf->loaded) {
+        fprintf(stderr, "error: configuration already loaded, use a new irc_conf_t.\n");
+        return 0;
+    }
+
+    struct stat source_stat;
+    if (stat(filename, &source_stat) < 0) {
+        return 0;
+    }
+    int fd = open(image_filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) < 0 || image_stat.st_size < (off_t) sizeof(conf_image_header_t)) {
+        close(fd);
+        return 0;
+    }
+    size_t image_size = image_stat.st_size;
+    char * image = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return 0;
+    }
+
+    const conf_image_header_t * header = (const conf_image_header_t *) image;
+    if (memcmp(header->magic, CONF_IMAGE_MAGIC, sizeof(header->magic)) || header->version != CONF_IMAGE_VERSION
+            || header->header_size != sizeof(conf_image_header_t) || header->image_size != image_size) {
+        log_warn("%s is not a configuration image of this version, loading %s.", image_filename, filename);
+        munmap(image, image_size);
+        return 0;
+    }
+    if (header->source_size != source_stat.st_size || header->source_mtime_sec != source_stat.st_mtim.tv_sec
+            || header->source_mtime_nsec != source_stat.st_mtim.tv_nsec) {
+        log_info("%s changed since %s was compiled, loading it.", filename, image_filename);
+        munmap(image, image_size);
+        return 0;
+    }
+    if (!image_validate(image, header)) {
+        log_warn("%s is corrupted, loading %s.", image_filename, filename);
+        munmap(image, image_size);
+        return 0;
+    }
+
+    image_materialize(irc_conf, image, header);
+    irc_conf->image = image;
+    irc_conf->image_size = image_size;
+    irc_conf->source_size = source_stat.st_size;
+    irc_conf->source_mtime = source_stat.st_mtim;
+    irc_conf->loaded = 1;
+    return 1;
+}
+
+// -----
+
+int irc_conf_get_threads_count(const irc_conf_t * irc_conf) {
+    return irc_conf->threads_count;
+}
+
+output_type_t irc_conf_get_output_type(const irc_conf_t * irc_conf) {
+    return irc_conf->output_type;
+}
+
+const char * irc_conf_get_output_path(const irc_conf_t * irc_conf) {
+    return irc_conf->output_path;
+}
+
+log_level_t irc_conf_get_log_level(const irc_conf_t * irc_conf) {
+    return irc_conf->log_level;
+}
+
+const char * irc_conf_get_log_path(const irc_conf_t * irc_conf) {
+    return irc_conf->log_path;
+}
+
+const char * irc_conf_get_stats_socket(const irc_conf_t * irc_conf) {
+    return irc_conf->stats_socket;
+}
+
+const char * irc_conf_get_stats_dump_path(const irc_conf_t * irc_conf) {
+    return irc_conf->stats_dump_path;
+}
+
+int irc_conf_get_stats_dump_interval_s(const irc_conf_t * irc_conf) {
+    return irc_conf->stats_dump_interval_s;
+}
+
+const char * irc_conf_get_archive_path(const irc_conf_t * irc_conf) {
+    return irc_conf->archive_path;
+}
+
+int irc_conf_get_archive_segment_size_mb(const irc_conf_t * irc_conf) {
+    return irc_conf->archive_segment_size_mb;
+}
+
+int irc_conf_get_archive_max_size_mb(const irc_conf_t * irc_conf) {
+    return irc_conf->archive_max_size_mb;
+}
+
+int irc_conf_get_archive_max_age_days(const irc_conf_t * irc_conf) {
+    return irc_conf->archive_max_age_days;
+}
+
+int irc_conf_get_servers_count(const irc_conf_t * irc_conf) {
+    return irc_conf->servers_count;
 }
 
-server_conf_t * irc_conf_get_server_at(irc_conf_t * irc_conf, int index) {
-    json_t * server_node = json_array_get(irc_conf->servers_root, index);
-    irc_conf->current_server.node = server_node;
-    irc_conf->current_server.channels_node = json_object_get(server_node, "channels");
-    irc_conf->current_server.cmds_node = json_object_get(server_node, "cmds");
-    return &irc_conf->current_server;
+const server_conf_t * irc_conf_get_server_at(const irc_conf_t * irc_conf, int index) {
+    return &irc_conf->servers[index];
 }
 
 // -----
@@ -1,7 +1,14 @@
 #ifndef CONF_H_
 #define CONF_H_
 
+#include "log.h"
+
 // Use opaque pointer : http://en.wikipedia.org/wiki/Opaque_pointer
+//
+// Once loaded, a configuration is an immutable snapshot : every handle returned
+// by the accessors below stays valid, and keeps pointing to the same node, for
+// the whole life of the irc_conf_t. Any number of threads may read it
+// concurrently without locking.
 typedef struct _regex_conf_t regex_conf_t;
 typedef struct _filter_conf_t filter_conf_t;
 typedef struct _cmd_conf_t cmd_conf_t;
@@ -9,74 +16,216 @@ typedef struct _channel_conf_t channel_conf_t;
 typedef struct _server_conf_t server_conf_t;
 typedef struct _irc_conf_t irc_conf_t;
 
+typedef enum {
+    OUTPUT_STDOUT = 0,
+    OUTPUT_FILE = 1,
+    OUTPUT_UNIX = 2
+} output_type_t;
+
+// Text a filter matches : normalized, see normalize.h, or raw and case insensitive.
+typedef enum {
+    FILTER_TEXT_NORMALIZED = 0,
+    FILTER_TEXT_RAW = 1
+} filter_text_t;
+
 
 // ----- regex_conf
 
-const char * regex_conf_get_regex(regex_conf_t * regex_conf);
+const char * regex_conf_get_regex(const regex_conf_t * regex_conf);
 
-int regex_conf_get_vars_count(regex_conf_t * regex_conf);
+int regex_conf_get_vars_count(const regex_conf_t * regex_conf);
 
-const char * regex_conf_get_var_at(regex_conf_t * regex_conf, int index);
+const char * regex_conf_get_var_at(const regex_conf_t * regex_conf, int index);
 
 // ----- filter_conf
 
-const char * filter_conf_get_name(filter_conf_t * filter_conf);
+const char * filter_conf_get_name(const filter_conf_t * filter_conf);
+
+int filter_conf_get_regexes_count(const filter_conf_t * filter_conf);
 
-int filter_conf_get_regexes_count(filter_conf_t * filter_conf);
+const regex_conf_t * filter_conf_get_regex_at(const filter_conf_t * filter_conf, int index);
 
-regex_conf_t * filter_conf_get_regex_at(filter_conf_t * filter_conf, int index);
+filter_text_t filter_conf_get_text(const filter_conf_t * filter_conf);
+
+/*
+ * Nicks and nick!user@host masks the filter is restricted to, on top of the
+ * nickfilter of its channel, none if it matches every line.
+ */
+int filter_conf_get_nicks_count(const filter_conf_t * filter_conf);
+
+const char * filter_conf_get_nick_at(const filter_conf_t * filter_conf, int index);
 
 // ---- cmd_conf
 
-const char * cmd_conf_get_name(cmd_conf_t * cmd_conf);
+const char * cmd_conf_get_name(const cmd_conf_t * cmd_conf);
 
-const char * cmd_conf_get_arg1(cmd_conf_t * cmd_conf);
+const char * cmd_conf_get_arg1(const cmd_conf_t * cmd_conf);
 
-const char * cmd_conf_get_arg2(cmd_conf_t * cmd_conf);
+const char * cmd_conf_get_arg2(const cmd_conf_t * cmd_conf);
 
 // ---- channel_conf
 
-const char * channel_conf_get_name(channel_conf_t * channel_conf);
+const char * channel_conf_get_name(const channel_conf_t * channel_conf);
+
+const char * channel_conf_get_passwd(const channel_conf_t * channel_conf);
 
-const char * channel_conf_get_passwd(channel_conf_t * channel_conf);
+/*
+ * Nicks and nick!user@host masks whose lines the filters of the channel see,
+ * every line if there is none.
+ */
+int channel_conf_get_nickfilters_count(const channel_conf_t * channel_conf);
 
-const char * channel_conf_get_nickfilter(channel_conf_t * channel_conf);
+const char * channel_conf_get_nickfilter_at(const channel_conf_t * channel_conf, int index);
 
-int channel_conf_get_filters_count(channel_conf_t * channel_conf);
+int channel_conf_get_filters_count(const channel_conf_t * channel_conf);
 
-filter_conf_t * channel_conf_get_filter_at(channel_conf_t * channel_conf, int index);
+const filter_conf_t * channel_conf_get_filter_at(const channel_conf_t * channel_conf, int index);
+
+/*
+ * Return 1 if both channels have the same filters, which then compile to the
+ * same filter set. The channels may belong to different snapshots.
+ */
+int channel_conf_same_filters(const channel_conf_t * channel_conf, const channel_conf_t * other);
 
 // ----- server_conf
 
-const char * server_conf_get_name(server_conf_t * server_conf);
+const char * server_conf_get_name(const server_conf_t * server_conf);
+
+const char * server_conf_get_ip(const server_conf_t * server_conf);
+
+int server_conf_get_port(const server_conf_t * server_conf);
+
+const char * server_conf_get_passwd(const server_conf_t * server_conf);
 
-const char * server_conf_get_ip(server_conf_t * server_conf);
+const char * server_conf_get_nick(const server_conf_t * server_conf);
 
-int server_conf_get_port(server_conf_t * server_conf);
+/*
+ * Lines that can be sent at once, 5 by default.
+ */
+int server_conf_get_flood_burst(const server_conf_t * server_conf);
 
-const char * server_conf_get_passwd(server_conf_t * server_conf);
+/*
+ * Delay before one more line can be sent, 1000 ms by default, 0 to disable pacing.
+ */
+int server_conf_get_flood_interval_ms(const server_conf_t * server_conf);
 
-const char * server_conf_get_nick(server_conf_t * server_conf);
+/*
+ * Connections opened to the server when its channels exceed the channel limit
+ * of one, 4 by default.
+ */
+int server_conf_get_connections_max(const server_conf_t * server_conf);
 
-int server_conf_get_channels_count(server_conf_t * server_conf);
+int server_conf_get_channels_count(const server_conf_t * server_conf);
 
-channel_conf_t * server_conf_get_channel_at(server_conf_t * server_conf, int index);
+const channel_conf_t * server_conf_get_channel_at(const server_conf_t * server_conf, int index);
 
-int server_conf_get_cmds_count(server_conf_t * server_conf);
+int server_conf_get_cmds_count(const server_conf_t * server_conf);
 
-cmd_conf_t * server_conf_get_cmd_at(server_conf_t * server_conf, int index);
+const cmd_conf_t * server_conf_get_cmd_at(const server_conf_t * server_conf, int index);
+
+/*
+ * Return 1 if a session connected with server_conf is also one of other :
+ * same address, identity and commands sent on connection. The servers may
+ * belong to different snapshots.
+ */
+int server_conf_same_connection(const server_conf_t * server_conf, const server_conf_t * other);
 
 // ----- irc_conf
 
 irc_conf_t * irc_conf_new();
 
+/*
+ * Take an additional reference on the snapshot, released by irc_conf_free().
+ */
+irc_conf_t * irc_conf_ref(irc_conf_t * irc_conf);
+
+/*
+ * Release a reference, the configuration is freed with its last reference.
+ */
 void irc_conf_free(irc_conf_t * irc_conf);
 
+/*
+ * Load filename into a new irc_conf_t. A configuration can only be loaded once.
+ */
 int irc_conf_load(irc_conf_t * irc_conf, const char* filename);
 
-int irc_conf_get_servers_count(irc_conf_t * irc_conf);
-
-server_conf_t * irc_conf_get_server_at(irc_conf_t * irc_conf, int index);
+/*
+ * Load image_filename, a binary image written by irc_conf_write_image(), into a
+ * new irc_conf_t. The image is mapped and its strings are used in place.
+ * Return 0, leaving irc_conf untouched, if the image is missing or invalid, or
+ * if filename changed since it was compiled : the caller then loads filename.
+ */
+int irc_conf_load_image(irc_conf_t * irc_conf, const char * filename, const char * image_filename);
+
+/*
+ * Write irc_conf to image_filename, stamped with the size and modification time
+ * of the JSON file it was loaded from.
+ */
+int irc_conf_write_image(const irc_conf_t * irc_conf, const char * image_filename);
+
+/*
+ * Number of worker threads the sessions are spread on, 1 by default.
+ */
+int irc_conf_get_threads_count(const irc_conf_t * irc_conf);
+
+/*
+ * Where the match events are written, stdout by default.
+ */
+output_type_t irc_conf_get_output_type(const irc_conf_t * irc_conf);
+
+/*
+ * File or UNIX socket path of the output, NULL for stdout.
+ */
+const char * irc_conf_get_output_path(const irc_conf_t * irc_conf);
+
+/*
+ * Minimum level of the logged messages, info by default.
+ */
+log_level_t irc_conf_get_log_level(const irc_conf_t * irc_conf);
+
+/*
+ * File the log is appended to, NULL for stderr.
+ */
+const char * irc_conf_get_log_path(const irc_conf_t * irc_conf);
+
+/*
+ * UNIX socket serving the performance counters, NULL for none.
+ */
+const char * irc_conf_get_stats_socket(const irc_conf_t * irc_conf);
+
+/*
+ * File the performance counters are dumped to, NULL for none.
+ */
+const char * irc_conf_get_stats_dump_path(const irc_conf_t * irc_conf);
+
+/*
+ * Delay between two dumps of the performance counters, 60 s by default.
+ */
+int irc_conf_get_stats_dump_interval_s(const irc_conf_t * irc_conf);
+
+/*
+ * Directory the channel traffic is archived to, NULL for none. See archive.h.
+ */
+const char * irc_conf_get_archive_path(const irc_conf_t * irc_conf);
+
+/*
+ * Size an archive segment is closed at, 64 MB by default.
+ */
+int irc_conf_get_archive_segment_size_mb(const irc_conf_t * irc_conf);
+
+/*
+ * The oldest segments are deleted past that size of the archive, 0 for no limit.
+ */
+int irc_conf_get_archive_max_size_mb(const irc_conf_t * irc_conf);
+
+/*
+ * The segments older than that are deleted, 0 for no limit.
+ */
+int irc_conf_get_archive_max_age_days(const irc_conf_t * irc_conf);
+
+int irc_conf_get_servers_count(const irc_conf_t * irc_conf);
+
+const server_conf_t * irc_conf_get_server_at(const irc_conf_t * irc_conf, int index);
 
 // -----
 
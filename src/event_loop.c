@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "event_loop.h"
+#include "log.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256
+#define NS_PER_MS 1000000LL
+
+// ---
+
+struct _event_watch_t {
+	int fd;
+	event_handler_t handler;
+	void * data;
+
+	// unwatched while dispatching, freed at the end of event_loop_run_once()
+	int dead;
+	event_watch_t * next_dead;
+};
+
+struct _event_timer_t {
+	// CLOCK_MONOTONIC, in ns
+	long long deadline;
+	size_t heap_index;
+	timer_handler_t handler;
+	void * data;
+};
+
+struct _event_loop_t {
+	int epoll_fd;
+	int wakeup_fd;
+	event_watch_t * wakeup_watch;
+	mpsc_queue_t tasks;
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	event_watch_t * dead_watches;
+
+	// pending timers, min-heap on the deadline
+	event_timer_t ** timers;
+	size_t timers_count;
+	size_t timers_capacity;
+};
+
+
+// -----
+
+static void event_loop_run_tasks(event_loop_t * loop) {
+	mpsc_node_t * node;
+	while ((node = mpsc_queue_pop(&loop->tasks))) {
+		event_task_t * task = (event_task_t *) node;
+		task->handler(loop, task->data);
+	}
+}
+
+static void event_loop_woken(event_loop_t * loop, int fd, int events, void * data) {
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) > 0) {
+	}
+	// a task pushed after this is followed by another wake up
+	event_loop_run_tasks(loop);
+}
+
+event_loop_t * event_loop_new() {
+	event_loop_t * result = calloc(1, sizeof(struct _event_loop_t));
+	mpsc_queue_init(&result->tasks);
+	result->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (result->epoll_fd < 0) {
+		log_error("epoll_create1() : %s.", strerror(errno));
+		free(result);
+		return NULL;
+	}
+	result->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (result->wakeup_fd < 0) {
+		log_error("eventfd() : %s.", strerror(errno));
+		close(result->epoll_fd);
+		free(result);
+		return NULL;
+	}
+	result->wakeup_watch = event_loop_watch(result, result->wakeup_fd, event_loop_woken, NULL);
+	if (!result->wakeup_watch) {
+		close(result->wakeup_fd);
+		close(result->epoll_fd);
+		free(result);
+		return NULL;
+	}
+	return result;
+}
+
+static void event_loop_release_dead(event_loop_t * loop) {
+	while (loop->dead_watches) {
+		event_watch_t * watch = loop->dead_watches;
+		loop->dead_watches = watch->next_dead;
+		free(watch);
+	}
+}
+
+void event_loop_free(event_loop_t * loop) {
+	if (!loop) {
+		return;
+	}
+	event_loop_run_tasks(loop);
+	event_loop_unwatch(loop, loop->wakeup_watch);
+	event_loop_release_dead(loop);
+	size_t i;
+	for (i = 0; i < loop->timers_count; i++) {
+		free(loop->timers[i]);
+	}
+	free(loop->timers);
+	close(loop->wakeup_fd);
+	close(loop->epoll_fd);
+	memset(loop, 0, sizeof(struct _event_loop_t));
+	free(loop);
+}
+
+// ----- watches
+
+event_watch_t * event_loop_watch(event_loop_t * loop, int fd, event_handler_t handler, void * data) {
+	event_watch_t * watch = calloc(1, sizeof(struct _event_watch_t));
+	watch->fd = fd;
+	watch->handler = handler;
+	watch->data = data;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = watch;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+		log_error("epoll_ctl(ADD, %d) : %s.", fd, strerror(errno));
+		free(watch);
+		return NULL;
+	}
+	return watch;
+}
+
+void event_loop_unwatch(event_loop_t * loop, event_watch_t * watch) {
+	if (!watch || watch->dead) {
+		return;
+	}
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL)) {
+		log_error("epoll_ctl(DEL, %d) : %s.", watch->fd, strerror(errno));
+	}
+	// events for this watch may still be pending in the current batch
+	watch->dead = 1;
+	watch->next_dead = loop->dead_watches;
+	loop->dead_watches = watch;
+}
+
+// ----- timers
+
+static long long event_loop_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 * NS_PER_MS + now.tv_nsec;
+}
+
+static void event_timer_place(event_loop_t * loop, event_timer_t * timer, size_t index) {
+	loop->timers[index] = timer;
+	timer->heap_index = index;
+}
+
+static void event_timer_sift_up(event_loop_t * loop, size_t index) {
+	event_timer_t * timer = loop->timers[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (loop->timers[parent]->deadline <= timer->deadline) {
+			break;
+		}
+		event_timer_place(loop, loop->timers[parent], index);
+		index = parent;
+	}
+	event_timer_place(loop, timer, index);
+}
+
+static void event_timer_sift_down(event_loop_t * loop, size_t index) {
+	event_timer_t * timer = loop->timers[index];
+	for (;;) {
+		size_t child = index * 2 + 1;
+		if (child >= loop->timers_count) {
+			break;
+		}
+		if (child + 1 < loop->timers_count && loop->timers[child + 1]->deadline < loop->timers[child]->deadline) {
+			child++;
+		}
+		if (timer->deadline <= loop->timers[child]->deadline) {
+			break;
+		}
+		event_timer_place(loop, loop->timers[child], index);
+		index = child;
+	}
+	event_timer_place(loop, timer, index);
+}
+
+static void event_timer_remove(event_loop_t * loop, event_timer_t * timer) {
+	size_t index = timer->heap_index;
+	event_timer_t * last = loop->timers[--loop->timers_count];
+	if (last == timer) {
+		return;
+	}
+	event_timer_place(loop, last, index);
+	if (index > 0 && loop->timers[(index - 1) / 2]->deadline > last->deadline) {
+		event_timer_sift_up(loop, index);
+	} else {
+		event_timer_sift_down(loop, index);
+	}
+}
+
+event_timer_t * event_loop_add_timer(event_loop_t * loop, long delay_ms, timer_handler_t handler, void * data) {
+	if (loop->timers_count == loop->timers_capacity) {
+		loop->timers_capacity = loop->timers_capacity ? loop->timers_capacity * 2 : 16;
+		loop->timers = realloc(loop->timers, loop->timers_capacity * sizeof(event_timer_t *));
+	}
+
+	event_timer_t * timer = calloc(1, sizeof(struct _event_timer_t));
+	timer->deadline = event_loop_now() + (delay_ms > 0 ? delay_ms * NS_PER_MS : 0);
+	timer->handler = handler;
+	timer->data = data;
+	loop->timers[loop->timers_count++] = timer;
+	event_timer_sift_up(loop, loop->timers_count - 1);
+	return timer;
+}
+
+void event_loop_cancel_timer(event_loop_t * loop, event_timer_t * timer) {
+	if (timer) {
+		event_timer_remove(loop, timer);
+		free(timer);
+	}
+}
+
+/*
+ * Call the handlers of the timers due at now.
+ */
+static void event_loop_run_timers(event_loop_t * loop, long long now) {
+	while (loop->timers_count && loop->timers[0]->deadline <= now) {
+		event_timer_t * timer = loop->timers[0];
+		event_timer_remove(loop, timer);
+		timer->handler(loop, timer->data);
+		free(timer);
+	}
+}
+
+/*
+ * Time to wait for events : at most timeout_ms, and not past the next deadline.
+ */
+static int event_loop_wait_ms(event_loop_t * loop, int timeout_ms) {
+	if (!loop->timers_count) {
+		return timeout_ms;
+	}
+	long long delay = loop->timers[0]->deadline - event_loop_now();
+	// rounded up, to not wake up just before the deadline
+	int delay_ms = delay <= 0 ? 0 : (int) ((delay + NS_PER_MS - 1) / NS_PER_MS);
+	return timeout_ms < 0 || delay_ms < timeout_ms ? delay_ms : timeout_ms;
+}
+
+// -----
+
+void event_loop_wakeup(event_loop_t * loop) {
+	uint64_t one = 1;
+	if (write(loop->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+		log_error("event_loop_wakeup() : %s.", strerror(errno));
+	}
+}
+
+void event_loop_post(event_loop_t * loop, event_task_t * task, task_handler_t handler, void * data) {
+	task->handler = handler;
+	task->data = data;
+	mpsc_queue_push(&loop->tasks, &task->node);
+	event_loop_wakeup(loop);
+}
+
+int event_loop_run_once(event_loop_t * loop, int timeout_ms) {
+	int count = epoll_wait(loop->epoll_fd, loop->events, EVENT_LOOP_MAX_EVENTS, event_loop_wait_ms(loop, timeout_ms));
+	if (count < 0) {
+		if (errno == EINTR) {
+			return 1;
+		}
+		log_error("epoll_wait() : %s.", strerror(errno));
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		event_watch_t * watch = (event_watch_t *) loop->events[i].data.ptr;
+		if (watch->dead) {
+			continue;
+		}
+		uint32_t epoll_events = loop->events[i].events;
+		int events = 0;
+		if (epoll_events & (EPOLLIN | EPOLLRDHUP)) {
+			events |= EVENT_READ;
+		}
+		if (epoll_events & EPOLLOUT) {
+			events |= EVENT_WRITE;
+		}
+		if (epoll_events & (EPOLLERR | EPOLLHUP)) {
+			events |= EVENT_ERROR;
+		}
+		watch->handler(loop, watch->fd, events, watch->data);
+	}
+
+	event_loop_run_timers(loop, event_loop_now());
+	event_loop_release_dead(loop);
+	return 1;
+}
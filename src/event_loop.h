@@ -0,0 +1,85 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include "mpsc_queue.h"
+
+/*
+ * epoll based event loop.
+ *
+ * Descriptors are registered once, edge-triggered, for both read and write :
+ * a handler is only called when the state of its descriptor changed, so it
+ * must consume everything that is available before returning.
+ * Timers are one shot, kept in a min-heap on a monotonic clock : the loop
+ * sleeps until the next deadline, whatever the number of timers.
+ * Other threads hand work over to the loop with event_loop_post().
+ */
+
+typedef struct _event_loop_t event_loop_t;
+typedef struct _event_watch_t event_watch_t;
+typedef struct _event_timer_t event_timer_t;
+
+#define EVENT_READ  0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4
+
+typedef void (*event_handler_t)(event_loop_t * loop, int fd, int events, void * data);
+
+typedef void (*timer_handler_t)(event_loop_t * loop, void * data);
+
+typedef void (*task_handler_t)(event_loop_t * loop, void * data);
+
+/*
+ * Work posted to a loop. Public so that it can be embedded, its fields are private.
+ */
+typedef struct {
+	mpsc_node_t node;
+	task_handler_t handler;
+	void * data;
+} event_task_t;
+
+event_loop_t * event_loop_new();
+
+void event_loop_free(event_loop_t * loop);
+
+/*
+ * Watch fd until event_loop_unwatch(). Return NULL on error.
+ */
+event_watch_t * event_loop_watch(event_loop_t * loop, int fd, event_handler_t handler, void * data);
+
+/*
+ * Stop watching. It is safe to call it from any handler, including the watch's own.
+ * The descriptor is not closed.
+ */
+void event_loop_unwatch(event_loop_t * loop, event_watch_t * watch);
+
+/*
+ * Call handler once, delay_ms milliseconds from now. Return NULL on error.
+ * The timer is released after its handler returned.
+ */
+event_timer_t * event_loop_add_timer(event_loop_t * loop, long delay_ms, timer_handler_t handler, void * data);
+
+/*
+ * Cancel a timer that has not fired yet. A timer must not be cancelled from its own handler.
+ */
+void event_loop_cancel_timer(event_loop_t * loop, event_timer_t * timer);
+
+/*
+ * Make a pending or the next event_loop_run_once() return. Can be called from any thread.
+ */
+void event_loop_wakeup(event_loop_t * loop);
+
+/*
+ * Call handler from the loop's thread. Can be called from any thread, task must
+ * stay valid until handler is called. Tasks still pending when the loop is freed
+ * are run by event_loop_free().
+ */
+void event_loop_post(event_loop_t * loop, event_task_t * task, task_handler_t handler, void * data);
+
+/*
+ * Wait at most timeout_ms (-1 : no limit) for events and dispatch them.
+ * Return 0 on a fatal error. Being interrupted by a signal is not an error.
+ */
+int event_loop_run_once(event_loop_t * loop, int timeout_ms);
+
+
+#endif /* EVENT_LOOP_H_ */
@@ -0,0 +1,670 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <regex.h>
+
+#include "filter.h"
+#include "prefilter.h"
+#include "regex_backend.h"
+#include "log.h"
+
+
+// ---
+
+/*
+ * The strings of a set are copies : a set kept over a reload outlives the
+ * configuration it was built from.
+ */
+struct _compiled_regex_t {
+    char * regex_str;
+    // case folded regex_str of a normalized filter, NULL for a raw one
+    char * folded_str;
+    // literal backend for plain strings, posix for the others
+    regex_program_t program;
+
+    // preallocated match buffer, re_nsub + 1 entries
+    regmatch_t * groups;
+    size_t ngroups;
+
+    char ** vars;
+    int vars_count;
+};
+
+struct _compiled_filter_t {
+    char * name;
+    filter_text_t text;
+    compiled_regex_t * regexes;
+    int regexes_count;
+
+    // bit i set : regexes 0..i matched the last i + 1 lines
+    uint64_t partial_matches;
+
+    // the first regex can only match lines containing its required literal
+    int has_literal;
+
+    filter_stats_t stats;
+};
+
+// texts of a line kept in the history
+typedef enum {
+    HISTORY_RAW = 0,
+    HISTORY_STRIPPED = 1,
+    HISTORY_FOLDED = 2,
+    HISTORY_TEXTS_COUNT = 3
+} history_text_t;
+
+/*
+ * Ring buffer of the last lines of a channel. Each slot is a fixed size
+ * arena holding the texts of a line, so storing a line never allocates.
+ */
+typedef struct {
+    char * arena;
+    int slots_count;
+    // slot of the next line
+    int next;
+    // lines stored so far, at most slots_count
+    int count;
+} channel_history_t;
+
+struct _filter_set_t {
+    compiled_filter_t * filters;
+    int filters_count;
+
+    channel_history_t history;
+    // lines of the current match, oldest first
+    const char ** match_lines;
+
+    // required literals of the first regexes, NULL if none was found :
+    // in the folded text for the normalized filters, in the raw one for the others
+    prefilter_t * prefilter;
+    prefilter_t * raw_prefilter;
+    // filters whose literal is in the current line : marks[i] == generation
+    unsigned int * marks;
+    unsigned int generation;
+
+    channel_stats_t stats;
+};
+
+
+// ----- compiled_regex
+
+// longest bracket expression fold_regex() writes : every byte but NUL, brackets included
+#define FOLDED_BRACKET_MAX 260
+
+/*
+ * End of the bracket expression at start, its closing ], NULL if it has none.
+ */
+static const char * bracket_end(const char * start) {
+    const char * p = start + 1;
+    // a leading ] is part of the list
+    if (*p == '^') {
+        p++;
+    }
+    if (*p == ']') {
+        p++;
+    }
+    while (*p) {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            // [:alpha:], [.x.] and [=x=]
+            char delimiter[3] = { p[1], ']', '\0' };
+            const char * end = strstr(p + 2, delimiter);
+            if (!end) {
+                return NULL;
+            }
+            p = end + 2;
+            continue;
+        }
+        if (*p == ']') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * Bytes matched case insensitively by the bracket expression of len bytes at
+ * start, in members. The set is the one written, ranges and classes included,
+ * with the other case of its letters, then negated for [^...].
+ * Return 0 if the expression does not compile.
+ */
+static int bracket_members(const char * start, size_t len, char * members) {
+    char * expression = strndup(start, len);
+    regex_t regex;
+    int ok = !regcomp(&regex, expression, REG_EXTENDED | REG_NOSUB);
+    free(expression);
+    if (!ok) {
+        return 0;
+    }
+    int negated = start[1] == '^';
+    int c;
+    members[0] = 0;
+    for (c = 1; c < 256; c++) {
+        char str[2] = { (char) c, '\0' };
+        members[c] = (regexec(&regex, str, 0, NULL, 0) == 0) != negated;
+    }
+    regfree(&regex);
+    for (c = 'a'; c <= 'z'; c++) {
+        members[c] = members[c - 'a' + 'A'] = members[c] || members[c - 'a' + 'A'];
+    }
+    for (c = 1; negated && c < 256; c++) {
+        members[c] = !members[c];
+    }
+    return 1;
+}
+
+static int is_bracket_special(int c) {
+    return c == ']' || c == '-' || c == '^';
+}
+
+/*
+ * Write the members of a bracket expression but the upper case letters, which
+ * the folded text does not have, to out, ranges of 3 bytes or more as such.
+ * Return the end of what was written, NULL if nothing is left to match.
+ */
+static char * write_bracket(char * out, const char * members) {
+    int count = 0;
+    int c;
+    for (c = 1; c < 256; c++) {
+        count += members[c] && !(c >= 'A' && c <= 'Z');
+    }
+    if (count == 0) {
+        return NULL;
+    }
+    if (count == 1 && members['^']) {
+        *out++ = '\\';
+        *out++ = '^';
+        return out;
+    }
+
+    *out++ = '[';
+    // ] first, ^ anywhere but first, - last
+    int body = members[']'];
+    if (body) {
+        *out++ = ']';
+    }
+    c = 1;
+    while (c < 256) {
+        if (!members[c] || (c >= 'A' && c <= 'Z') || is_bracket_special(c)) {
+            c++;
+            continue;
+        }
+        int last = c;
+        while (last + 1 < 256 && members[last + 1] && !(last + 1 >= 'A' && last + 1 <= 'Z')
+                && !is_bracket_special(last + 1)) {
+            last++;
+        }
+        *out++ = (char) c;
+        if (last - c >= 2) {
+            *out++ = '-';
+        }
+        if (last > c) {
+            *out++ = (char) last;
+        }
+        body = 1;
+        c = last + 1;
+    }
+    if (members['^'] && body) {
+        *out++ = '^';
+    }
+    if (members['-']) {
+        *out++ = '-';
+    }
+    if (members['^'] && !body) {
+        *out++ = '^';
+    }
+    *out++ = ']';
+    return out;
+}
+
+/*
+ * Fold a POSIX extended regex so that it matches folded text case
+ * sensitively : its literal letters are folded, and its bracket expressions
+ * rewritten as the bytes they match case insensitively, so that ranges such
+ * as [A-z] and classes such as [:upper:] keep their meaning. Escapes are kept.
+ * Return NULL if a bracket expression cannot be folded.
+ */
+static char * fold_regex(const char * regex) {
+    size_t brackets_count = 0;
+    const char * p;
+    for (p = regex; *p; p++) {
+        brackets_count += *p == '[';
+    }
+    char * result = malloc(strlen(regex) + brackets_count * FOLDED_BRACKET_MAX + 1);
+    char * out = result;
+    p = regex;
+    while (*p) {
+        if (*p == '\\' && p[1]) {
+            *out++ = *p++;
+            *out++ = *p++;
+        } else if (*p == '[') {
+            const char * end = bracket_end(p);
+            char members[256];
+            if (!end || !bracket_members(p, end + 1 - p, members) || !(out = write_bracket(out, members))) {
+                free(result);
+                return NULL;
+            }
+            p = end + 1;
+        } else if (*p >= 'A' && *p <= 'Z') {
+            *out++ = *p++ + 'a' - 'A';
+        } else {
+            *out++ = *p++;
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+static int compiled_regex_init(compiled_regex_t * compiled, const regex_conf_t * regex_conf, filter_text_t text) {
+    const char * conf_regex_str = regex_conf_get_regex(regex_conf);
+    if (!conf_regex_str) {
+        log_error("regex is missing or it's not a string.");
+        return 0;
+    }
+    compiled->regex_str = strdup(conf_regex_str);
+
+    const char * regex_str = compiled->regex_str;
+    int icase = text == FILTER_TEXT_RAW;
+    if (!icase) {
+        compiled->folded_str = fold_regex(compiled->regex_str);
+        if (compiled->folded_str) {
+            regex_str = compiled->folded_str;
+        } else {
+            // matched case insensitively, on the folded text as on the stripped one
+            icase = 1;
+        }
+    }
+    char buf[512];
+    if (!regex_program_compile(&compiled->program, regex_backend_select(regex_str), regex_str, icase,
+            buf, sizeof(buf))) {
+        log_error("invalid regular expression %s : %s", compiled->regex_str, buf);
+        return 0;
+    }
+    log_debug("Compilation ok : %s => %s", compiled->regex_str, compiled->program.backend->name);
+
+    compiled->vars_count = regex_conf_get_vars_count(regex_conf);
+    if (compiled->vars_count != compiled->program.nsub) {
+        log_error("wrong number of variables for %s, re: %d, vars: %d",
+            compiled->regex_str, (int) compiled->program.nsub, compiled->vars_count);
+        return 0;
+    }
+
+    compiled->ngroups = compiled->program.nsub + 1;
+    compiled->groups = calloc(compiled->ngroups, sizeof(regmatch_t));
+    if (compiled->vars_count > 0) {
+        compiled->vars = calloc(compiled->vars_count, sizeof(char *));
+    }
+
+    int i;
+    for (i = 0; i < compiled->vars_count; i++) {
+        const char * var = regex_conf_get_var_at(regex_conf, i);
+        compiled->vars[i] = var ? strdup(var) : NULL;
+    }
+    return 1;
+}
+
+static void compiled_regex_destroy(compiled_regex_t * compiled) {
+    regex_program_free(&compiled->program);
+    free(compiled->regex_str);
+    free(compiled->folded_str);
+    free(compiled->groups);
+    int i;
+    for (i = 0; compiled->vars && i < compiled->vars_count; i++) {
+        free(compiled->vars[i]);
+    }
+    free(compiled->vars);
+}
+
+// ----- channel_history
+
+static void channel_history_init(channel_history_t * history, int slots_count) {
+    history->slots_count = slots_count;
+    history->arena = calloc((size_t) slots_count * HISTORY_TEXTS_COUNT, FILTER_LINE_MAX);
+    history->next = 0;
+    history->count = 0;
+}
+
+static void channel_history_destroy(channel_history_t * history) {
+    free(history->arena);
+    memset(history, 0, sizeof(channel_history_t));
+}
+
+static char * channel_history_text(channel_history_t * history, int slot, history_text_t text) {
+    return history->arena + ((size_t) slot * HISTORY_TEXTS_COUNT + text) * FILTER_LINE_MAX;
+}
+
+static void channel_history_copy(char * dest, const char * text, size_t len) {
+    if (len >= FILTER_LINE_MAX) {
+        len = FILTER_LINE_MAX - 1;
+    }
+    memcpy(dest, text, len);
+    dest[len] = '\0';
+}
+
+/*
+ * Store line, return the slot of its texts.
+ */
+static int channel_history_push(channel_history_t * history, const normalized_line_t * line) {
+    int slot = history->next;
+    channel_history_copy(channel_history_text(history, slot, HISTORY_RAW), line->raw, strlen(line->raw));
+    channel_history_copy(channel_history_text(history, slot, HISTORY_STRIPPED), line->stripped, line->len);
+    channel_history_copy(channel_history_text(history, slot, HISTORY_FOLDED), line->folded, line->len);
+
+    history->next = (history->next + 1) % history->slots_count;
+    if (history->count < history->slots_count) {
+        history->count++;
+    }
+    return slot;
+}
+
+/*
+ * Fill lines with a text of the last count lines, oldest first.
+ */
+static void channel_history_get_last(channel_history_t * history, int count, history_text_t text, const char ** lines) {
+    int i;
+    for (i = 0; i < count; i++) {
+        int slot = (history->next - count + i + history->slots_count) % history->slots_count;
+        lines[i] = channel_history_text(history, slot, text);
+    }
+}
+
+// ----- compiled_filter
+
+const char * compiled_filter_get_name(compiled_filter_t * filter) {
+    return filter->name;
+}
+
+int compiled_filter_get_regexes_count(compiled_filter_t * filter) {
+    return filter->regexes_count;
+}
+
+const filter_stats_t * compiled_filter_get_stats(compiled_filter_t * filter) {
+    return &filter->stats;
+}
+
+void compiled_filter_foreach_capture(compiled_filter_t * filter, const char ** lines, int lines_count,
+        filter_capture_handler_t handler, void * data) {
+    int i;
+    for (i = 0; i < lines_count && i < filter->regexes_count; i++) {
+        compiled_regex_t * compiled = &filter->regexes[i];
+        int j;
+        for (j = 1; j < compiled->ngroups; j++) {
+            regmatch_t * group = &compiled->groups[j];
+            if (group->rm_so != -1) {
+                handler(compiled->vars[j - 1], lines[i] + group->rm_so, group->rm_eo - group->rm_so, data);
+            }
+        }
+    }
+}
+
+static int compiled_filter_init(compiled_filter_t * filter, const filter_conf_t * filter_conf) {
+    const char * name = filter_conf_get_name(filter_conf);
+    filter->name = name ? strdup(name) : NULL;
+    filter->text = filter_conf_get_text(filter_conf);
+    filter->regexes_count = filter_conf_get_regexes_count(filter_conf);
+    if (filter->regexes_count == 0) {
+        return 1;
+    }
+    if (filter->regexes_count > FILTER_REGEXES_MAX) {
+        log_error("filter %s has %d regexes, at most %d are supported.",
+            filter->name ? filter->name : "?", filter->regexes_count, FILTER_REGEXES_MAX);
+        filter->regexes_count = 0;
+        return 0;
+    }
+    filter->regexes = calloc(filter->regexes_count, sizeof(compiled_regex_t));
+
+    int i;
+    for (i = 0; i < filter->regexes_count; i++) {
+        const regex_conf_t * regex_conf = filter_conf_get_regex_at(filter_conf, i);
+        if (!compiled_regex_init(&filter->regexes[i], regex_conf, filter->text)) {
+            log_error("filter %s, regexes[%d] rejected.", filter->name ? filter->name : "?", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void compiled_filter_destroy(compiled_filter_t * filter) {
+    int i;
+    for (i = 0; i < filter->regexes_count; i++) {
+        if (filter->regexes) {
+            compiled_regex_destroy(&filter->regexes[i]);
+        }
+    }
+    free(filter->regexes);
+    free(filter->name);
+}
+
+// ----- filter_set
+
+/*
+ * Build the automaton finding, in one pass, which filters matching text can start a match on a line.
+ */
+static prefilter_t * filter_set_build_prefilter(filter_set_t * filter_set, filter_text_t text) {
+    prefilter_t * prefilter = prefilter_new();
+    char literal[FILTER_LINE_MAX];
+    int i;
+    for (i = 0; i < filter_set->filters_count; i++) {
+        compiled_filter_t * filter = &filter_set->filters[i];
+        if (filter->text == text && filter->regexes_count > 0
+                && prefilter_required_literal(filter->regexes[0].regex_str, literal, sizeof(literal))) {
+            prefilter_add(prefilter, literal, i);
+            filter->has_literal = 1;
+        }
+    }
+    if (!prefilter_compile(prefilter)) {
+        prefilter_free(prefilter);
+        return NULL;
+    }
+    return prefilter;
+}
+
+static void filter_set_init_prefilter(filter_set_t * filter_set) {
+    filter_set->prefilter = filter_set_build_prefilter(filter_set, FILTER_TEXT_NORMALIZED);
+    filter_set->raw_prefilter = filter_set_build_prefilter(filter_set, FILTER_TEXT_RAW);
+    if (filter_set->prefilter || filter_set->raw_prefilter) {
+        filter_set->marks = calloc(filter_set->filters_count, sizeof(unsigned int));
+    }
+}
+
+filter_set_t * filter_set_new(const channel_conf_t * channel_conf) {
+    filter_set_t * result = calloc(1, sizeof(struct _filter_set_t));
+    result->filters_count = channel_conf_get_filters_count(channel_conf);
+    if (result->filters_count == 0) {
+        return result;
+    }
+    result->filters = calloc(result->filters_count, sizeof(compiled_filter_t));
+
+    // the history must hold the lines of the longest filter
+    int history_size = 1;
+    int i;
+    for (i = 0; i < result->filters_count; i++) {
+        const filter_conf_t * filter_conf = channel_conf_get_filter_at(channel_conf, i);
+        if (!compiled_filter_init(&result->filters[i], filter_conf)) {
+            filter_set_free(result);
+            return NULL;
+        }
+        if (result->filters[i].regexes_count > history_size) {
+            history_size = result->filters[i].regexes_count;
+        }
+    }
+    channel_history_init(&result->history, history_size);
+    result->match_lines = calloc(history_size, sizeof(const char *));
+
+    filter_set_init_prefilter(result);
+    return result;
+}
+
+void filter_set_free(filter_set_t * filter_set) {
+    if (!filter_set) {
+        return;
+    }
+    int i;
+    for (i = 0; i < filter_set->filters_count; i++) {
+        if (filter_set->filters) {
+            compiled_filter_destroy(&filter_set->filters[i]);
+        }
+    }
+    free(filter_set->filters);
+    channel_history_destroy(&filter_set->history);
+    free(filter_set->match_lines);
+    prefilter_free(filter_set->prefilter);
+    prefilter_free(filter_set->raw_prefilter);
+    free(filter_set->marks);
+    memset(filter_set, 0, sizeof(struct _filter_set_t));
+    free(filter_set);
+}
+
+int filter_set_get_count(filter_set_t * filter_set) {
+    return filter_set->filters_count;
+}
+
+compiled_filter_t * filter_set_get_at(filter_set_t * filter_set, int index) {
+    return &filter_set->filters[index];
+}
+
+const channel_stats_t * filter_set_get_stats(filter_set_t * filter_set) {
+    return &filter_set->stats;
+}
+
+int filter_set_feed(filter_set_t * filter_set, const normalized_line_t * line, const uint64_t * filters,
+        filter_match_handler_t handler, void * data) {
+    if (filter_set->filters_count == 0) {
+        return 0;
+    }
+    uint64_t start = stats_now_ns();
+    int slot = channel_history_push(&filter_set->history, line);
+    const char * raw = channel_history_text(&filter_set->history, slot, HISTORY_RAW);
+    const char * folded = channel_history_text(&filter_set->history, slot, HISTORY_FOLDED);
+
+    if (filter_set->marks) {
+        if (++filter_set->generation == 0) {
+            memset(filter_set->marks, 0, filter_set->filters_count * sizeof(unsigned int));
+            filter_set->generation = 1;
+        }
+        if (filter_set->prefilter) {
+            prefilter_scan(filter_set->prefilter, folded, filter_set->generation, filter_set->marks);
+        }
+        if (filter_set->raw_prefilter) {
+            prefilter_scan(filter_set->raw_prefilter, raw, filter_set->generation, filter_set->marks);
+        }
+    }
+
+    int matches = 0;
+    int i;
+    for (i = 0; i < filter_set->filters_count; i++) {
+        compiled_filter_t * filter = &filter_set->filters[i];
+        if (filter->regexes_count == 0) {
+            continue;
+        }
+        if (filters && !((filters[i / 64] >> (i % 64)) & 1)) {
+            // a line from a sender the filter does not watch
+            filter->partial_matches = 0;
+            continue;
+        }
+
+        // regex i + 1 can extend the partial match i, regex 0 can start a new one
+        uint64_t candidates = filter->partial_matches << 1;
+        if (!filter->has_literal || filter_set->marks[i] == filter_set->generation) {
+            candidates |= 1;
+        }
+        if (!candidates) {
+            continue;
+        }
+        // only the filters running a regex are timed
+        uint64_t filter_start = stats_now_ns();
+        const char * text = filter->text == FILTER_TEXT_RAW ? raw : folded;
+        uint64_t matched = 0;
+        int j;
+        for (j = 0; j < filter->regexes_count && candidates >> j; j++) {
+            if ((candidates >> j) & 1) {
+                filter->stats.evaluations++;
+                if (regex_program_exec(&filter->regexes[j].program, text, 0, NULL)) {
+                    matched |= (uint64_t) 1 << j;
+                }
+            }
+        }
+
+        uint64_t complete = (uint64_t) 1 << (filter->regexes_count - 1);
+        filter->partial_matches = matched & ~complete;
+        int filter_matched = 0;
+        if (matched & complete) {
+            history_text_t matched_text = filter->text == FILTER_TEXT_RAW ? HISTORY_RAW : HISTORY_FOLDED;
+            channel_history_get_last(&filter_set->history, filter->regexes_count, matched_text,
+                    filter_set->match_lines);
+            // run the regexes again, with subgroups this time
+            filter->stats.evaluations += filter->regexes_count;
+            filter_matched = match_filter(filter_set->match_lines, filter->regexes_count, filter);
+            if (filter_matched && matched_text == HISTORY_FOLDED) {
+                // same offsets, original case
+                channel_history_get_last(&filter_set->history, filter->regexes_count, HISTORY_STRIPPED,
+                        filter_set->match_lines);
+            }
+        }
+        filter->stats.eval_ns += stats_now_ns() - filter_start;
+
+        if (filter_matched) {
+            matches++;
+            filter->stats.matches++;
+            if (handler) {
+                handler(filter, filter_set->match_lines, filter->regexes_count, data);
+            }
+        }
+    }
+
+    filter_set->stats.lines++;
+    filter_set->stats.matches += matches;
+    // the handlers publishing the matches are part of the latency
+    stats_histogram_record(&filter_set->stats.latency, stats_now_ns() - start);
+    return matches;
+}
+
+void filter_set_reset(filter_set_t * filter_set) {
+    int i;
+    for (i = 0; i < filter_set->filters_count; i++) {
+        filter_set->filters[i].partial_matches = 0;
+    }
+    filter_set->history.next = 0;
+    filter_set->history.count = 0;
+}
+
+// -----
+
+int match_filter(const char** lines, int lines_count, compiled_filter_t * filter) {
+    int regexes_count = filter->regexes_count;
+    if (lines_count < regexes_count) {
+        log_debug("No match, not enough lines.");
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < lines_count && i < regexes_count; i++) {
+        compiled_regex_t * compiled = &filter->regexes[i];
+        regmatch_t * groups = compiled->groups;
+
+        log_debug("matching line %d : %s with %s, ngroups = %d, backend = %s",
+            i, lines[i], compiled->regex_str, (int) compiled->ngroups, compiled->program.backend->name);
+
+        if (regex_program_exec(&compiled->program, lines[i], compiled->ngroups, groups))
+        {
+            log_debug("line %d match -> %s", i, lines[i]);
+            int j;
+            for (j = 1; j < compiled->ngroups; j++)
+            {
+                if (groups[j].rm_so != -1)
+                {
+                    log_debug("subgroup %2d from %2d to %2d: \"%.*s\", var = %s", j, (int) groups[j].rm_so,
+                            (int) groups[j].rm_eo, (int) (groups[j].rm_eo - groups[j].rm_so), lines[i]
+                            + groups[j].rm_so, compiled->vars[j - 1]);
+                }
+
+            }
+        } else {
+            log_debug("No match, line %d : %s != %s", i, lines[i], compiled->regex_str);
+            return 0;
+        }
+    }
+    return 1;
+}
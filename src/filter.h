@@ -0,0 +1,110 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include "conf.h"
+#include "normalize.h"
+#include "stats.h"
+
+/*
+ * Compiled form of the filters of a channel.
+ *
+ * Regexes are compiled once when the set is built, and every regex owns a
+ * preallocated match buffer, so matching a line does not allocate. Plain
+ * strings, anchored or not, run on the literal backend instead of regexec(),
+ * see regex_backend.h.
+ * A filter set is not reentrant : it must only be used by one thread at a time.
+ *
+ * A filter with several regexes matches consecutive lines of the channel, one
+ * regex per line. The set keeps the last lines of its channel in a ring buffer
+ * and, for each filter, which prefixes of its regexes matched the latest lines,
+ * so a new line is only tested against the regexes that can extend a match.
+ *
+ * Unless configured to match the raw text case insensitively, a filter is
+ * compiled case folded and matches the normalized text of the lines, see
+ * normalize.h. Its matched lines are then the stripped texts, in their
+ * original case.
+ */
+
+// Longest line kept in the channel history, an IRC message is at most 512 bytes.
+#define FILTER_LINE_MAX 512
+
+// Most regexes a filter can have.
+#define FILTER_REGEXES_MAX 64
+
+typedef struct _compiled_regex_t compiled_regex_t;
+typedef struct _compiled_filter_t compiled_filter_t;
+typedef struct _filter_set_t filter_set_t;
+
+// ----- compiled_filter
+
+const char * compiled_filter_get_name(compiled_filter_t * filter);
+
+int compiled_filter_get_regexes_count(compiled_filter_t * filter);
+
+/*
+ * Counters of the filter since its set was built.
+ */
+const filter_stats_t * compiled_filter_get_stats(compiled_filter_t * filter);
+
+/*
+ * Called for each variable captured by a match, value is not NUL terminated.
+ */
+typedef void (*filter_capture_handler_t)(const char * var, const char * value, int value_len, void * data);
+
+/*
+ * Visit the variables captured by the last successful match_filter() of filter on lines.
+ */
+void compiled_filter_foreach_capture(compiled_filter_t * filter, const char ** lines, int lines_count,
+        filter_capture_handler_t handler, void * data);
+
+// ----- filter_set
+
+/*
+ * Called for each filter matched by filter_set_feed(), lines are the lines it
+ * matched, oldest first : raw, or stripped for a normalized filter.
+ */
+typedef void (*filter_match_handler_t)(compiled_filter_t * filter, const char ** lines, int lines_count, void * data);
+
+/*
+ * Compile all the filters of channel_conf.
+ * Return NULL if a regex is invalid or if its vars count does not match its subgroups count.
+ */
+filter_set_t * filter_set_new(const channel_conf_t * channel_conf);
+
+void filter_set_free(filter_set_t * filter_set);
+
+int filter_set_get_count(filter_set_t * filter_set);
+
+compiled_filter_t * filter_set_get_at(filter_set_t * filter_set, int index);
+
+/*
+ * Counters of the channel since the set was built.
+ */
+const channel_stats_t * filter_set_get_stats(filter_set_t * filter_set);
+
+/*
+ * Append line, normalized by the caller, to the channel history and call
+ * handler for each filter it completes.
+ * Only the filters whose bit is set in filters (filter i : bit i % 64 of word
+ * i / 64) can match the line, NULL for all of them : the line interrupts the
+ * partial matches of the others. Return the number of matched filters.
+ */
+int filter_set_feed(filter_set_t * filter_set, const normalized_line_t * line, const uint64_t * filters,
+        filter_match_handler_t handler, void * data);
+
+/*
+ * Forget the channel history and the partial matches, e.g. after a reconnection.
+ */
+void filter_set_reset(filter_set_t * filter_set);
+
+// -----
+
+/*
+ * Match lines against filter, one regex per consecutive line : raw lines, or
+ * folded lines for a normalized filter.
+ * Return 1 if every regex of the filter matched.
+ */
+int match_filter(const char** lines, int lines_count, compiled_filter_t * filter);
+
+
+#endif /* FILTER_H_ */
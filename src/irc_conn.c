@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "irc_conn.h"
+#include "irc_message.h"
+#include "event_loop.h"
+#include "log.h"
+
+// Lines are at most 512 bytes, plus 8191 bytes of IRCv3 tags.
+#define IRC_CONN_RECV_SIZE (16 * 1024)
+// Lines sent are at most 512 bytes, CR LF included.
+#define IRC_LINE_MAX 512
+// Lines sent by a single writev()
+#define IRC_CONN_IOV_MAX 64
+
+
+// ---
+
+typedef enum {
+	CONN_CLOSED = 0,
+	CONN_CONNECTING = 1,
+	CONN_CONNECTED = 2
+} irc_conn_state_t;
+
+typedef struct {
+	size_t len;
+	int urgent;
+	char data[IRC_LINE_MAX];
+} irc_line_t;
+
+struct _irc_conn_t {
+	irc_conn_callbacks_t callbacks;
+	int options;
+	void * ctx;
+
+	irc_conn_state_t state;
+	int fd;
+	char * host;
+
+	// callbacks are running, or irc_conn_hold() : sends are delayed until irc_conn_process()
+	int dispatching;
+
+	char recv_buffer[IRC_CONN_RECV_SIZE];
+	size_t recv_len;
+	// the end of a line too long for the buffer is being skipped
+	int discarding;
+
+	// lines to send, circular, queue_offset bytes of the first one are already sent
+	irc_line_t * queue;
+	size_t queue_head;
+	size_t queue_count;
+	size_t queue_capacity;
+	size_t queue_offset;
+
+	// channels joined by the next JOIN line : the keyed ones come first
+	char join_keyed[IRC_LINE_MAX];
+	size_t join_keyed_len;
+	char join_plain[IRC_LINE_MAX];
+	size_t join_plain_len;
+	char join_keys[IRC_LINE_MAX];
+	size_t join_keys_len;
+	// channels of the next JOIN line, at most join_targets_max unless 0
+	int join_count;
+	int join_targets_max;
+
+	// token bucket : one line per token, a token every flood_interval_ms
+	int flood_burst;
+	int flood_interval_ms;
+	double flood_tokens;
+	long flood_time;
+
+	// since irc_conn_new()
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+typedef struct {
+	const char * command;
+	size_t callback_offset;
+} irc_command_t;
+
+static const irc_command_t irc_commands[] = {
+	{ "NICK", offsetof(irc_conn_callbacks_t, event_nick) },
+	{ "QUIT", offsetof(irc_conn_callbacks_t, event_quit) },
+	{ "JOIN", offsetof(irc_conn_callbacks_t, event_join) },
+	{ "PART", offsetof(irc_conn_callbacks_t, event_part) },
+	{ "TOPIC", offsetof(irc_conn_callbacks_t, event_topic) },
+	{ "KICK", offsetof(irc_conn_callbacks_t, event_kick) },
+	{ "INVITE", offsetof(irc_conn_callbacks_t, event_invite) },
+	{ NULL, 0 }
+};
+
+
+// -----
+
+irc_conn_t * irc_conn_new(const irc_conn_callbacks_t * callbacks, int options) {
+	irc_conn_t * conn = calloc(1, sizeof(struct _irc_conn_t));
+	conn->callbacks = *callbacks;
+	conn->options = options;
+	conn->fd = -1;
+	irc_conn_set_flood_control(conn, 1, 0);
+	return conn;
+}
+
+void irc_conn_free(irc_conn_t * conn) {
+	if (!conn) {
+		return;
+	}
+	irc_conn_disconnect(conn);
+	free(conn->host);
+	free(conn->queue);
+	free(conn);
+}
+
+void irc_conn_set_ctx(irc_conn_t * conn, void * ctx) {
+	conn->ctx = ctx;
+}
+
+void * irc_conn_get_ctx(const irc_conn_t * conn) {
+	return conn->ctx;
+}
+
+int irc_conn_get_fd(const irc_conn_t * conn) {
+	return conn->fd;
+}
+
+// ----- sending
+
+static long irc_conn_now_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+void irc_conn_set_flood_control(irc_conn_t * conn, int burst, int interval_ms) {
+	conn->flood_burst = burst > 0 ? burst : 1;
+	conn->flood_interval_ms = interval_ms;
+	conn->flood_tokens = conn->flood_burst;
+	conn->flood_time = irc_conn_now_ms();
+}
+
+void irc_conn_set_join_targets_max(irc_conn_t * conn, int targets_max) {
+	conn->join_targets_max = targets_max > 0 ? targets_max : 0;
+}
+
+static void irc_conn_refill(irc_conn_t * conn) {
+	if (!conn->flood_interval_ms) {
+		return;
+	}
+	long now = irc_conn_now_ms();
+	conn->flood_tokens += (double) (now - conn->flood_time) / conn->flood_interval_ms;
+	if (conn->flood_tokens > conn->flood_burst) {
+		conn->flood_tokens = conn->flood_burst;
+	}
+	conn->flood_time = now;
+}
+
+static irc_line_t * irc_conn_queue_at(irc_conn_t * conn, size_t index) {
+	return &conn->queue[(conn->queue_head + index) & (conn->queue_capacity - 1)];
+}
+
+static void irc_conn_queue_grow(irc_conn_t * conn) {
+	if (conn->queue_count < conn->queue_capacity) {
+		return;
+	}
+	size_t capacity = conn->queue_capacity ? conn->queue_capacity * 2 : 16;
+	irc_line_t * queue = malloc(capacity * sizeof(irc_line_t));
+	size_t i;
+	for (i = 0; i < conn->queue_count; i++) {
+		queue[i] = *irc_conn_queue_at(conn, i);
+	}
+	free(conn->queue);
+	conn->queue = queue;
+	conn->queue_capacity = capacity;
+	conn->queue_head = 0;
+}
+
+/*
+ * Queue line, or put it first if urgent : urgent lines are not paced.
+ */
+static void irc_conn_queue_push(irc_conn_t * conn, const char * data, size_t len, int urgent) {
+	irc_conn_queue_grow(conn);
+	irc_line_t * line;
+	if (urgent) {
+		conn->queue_head = (conn->queue_head - 1) & (conn->queue_capacity - 1);
+		conn->queue_count++;
+		line = irc_conn_queue_at(conn, 0);
+		if (conn->queue_offset) {
+			// the previous head is partially sent, it must stay first
+			*line = *irc_conn_queue_at(conn, 1);
+			line = irc_conn_queue_at(conn, 1);
+		}
+	} else {
+		line = irc_conn_queue_at(conn, conn->queue_count++);
+	}
+	memcpy(line->data, data, len);
+	line->len = len;
+	line->urgent = urgent;
+}
+
+/*
+ * Queue the JOIN of the channels batched so far.
+ */
+static void irc_conn_end_join(irc_conn_t * conn) {
+	if (!conn->join_keyed_len && !conn->join_plain_len) {
+		return;
+	}
+	char line[IRC_LINE_MAX];
+	int len = snprintf(line, sizeof(line), "JOIN %.*s%s%.*s%s%.*s\r\n",
+			(int) conn->join_keyed_len, conn->join_keyed, conn->join_keyed_len && conn->join_plain_len ? "," : "",
+			(int) conn->join_plain_len, conn->join_plain,
+			conn->join_keys_len ? " " : "", (int) conn->join_keys_len, conn->join_keys);
+	irc_conn_queue_push(conn, line, len, 0);
+	conn->join_keyed_len = 0;
+	conn->join_plain_len = 0;
+	conn->join_keys_len = 0;
+	conn->join_count = 0;
+}
+
+/*
+ * Append item to a comma separated list.
+ */
+static void irc_conn_append_item(char * list, size_t * list_len, const char * item, size_t item_len) {
+	if (*list_len) {
+		list[(*list_len)++] = ',';
+	}
+	memcpy(list + *list_len, item, item_len);
+	*list_len += item_len;
+}
+
+/*
+ * Send the queued lines until the socket is full or the flood control delays
+ * them. Return 0 on error.
+ */
+static int irc_conn_flush(irc_conn_t * conn) {
+	irc_conn_end_join(conn);
+	irc_conn_refill(conn);
+
+	while (conn->queue_count) {
+		struct iovec iov[IRC_CONN_IOV_MAX];
+		int iov_count = 0;
+		double tokens = conn->flood_tokens;
+		size_t i;
+		for (i = 0; i < conn->queue_count && iov_count < IRC_CONN_IOV_MAX; i++) {
+			irc_line_t * line = irc_conn_queue_at(conn, i);
+			size_t offset = i ? 0 : conn->queue_offset;
+			if (!offset && !line->urgent && conn->flood_interval_ms) {
+				if (tokens < 1) {
+					break;
+				}
+				tokens--;
+			}
+			iov[iov_count].iov_base = line->data + offset;
+			iov[iov_count].iov_len = line->len - offset;
+			iov_count++;
+		}
+		if (!iov_count) {
+			break;
+		}
+
+		ssize_t result = writev(conn->fd, iov, iov_count);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			log_error("could not send to %s : %s.", conn->host, strerror(errno));
+			return 0;
+		}
+
+		size_t written = result;
+		conn->bytes_out += written;
+		while (written > 0) {
+			irc_line_t * line = irc_conn_queue_at(conn, 0);
+			if (!conn->queue_offset && !line->urgent && conn->flood_interval_ms) {
+				conn->flood_tokens--;
+			}
+			size_t rest = line->len - conn->queue_offset;
+			if (written < rest) {
+				conn->queue_offset += written;
+				break;
+			}
+			written -= rest;
+			conn->queue_offset = 0;
+			conn->queue_head = (conn->queue_head + 1) & (conn->queue_capacity - 1);
+			conn->queue_count--;
+		}
+	}
+	return 1;
+}
+
+long irc_conn_get_send_delay(irc_conn_t * conn) {
+	if (!conn->queue_count || conn->state != CONN_CONNECTED || !conn->flood_interval_ms
+			|| conn->flood_tokens >= 1 || conn->queue_offset) {
+		return -1;
+	}
+	irc_conn_refill(conn);
+	if (conn->flood_tokens >= 1) {
+		return 0;
+	}
+	return (long) ((1 - conn->flood_tokens) * conn->flood_interval_ms) + 1;
+}
+
+static int irc_conn_send_line(irc_conn_t * conn, const char * line, size_t len, int urgent) {
+	if (conn->state == CONN_CLOSED) {
+		return 0;
+	}
+	// keep the order of the lines
+	irc_conn_end_join(conn);
+	irc_conn_queue_push(conn, line, len, urgent);
+
+	if (!conn->dispatching && conn->state == CONN_CONNECTED) {
+		return irc_conn_flush(conn);
+	}
+	return 1;
+}
+
+static int irc_conn_vsend(irc_conn_t * conn, int urgent, const char * fmt, va_list va_alist) {
+	char line[IRC_LINE_MAX];
+	int len = vsnprintf(line, IRC_LINE_MAX - 2, fmt, va_alist);
+	if (len < 0) {
+		return 0;
+	}
+	if (len >= IRC_LINE_MAX - 2) {
+		log_warn("line to %s truncated : %s", conn->host, line);
+		len = IRC_LINE_MAX - 3;
+	}
+	line[len++] = '\r';
+	line[len++] = '\n';
+	return irc_conn_send_line(conn, line, len, urgent);
+}
+
+int irc_conn_send_raw(irc_conn_t * conn, const char * fmt, ...) {
+	va_list va_alist;
+	va_start(va_alist, fmt);
+	int result = irc_conn_vsend(conn, 0, fmt, va_alist);
+	va_end(va_alist);
+	return result;
+}
+
+/*
+ * Like irc_conn_send_raw(), but the line is sent before the queued ones and is not paced.
+ */
+static int irc_conn_send_urgent(irc_conn_t * conn, const char * fmt, ...) {
+	va_list va_alist;
+	va_start(va_alist, fmt);
+	int result = irc_conn_vsend(conn, 1, fmt, va_alist);
+	va_end(va_alist);
+	return result;
+}
+
+int irc_conn_cmd_msg(irc_conn_t * conn, const char * target, const char * text) {
+	return irc_conn_send_raw(conn, "PRIVMSG %s :%s", target, text);
+}
+
+int irc_conn_cmd_join(irc_conn_t * conn, const char * channel, const char * key) {
+	if (conn->state == CONN_CLOSED) {
+		return 0;
+	}
+	size_t channel_len = strlen(channel);
+	size_t key_len = key ? strlen(key) : 0;
+	if (channel_len + key_len + 10 > IRC_LINE_MAX || strchr(channel, ',') || (key && strchr(key, ','))) {
+		log_error("invalid channel %s.", channel);
+		return 0;
+	}
+
+	// JOIN keyed,plain keys\r\n
+	size_t len = 5 + conn->join_keyed_len + 1 + conn->join_plain_len + 1 + conn->join_keys_len + 2
+			+ channel_len + 1 + (key ? key_len + 1 : 0);
+	if (len > IRC_LINE_MAX || (conn->join_targets_max && conn->join_count >= conn->join_targets_max)) {
+		irc_conn_end_join(conn);
+	}
+	conn->join_count++;
+	if (key) {
+		irc_conn_append_item(conn->join_keyed, &conn->join_keyed_len, channel, channel_len);
+		irc_conn_append_item(conn->join_keys, &conn->join_keys_len, key, key_len);
+	} else {
+		irc_conn_append_item(conn->join_plain, &conn->join_plain_len, channel, channel_len);
+	}
+
+	if (!conn->dispatching && conn->state == CONN_CONNECTED) {
+		return irc_conn_flush(conn);
+	}
+	return 1;
+}
+
+int irc_conn_cmd_part(irc_conn_t * conn, const char * channel) {
+	return irc_conn_send_raw(conn, "PART %s", channel);
+}
+
+int irc_conn_cmd_quit(irc_conn_t * conn, const char * reason) {
+	return irc_conn_send_raw(conn, "QUIT :%s", reason ? reason : "quit");
+}
+
+// ----- connecting
+
+int irc_conn_connect(irc_conn_t * conn, const char * host, const struct sockaddr * address, socklen_t address_len,
+		const char * password, const char * nick, const char * username, const char * realname) {
+	if (conn->state != CONN_CLOSED) {
+		log_error("already connected to %s.", conn->host);
+		return 0;
+	}
+
+	free(conn->host);
+	conn->host = strdup(host);
+
+	conn->fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0) {
+		log_error("socket() : %s.", strerror(errno));
+		return 0;
+	}
+	if (connect(conn->fd, address, address_len) && errno != EINPROGRESS) {
+		log_error("could not connect to %s : %s.", host, strerror(errno));
+		close(conn->fd);
+		conn->fd = -1;
+		return 0;
+	}
+
+	conn->state = CONN_CONNECTING;
+	conn->recv_len = 0;
+	conn->discarding = 0;
+	conn->queue_count = 0;
+	conn->queue_offset = 0;
+	conn->join_keyed_len = 0;
+	conn->join_plain_len = 0;
+	conn->join_keys_len = 0;
+	conn->join_count = 0;
+
+	// sent once connected
+	if (password && password[0]) {
+		irc_conn_send_raw(conn, "PASS %s", password);
+	}
+	irc_conn_send_raw(conn, "NICK %s", nick);
+	irc_conn_send_raw(conn, "USER %s unknown unknown :%s", username ? username : nick, realname ? realname : nick);
+	return 1;
+}
+
+void irc_conn_disconnect(irc_conn_t * conn) {
+	if (conn->fd >= 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	conn->state = CONN_CLOSED;
+}
+
+int irc_conn_is_connected(const irc_conn_t * conn) {
+	return conn->state == CONN_CONNECTED;
+}
+
+static int irc_conn_finish_connect(irc_conn_t * conn) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		error = errno;
+	}
+	if (error == EINPROGRESS) {
+		return 1;
+	}
+	if (error) {
+		log_error("could not connect to %s : %s.", conn->host, strerror(error));
+		return 0;
+	}
+	conn->state = CONN_CONNECTED;
+	return 1;
+}
+
+// ----- receiving
+
+static int irc_conn_is_channel(const char * target) {
+	return target[0] == '#' || target[0] == '&' || target[0] == '+' || target[0] == '!';
+}
+
+/*
+ * Split a CTCP message \001COMMAND args\001 in place. Return 0 if text is not one.
+ */
+static int irc_conn_parse_ctcp(char * text) {
+	size_t len = strlen(text);
+	if (len < 2 || text[0] != '\001') {
+		return 0;
+	}
+	if (text[len - 1] == '\001') {
+		text[len - 1] = '\0';
+	}
+	return 1;
+}
+
+static void irc_conn_dispatch(irc_conn_t * conn, char * line) {
+	irc_message_t message;
+	if (!irc_message_parse(line, &message)) {
+		return;
+	}
+
+	const irc_conn_callbacks_t * callbacks = &conn->callbacks;
+	const char * command = message.command;
+	const char ** params = message.params;
+	unsigned int count = message.params_count;
+	char * origin = (char *) message.prefix;
+	if (origin && (conn->options & IRC_CONN_OPTION_STRIPNICKS)) {
+		char * end = strpbrk(origin, "!@");
+		if (end) {
+			*end = '\0';
+		}
+	}
+
+	unsigned int code = irc_message_get_numeric(&message);
+	if (code) {
+		if (code == 1 && callbacks->event_connect) {
+			callbacks->event_connect(conn, "CONNECT", origin, params, count);
+		}
+		if (callbacks->event_numeric) {
+			callbacks->event_numeric(conn, code, origin, params, count);
+		}
+		return;
+	}
+
+	irc_conn_event_callback_t callback = callbacks->event_unknown;
+	if (!strcmp(command, "PING")) {
+		irc_conn_send_urgent(conn, "PONG :%s", count ? params[count - 1] : "");
+		return;
+	} else if (!strcmp(command, "PRIVMSG") && count == 2) {
+		char * text = (char *) params[1];
+		if (irc_conn_parse_ctcp(text)) {
+			params[1] = text + 1;
+			if (!strncmp(params[1], "ACTION ", 7)) {
+				params[1] += 7;
+				callback = callbacks->event_ctcp_action;
+			} else {
+				callback = callbacks->event_ctcp_req;
+			}
+		} else {
+			callback = irc_conn_is_channel(params[0]) ? callbacks->event_channel : callbacks->event_privmsg;
+		}
+	} else if (!strcmp(command, "NOTICE") && count == 2) {
+		callback = irc_conn_is_channel(params[0]) ? callbacks->event_channel_notice : callbacks->event_notice;
+	} else if (!strcmp(command, "MODE") && count > 0) {
+		callback = irc_conn_is_channel(params[0]) ? callbacks->event_mode : callbacks->event_umode;
+	} else {
+		const irc_command_t * each;
+		for (each = irc_commands; each->command; each++) {
+			if (!strcmp(command, each->command)) {
+				callback = *(const irc_conn_event_callback_t *) ((const char *) callbacks + each->callback_offset);
+				break;
+			}
+		}
+	}
+
+	if (callback) {
+		callback(conn, command, origin, params, count);
+	}
+}
+
+/*
+ * Dispatch the complete lines of the receive buffer and keep the last partial one.
+ */
+static void irc_conn_dispatch_lines(irc_conn_t * conn) {
+	char * start = conn->recv_buffer;
+	char * end = conn->recv_buffer + conn->recv_len;
+	char * eol;
+
+	while ((eol = memchr(start, '\n', end - start))) {
+		char * line_end = eol;
+		if (line_end > start && line_end[-1] == '\r') {
+			line_end--;
+		}
+		*line_end = '\0';
+		if (conn->discarding) {
+			conn->discarding = 0;
+		} else {
+			irc_conn_dispatch(conn, start);
+		}
+		start = eol + 1;
+	}
+
+	size_t rest = end - start;
+	if (rest == IRC_CONN_RECV_SIZE) {
+		log_warn("line from %s too long, discarded.", conn->host);
+		conn->discarding = 1;
+		rest = 0;
+	}
+	memmove(conn->recv_buffer, start, rest);
+	conn->recv_len = rest;
+}
+
+/*
+ * Read until the socket is drained. Return 0 on error or end of stream.
+ */
+static int irc_conn_read(irc_conn_t * conn) {
+	for (;;) {
+		ssize_t result = recv(conn->fd, conn->recv_buffer + conn->recv_len, IRC_CONN_RECV_SIZE - conn->recv_len, 0);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			log_error("could not read from %s : %s.", conn->host, strerror(errno));
+			return 0;
+		}
+		if (result == 0) {
+			log_info("connection closed by %s.", conn->host);
+			return 0;
+		}
+		conn->recv_len += result;
+		conn->bytes_in += result;
+		irc_conn_dispatch_lines(conn);
+	}
+}
+
+uint64_t irc_conn_get_bytes_in(const irc_conn_t * conn) {
+	return conn->bytes_in;
+}
+
+uint64_t irc_conn_get_bytes_out(const irc_conn_t * conn) {
+	return conn->bytes_out;
+}
+
+void irc_conn_hold(irc_conn_t * conn) {
+	conn->dispatching = 1;
+}
+
+int irc_conn_process(irc_conn_t * conn, int events) {
+	// what was held is flushed below
+	conn->dispatching = 0;
+	if (conn->state == CONN_CLOSED) {
+		return 0;
+	}
+	if (conn->state == CONN_CONNECTING) {
+		if (!irc_conn_finish_connect(conn)) {
+			return 0;
+		}
+		if (conn->state == CONN_CONNECTING) {
+			return 1;
+		}
+		events |= EVENT_READ;
+	}
+
+	if (events & (EVENT_READ | EVENT_ERROR)) {
+		conn->dispatching = 1;
+		int result = irc_conn_read(conn);
+		conn->dispatching = 0;
+		if (!result) {
+			return 0;
+		}
+	}
+	return irc_conn_flush(conn);
+}
@@ -0,0 +1,151 @@
+#ifndef IRC_CONN_H_
+#define IRC_CONN_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Client connection to an IRC server.
+ *
+ * Lines are read into a per-connection receive buffer, split in place by
+ * irc_message_parse() and dispatched to callbacks having the signatures of
+ * libircclient's : the origin and params they get point into the receive
+ * buffer and are only valid during the call.
+ *
+ * The socket is non blocking and meant to be watched by an edge-triggered
+ * event loop : irc_conn_process() reads and writes until it would block.
+ * Callbacks must not free the connection.
+ *
+ * Outgoing lines are queued and sent by batches with writev(), paced by a
+ * token bucket to stay below the flood limits of the server. Consecutive
+ * joins are sent as a single JOIN #a,#b,... line.
+ */
+
+typedef struct _irc_conn_t irc_conn_t;
+
+typedef void (*irc_conn_event_callback_t)(irc_conn_t * conn, const char * event, const char * origin,
+		const char ** params, unsigned int count);
+
+typedef void (*irc_conn_eventcode_callback_t)(irc_conn_t * conn, unsigned int event, const char * origin,
+		const char ** params, unsigned int count);
+
+typedef struct {
+	// RPL_WELCOME received : the connection is registered
+	irc_conn_event_callback_t event_connect;
+	irc_conn_event_callback_t event_nick;
+	irc_conn_event_callback_t event_quit;
+	irc_conn_event_callback_t event_join;
+	irc_conn_event_callback_t event_part;
+	irc_conn_event_callback_t event_mode;
+	irc_conn_event_callback_t event_umode;
+	irc_conn_event_callback_t event_topic;
+	irc_conn_event_callback_t event_kick;
+	// PRIVMSG to a channel
+	irc_conn_event_callback_t event_channel;
+	// PRIVMSG to us
+	irc_conn_event_callback_t event_privmsg;
+	irc_conn_event_callback_t event_notice;
+	irc_conn_event_callback_t event_channel_notice;
+	irc_conn_event_callback_t event_invite;
+	// CTCP request, params[1] is the request without its \001 delimiters
+	irc_conn_event_callback_t event_ctcp_req;
+	irc_conn_event_callback_t event_ctcp_action;
+	// any other command
+	irc_conn_event_callback_t event_unknown;
+	irc_conn_eventcode_callback_t event_numeric;
+} irc_conn_callbacks_t;
+
+// Keep only the nick of the origins, drop their !user@host part
+#define IRC_CONN_OPTION_STRIPNICKS 0x1
+
+irc_conn_t * irc_conn_new(const irc_conn_callbacks_t * callbacks, int options);
+
+/*
+ * Close the connection, without sending what is still pending.
+ */
+void irc_conn_free(irc_conn_t * conn);
+
+void irc_conn_set_ctx(irc_conn_t * conn, void * ctx);
+
+void * irc_conn_get_ctx(const irc_conn_t * conn);
+
+/*
+ * Send at most burst lines at once, then one every interval_ms. An interval of
+ * 0 disables the pacing, which is the default.
+ */
+void irc_conn_set_flood_control(irc_conn_t * conn, int burst, int interval_ms);
+
+/*
+ * Join at most targets_max channels per JOIN line, e.g. the TARGMAX of the
+ * server. 0 or less only limits the length of the line, which is the default.
+ */
+void irc_conn_set_join_targets_max(irc_conn_t * conn, int targets_max);
+
+/*
+ * Start connecting to address, a resolved address of host, and queue the
+ * registration. username and realname default to nick, password may be NULL.
+ * Return 0 on error.
+ */
+int irc_conn_connect(irc_conn_t * conn, const char * host, const struct sockaddr * address, socklen_t address_len,
+		const char * password, const char * nick, const char * username, const char * realname);
+
+/*
+ * Close the socket, irc_conn_connect() can be called again.
+ */
+void irc_conn_disconnect(irc_conn_t * conn);
+
+/*
+ * Return 1 once the TCP connection is established.
+ */
+int irc_conn_is_connected(const irc_conn_t * conn);
+
+/*
+ * Socket of the connection, -1 if it is not connected.
+ */
+int irc_conn_get_fd(const irc_conn_t * conn);
+
+/*
+ * Handle events (EVENT_* of event_loop.h) on the socket : finish connecting,
+ * read and dispatch the available lines, send what is pending.
+ * Return 0 if the connection failed or was closed.
+ */
+int irc_conn_process(irc_conn_t * conn, int events);
+
+/*
+ * Delay in ms before irc_conn_process() can send more of the queued lines,
+ * -1 if nothing is waiting for the flood control.
+ */
+long irc_conn_get_send_delay(irc_conn_t * conn);
+
+/*
+ * Queue a line, the CR LF is added. It is sent right away unless called from a
+ * callback, then at the end of irc_conn_process(). Return 0 on error.
+ */
+int irc_conn_send_raw(irc_conn_t * conn, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+int irc_conn_cmd_msg(irc_conn_t * conn, const char * target, const char * text);
+
+/*
+ * Joins queued from callbacks are batched until the end of irc_conn_process().
+ */
+int irc_conn_cmd_join(irc_conn_t * conn, const char * channel, const char * key);
+
+int irc_conn_cmd_part(irc_conn_t * conn, const char * channel);
+
+int irc_conn_cmd_quit(irc_conn_t * conn, const char * reason);
+
+/*
+ * Hold the lines queued from now on until the next irc_conn_process(), as if
+ * queued from a callback : consecutive joins get batched.
+ */
+void irc_conn_hold(irc_conn_t * conn);
+
+/*
+ * Bytes received and sent since the connection was created, over all its connections.
+ */
+uint64_t irc_conn_get_bytes_in(const irc_conn_t * conn);
+
+uint64_t irc_conn_get_bytes_out(const irc_conn_t * conn);
+
+
+#endif /* IRC_CONN_H_ */
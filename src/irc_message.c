@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "irc_message.h"
+
+
+// -----
+
+/*
+ * Terminate the word starting at p, return the start of the next one.
+ */
+static char * end_word(char * p) {
+	while (*p && *p != ' ') {
+		p++;
+	}
+	while (*p == ' ') {
+		*p++ = '\0';
+	}
+	return p;
+}
+
+int irc_message_parse(char * line, irc_message_t * message) {
+	char * p = line;
+
+	message->tags = NULL;
+	message->prefix = NULL;
+	message->command = NULL;
+	message->params_count = 0;
+
+	while (*p == ' ') {
+		p++;
+	}
+	if (*p == '@') {
+		message->tags = p + 1;
+		p = end_word(p);
+	}
+	if (*p == ':') {
+		message->prefix = p + 1;
+		p = end_word(p);
+	}
+	if (!*p) {
+		return 0;
+	}
+	message->command = p;
+	p = end_word(p);
+
+	while (*p) {
+		if (*p == ':' || message->params_count == IRC_PARAMS_MAX - 1) {
+			// trailing parameter : the rest of the line
+			message->params[message->params_count++] = *p == ':' ? p + 1 : p;
+			break;
+		}
+		message->params[message->params_count++] = p;
+		p = end_word(p);
+	}
+	return 1;
+}
+
+unsigned int irc_message_get_numeric(const irc_message_t * message) {
+	const char * c = message->command;
+	if (c[0] >= '0' && c[0] <= '9' && c[1] >= '0' && c[1] <= '9' && c[2] >= '0' && c[2] <= '9' && !c[3]) {
+		return (c[0] - '0') * 100 + (c[1] - '0') * 10 + (c[2] - '0');
+	}
+	return 0;
+}
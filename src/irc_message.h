@@ -0,0 +1,37 @@
+#ifndef IRC_MESSAGE_H_
+#define IRC_MESSAGE_H_
+
+/*
+ * IRC line parser (RFC 1459, with IRCv3 message tags).
+ *
+ *   [@tags ][:prefix ]command[ param...][ :trailing]
+ *
+ * The line is split in place : every field points into the line, which gets
+ * NUL terminated at the field boundaries. Nothing is copied or allocated.
+ */
+
+// A message has at most 15 parameters, the last one may contain spaces.
+#define IRC_PARAMS_MAX 15
+
+typedef struct {
+	// NULL when absent
+	const char * tags;
+	// NULL for messages of the server we are connected to
+	const char * prefix;
+	const char * command;
+	const char * params[IRC_PARAMS_MAX];
+	unsigned int params_count;
+} irc_message_t;
+
+/*
+ * Parse line, without its CR LF. Return 0 if it has no command.
+ */
+int irc_message_parse(char * line, irc_message_t * message);
+
+/*
+ * Numeric reply code of message, 0 if its command is not a 3 digits number.
+ */
+unsigned int irc_message_get_numeric(const irc_message_t * message);
+
+
+#endif /* IRC_MESSAGE_H_ */
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isupport.h"
+
+
+// -----
+
+/*
+ * Limit at value, up to one of the end characters. Empty means no limit.
+ */
+static int parse_limit(const char * value, const char * end) {
+	if (!*value || strchr(end, *value)) {
+		return ISUPPORT_UNLIMITED;
+	}
+	char * number_end;
+	long limit = strtol(value, &number_end, 10);
+	if (number_end == value || limit < 0 || (*number_end && !strchr(end, *number_end))) {
+		return ISUPPORT_UNLIMITED;
+	}
+	return (int) limit;
+}
+
+/*
+ * CHANLIMIT=#&:50,+:10
+ */
+static void parse_chanlimit(irc_isupport_t * isupport, const char * value) {
+	isupport->chanlimits_count = 0;
+	isupport->maxchannels = 0;
+	const char * item = value;
+	while (*item && isupport->chanlimits_count < ISUPPORT_CHANLIMITS_MAX) {
+		size_t item_len = strcspn(item, ",");
+		const char * colon = memchr(item, ':', item_len);
+		size_t prefixes_len = colon ? (size_t) (colon - item) : 0;
+		if (colon && prefixes_len > 0 && prefixes_len < ISUPPORT_PREFIXES_MAX) {
+			irc_chanlimit_t * chanlimit = &isupport->chanlimits[isupport->chanlimits_count++];
+			memcpy(chanlimit->prefixes, item, prefixes_len);
+			chanlimit->prefixes[prefixes_len] = '\0';
+			chanlimit->limit = parse_limit(colon + 1, ",");
+		}
+		item += item_len;
+		if (*item == ',') {
+			item++;
+		}
+	}
+}
+
+/*
+ * MAXCHANNELS=20, ignored once CHANLIMIT was given.
+ */
+static void parse_maxchannels(irc_isupport_t * isupport, const char * value) {
+	if (isupport->chanlimits_count && !isupport->maxchannels) {
+		return;
+	}
+	isupport->chanlimits[0].prefixes[0] = '\0';
+	isupport->chanlimits[0].limit = parse_limit(value, "");
+	isupport->chanlimits_count = 1;
+	isupport->maxchannels = 1;
+}
+
+/*
+ * TARGMAX=JOIN:5,PRIVMSG:4, only JOIN is kept.
+ */
+static void parse_targmax(irc_isupport_t * isupport, const char * value) {
+	isupport->join_targets_max = ISUPPORT_UNLIMITED;
+	const char * item = value;
+	while (*item) {
+		size_t item_len = strcspn(item, ",");
+		if (item_len >= 5 && !strncmp(item, "JOIN:", 5)) {
+			isupport->join_targets_max = parse_limit(item + 5, ",");
+		}
+		item += item_len;
+		if (*item == ',') {
+			item++;
+		}
+	}
+}
+
+static void parse_casemapping(irc_isupport_t * isupport, const char * value) {
+	if (!strcmp(value, "ascii")) {
+		isupport->casemapping = CASEMAPPING_ASCII;
+	} else if (!strcmp(value, "rfc1459")) {
+		isupport->casemapping = CASEMAPPING_RFC1459;
+	} else if (!strcmp(value, "strict-rfc1459")) {
+		isupport->casemapping = CASEMAPPING_STRICT_RFC1459;
+	}
+	// others, e.g. rfc7613, keep the default
+}
+
+/*
+ * Apply one token, NAME, NAME=value or -NAME which restores the default.
+ */
+static void parse_token(irc_isupport_t * isupport, const char * token) {
+	int negated = *token == '-';
+	if (negated) {
+		token++;
+	}
+	size_t name_len = strcspn(token, "=");
+	const char * value = token[name_len] == '=' ? token + name_len + 1 : "";
+
+#define IS_TOKEN(name) (name_len == sizeof(name) - 1 && !strncmp(token, name, name_len))
+	if (IS_TOKEN("CHANLIMIT")) {
+		if (negated) {
+			isupport->chanlimits_count = 0;
+		} else {
+			parse_chanlimit(isupport, value);
+		}
+	} else if (IS_TOKEN("MAXCHANNELS")) {
+		if (negated) {
+			if (isupport->maxchannels) {
+				isupport->chanlimits_count = 0;
+			}
+		} else {
+			parse_maxchannels(isupport, value);
+		}
+	} else if (IS_TOKEN("TARGMAX")) {
+		parse_targmax(isupport, negated ? "" : value);
+	} else if (IS_TOKEN("NICKLEN") || IS_TOKEN("MAXNICKLEN")) {
+		int nicklen = negated ? ISUPPORT_UNLIMITED : parse_limit(value, "");
+		isupport->nicklen = nicklen > 0 ? nicklen : ISUPPORT_NICKLEN_DEFAULT;
+	} else if (IS_TOKEN("CASEMAPPING")) {
+		parse_casemapping(isupport, negated ? "rfc1459" : value);
+	}
+#undef IS_TOKEN
+}
+
+// -----
+
+void irc_isupport_init(irc_isupport_t * isupport) {
+	memset(isupport, 0, sizeof(irc_isupport_t));
+	isupport->join_targets_max = ISUPPORT_UNLIMITED;
+	isupport->nicklen = ISUPPORT_NICKLEN_DEFAULT;
+	isupport->casemapping = CASEMAPPING_RFC1459;
+}
+
+void irc_isupport_parse(irc_isupport_t * isupport, const char ** params, unsigned int count) {
+	unsigned int i;
+	for (i = 1; i < count; i++) {
+		// the trailing "are supported by this server"
+		if (i == count - 1 && strchr(params[i], ' ')) {
+			break;
+		}
+		parse_token(isupport, params[i]);
+	}
+}
+
+int irc_isupport_find_chanlimit(const irc_isupport_t * isupport, const char * channel) {
+	int i;
+	for (i = 0; i < isupport->chanlimits_count; i++) {
+		const irc_chanlimit_t * chanlimit = &isupport->chanlimits[i];
+		if (chanlimit->limit != ISUPPORT_UNLIMITED
+				&& (!chanlimit->prefixes[0] || (channel[0] && strchr(chanlimit->prefixes, channel[0])))) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int irc_isupport_get_chanlimit_min(const irc_isupport_t * isupport) {
+	int result = ISUPPORT_UNLIMITED;
+	int i;
+	for (i = 0; i < isupport->chanlimits_count; i++) {
+		int limit = isupport->chanlimits[i].limit;
+		if (limit != ISUPPORT_UNLIMITED && (result == ISUPPORT_UNLIMITED || limit < result)) {
+			result = limit;
+		}
+	}
+	return result;
+}
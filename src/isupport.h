@@ -0,0 +1,61 @@
+#ifndef ISUPPORT_H_
+#define ISUPPORT_H_
+
+#include "casemap.h"
+
+/*
+ * Limits advertised by a server in its RPL_ISUPPORT (005) replies, e.g.
+ *
+ *   :irc.example.org 005 nick CHANLIMIT=#&:50 TARGMAX=JOIN:10 NICKLEN=30 CASEMAPPING=ascii :are supported
+ *
+ * A token that is not advertised keeps its default : no channel limit, no
+ * limit on the channels of a JOIN, 9 characters long nicks and the RFC1459
+ * case mapping. MAXCHANNELS, its older form, applies to every channel type
+ * unless CHANLIMIT is advertised too.
+ */
+
+// Limit groups of CHANLIMIT kept, "#&:50,+:10" has two.
+#define ISUPPORT_CHANLIMITS_MAX 8
+// Channel types sharing a limit.
+#define ISUPPORT_PREFIXES_MAX 8
+
+#define ISUPPORT_UNLIMITED -1
+#define ISUPPORT_NICKLEN_DEFAULT 9
+
+typedef struct {
+	// NUL terminated, empty for every channel type
+	char prefixes[ISUPPORT_PREFIXES_MAX];
+	int limit;
+} irc_chanlimit_t;
+
+typedef struct {
+	irc_chanlimit_t chanlimits[ISUPPORT_CHANLIMITS_MAX];
+	int chanlimits_count;
+	// chanlimits come from MAXCHANNELS, replaced by a CHANLIMIT
+	int maxchannels;
+	// channels per JOIN line
+	int join_targets_max;
+	int nicklen;
+	irc_casemapping_t casemapping;
+} irc_isupport_t;
+
+void irc_isupport_init(irc_isupport_t * isupport);
+
+/*
+ * Apply the tokens of an RPL_ISUPPORT reply, params as given to event_numeric :
+ * our nick, the tokens, then the trailing text.
+ */
+void irc_isupport_parse(irc_isupport_t * isupport, const char ** params, unsigned int count);
+
+/*
+ * Index in chanlimits of the limit on channel, -1 if it is not limited.
+ */
+int irc_isupport_find_chanlimit(const irc_isupport_t * isupport, const char * channel);
+
+/*
+ * Smallest channel limit, ISUPPORT_UNLIMITED if there is none.
+ */
+int irc_isupport_get_chanlimit_min(const irc_isupport_t * isupport);
+
+
+#endif /* ISUPPORT_H_ */
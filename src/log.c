@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mpsc_wait.h"
+#include "log.h"
+
+// Must be a power of 2.
+#define LOG_RING_SLOTS 4096
+#define LOG_MESSAGE_MAX 480
+#define LOG_BATCH_SIZE (64 * 1024)
+// The writer thread wakes up at least that often, or when the ring is half full.
+#define LOG_FLUSH_INTERVAL_MS 100
+
+
+// ---
+
+typedef struct {
+	// Vyukov's bounded queue : slot is writable when seq == position,
+	// readable when seq == position + 1
+	size_t seq;
+	log_level_t level;
+	struct timespec time;
+	int len;
+	char message[LOG_MESSAGE_MAX];
+} log_slot_t;
+
+typedef struct {
+	log_slot_t * slots;
+	size_t enqueue_pos;
+	size_t dequeue_pos;
+	unsigned long dropped;
+
+	int fd;
+	mpsc_wait_t wait;
+	int running;
+	pthread_t thread;
+
+	char batch[LOG_BATCH_SIZE];
+	size_t batch_len;
+} log_ctx_t;
+
+log_level_t g_log_level = LOG_LEVEL_INFO;
+
+static log_ctx_t * g_log = NULL;
+
+static const char * level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR", "NONE " };
+
+
+// -----
+
+int log_level_parse(const char * name, log_level_t * level) {
+	if (!strcmp(name, "debug")) {
+		*level = LOG_LEVEL_DEBUG;
+	} else if (!strcmp(name, "info")) {
+		*level = LOG_LEVEL_INFO;
+	} else if (!strcmp(name, "warn")) {
+		*level = LOG_LEVEL_WARN;
+	} else if (!strcmp(name, "error")) {
+		*level = LOG_LEVEL_ERROR;
+	} else if (!strcmp(name, "none")) {
+		*level = LOG_LEVEL_NONE;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static int log_format_line(char * buf, size_t size, log_level_t level, const struct timespec * time,
+		const char * message, int len) {
+	struct tm tm;
+	localtime_r(&time->tv_sec, &tm);
+	size_t result = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+	result += snprintf(buf + result, size - result, ".%03ld %s %.*s\n", time->tv_nsec / 1000000,
+			level_names[level], len, message);
+	return result < size ? result : size - 1;
+}
+
+static void log_write_all(int fd, const char * buf, size_t len) {
+	while (len > 0) {
+		ssize_t result = write(fd, buf, len);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += result;
+		len -= result;
+	}
+}
+
+static void log_flush(log_ctx_t * log) {
+	log_write_all(log->fd, log->batch, log->batch_len);
+	log->batch_len = 0;
+}
+
+/*
+ * Format the readable slots into the batch. Return the number of messages.
+ */
+static int log_drain(log_ctx_t * log) {
+	int count = 0;
+	for (;;) {
+		log_slot_t * slot = &log->slots[log->dequeue_pos & (LOG_RING_SLOTS - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != log->dequeue_pos + 1) {
+			break;
+		}
+		if (log->batch_len + LOG_MESSAGE_MAX + 64 > LOG_BATCH_SIZE) {
+			log_flush(log);
+		}
+		log->batch_len += log_format_line(log->batch + log->batch_len, LOG_BATCH_SIZE - log->batch_len,
+				slot->level, &slot->time, slot->message, slot->len);
+		__atomic_store_n(&slot->seq, log->dequeue_pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&log->dequeue_pos, log->dequeue_pos + 1, __ATOMIC_RELAXED);
+		count++;
+	}
+
+	unsigned long dropped = __atomic_exchange_n(&log->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		struct timespec now;
+		char message[64];
+		clock_gettime(CLOCK_REALTIME, &now);
+		int len = snprintf(message, sizeof(message), "%lu log messages dropped", dropped);
+		log->batch_len += log_format_line(log->batch + log->batch_len, LOG_BATCH_SIZE - log->batch_len,
+				LOG_LEVEL_WARN, &now, message, len);
+	}
+	return count;
+}
+
+static size_t log_pending(log_ctx_t * log) {
+	return __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED) - __atomic_load_n(&log->dequeue_pos, __ATOMIC_RELAXED);
+}
+
+static void * log_run(void * arg) {
+	log_ctx_t * log = (log_ctx_t *) arg;
+	for (;;) {
+		log_drain(log);
+		log_flush(log);
+
+		if (!__atomic_load_n(&log->running, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+
+		mpsc_wait_prepare(&log->wait);
+		if (log_pending(log) > LOG_RING_SLOTS / 2) {
+			// filled up while writing, the producers may not have seen the sleep
+			mpsc_wait_cancel(&log->wait);
+			continue;
+		}
+		mpsc_wait_sleep(&log->wait, LOG_FLUSH_INTERVAL_MS);
+	}
+	return NULL;
+}
+
+void log_set_level(log_level_t min_level) {
+	__atomic_store_n(&g_log_level, min_level, __ATOMIC_RELAXED);
+}
+
+int log_start(log_level_t min_level, const char * path) {
+	log_set_level(min_level);
+	if (g_log) {
+		return 1;
+	}
+
+	log_ctx_t * log = calloc(1, sizeof(log_ctx_t));
+	log->slots = calloc(LOG_RING_SLOTS, sizeof(log_slot_t));
+	size_t i;
+	for (i = 0; i < LOG_RING_SLOTS; i++) {
+		log->slots[i].seq = i;
+	}
+
+	log->fd = STDERR_FILENO;
+	if (path) {
+		log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (log->fd < 0) {
+			fprintf(stderr, "ERROR: could not open log %s : %s.\n", path, strerror(errno));
+			free(log->slots);
+			free(log);
+			return 0;
+		}
+	}
+	log->running = 1;
+	if (!mpsc_wait_init(&log->wait) || pthread_create(&log->thread, NULL, log_run, log)) {
+		fprintf(stderr, "ERROR: could not start the log thread.\n");
+		mpsc_wait_destroy(&log->wait);
+		if (log->fd != STDERR_FILENO) {
+			close(log->fd);
+		}
+		free(log->slots);
+		free(log);
+		return 0;
+	}
+	__atomic_store_n(&g_log, log, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void log_stop() {
+	log_ctx_t * log = g_log;
+	if (!log) {
+		return;
+	}
+	__atomic_store_n(&log->running, 0, __ATOMIC_SEQ_CST);
+	mpsc_wait_signal(&log->wait);
+	pthread_join(log->thread, NULL);
+	__atomic_store_n(&g_log, NULL, __ATOMIC_RELEASE);
+
+	mpsc_wait_destroy(&log->wait);
+	if (log->fd != STDERR_FILENO) {
+		close(log->fd);
+	}
+	free(log->slots);
+	free(log);
+}
+
+void log_write(log_level_t level, const char * fmt, ...) {
+	va_list va_alist;
+	log_ctx_t * log = __atomic_load_n(&g_log, __ATOMIC_ACQUIRE);
+
+	if (!log) {
+		char message[LOG_MESSAGE_MAX];
+		char line[LOG_MESSAGE_MAX + 64];
+		struct timespec now;
+		va_start(va_alist, fmt);
+		int len = vsnprintf(message, sizeof(message), fmt, va_alist);
+		va_end(va_alist);
+		if (len >= (int) sizeof(message)) {
+			len = sizeof(message) - 1;
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		len = log_format_line(line, sizeof(line), level, &now, message, len);
+		log_write_all(STDERR_FILENO, line, len);
+		return;
+	}
+
+	// claim a slot
+	size_t pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+	log_slot_t * slot;
+	for (;;) {
+		slot = &log->slots[pos & (LOG_RING_SLOTS - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&log->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// full
+			__atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+			mpsc_wait_wake(&log->wait);
+			return;
+		} else {
+			pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->level = level;
+	clock_gettime(CLOCK_REALTIME, &slot->time);
+	va_start(va_alist, fmt);
+	slot->len = vsnprintf(slot->message, LOG_MESSAGE_MAX, fmt, va_alist);
+	va_end(va_alist);
+	if (slot->len >= LOG_MESSAGE_MAX) {
+		slot->len = LOG_MESSAGE_MAX - 1;
+	} else if (slot->len < 0) {
+		slot->len = 0;
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	// Batch : only wake the writer for errors or when the ring fills up.
+	if (level >= LOG_LEVEL_ERROR || log_pending(log) > LOG_RING_SLOTS / 2) {
+		mpsc_wait_wake(&log->wait);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+/*
+ * Asynchronous logging.
+ *
+ * The caller only formats its message into a slot of a lock-free ring buffer,
+ * a background thread timestamps and writes the messages in batches. When the
+ * ring is full, messages are dropped and counted instead of blocking the caller.
+ * Before log_start() and after log_stop(), messages are written synchronously
+ * to stderr.
+ *
+ * Messages below LOG_COMPILE_LEVEL are compiled out : build with
+ * -DLOG_COMPILE_LEVEL=LOG_LEVEL_DEBUG to get the debug traces.
+ */
+
+typedef enum {
+	LOG_LEVEL_DEBUG = 0,
+	LOG_LEVEL_INFO = 1,
+	LOG_LEVEL_WARN = 2,
+	LOG_LEVEL_ERROR = 3,
+	LOG_LEVEL_NONE = 4
+} log_level_t;
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+extern log_level_t g_log_level;
+
+/*
+ * Start the writer thread, logging messages of min_level and above to path,
+ * or to stderr if path is NULL. Return 0 on error.
+ */
+int log_start(log_level_t min_level, const char * path);
+
+/*
+ * Write the pending messages and stop the writer thread.
+ */
+void log_stop();
+
+/*
+ * Change the minimum level of the logged messages, from any thread.
+ */
+void log_set_level(log_level_t min_level);
+
+void log_write(log_level_t level, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Parse a level name : debug, info, warn, error or none. Return 0 if it is unknown.
+ */
+int log_level_parse(const char * name, log_level_t * level);
+
+#define log_enabled(level) ((level) >= LOG_COMPILE_LEVEL && (level) >= __atomic_load_n(&g_log_level, __ATOMIC_RELAXED))
+
+#define log_at(level, ...) do { \
+		if (log_enabled(level)) { \
+			log_write(level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+
+#endif /* LOG_H_ */
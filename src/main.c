@@ -1,247 +1,380 @@
 #include <stdio.h>
-#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <signal.h>
-
-#include <regex.h>
-
-#include <libircclient/libircclient.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
 
 #include <jansson.h>
 
+#include "archive.h"
 #include "conf.h"
+#include "filter.h"
+#include "channel_index.h"
+#include "event_loop.h"
+#include "match_output.h"
+#include "irc_conn.h"
+#include "isupport.h"
+#include "replay.h"
+#include "resolver.h"
+#include "stats.h"
+#include "log.h"
 
 
 // -----------------------------------------------------------------------------------------------
 // global
 sig_atomic_t g_askedToStop = 0;
+sig_atomic_t g_askedToReload = 0;
 
 // -----------------------------------------------------------------------------------------------
 
+// Reconnection delays double after each failure, from min to max
+#define RECONNECT_DELAY_MIN_MS 2000
+#define RECONNECT_DELAY_MAX_MS (5 * 60 * 1000)
+// From the name resolution to the welcome of the server
+#define CONNECT_TIMEOUT_MS 30000
+// From the welcome to the end of the MOTD, channels are joined anyway after that
+#define READY_TIMEOUT_MS 10000
+#define NICK_MAX 64
+// Name resolutions in parallel
+#define RESOLVER_THREADS_MAX 32
+
+#define CONF_FILENAME "testIrc.conf"
+// written by --compile-config, loaded instead of CONF_FILENAME while up to date
+#define CONF_IMAGE_FILENAME CONF_FILENAME ".bin"
+
+// numeric replies
+#define RPL_ISUPPORT 5
+#define RPL_ENDOFMOTD 376
+#define ERR_TOOMANYCHANNELS 405
+#define ERR_NOMOTD 422
+#define ERR_NICKNAMEINUSE 433
+
 typedef enum {
 	STATE_UNCREATED = 1,
 	STATE_CREATED = 2,
 	STATE_CONNECTED = 3,
-	STATE_DESCRIPTOR_ADDED = 4,
-	STATE_CONNECTION_ERROR = 5,
-	STATE_WAIT_TO_RECONNECT = 6,
-	STATE_STOPPING = 7
+	STATE_CONNECTION_ERROR = 4,
+	STATE_WAIT_TO_RECONNECT = 5,
+	STATE_STOPPING = 6,
+	STATE_RESOLVING = 7
 } irc_session_state_t;
 
-typedef struct {
-	irc_session_state_t state;
-	irc_session_t * s;
-
-	server_conf_t * server_conf;
-
-	struct timeval wait_date;
-
-} irc_ctx_t;
+typedef struct _irc_common_ctx_t irc_common_ctx_t;
+typedef struct _irc_ctx_t irc_ctx_t;
 
+/*
+ * A worker thread drives its own event loop and the sessions assigned to it.
+ * A session is only ever touched by its worker, other threads post it tasks.
+ */
+typedef struct {
+	irc_common_ctx_t * common_ctx;
+	int index;
+	event_loop_t * loop;
+	// reused for every match of the worker's sessions
+	match_event_t * event;
+	// sessions of the worker, only touched by its thread once started
+	irc_ctx_t ** sessions;
+	int sessions_count;
+	int sessions_capacity;
+	pthread_t thread;
+	int started;
+} irc_worker_t;
+
+/*
+ * A connection of a session. The channels of a server are spread over the
+ * shards of its session, each one joining as many as the server lets one
+ * client join, under its own nick.
+ */
 typedef struct {
+	irc_ctx_t * ctx;
+	// in ctx->shards, appended to the nick of all but the first
+	int index;
+	irc_session_state_t state;
+	irc_conn_t * conn;
+	// registration of the shard socket in the event loop
+	event_watch_t * watch;
+	resolver_request_t * resolve_request;
+	// addresses of the server, next_address is the one to try if the current one fails
+	struct addrinfo * addresses;
+	struct addrinfo * next_address;
+	// until the welcome of the server, then until the shard is ready
+	event_timer_t * connect_timer;
+	event_timer_t * reconnect_timer;
+	// failures since the last successful registration
+	int reconnect_attempts;
+	// pending send, delayed by the flood control
+	event_timer_t * send_timer;
+
+	char nick[NICK_MAX];
+	// nicks refused since the connection, the next one gets one more '_'
+	int nick_attempts;
+	// welcome received
+	int registered;
+	// limits of the server, complete once ready
+	irc_isupport_t isupport;
+	// end of the MOTD received : channels can be joined
+	int ready;
+	// channels joined, in total and per chanlimit of isupport
+	int channels_count;
+	int chanlimit_counts[ISUPPORT_CHANLIMITS_MAX];
+	// lowered when the server refuses a join with ERR_TOOMANYCHANNELS, -1 until then
+	int channels_max;
+
+	// counters, only touched by the worker
+	int reconnects;
+	// bytes of the previous connections
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} irc_shard_t;
+
+struct _irc_ctx_t {
+	irc_common_ctx_t * common_ctx;
+	// set before the session is handed to its worker, never changes
+	irc_worker_t * worker;
+	// connections to the server, the first one is created with the session
+	irc_shard_t ** shards;
+	int shards_count;
+	unsigned int seed;
+
+	// reference on the configuration snapshot server_conf belongs to
+	irc_conf_t * irc_conf;
+	const server_conf_t * server_conf;
+	// compiled filters, one set per channel of server_conf
+	filter_set_t ** channel_filters;
+	int channels_count;
+	// index of the shard joined to each channel of server_conf, -1 while none is
+	int * channel_shards;
+	// the channels left for lack of connections were reported
+	int unjoined_reported;
+	// limits of the server, from the last shard that got ready
+	irc_isupport_t isupport;
+	// channel dispatch index, built when the first shard gets ready
+	channel_index_t * channel_index;
+	// text of the current channel line, normalized for the filters
+	normalized_line_t line;
+
+	// counters, only touched by the worker
+	uint64_t messages;
+};
+
+struct _irc_common_ctx_t {
 	irc_conf_t * irc_conf;
-	irc_callbacks_t	callbacks;
-	irc_ctx_t * servers_ctx;
+	irc_conn_callbacks_t callbacks;
+	// session of each server of irc_conf, only touched by the thread of worker 0 once started
+	irc_ctx_t ** servers_ctx;
 	int servers_count;
-	struct timeval tv;
-	fd_set in_set, out_set;
-	int maxfd;
-} irc_common_ctx_t;
-
-void addlog(const char * fmt, ...) {
-	char buf[1024];
-	va_list va_alist;
-
-	va_start(va_alist, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, va_alist);
-	va_end(va_alist);
-
-	printf("%s\n", buf);
-}
-
-int regex_conf_compile(regex_conf_t* regex_conf, regex_t * regex) {
-    const char * regex_str = regex_conf_get_regex(regex_conf);
-    int result = regcomp(regex, regex_str, REG_EXTENDED | REG_ICASE);
-    if (result)
-    {
-        char buf[512];
-        regerror(result, regex, buf, sizeof(buf));
-        fprintf(stderr, "Invalid regular expression: %s", buf);
-        regfree(regex);
-        return 0;
-    } else {
-        printf("Compilation ok : %s => %p\n", regex_str, regex);
-    }
-    return 1;
-}
-
-int match_filter(const char** lines, int lines_count, filter_conf_t * filter_conf) {
-    int regexes_count = filter_conf_get_regexes_count(filter_conf);
-    if (lines_count < regexes_count) {
-        printf("No match, not enough lines.\n");
-        return 0;
-    }
-
-    int i;
-    for (i = 0; i < lines_count && i < regexes_count; i++) {
-        regex_conf_t * regex_conf = filter_conf_get_regex_at(filter_conf, i);
-        regex_t regex;
-        if (!regex_conf_compile(regex_conf, &regex)) {
-            return 0;
-        }
-
-        if (regex_conf_get_vars_count(regex_conf) != regex.re_nsub) {
-            printf("Wrong number of variable, re: %d, vars: %d\n", regex.re_nsub,
-                regex_conf_get_vars_count(regex_conf));
-            regfree(&regex);
-            return 0;
-        }
-
-
-        size_t ngroups = regex.re_nsub + 1;
-        regmatch_t *groups = malloc(ngroups * sizeof(regmatch_t));
-
-        printf("matching line %d : %s with %s, ngroups = %d, regex = %p\n",
-            i, lines[i], regex_conf_get_regex(regex_conf), ngroups, &regex);
-
-        int result = regexec(&regex, lines[i], ngroups, groups, 0);
-        if (!result)
-        {
-            printf("line %d match -> %s\n", i, lines[i]);
-            int j;
-            for (j = 1; j <= regex.re_nsub; j++)
-            {
-                if (groups[j].rm_so != -1)
-                {
-                    printf("subgroup %2d from %2d to %2d: \"%.*s\", var = %s\n", j, groups[j].rm_so,
-                            groups[j].rm_eo, groups[j].rm_eo - groups[j].rm_so, lines[i]
-                            + groups[j].rm_so, regex_conf_get_var_at(regex_conf, j - 1));
-                }
-
-            }
-        } else {
-            printf("No match, line %d : %s != %s\n", i, lines[i], regex_conf_get_regex(regex_conf));
-            free(groups);
-            regfree(&regex);
-            return 0;
-        }
-        free(groups);
-        regfree(&regex);
-    }
-    return 1;
-}
-
-void dump_event (irc_session_t * session, const char * event, const char * origin, const char ** params, unsigned int count)
+	irc_worker_t * workers;
+	int workers_count;
+	// worker of the next session added by a reload
+	int next_worker;
+	match_output_t * output;
+	// NULL if the channel traffic is not archived
+	archive_t * archive;
+	resolver_t * resolver;
+	// a reload thread is running, reload_pending if asked again meanwhile
+	pthread_t reload_thread;
+	int reloading;
+	int reload_pending;
+	// served and dumped from worker 0
+	stats_server_t * stats_server;
+	event_timer_t * stats_timer;
+};
+
+void dump_event (irc_conn_t * conn, const char * event, const char * origin, const char ** params, unsigned int count)
 {
+	if (!log_enabled(LOG_LEVEL_INFO)) {
+		return;
+	}
+
 	char buf[512];
-	int cnt;
+	size_t len = 0;
+	unsigned int cnt;
 
 	buf[0] = '\0';
 
-	for ( cnt = 0; cnt < count; cnt++ ) {
-		if ( cnt ) {
-			strcat (buf, "|");
-		}
-		strcat (buf, params[cnt]);
+	for ( cnt = 0; cnt < count && len < sizeof(buf); cnt++ ) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%s", cnt ? "|" : "", params[cnt]);
+	}
+
+	log_info("Event \"%s\", origin: \"%s\", params: %d [%s]", event, origin ? origin : "NULL", count, buf);
+}
+
+void initChannelIndex(irc_ctx_t* ctx) {
+	channel_index_free(ctx->channel_index);
+	ctx->channel_index = channel_index_new(ctx->channels_count, ctx->isupport.casemapping);
+
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < ctx->channels_count; chan_idx++) {
+		const channel_conf_t * channel_conf = server_conf_get_channel_at(ctx->server_conf, chan_idx);
+		channel_index_add(ctx->channel_index, channel_conf, ctx->channel_filters[chan_idx]);
 	}
+}
+
+void balanceChannels(irc_ctx_t* ctx);
+void refuseChannel(irc_shard_t* shard, const char * name);
+void setShardNick(irc_shard_t* shard);
+
+/*
+ * The server sent its limits, or is not going to : join channels on the shard.
+ */
+void readyShard(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	if (shard->ready) {
+		return;
+	}
+	event_loop_cancel_timer(ctx->worker->loop, shard->connect_timer);
+	shard->connect_timer = NULL;
+	shard->ready = 1;
+	irc_conn_set_join_targets_max(shard->conn, shard->isupport.join_targets_max);
+	log_info("Connected to %s as %s, channel limit %d.", server_conf_get_name(ctx->server_conf), shard->nick,
+			irc_isupport_get_chanlimit_min(&shard->isupport));
+
+	int casemapping_changed = !ctx->channel_index || ctx->isupport.casemapping != shard->isupport.casemapping;
+	ctx->isupport = shard->isupport;
+	if (casemapping_changed) {
+		initChannelIndex(ctx);
+	}
+	balanceChannels(ctx);
+}
 
-	addlog ("Event \"%s\", origin: \"%s\", params: %d [%s]", event, origin ? origin : "NULL", cnt, buf);
+void onReadyTimeout(event_loop_t * loop, void * data) {
+	irc_shard_t * shard = (irc_shard_t *) data;
+	shard->connect_timer = NULL;
+	log_warn("no end of MOTD from %s, joining channels anyway.", server_conf_get_name(shard->ctx->server_conf));
+	readyShard(shard);
 }
 
-void event_connect (irc_session_t * session, const char * event, const char * origin, const char ** params, unsigned int count)
+void event_connect (irc_conn_t * conn, const char * event, const char * origin, const char ** params, unsigned int count)
 {
-	dump_event(session, event, origin, params, count);
+	dump_event(conn, event, origin, params, count);
 
-	irc_ctx_t * ctx = (irc_ctx_t *) irc_get_ctx (session);
+	irc_shard_t * shard = (irc_shard_t *) irc_conn_get_ctx(conn);
+	irc_ctx_t * ctx = shard->ctx;
+
+	shard->reconnect_attempts = 0;
+	shard->registered = 1;
+	event_loop_cancel_timer(ctx->worker->loop, shard->connect_timer);
+	// channels are joined once the limits of the server are known, see event_numeric
+	shard->connect_timer = event_loop_add_timer(ctx->worker->loop, READY_TIMEOUT_MS, onReadyTimeout, shard);
 
 	// Send commands
 	int cmd_idx;
 	for (cmd_idx = 0; cmd_idx < server_conf_get_cmds_count(ctx->server_conf); cmd_idx++) {
-		cmd_conf_t * cmd_conf = server_conf_get_cmd_at(ctx->server_conf, cmd_idx);
+		const cmd_conf_t * cmd_conf = server_conf_get_cmd_at(ctx->server_conf, cmd_idx);
 		const char* cmd_name = cmd_conf_get_name(cmd_conf);
 		const char* cmd_arg1 = cmd_conf_get_arg1(cmd_conf);
 		const char* cmd_arg2 = cmd_conf_get_arg2(cmd_conf);
 
 		if (!strcmp(cmd_name, "msg")) {
-			printf("Sending msg to %s\n", cmd_arg1);
-			irc_cmd_msg(session, cmd_arg1, cmd_arg2);
+			log_info("Sending msg to %s", cmd_arg1);
+			irc_conn_cmd_msg(conn, cmd_arg1, cmd_arg2);
 		} else {
-			fprintf(stderr, "WARN: unsupported command %s\n", cmd_name);
+			log_warn("unsupported command %s", cmd_name);
 		}
 	}
+}
 
-	// Join channels
-	int chan_idx;
-	for (chan_idx = 0; chan_idx < server_conf_get_channels_count(ctx->server_conf); chan_idx++) {
-		channel_conf_t * channel_conf = server_conf_get_channel_at(ctx->server_conf, chan_idx);
-
-		const char* chan_name = channel_conf_get_name(channel_conf);
-		const char* chan_pass = channel_conf_get_passwd(channel_conf);
-		printf("Joining %s\n", chan_name);
 
-		irc_cmd_join (session, chan_name, chan_pass);
-	}
+typedef struct {
+	irc_ctx_t * ctx;
+	const char * channel;
+	// nick!user@host, only the nick is published
+	const char * origin;
+	int nick_len;
+} channel_match_t;
+
+void onFilterCapture(const char * var, const char * value, int value_len, void * data) {
+	match_event_add_var((match_event_t *) data, var, value, value_len);
 }
 
+void onFilterMatch(compiled_filter_t * filter, const char ** lines, int lines_count, void * data) {
+	channel_match_t * match = (channel_match_t *) data;
+	match_event_t * event = match->ctx->worker->event;
+	char nick[FILTER_LINE_MAX];
+	snprintf(nick, sizeof(nick), "%.*s", match->nick_len, match->origin);
+
+	match_event_begin(event, server_conf_get_name(match->ctx->server_conf), match->channel, nick,
+			compiled_filter_get_name(filter));
+	compiled_filter_foreach_capture(filter, lines, lines_count, onFilterCapture, event);
+	match_output_publish(match->ctx->common_ctx->output, event);
+}
 
-void event_channel (irc_session_t * session, const char * event, const char * origin, const char ** params, unsigned int count)
+void event_channel (irc_conn_t * conn, const char * event, const char * origin, const char ** params, unsigned int count)
 {
 	if (count != 2) {
 		return;
 	}
 
 	if (!origin) {
-		fprintf(stderr, "WARN: No origin for following event:");
-		dump_event(session, event, origin, params, count);
+		log_warn("No origin for following event:");
+		dump_event(conn, event, origin, params, count);
 		return;
 	}
 
-	irc_ctx_t * ctx = (irc_ctx_t *) irc_get_ctx (session);
+	irc_ctx_t * ctx = ((irc_shard_t *) irc_conn_get_ctx(conn))->ctx;
+	ctx->messages++;
+	if (ctx->common_ctx->archive) {
+		archive_append(ctx->common_ctx->archive, server_conf_get_name(ctx->server_conf), params[0], origin,
+				params[1]);
+	}
 
-	int chan_idx;
-	for (chan_idx = 0; chan_idx < server_conf_get_channels_count(ctx->server_conf); chan_idx++) {
-		channel_conf_t * channel_conf = server_conf_get_channel_at(ctx->server_conf, chan_idx);
-
-		const char* chan_name = channel_conf_get_name(channel_conf);
-		if (!strcmp(chan_name, params[0])) {
-			const char* nickfilter = channel_conf_get_nickfilter(channel_conf);
-			if (nickfilter) {
-				if(!strcmp(nickfilter, origin)) {
-					// match filters on channel history
-
-					int filters_count = channel_conf_get_filters_count(channel_conf);
-					int filter_idx;
-					printf("filters_count = %d\n", filters_count);
-				    for (filter_idx = 0; filter_idx < filters_count; filter_idx++) {
-				        filter_conf_t * filter_conf = channel_conf_get_filter_at(channel_conf, filter_idx);
-				        match_filter(&params[1], 1, filter_conf);
-				    }
-				}
-			} else {
-				// match filters on channel history
-			}
-		}
+	channel_entry_t * entry = ctx->channel_index ? channel_index_find(ctx->channel_index, params[0]) : NULL;
+	// Without nickfilter, every line of the channel is part of its history.
+	const uint64_t * filters;
+	if (entry && channel_entry_accept(entry, origin, &filters)) {
+		// match filters on channel history
+		channel_match_t match;
+		match.ctx = ctx;
+		match.channel = params[0];
+		match.origin = origin;
+		match.nick_len = strcspn(origin, "!@");
+		normalize_line(&ctx->line, params[1]);
+		filter_set_feed(channel_entry_get_filter_set(entry), &ctx->line, filters, onFilterMatch, &match);
 	}
 
-	printf ("%s:%s: %s\n", origin ? origin : "someone", params[0], params[1] );
+	log_debug("%s:%s: %s", origin, params[0], params[1]);
 }
 
-void event_kick (irc_session_t * session, const char * event, const char * origin, const char ** params, unsigned int count)
+void event_kick (irc_conn_t * conn, const char * event, const char * origin, const char ** params, unsigned int count)
 {
-	dump_event(session, event, origin, params, count);
-//	irc_ctx_t * ctx = (irc_ctx_t *) irc_get_ctx (session);
-//	irc_cmd_join (session, ctx->channel, 0);
+	dump_event(conn, event, origin, params, count);
+//	irc_ctx_t * ctx = (irc_ctx_t *) irc_conn_get_ctx(conn);
+//	irc_conn_cmd_join(conn, ctx->channel, 0);
 }
 
-void event_numeric (irc_session_t * session, unsigned int event, const char * origin, const char ** params, unsigned int count)
+void event_numeric (irc_conn_t * conn, unsigned int event, const char * origin, const char ** params, unsigned int count)
 {
+	irc_shard_t * shard = (irc_shard_t *) irc_conn_get_ctx(conn);
+
+	switch (event) {
+	case RPL_ISUPPORT:
+		irc_isupport_parse(&shard->isupport, params, count);
+		break;
+	case RPL_ENDOFMOTD:
+	case ERR_NOMOTD:
+		readyShard(shard);
+		break;
+	case ERR_TOOMANYCHANNELS:
+		if (count > 1) {
+			refuseChannel(shard, params[1]);
+		}
+		break;
+	case ERR_NICKNAMEINUSE:
+		if (!shard->registered) {
+			shard->nick_attempts++;
+			setShardNick(shard);
+			irc_conn_send_raw(conn, "NICK %s", shard->nick);
+		}
+		break;
+	}
+
 	if ( event > 400 )
 	{
-		printf ("ERROR %d: %s: %s %s %s %s\n",
+		log_warn("%d: %s: %s %s %s %s",
 				event,
 				origin ? origin : "unknown",
 				params[0],
@@ -251,8 +384,8 @@ void event_numeric (irc_session_t * session, unsigned int event, const char * or
 	}
 }
 
-void initCallbacks(irc_callbacks_t* callbacks) {
-	memset (callbacks, 0, sizeof(irc_callbacks_t));
+void initCallbacks(irc_conn_callbacks_t* callbacks) {
+	memset (callbacks, 0, sizeof(irc_conn_callbacks_t));
 
 	callbacks->event_connect = event_connect;
 	callbacks->event_channel = event_channel;
@@ -270,7 +403,6 @@ void initCallbacks(irc_callbacks_t* callbacks) {
 	callbacks->event_invite = dump_event;
 	//callbacks->event_umode = dump_event;
 	//callbacks->event_ctcp_req = dump_event;
-	//callbacks->event_ctcp_rep = dump_event;
 	//callbacks->event_ctcp_action = dump_event;
 	callbacks->event_unknown = dump_event;
 	callbacks->event_numeric = event_numeric;
@@ -278,207 +410,1519 @@ void initCallbacks(irc_callbacks_t* callbacks) {
 
 typedef int (*sessionActionFunc_t)(irc_common_ctx_t* , irc_ctx_t* );
 
-int doAction(irc_common_ctx_t* common_ctx, sessionActionFunc_t sessionActionFunc) {
+int doWorkerAction(irc_worker_t* worker, sessionActionFunc_t sessionActionFunc) {
+	irc_common_ctx_t* common_ctx = worker->common_ctx;
 	int result = 0;
 	int i;
-	for (i = 0; i < common_ctx->servers_count; i++) {
-		int actionResult = sessionActionFunc(common_ctx, &common_ctx->servers_ctx[i]);
-		// We want to process all ctxs even if there is an error.
-		result &= actionResult;
+	for (i = 0; i < worker->sessions_count; i++) {
+		result &= sessionActionFunc(common_ctx, worker->sessions[i]);
 	}
 	return result;
 }
 
-int doCreation(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
-	if (ctx->state == STATE_UNCREATED) {
-		printf("Creating session for %s\n", server_conf_get_name(ctx->server_conf));
-		ctx->s = irc_create_session (&common_ctx->callbacks);
-		if (!ctx->s) {
-			printf("FATAL: Could not create IRC session.\n");
-			return 0;
-		}
-		irc_set_ctx (ctx->s, ctx);
-		irc_option_set(ctx->s, LIBIRC_OPTION_STRIPNICKS);
-		ctx->state = STATE_CREATED;
+int doShardCreation(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	if (shard->state == STATE_UNCREATED) {
+		log_info("Creating connection %d for %s", shard->index, server_conf_get_name(ctx->server_conf));
+		// nick masks need the whole prefix of the senders
+		shard->conn = irc_conn_new(&ctx->common_ctx->callbacks, 0);
+		irc_conn_set_ctx(shard->conn, shard);
+		irc_conn_set_flood_control(shard->conn, server_conf_get_flood_burst(ctx->server_conf),
+				server_conf_get_flood_interval_ms(ctx->server_conf));
+		shard->state = STATE_CREATED;
 	}
 	return 1;
 }
 
-int doConnection(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
-	if (ctx->state == STATE_CREATED) {
+void doShardConnectionError(irc_shard_t* shard);
+void onShardEvent(event_loop_t * loop, int fd, int events, void * data);
+
+/*
+ * Connect to the next address of the server. Return 0 if none is left.
+ */
+int connectNextAddress(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	const char* server_ip = server_conf_get_ip(ctx->server_conf);
+	const char* server_pass = server_conf_get_passwd(ctx->server_conf);
+
+	while (shard->next_address) {
+		struct addrinfo * address = shard->next_address;
+		shard->next_address = address->ai_next;
+		if (!irc_conn_connect(shard->conn, server_ip, address->ai_addr, address->ai_addrlen,
+				server_pass, shard->nick, NULL, NULL)) {
+			continue;
+		}
+
+		// The socket stays the same for the whole connection : register it once.
+		shard->watch = event_loop_watch(ctx->worker->loop, irc_conn_get_fd(shard->conn), onShardEvent, shard);
+		if (!shard->watch) {
+			log_error("could not watch connection to %s", server_conf_get_name(ctx->server_conf));
+			irc_conn_disconnect(shard->conn);
+			continue;
+		}
+		shard->state = STATE_CONNECTED;
+		return 1;
+	}
+	return 0;
+}
+
+void onResolved(struct addrinfo * addresses, void * data) {
+	irc_shard_t * shard = (irc_shard_t *) data;
+	shard->resolve_request = NULL;
+	shard->addresses = addresses;
+	shard->next_address = addresses;
+	if (!connectNextAddress(shard)) {
+		doShardConnectionError(shard);
+	}
+}
+
+void onConnectTimeout(event_loop_t * loop, void * data) {
+	irc_shard_t * shard = (irc_shard_t *) data;
+	shard->connect_timer = NULL;
+	log_error("timeout connecting to %s.", server_conf_get_name(shard->ctx->server_conf));
+	doShardConnectionError(shard);
+}
+
+int doShardConnection(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	if (shard->state == STATE_CREATED) {
 		const char* server_ip = server_conf_get_ip(ctx->server_conf);
 		const int server_port = server_conf_get_port(ctx->server_conf);
-		const char* server_pass = server_conf_get_passwd(ctx->server_conf);
-		const char* server_nick = server_conf_get_nick(ctx->server_conf);
 
-		printf("Connecting to %s:%d\n", server_ip, server_port);
-		if (irc_connect(ctx->s, server_ip, server_port, server_pass, server_nick, 0, 0)) {
-			printf("FATAL: Could not connect: %s\n", irc_strerror(irc_errno(ctx->s)));
-			return 0;
-		}
-		ctx->state = STATE_CONNECTED;
+		log_info("Connecting to %s:%d as %s", server_ip, server_port, shard->nick);
+		shard->state = STATE_RESOLVING;
+		shard->connect_timer = event_loop_add_timer(ctx->worker->loop, CONNECT_TIMEOUT_MS, onConnectTimeout, shard);
+		shard->resolve_request = resolver_resolve(ctx->common_ctx->resolver, ctx->worker->loop, server_ip, server_port,
+				onResolved, shard);
 	}
 	return 1;
 }
 
-int doAddDescriptors(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
-	if (ctx->state == STATE_CONNECTED) {
-		if (irc_add_select_descriptors (ctx->s, &common_ctx->in_set, &common_ctx->out_set, &common_ctx->maxfd)) {
-			printf("ERROR: irc_add_select_descriptors() : %s (%d)\n",
-					irc_strerror(irc_errno(ctx->s)), irc_errno(ctx->s));
-			return 0;
+/*
+ * Forget the channels of the shard and what the server told it : they belong
+ * to its connection.
+ */
+void releaseShard(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < ctx->channels_count; chan_idx++) {
+		if (ctx->channel_shards[chan_idx] == shard->index) {
+			ctx->channel_shards[chan_idx] = -1;
+		}
+	}
+	shard->channels_count = 0;
+	memset(shard->chanlimit_counts, 0, sizeof(shard->chanlimit_counts));
+	shard->ready = 0;
+	shard->registered = 0;
+	irc_isupport_init(&shard->isupport);
+	if (shard->nick_attempts) {
+		shard->nick_attempts = 0;
+		setShardNick(shard);
+	}
+}
+
+int doShardDestroy(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	if ((shard->state != STATE_UNCREATED)
+			&& (shard->state != STATE_WAIT_TO_RECONNECT)) {
+		log_info("Destroy connection to %s as %s", server_conf_get_name(ctx->server_conf), shard->nick);
+		event_loop_cancel_timer(ctx->worker->loop, shard->send_timer);
+		shard->send_timer = NULL;
+		event_loop_cancel_timer(ctx->worker->loop, shard->connect_timer);
+		shard->connect_timer = NULL;
+		resolver_cancel(shard->resolve_request);
+		shard->resolve_request = NULL;
+		if (shard->addresses) {
+			freeaddrinfo(shard->addresses);
 		}
-		ctx->state = STATE_DESCRIPTOR_ADDED;
+		shard->addresses = NULL;
+		shard->next_address = NULL;
+		event_loop_unwatch(ctx->worker->loop, shard->watch);
+		shard->watch = NULL;
+		shard->bytes_in += irc_conn_get_bytes_in(shard->conn);
+		shard->bytes_out += irc_conn_get_bytes_out(shard->conn);
+		irc_conn_free(shard->conn);
+		shard->conn = NULL;
+		releaseShard(shard);
+		shard->state = STATE_WAIT_TO_RECONNECT;
 	}
 	return 1;
 }
 
-int doSelect(irc_common_ctx_t* common_ctx) {
-	do {
-		int retval = select (common_ctx->maxfd + 1, &common_ctx->in_set, &common_ctx->out_set, 0, &common_ctx->tv);
-		if ( retval < 0 ) {
-			// Does something really bad happened?
-			if ( errno == EINTR ) {
-				// No, select was just interrupted by a signal.
-				fprintf(stderr, "I");
-				if (g_askedToStop) {
-					int i;
-					for (i = 0; i < common_ctx->servers_count; i++) {
-						common_ctx->servers_ctx[i].state = STATE_STOPPING;
-					}
-					return 0;
-				}
-				continue;
+void onReconnectTimer(event_loop_t * loop, void * data) {
+	irc_shard_t * shard = (irc_shard_t *) data;
+	shard->reconnect_timer = NULL;
+	if (shard->state == STATE_WAIT_TO_RECONNECT) {
+		shard->state = STATE_UNCREATED;
+		doShardCreation(shard);
+		doShardConnection(shard);
+	}
+}
+
+/*
+ * Exponential backoff, with jitter so that shards failing together do not retry together.
+ */
+long reconnectDelay(irc_shard_t* shard) {
+	long delay = RECONNECT_DELAY_MIN_MS;
+	int i;
+	for (i = 0; i < shard->reconnect_attempts && delay < RECONNECT_DELAY_MAX_MS; i++) {
+		delay *= 2;
+	}
+	if (delay > RECONNECT_DELAY_MAX_MS) {
+		delay = RECONNECT_DELAY_MAX_MS;
+	}
+	shard->reconnect_attempts++;
+	return delay / 2 + rand_r(&shard->ctx->seed) % (delay / 2 + 1);
+}
+
+/*
+ * Tear the shard down and try again later, its channels move to the other shards meanwhile.
+ */
+void doShardConnectionError(irc_shard_t* shard) {
+	irc_ctx_t * ctx = shard->ctx;
+	shard->state = STATE_CONNECTION_ERROR;
+	shard->reconnects++;
+	doShardDestroy(shard);
+
+	long delay = reconnectDelay(shard);
+	log_info("Reconnecting to %s as %s in %ld ms", server_conf_get_name(ctx->server_conf), shard->nick, delay);
+	shard->reconnect_timer = event_loop_add_timer(ctx->worker->loop, delay, onReconnectTimer, shard);
+	if (!shard->reconnect_timer) {
+		log_error("could not schedule reconnection to %s.", server_conf_get_name(ctx->server_conf));
+	}
+	balanceChannels(ctx);
+}
+
+void onSendTimer(event_loop_t * loop, void * data);
+
+/*
+ * Come back when the flood control lets the queued lines go.
+ */
+void scheduleSend(irc_shard_t* shard) {
+	long delay = irc_conn_get_send_delay(shard->conn);
+	if (delay >= 0 && !shard->send_timer) {
+		shard->send_timer = event_loop_add_timer(shard->ctx->worker->loop, delay, onSendTimer, shard);
+		if (!shard->send_timer) {
+			log_error("could not schedule sending to %s.", server_conf_get_name(shard->ctx->server_conf));
+		}
+	}
+}
+
+/*
+ * Send the lines held on the shard on the next turn of the loop : the shard
+ * may be processing, or another one.
+ */
+void flushShard(irc_shard_t* shard) {
+	if (!shard->send_timer) {
+		shard->send_timer = event_loop_add_timer(shard->ctx->worker->loop, 0, onSendTimer, shard);
+		if (!shard->send_timer) {
+			log_error("could not schedule sending to %s.", server_conf_get_name(shard->ctx->server_conf));
+		}
+	}
+}
+
+void processShard(irc_shard_t* shard, int events) {
+	if (!irc_conn_process(shard->conn, events)) {
+		if (!irc_conn_is_connected(shard->conn) && shard->next_address) {
+			// try the other addresses of the server first
+			event_loop_unwatch(shard->ctx->worker->loop, shard->watch);
+			shard->watch = NULL;
+			irc_conn_disconnect(shard->conn);
+			if (connectNextAddress(shard)) {
+				return;
 			}
-			// Yes, get out of here.
-			printf("FATAL select error : %s.\n", strerror(errno));
-			return 0;
-		} else if (retval == 0) {
-			// Timeout
-			//fprintf(stderr, "T");
 		}
+		doShardConnectionError(shard);
+		return;
+	}
+	scheduleSend(shard);
+}
 
-		// Everything OK.
+void onSendTimer(event_loop_t * loop, void * data) {
+	irc_shard_t * shard = (irc_shard_t *) data;
+	shard->send_timer = NULL;
+	if (shard->state == STATE_CONNECTED) {
+		processShard(shard, EVENT_WRITE);
+	}
+}
 
-	} while(0); // to be able to use "continue" when interrupted
+void onShardEvent(event_loop_t * loop, int fd, int events, void * data) {
+	irc_shard_t * shard = (irc_shard_t *) data;
+	if (shard->state != STATE_CONNECTED) {
+		return;
+	}
+	processShard(shard, events);
+}
 
+int doShardStop(irc_shard_t* shard) {
+	event_loop_cancel_timer(shard->ctx->worker->loop, shard->reconnect_timer);
+	shard->reconnect_timer = NULL;
+	if (shard->state != STATE_UNCREATED && shard->state != STATE_WAIT_TO_RECONNECT) {
+		shard->state = STATE_STOPPING;
+	}
+	doShardDestroy(shard);
 	return 1;
 }
 
-int doProcessDescriptors(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
-	if (ctx->state == STATE_DESCRIPTOR_ADDED) {
+int doCreation(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
+	int i;
+	for (i = 0; i < ctx->shards_count; i++) {
+		doShardCreation(ctx->shards[i]);
+	}
+	return 1;
+}
 
-		if ( irc_process_select_descriptors (ctx->s, &common_ctx->in_set, &common_ctx->out_set)) {
-			printf("ERROR: irc_process_select_descriptors() : %s (%d)\n",
-					irc_strerror(irc_errno(ctx->s)), irc_errno(ctx->s));
-			ctx->state = STATE_CONNECTION_ERROR;
+int doConnection(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
+	int i;
+	for (i = 0; i < ctx->shards_count; i++) {
+		doShardConnection(ctx->shards[i]);
+	}
+	return 1;
+}
+
+int doStop(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
+	int i;
+	for (i = 0; i < ctx->shards_count; i++) {
+		doShardStop(ctx->shards[i]);
+	}
+	return 1;
+}
+
+// -----------------------------------------------------------------------------------------------
+// sharding
+//
+// A server limits the channels a client can join, its CHANLIMIT. Channels are
+// joined on the ready shards of the session with room left, the least loaded
+// first. When they are all full, more shards are opened, up to the
+// connections_max of the server, each one taking the channel limit of the
+// others. A shard losing its connection gives its channels back, and they move
+// to the shards with room left until it is ready again.
+//
+// The shards of a session share its worker, only this thread touches them.
+
+/*
+ * Nick of the shard : the configured one for the first, with its index appended
+ * for the others, then one '_' per nick refused. Cut to the NICKLEN of the server.
+ */
+void setShardNick(irc_shard_t* shard) {
+	const char * nick = server_conf_get_nick(shard->ctx->server_conf);
+	char suffix[NICK_MAX];
+	int suffix_len = shard->index ? snprintf(suffix, sizeof(suffix), "%d", shard->index) : 0;
+	int i;
+	for (i = 0; i < shard->nick_attempts && suffix_len < NICK_MAX / 2; i++) {
+		suffix[suffix_len++] = '_';
+	}
+	suffix[suffix_len] = '\0';
+
+	int nick_len = strlen(nick);
+	int nicklen = shard->ctx->isupport.nicklen;
+	if (suffix_len && nick_len + suffix_len > nicklen) {
+		nick_len = nicklen > suffix_len ? nicklen - suffix_len : 1;
+	}
+	if (nick_len > NICK_MAX - 1 - suffix_len) {
+		nick_len = NICK_MAX - 1 - suffix_len;
+	}
+	memcpy(shard->nick, nick, nick_len);
+	memcpy(shard->nick + nick_len, suffix, suffix_len + 1);
+}
+
+/*
+ * Add or remove (delta) a channel to the counts of the shard.
+ */
+void countChannel(irc_shard_t* shard, const char * name, int delta) {
+	shard->channels_count += delta;
+	int chanlimit = irc_isupport_find_chanlimit(&shard->isupport, name);
+	if (chanlimit >= 0) {
+		shard->chanlimit_counts[chanlimit] += delta;
+	}
+}
+
+int shardHasRoom(const irc_shard_t* shard, const char * name) {
+	if (!shard->ready || (shard->channels_max >= 0 && shard->channels_count >= shard->channels_max)) {
+		return 0;
+	}
+	int chanlimit = irc_isupport_find_chanlimit(&shard->isupport, name);
+	return chanlimit < 0 || shard->chanlimit_counts[chanlimit] < shard->isupport.chanlimits[chanlimit].limit;
+}
+
+/*
+ * Queue the join of the channel at chan_idx on shard.
+ */
+void joinChannel(irc_shard_t* shard, int chan_idx) {
+	irc_ctx_t * ctx = shard->ctx;
+	const channel_conf_t * channel_conf = server_conf_get_channel_at(ctx->server_conf, chan_idx);
+	const char * chan_name = channel_conf_get_name(channel_conf);
+	log_info("Joining %s as %s", chan_name, shard->nick);
+
+	ctx->channel_shards[chan_idx] = shard->index;
+	countChannel(shard, chan_name, 1);
+	// a new join starts a new history
+	filter_set_reset(ctx->channel_filters[chan_idx]);
+	// batched with the other joins
+	irc_conn_hold(shard->conn);
+	irc_conn_cmd_join(shard->conn, chan_name, channel_conf_get_passwd(channel_conf));
+	flushShard(shard);
+}
+
+irc_shard_t * addShard(irc_ctx_t* ctx) {
+	irc_shard_t * shard = calloc(1, sizeof(irc_shard_t));
+	shard->ctx = ctx;
+	shard->index = ctx->shards_count;
+	shard->state = STATE_UNCREATED;
+	shard->channels_max = -1;
+	irc_isupport_init(&shard->isupport);
+	setShardNick(shard);
+	ctx->shards = realloc(ctx->shards, (ctx->shards_count + 1) * sizeof(irc_shard_t *));
+	ctx->shards[ctx->shards_count++] = shard;
+	return shard;
+}
+
+/*
+ * Open enough shards for waiting channels, counting the ones not ready yet.
+ */
+void growShards(irc_ctx_t* ctx, int waiting) {
+	int pending = 0;
+	int per_shard = irc_isupport_get_chanlimit_min(&ctx->isupport);
+	int i;
+	for (i = 0; i < ctx->shards_count; i++) {
+		const irc_shard_t * shard = ctx->shards[i];
+		if (!shard->ready) {
+			pending++;
+		} else if (shard->channels_max >= 0 && (per_shard == ISUPPORT_UNLIMITED || shard->channels_max < per_shard)) {
+			per_shard = shard->channels_max;
+		}
+	}
 
-			if (gettimeofday(&ctx->wait_date, NULL)) {
-				printf("ERROR: gettimeofday() : %s.\n", strerror(errno));
-			} else {
-				ctx->wait_date.tv_sec += 2;
-				ctx->wait_date.tv_usec += 0;
+	int wanted = per_shard > 0 ? (waiting + per_shard - 1) / per_shard : 1;
+	int connections_max = server_conf_get_connections_max(ctx->server_conf);
+	while (pending < wanted && ctx->shards_count < connections_max) {
+		irc_shard_t * shard = addShard(ctx);
+		doShardCreation(shard);
+		doShardConnection(shard);
+		pending++;
+	}
+	if (!pending && !ctx->unjoined_reported) {
+		log_warn("%d channels of %s are not joined : its %d connections are full.", waiting,
+				server_conf_get_name(ctx->server_conf), ctx->shards_count);
+		ctx->unjoined_reported = 1;
+	}
+}
+
+/*
+ * Join the channels no shard is joined to.
+ */
+void balanceChannels(irc_ctx_t* ctx) {
+	// no shard was ever ready : the limits of the server are unknown
+	if (!ctx->channel_index || __atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		return;
+	}
+	int waiting = 0;
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < ctx->channels_count; chan_idx++) {
+		if (ctx->channel_shards[chan_idx] >= 0) {
+			continue;
+		}
+		const char * chan_name = channel_conf_get_name(server_conf_get_channel_at(ctx->server_conf, chan_idx));
+		irc_shard_t * best = NULL;
+		int i;
+		for (i = 0; i < ctx->shards_count; i++) {
+			irc_shard_t * shard = ctx->shards[i];
+			if (shardHasRoom(shard, chan_name) && (!best || shard->channels_count < best->channels_count)) {
+				best = shard;
 			}
+		}
+		if (best) {
+			joinChannel(best, chan_idx);
+		} else {
+			waiting++;
+		}
+	}
+
+	if (waiting) {
+		growShards(ctx, waiting);
+	} else {
+		ctx->unjoined_reported = 0;
+	}
+}
+
+/*
+ * ERR_TOOMANYCHANNELS : the shard is full with the channels it joined before,
+ * the channel goes to another one.
+ */
+void refuseChannel(irc_shard_t* shard, const char * name) {
+	irc_ctx_t * ctx = shard->ctx;
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < ctx->channels_count; chan_idx++) {
+		const char * chan_name = channel_conf_get_name(server_conf_get_channel_at(ctx->server_conf, chan_idx));
+		if (ctx->channel_shards[chan_idx] == shard->index
+				&& !irc_strcasecmp(ctx->isupport.casemapping, chan_name, name)) {
+			ctx->channel_shards[chan_idx] = -1;
+			countChannel(shard, chan_name, -1);
+			shard->channels_max = shard->channels_count;
+			log_warn("%s could not join %s, too many channels : joining it on another connection.", shard->nick,
+					chan_name);
+			balanceChannels(ctx);
+			return;
+		}
+	}
+}
+
+void freeFilterSets(filter_set_t ** channel_filters, int channels_count) {
+	if (!channel_filters) {
+		return;
+	}
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < channels_count; chan_idx++) {
+		filter_set_free(channel_filters[chan_idx]);
+	}
+	free(channel_filters);
+}
+
+/*
+ * Compile the filters of each channel of server_conf. Return NULL on error.
+ */
+filter_set_t ** compileFilters(const server_conf_t * server_conf) {
+	int channels_count = server_conf_get_channels_count(server_conf);
+	filter_set_t ** channel_filters = calloc(channels_count ? channels_count : 1, sizeof(filter_set_t *));
 
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < channels_count; chan_idx++) {
+		const channel_conf_t * channel_conf = server_conf_get_channel_at(server_conf, chan_idx);
+		channel_filters[chan_idx] = filter_set_new(channel_conf);
+		if (!channel_filters[chan_idx]) {
+			log_error("could not compile filters of %s on %s.",
+					channel_conf_get_name(channel_conf), server_conf_get_name(server_conf));
+			freeFilterSets(channel_filters, chan_idx);
+			return NULL;
+		}
+	}
+	return channel_filters;
+}
+
+/*
+ * Session of the server at server_idx of irc_conf, which takes channel_filters.
+ */
+irc_ctx_t * newSession(irc_common_ctx_t* common_ctx, irc_conf_t * irc_conf, int server_idx,
+		filter_set_t ** channel_filters) {
+	irc_ctx_t * ctx = calloc(1, sizeof(irc_ctx_t));
+	ctx->common_ctx = common_ctx;
+	ctx->seed = time(NULL) ^ (server_idx * 2654435761u);
+	ctx->irc_conf = irc_conf_ref(irc_conf);
+	ctx->server_conf = irc_conf_get_server_at(irc_conf, server_idx);
+	ctx->channel_filters = channel_filters;
+	ctx->channels_count = server_conf_get_channels_count(ctx->server_conf);
+	ctx->channel_shards = malloc((ctx->channels_count ? ctx->channels_count : 1) * sizeof(int));
+	memset(ctx->channel_shards, -1, (ctx->channels_count ? ctx->channels_count : 1) * sizeof(int));
+	irc_isupport_init(&ctx->isupport);
+	addShard(ctx);
+	return ctx;
+}
+
+/*
+ * Free a stopped session.
+ */
+void freeSession(irc_ctx_t* ctx) {
+	int i;
+	for (i = 0; i < ctx->shards_count; i++) {
+		free(ctx->shards[i]);
+	}
+	free(ctx->shards);
+	free(ctx->channel_shards);
+	channel_index_free(ctx->channel_index);
+	freeFilterSets(ctx->channel_filters, ctx->channels_count);
+	irc_conf_free(ctx->irc_conf);
+	free(ctx);
+}
+
+void addSession(irc_worker_t* worker, irc_ctx_t* ctx) {
+	if (worker->sessions_count == worker->sessions_capacity) {
+		worker->sessions_capacity = worker->sessions_capacity ? worker->sessions_capacity * 2 : 4;
+		worker->sessions = realloc(worker->sessions, worker->sessions_capacity * sizeof(irc_ctx_t *));
+	}
+	worker->sessions[worker->sessions_count++] = ctx;
+}
+
+void removeSession(irc_worker_t* worker, irc_ctx_t* ctx) {
+	int i;
+	for (i = 0; i < worker->sessions_count; i++) {
+		if (worker->sessions[i] == ctx) {
+			worker->sessions[i] = worker->sessions[--worker->sessions_count];
+			return;
+		}
+	}
+}
+
+/*
+ * Load the configuration image if it is up to date, the JSON file otherwise.
+ */
+irc_conf_t * loadConf() {
+	irc_conf_t * irc_conf = irc_conf_new();
+	if (!irc_conf_load_image(irc_conf, CONF_FILENAME, CONF_IMAGE_FILENAME)
+			&& !irc_conf_load(irc_conf, CONF_FILENAME)) {
+		irc_conf_free(irc_conf);
+		return NULL;
+	}
+	return irc_conf;
+}
+
+/*
+ * --compile-config : check the configuration, filters included, and write its image.
+ */
+int compileConf() {
+	irc_conf_t * irc_conf = irc_conf_new();
+	if (!irc_conf_load(irc_conf, CONF_FILENAME)) {
+		irc_conf_free(irc_conf);
+		return 0;
+	}
+
+	int ok = 1;
+	int server_idx;
+	for (server_idx = 0; server_idx < irc_conf_get_servers_count(irc_conf) && ok; server_idx++) {
+		const server_conf_t * server_conf = irc_conf_get_server_at(irc_conf, server_idx);
+		filter_set_t ** channel_filters = compileFilters(server_conf);
+		ok = channel_filters != NULL;
+		freeFilterSets(channel_filters, server_conf_get_channels_count(server_conf));
+	}
+	if (ok) {
+		ok = irc_conf_write_image(irc_conf, CONF_IMAGE_FILENAME);
+	}
+	if (ok) {
+		log_info("Compiled %s into %s.", CONF_FILENAME, CONF_IMAGE_FILENAME);
+	}
+	irc_conf_free(irc_conf);
+	return ok;
+}
+
+/*
+ * --replay [-s server] [-f format] [-t threads] file... : run the filters over
+ * IRC logs, see replay.h, and write the matches to the configured output.
+ */
+int replayLogs(int argc, char ** argv) {
+	const char * server_name = NULL;
+	replay_format_t format = REPLAY_FORMAT_AUTO;
+	long threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "s:f:t:")) != -1) {
+		switch (opt) {
+		case 's':
+			server_name = optarg;
+			break;
+		case 'f':
+			if (!replay_format_parse(optarg, &format)) {
+				fprintf(stderr, "unknown log format %s : auto, raw, irssi or weechat.\n", optarg);
+				return 0;
+			}
+			break;
+		case 't':
+			threads_count = atol(optarg);
+			break;
+		default:
 			return 0;
 		}
+	}
+	if (optind >= argc || threads_count < 1) {
+		fprintf(stderr, "usage: testIrc --replay [-s server] [-f format] [-t threads] file...\n");
+		return 0;
+	}
+
+	irc_conf_t * irc_conf = loadConf();
+	if (!irc_conf) {
+		return 0;
+	}
+	if (!log_start(irc_conf_get_log_level(irc_conf), irc_conf_get_log_path(irc_conf))) {
+		irc_conf_free(irc_conf);
+		return 0;
+	}
+	match_output_t * output = match_output_new(irc_conf_get_output_type(irc_conf), irc_conf_get_output_path(irc_conf));
+	int ok = output && match_output_start(output);
+
+	replay_stats_t stats;
+	if (ok) {
+		ok = replay_run(irc_conf, server_name, format, (const char **) argv + optind, argc - optind, threads_count,
+				output, &stats);
+		match_output_stop(output);
+	}
+	if (ok) {
+		double seconds = stats.elapsed_ns / 1e9;
+		fprintf(stderr, "Replayed %llu lines in %.3f s on %ld threads, %.0f lines/s : %llu channel lines, %llu matches.\n",
+				(unsigned long long) stats.lines, seconds, threads_count, seconds > 0 ? stats.lines / seconds : 0,
+				(unsigned long long) stats.channel_lines, (unsigned long long) stats.matches);
+	}
+	match_output_free(output);
+	irc_conf_free(irc_conf);
+	log_stop();
+	return ok;
+}
 
-		ctx->state = STATE_CONNECTED;
+void getArchiveLimits(const irc_conf_t * irc_conf, archive_limits_t * limits) {
+	limits->segment_size = (uint64_t) irc_conf_get_archive_segment_size_mb(irc_conf) << 20;
+	limits->max_size = (uint64_t) irc_conf_get_archive_max_size_mb(irc_conf) << 20;
+	limits->max_age_s = (uint64_t) irc_conf_get_archive_max_age_days(irc_conf) * 24 * 3600;
+}
 
+/*
+ * Time in ns of "2024-01-02T12:34:56", UTC, or of a number of seconds since the epoch.
+ */
+int parseTime(const char * text, uint64_t * time_ns) {
+	struct tm tm;
+	int end = 0;
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(text, "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+			&tm.tm_sec, &end) == 6 && (!text[end] || !strcmp(text + end, "Z"))) {
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		*time_ns = (uint64_t) timegm(&tm) * 1000000000;
+		return 1;
+	}
+	char * number_end;
+	unsigned long long seconds = strtoull(text, &number_end, 10);
+	if (number_end == text || *number_end) {
+		return 0;
 	}
+	*time_ns = seconds * 1000000000;
 	return 1;
 }
 
-int doDestroy(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
-	if ((ctx->state != STATE_CONNECTED)
-			&& (ctx->state != STATE_UNCREATED)
-			&& (ctx->state != STATE_WAIT_TO_RECONNECT)) {
-		printf("Destroy connection to %s\n", server_conf_get_name(ctx->server_conf));
-		irc_destroy_session(ctx->s);
-		ctx->state = STATE_WAIT_TO_RECONNECT;
+/*
+ * A record as a raw IRC line, tagged with its IRCv3 server time : --replay reads it back.
+ */
+void onArchiveRecord(uint64_t time_ns, const char * server, const char * channel, const char * origin,
+		const char * text, size_t text_len, void * data) {
+	time_t seconds = time_ns / 1000000000;
+	struct tm tm;
+	char time_buf[32];
+	gmtime_r(&seconds, &tm);
+	strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+	printf("@time=%s.%03dZ :%s PRIVMSG %s :%.*s\n", time_buf, (int) (time_ns / 1000000 % 1000), origin, channel,
+			(int) text_len, text);
+}
+
+/*
+ * --archive-query [-s server] channel [from [to]] : print the archived lines of
+ * channel, between the times from and to, see parseTime().
+ */
+int queryArchive(int argc, char ** argv) {
+	const char * server_name = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			server_name = optarg;
+			break;
+		default:
+			return 0;
+		}
+	}
+	uint64_t from_ns = 0;
+	uint64_t to_ns = UINT64_MAX;
+	if (optind >= argc || argc - optind > 3 || (argc - optind > 1 && !parseTime(argv[optind + 1], &from_ns))
+			|| (argc - optind > 2 && !parseTime(argv[optind + 2], &to_ns))) {
+		fprintf(stderr, "usage: testIrc --archive-query [-s server] channel [from [to]], times as"
+				" 2024-01-02T12:34:56 UTC or seconds since the epoch\n");
+		return 0;
+	}
+
+	irc_conf_t * irc_conf = loadConf();
+	if (!irc_conf) {
+		return 0;
 	}
+	const char * archive_path = irc_conf_get_archive_path(irc_conf);
+	int ok = archive_path != NULL;
+	if (!ok) {
+		fprintf(stderr, "error: no archive in %s.\n", CONF_FILENAME);
+	} else {
+		ok = archive_query(archive_path, server_name, argv[optind], from_ns, to_ns, onArchiveRecord, NULL);
+	}
+	irc_conf_free(irc_conf);
+	return ok;
+}
+
+void SIGINThandler(int sig) {
+	g_askedToStop = 1;
+}
+
+void SIGHUPhandler(int sig) {
+	g_askedToReload = 1;
+}
+
+/*
+ * Block or unblock (how of pthread_sigmask()) SIGINT and SIGHUP. Only the
+ * thread of worker 0 handles them, to interrupt its epoll_wait().
+ */
+void maskSignals(int how, sigset_t * old_set) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(how, &set, old_set);
+}
+
+int doStop(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx);
+
+// -----------------------------------------------------------------------------------------------
+// reload
+//
+// The new configuration is loaded and its filters compiled on a reload thread.
+// Worker 0 then diffs it against the running one, by server name, and posts
+// the changes to the workers owning the sessions : a session whose connection
+// settings are the same is kept and only joins, parts and swaps its filter sets,
+// the others are stopped or started.
+//
+// A worker swaps the filter sets of its session between two events, so no
+// match can see them change, and frees the replaced ones right away : the
+// worker being their only reader, its event loop turn is the grace period.
+
+typedef struct {
+	event_task_t task;
+	irc_common_ctx_t * common_ctx;
+	irc_conf_t * irc_conf;
+	// compiled filters of each server of irc_conf, taken by the sessions
+	filter_set_t *** servers_filters;
+	int ok;
+} conf_reload_t;
+
+/*
+ * Change of a session, applied by its worker. Either ctx is updated to
+ * server_conf of irc_conf with channel_filters, or ctx is stopped and new_ctx
+ * started, one of them being possibly NULL.
+ */
+typedef struct {
+	event_task_t task;
+	irc_ctx_t * ctx;
+	irc_ctx_t * new_ctx;
+	irc_conf_t * irc_conf;
+	const server_conf_t * server_conf;
+	filter_set_t ** channel_filters;
+} session_change_t;
+
+int findChannel(const server_conf_t * server_conf, const char * name, const char * found) {
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < server_conf_get_channels_count(server_conf); chan_idx++) {
+		const channel_conf_t * channel_conf = server_conf_get_channel_at(server_conf, chan_idx);
+		if (!found[chan_idx] && !irc_strcasecmp(CASEMAPPING_RFC1459, channel_conf_get_name(channel_conf), name)) {
+			return chan_idx;
+		}
+	}
+	return -1;
+}
+
+void onSessionUpdate(event_loop_t * loop, void * data) {
+	session_change_t * change = (session_change_t *) data;
+	irc_ctx_t * ctx = change->ctx;
+	int channels_count = server_conf_get_channels_count(change->server_conf);
+
+	if (__atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		freeFilterSets(change->channel_filters, channels_count);
+		irc_conf_free(change->irc_conf);
+		free(change);
+		return;
+	}
+
+	// channels are assigned to the shards once one is ready, along with the index
+	int joined = ctx->channel_index != NULL;
+
+	int * channel_shards = malloc((channels_count ? channels_count : 1) * sizeof(int));
+	char * found = calloc(ctx->channels_count ? ctx->channels_count : 1, 1);
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < channels_count; chan_idx++) {
+		const channel_conf_t * channel_conf = server_conf_get_channel_at(change->server_conf, chan_idx);
+		const char * chan_name = channel_conf_get_name(channel_conf);
+		int old_idx = findChannel(ctx->server_conf, chan_name, found);
+		channel_shards[chan_idx] = -1;
+		if (old_idx >= 0) {
+			found[old_idx] = 1;
+			// still joined on the same shard
+			channel_shards[chan_idx] = ctx->channel_shards[old_idx];
+			if (channel_conf_same_filters(server_conf_get_channel_at(ctx->server_conf, old_idx), channel_conf)) {
+				// keep the running filters and their history
+				filter_set_free(change->channel_filters[chan_idx]);
+				change->channel_filters[chan_idx] = ctx->channel_filters[old_idx];
+				ctx->channel_filters[old_idx] = NULL;
+			}
+		}
+	}
+	for (chan_idx = 0; chan_idx < ctx->channels_count; chan_idx++) {
+		int shard_idx = ctx->channel_shards[chan_idx];
+		if (!found[chan_idx] && shard_idx >= 0) {
+			irc_shard_t * shard = ctx->shards[shard_idx];
+			const char * chan_name = channel_conf_get_name(server_conf_get_channel_at(ctx->server_conf, chan_idx));
+			log_info("Leaving %s as %s", chan_name, shard->nick);
+			countChannel(shard, chan_name, -1);
+			irc_conn_hold(shard->conn);
+			irc_conn_cmd_part(shard->conn, chan_name);
+			flushShard(shard);
+		}
+	}
+	free(found);
+
+	int flood_changed = server_conf_get_flood_burst(ctx->server_conf) != server_conf_get_flood_burst(change->server_conf)
+			|| server_conf_get_flood_interval_ms(ctx->server_conf) != server_conf_get_flood_interval_ms(change->server_conf);
+
+	freeFilterSets(ctx->channel_filters, ctx->channels_count);
+	ctx->channel_filters = change->channel_filters;
+	free(ctx->channel_shards);
+	ctx->channel_shards = channel_shards;
+	ctx->channels_count = channels_count;
+	irc_conf_free(ctx->irc_conf);
+	ctx->irc_conf = change->irc_conf;
+	ctx->server_conf = change->server_conf;
+	free(change);
+
+	int i;
+	for (i = 0; flood_changed && i < ctx->shards_count; i++) {
+		if (ctx->shards[i]->conn) {
+			irc_conn_set_flood_control(ctx->shards[i]->conn, server_conf_get_flood_burst(ctx->server_conf),
+					server_conf_get_flood_interval_ms(ctx->server_conf));
+		}
+	}
+	if (joined) {
+		initChannelIndex(ctx);
+		// joins the new channels
+		balanceChannels(ctx);
+	}
+}
+
+void onSessionReplace(event_loop_t * loop, void * data) {
+	session_change_t * change = (session_change_t *) data;
+
+	if (__atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		// ctx is stopped and freed with the others
+		if (change->new_ctx) {
+			freeSession(change->new_ctx);
+		}
+		free(change);
+		return;
+	}
+
+	irc_ctx_t * ctx = change->ctx;
+	if (ctx) {
+		log_info("Disconnecting from %s", server_conf_get_name(ctx->server_conf));
+		int i;
+		for (i = 0; i < ctx->shards_count; i++) {
+			if (ctx->shards[i]->state == STATE_CONNECTED) {
+				irc_conn_cmd_quit(ctx->shards[i]->conn, "reload");
+			}
+		}
+		removeSession(ctx->worker, ctx);
+		doStop(ctx->common_ctx, ctx);
+		freeSession(ctx);
+	}
+
+	ctx = change->new_ctx;
+	if (ctx) {
+		addSession(ctx->worker, ctx);
+		doCreation(ctx->common_ctx, ctx);
+		doConnection(ctx->common_ctx, ctx);
+	}
+	free(change);
+}
+
+void postSessionUpdate(irc_ctx_t* ctx, irc_conf_t * irc_conf, int server_idx, filter_set_t ** channel_filters) {
+	session_change_t * change = calloc(1, sizeof(session_change_t));
+	change->ctx = ctx;
+	change->irc_conf = irc_conf_ref(irc_conf);
+	change->server_conf = irc_conf_get_server_at(irc_conf, server_idx);
+	change->channel_filters = channel_filters;
+	event_loop_post(ctx->worker->loop, &change->task, onSessionUpdate, change);
+}
+
+void postSessionReplace(irc_worker_t* worker, irc_ctx_t* ctx, irc_ctx_t* new_ctx) {
+	session_change_t * change = calloc(1, sizeof(session_change_t));
+	change->ctx = ctx;
+	change->new_ctx = new_ctx;
+	event_loop_post(worker->loop, &change->task, onSessionReplace, change);
+}
+
+int findServer(const irc_conf_t * irc_conf, const char * name, const char * found) {
+	int server_idx;
+	for (server_idx = 0; server_idx < irc_conf_get_servers_count(irc_conf); server_idx++) {
+		if (!found[server_idx] && !strcmp(server_conf_get_name(irc_conf_get_server_at(irc_conf, server_idx)), name)) {
+			return server_idx;
+		}
+	}
+	return -1;
+}
+
+int samePath(const char * path, const char * other) {
+	return path == other || (path && other && !strcmp(path, other));
+}
+
+void applyReload(irc_common_ctx_t* common_ctx, conf_reload_t* reload) {
+	irc_conf_t * irc_conf = reload->irc_conf;
+	int servers_count = irc_conf_get_servers_count(irc_conf);
+	irc_ctx_t ** servers_ctx = calloc(servers_count ? servers_count : 1, sizeof(irc_ctx_t *));
+	char * found = calloc(common_ctx->servers_count ? common_ctx->servers_count : 1, 1);
+	int kept = 0, started = 0, stopped = 0;
+
+	if (irc_conf_get_threads_count(irc_conf) != common_ctx->workers_count
+			|| irc_conf_get_output_type(irc_conf) != irc_conf_get_output_type(common_ctx->irc_conf)
+			|| !samePath(irc_conf_get_output_path(irc_conf), irc_conf_get_output_path(common_ctx->irc_conf))
+			|| !samePath(irc_conf_get_log_path(irc_conf), irc_conf_get_log_path(common_ctx->irc_conf))
+			|| !samePath(irc_conf_get_stats_socket(irc_conf), irc_conf_get_stats_socket(common_ctx->irc_conf))
+			|| !samePath(irc_conf_get_archive_path(irc_conf), irc_conf_get_archive_path(common_ctx->irc_conf))) {
+		log_warn("threads, output, log path, stats socket and archive path changes are applied on restart only.");
+	}
+	log_set_level(irc_conf_get_log_level(irc_conf));
+	if (common_ctx->archive) {
+		archive_limits_t limits;
+		getArchiveLimits(irc_conf, &limits);
+		archive_set_limits(common_ctx->archive, &limits);
+	}
+
+	int server_idx;
+	for (server_idx = 0; server_idx < servers_count; server_idx++) {
+		const server_conf_t * server_conf = irc_conf_get_server_at(irc_conf, server_idx);
+		filter_set_t ** channel_filters = reload->servers_filters[server_idx];
+		reload->servers_filters[server_idx] = NULL;
+
+		int old_idx = findServer(common_ctx->irc_conf, server_conf_get_name(server_conf), found);
+		irc_ctx_t * old_ctx = NULL;
+		if (old_idx >= 0) {
+			found[old_idx] = 1;
+			old_ctx = common_ctx->servers_ctx[old_idx];
+			if (server_conf_same_connection(irc_conf_get_server_at(common_ctx->irc_conf, old_idx), server_conf)) {
+				postSessionUpdate(old_ctx, irc_conf, server_idx, channel_filters);
+				servers_ctx[server_idx] = old_ctx;
+				kept++;
+				continue;
+			}
+			stopped++;
+		}
+
+		irc_ctx_t * ctx = newSession(common_ctx, irc_conf, server_idx, channel_filters);
+		if (old_ctx) {
+			ctx->worker = old_ctx->worker;
+		} else {
+			ctx->worker = &common_ctx->workers[common_ctx->next_worker++ % common_ctx->workers_count];
+		}
+		postSessionReplace(ctx->worker, old_ctx, ctx);
+		servers_ctx[server_idx] = ctx;
+		started++;
+	}
+
+	for (server_idx = 0; server_idx < common_ctx->servers_count; server_idx++) {
+		if (!found[server_idx]) {
+			irc_ctx_t * old_ctx = common_ctx->servers_ctx[server_idx];
+			postSessionReplace(old_ctx->worker, old_ctx, NULL);
+			stopped++;
+		}
+	}
+	free(found);
+
+	free(common_ctx->servers_ctx);
+	common_ctx->servers_ctx = servers_ctx;
+	common_ctx->servers_count = servers_count;
+	irc_conf_free(common_ctx->irc_conf);
+	common_ctx->irc_conf = irc_conf_ref(irc_conf);
+
+	log_info("Reloaded %s : %d sessions kept, %d started, %d stopped.", CONF_FILENAME, kept, started, stopped);
+}
+
+void freeReload(conf_reload_t* reload) {
+	if (reload->servers_filters) {
+		int server_idx;
+		for (server_idx = 0; server_idx < irc_conf_get_servers_count(reload->irc_conf); server_idx++) {
+			freeFilterSets(reload->servers_filters[server_idx],
+					server_conf_get_channels_count(irc_conf_get_server_at(reload->irc_conf, server_idx)));
+		}
+		free(reload->servers_filters);
+	}
+	if (reload->irc_conf) {
+		irc_conf_free(reload->irc_conf);
+	}
+	free(reload);
+}
+
+void joinReload(irc_common_ctx_t* common_ctx) {
+	if (common_ctx->reloading) {
+		pthread_join(common_ctx->reload_thread, NULL);
+		common_ctx->reloading = 0;
+	}
+}
+
+void startReload(irc_common_ctx_t* common_ctx);
+
+void onReloadLoaded(event_loop_t * loop, void * data) {
+	conf_reload_t * reload = (conf_reload_t *) data;
+	irc_common_ctx_t * common_ctx = reload->common_ctx;
+	joinReload(common_ctx);
+
+	if (__atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		freeReload(reload);
+		return;
+	}
+
+	if (reload->ok) {
+		applyReload(common_ctx, reload);
+	} else {
+		log_error("could not reload %s, the running configuration is kept.", CONF_FILENAME);
+	}
+	freeReload(reload);
+
+	if (common_ctx->reload_pending) {
+		common_ctx->reload_pending = 0;
+		startReload(common_ctx);
+	}
+}
+
+void * reloadThread(void * arg) {
+	conf_reload_t * reload = (conf_reload_t *) arg;
+
+	reload->irc_conf = loadConf();
+	if (reload->irc_conf) {
+		int servers_count = irc_conf_get_servers_count(reload->irc_conf);
+		reload->servers_filters = calloc(servers_count ? servers_count : 1, sizeof(filter_set_t **));
+		reload->ok = 1;
+
+		int server_idx;
+		for (server_idx = 0; server_idx < servers_count && reload->ok; server_idx++) {
+			reload->servers_filters[server_idx] = compileFilters(irc_conf_get_server_at(reload->irc_conf, server_idx));
+			reload->ok = reload->servers_filters[server_idx] != NULL;
+		}
+	}
+
+	event_loop_post(reload->common_ctx->workers[0].loop, &reload->task, onReloadLoaded, reload);
+	return NULL;
+}
+
+/*
+ * Load the configuration again, in the background. Called by worker 0.
+ */
+void startReload(irc_common_ctx_t* common_ctx) {
+	if (common_ctx->reloading) {
+		common_ctx->reload_pending = 1;
+		return;
+	}
+	log_info("Reloading %s", CONF_FILENAME);
+
+	conf_reload_t * reload = calloc(1, sizeof(conf_reload_t));
+	reload->common_ctx = common_ctx;
+
+	sigset_t old_set;
+	maskSignals(SIG_BLOCK, &old_set);
+	int result = pthread_create(&common_ctx->reload_thread, NULL, reloadThread, reload);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (result) {
+		log_error("could not start reload : %s.", strerror(result));
+		free(reload);
+		return;
+	}
+	common_ctx->reloading = 1;
+}
+
+// -----------------------------------------------------------------------------------------------
+// stats
+//
+// A report is started by worker 0, for a client of the stats socket or for the
+// periodic dump. It goes through every worker, each appending its own sessions,
+// then back to worker 0 which sends or writes it.
+
+typedef struct {
+	event_task_t task;
+	irc_common_ctx_t * common_ctx;
+	stats_report_t * report;
+	// worker appending its sessions next
+	int worker_index;
+	int sessions_count;
+	// client of the stats socket, -1 for a dump
+	int client_fd;
+} stats_request_t;
+
+void freeStatsRequest(stats_request_t* request) {
+	if (request->client_fd >= 0) {
+		close(request->client_fd);
+	}
+	stats_report_free(request->report);
+	free(request);
+}
+
+void appendSessionStats(stats_report_t * report, irc_ctx_t* ctx) {
+	uint64_t bytes_in = 0;
+	uint64_t bytes_out = 0;
+	int connected = 0;
+	int reconnects = 0;
+	int i;
+	for (i = 0; i < ctx->shards_count; i++) {
+		const irc_shard_t * shard = ctx->shards[i];
+		bytes_in += shard->bytes_in;
+		bytes_out += shard->bytes_out;
+		if (shard->conn) {
+			bytes_in += irc_conn_get_bytes_in(shard->conn);
+			bytes_out += irc_conn_get_bytes_out(shard->conn);
+		}
+		connected |= shard->state == STATE_CONNECTED;
+		reconnects += shard->reconnects;
+	}
+	stats_report_append(report, "{\"server\":");
+	stats_report_append_string(report, server_conf_get_name(ctx->server_conf));
+	stats_report_append(report,
+			",\"connected\":%s,\"reconnects\":%d,\"bytes_in\":%llu,\"bytes_out\":%llu,\"messages\":%llu,\"connections\":[",
+			connected ? "true" : "false", reconnects, (unsigned long long) bytes_in,
+			(unsigned long long) bytes_out, (unsigned long long) ctx->messages);
+	for (i = 0; i < ctx->shards_count; i++) {
+		const irc_shard_t * shard = ctx->shards[i];
+		stats_report_append(report, "%s{\"nick\":", i ? "," : "");
+		stats_report_append_string(report, shard->nick);
+		stats_report_append(report, ",\"connected\":%s,\"channels\":%d}",
+				shard->state == STATE_CONNECTED ? "true" : "false", shard->channels_count);
+	}
+	stats_report_append(report, "],\"channels\":[");
+
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < ctx->channels_count; chan_idx++) {
+		filter_set_t * filter_set = ctx->channel_filters[chan_idx];
+		const channel_stats_t * channel_stats = filter_set_get_stats(filter_set);
+		stats_report_append(report, "%s{\"name\":", chan_idx ? "," : "");
+		stats_report_append_string(report, channel_conf_get_name(server_conf_get_channel_at(ctx->server_conf, chan_idx)));
+		stats_report_append(report, ",\"lines\":%llu,\"matches\":%llu,\"latency_ns\":",
+				(unsigned long long) channel_stats->lines, (unsigned long long) channel_stats->matches);
+		stats_report_append_histogram(report, &channel_stats->latency);
+		stats_report_append(report, ",\"filters\":[");
+
+		int filter_idx;
+		for (filter_idx = 0; filter_idx < filter_set_get_count(filter_set); filter_idx++) {
+			compiled_filter_t * filter = filter_set_get_at(filter_set, filter_idx);
+			const filter_stats_t * filter_stats = compiled_filter_get_stats(filter);
+			stats_report_append(report, "%s{\"name\":", filter_idx ? "," : "");
+			stats_report_append_string(report, compiled_filter_get_name(filter));
+			stats_report_append(report, ",\"evaluations\":%llu,\"matches\":%llu,\"eval_ns\":%llu}",
+					(unsigned long long) filter_stats->evaluations, (unsigned long long) filter_stats->matches,
+					(unsigned long long) filter_stats->eval_ns);
+		}
+		stats_report_append(report, "]}");
+	}
+	stats_report_append(report, "]}");
+}
+
+void onStatsCollected(event_loop_t * loop, void * data) {
+	stats_request_t * request = (stats_request_t *) data;
+	irc_common_ctx_t * common_ctx = request->common_ctx;
+
+	if (__atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		freeStatsRequest(request);
+		return;
+	}
+
+	stats_report_append(request->report, "]}\n");
+	if (request->client_fd >= 0) {
+		stats_server_reply(common_ctx->stats_server, request->client_fd, request->report);
+		request->client_fd = -1;
+		request->report = NULL;
+	} else {
+		stats_report_write_file(request->report, irc_conf_get_stats_dump_path(common_ctx->irc_conf));
+	}
+	freeStatsRequest(request);
+}
+
+void onStatsCollect(event_loop_t * loop, void * data) {
+	stats_request_t * request = (stats_request_t *) data;
+	irc_common_ctx_t * common_ctx = request->common_ctx;
+
+	if (__atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		freeStatsRequest(request);
+		return;
+	}
+
+	irc_worker_t * worker = &common_ctx->workers[request->worker_index++];
+	int i;
+	for (i = 0; i < worker->sessions_count; i++) {
+		if (request->sessions_count++) {
+			stats_report_append(request->report, ",");
+		}
+		appendSessionStats(request->report, worker->sessions[i]);
+	}
+
+	if (request->worker_index < common_ctx->workers_count) {
+		event_loop_post(common_ctx->workers[request->worker_index].loop, &request->task, onStatsCollect, request);
+	} else {
+		event_loop_post(common_ctx->workers[0].loop, &request->task, onStatsCollected, request);
+	}
+}
+
+/*
+ * Build a report for client_fd, or dump it if -1. Called by worker 0.
+ */
+void startStats(irc_common_ctx_t* common_ctx, int client_fd) {
+	stats_request_t * request = calloc(1, sizeof(stats_request_t));
+	request->common_ctx = common_ctx;
+	request->client_fd = client_fd;
+	request->report = stats_report_new();
+
+	struct timespec now;
+	struct tm tm;
+	char time_buf[32];
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+	stats_report_append(request->report, "{\"time\":\"%s.%03ldZ\",\"sessions\":[", time_buf, now.tv_nsec / 1000000);
+
+	event_loop_post(common_ctx->workers[0].loop, &request->task, onStatsCollect, request);
+}
+
+void onStatsRequest(stats_server_t * server, int client_fd, void * data) {
+	startStats((irc_common_ctx_t *) data, client_fd);
+}
+
+void onStatsTimer(event_loop_t * loop, void * data) {
+	irc_common_ctx_t * common_ctx = (irc_common_ctx_t *) data;
+	common_ctx->stats_timer = NULL;
+	// the dump settings follow the reloads
+	if (irc_conf_get_stats_dump_path(common_ctx->irc_conf)) {
+		startStats(common_ctx, -1);
+	}
+	common_ctx->stats_timer = event_loop_add_timer(loop, irc_conf_get_stats_dump_interval_s(common_ctx->irc_conf) * 1000L,
+			onStatsTimer, common_ctx);
+}
+
+/*
+ * Serve the stats socket and schedule the dumps, from worker 0.
+ */
+int initStats(irc_common_ctx_t* common_ctx) {
+	event_loop_t * loop = common_ctx->workers[0].loop;
+	const char * socket_path = irc_conf_get_stats_socket(common_ctx->irc_conf);
+	if (socket_path) {
+		common_ctx->stats_server = stats_server_new(loop, socket_path, onStatsRequest, common_ctx);
+		if (!common_ctx->stats_server) {
+			return 0;
+		}
+	}
+	common_ctx->stats_timer = event_loop_add_timer(loop, irc_conf_get_stats_dump_interval_s(common_ctx->irc_conf) * 1000L,
+			onStatsTimer, common_ctx);
 	return 1;
 }
 
-int doWait(irc_common_ctx_t* common_ctx, irc_ctx_t* ctx) {
-	if (ctx->state == STATE_WAIT_TO_RECONNECT) {
-		fprintf(stderr, "W");
+// -----------------------------------------------------------------------------------------------
+
+void runWorker(irc_worker_t* worker) {
+	doWorkerAction(worker, &doCreation);
+	doWorkerAction(worker, &doConnection);
 
-		struct timeval current;
-		if (gettimeofday(&current, NULL)) {
-			printf("ERROR: gettimeofday() : %s.\n", strerror(errno));
+	while (!__atomic_load_n(&g_askedToStop, __ATOMIC_RELAXED)) {
+		if (!event_loop_run_once(worker->loop, -1)) {
+			break;
 		}
-		if (current.tv_sec > ctx->wait_date.tv_sec && current.tv_usec > ctx->wait_date.tv_usec) {
-			ctx->state = STATE_UNCREATED;
-			ctx->wait_date.tv_sec = 0;
-			ctx->wait_date.tv_usec = 0;
+		if (worker->index == 0 && __atomic_exchange_n(&g_askedToReload, 0, __ATOMIC_RELAXED)) {
+			startReload(worker->common_ctx);
 		}
 	}
+
+	doWorkerAction(worker, &doStop);
+}
+
+void * workerThread(void * arg) {
+	runWorker((irc_worker_t *) arg);
+	return NULL;
+}
+
+/*
+ * Create the workers and spread the sessions over them.
+ */
+int initWorkers(irc_common_ctx_t* common_ctx) {
+	common_ctx->workers_count = irc_conf_get_threads_count(common_ctx->irc_conf);
+	common_ctx->workers = calloc(common_ctx->workers_count, sizeof(irc_worker_t));
+
+	int i;
+	for (i = 0; i < common_ctx->servers_count; i++) {
+		irc_ctx_t * ctx = common_ctx->servers_ctx[i];
+		ctx->worker = &common_ctx->workers[common_ctx->next_worker++ % common_ctx->workers_count];
+		addSession(ctx->worker, ctx);
+	}
+
+	for (i = 0; i < common_ctx->workers_count; i++) {
+		irc_worker_t * worker = &common_ctx->workers[i];
+		worker->common_ctx = common_ctx;
+		worker->index = i;
+		worker->loop = event_loop_new();
+		if (!worker->loop) {
+			return 0;
+		}
+		worker->event = match_event_new();
+	}
 	return 1;
 }
 
-void resetSelectData(irc_common_ctx_t* common_ctx) {
-	common_ctx->tv.tv_sec = 1;
-	common_ctx->tv.tv_usec = 0;
-	common_ctx->maxfd = 0;
-	FD_ZERO (&common_ctx->in_set);
-	FD_ZERO (&common_ctx->out_set);
+void freeWorkers(irc_common_ctx_t* common_ctx) {
+	int i;
+	for (i = 0; i < common_ctx->workers_count; i++) {
+		event_loop_free(common_ctx->workers[i].loop);
+		match_event_free(common_ctx->workers[i].event);
+	}
+	free(common_ctx->workers);
+	common_ctx->workers = NULL;
+	common_ctx->workers_count = 0;
 }
 
-void SIGINThandler(int sig) {
-	printf("Stopping program.\n");
-	g_askedToStop = 1;
+/*
+ * Run worker 0 on the calling thread and the others on their own threads,
+ * until asked to stop.
+ */
+void runWorkers(irc_common_ctx_t* common_ctx) {
+	int i;
+	for (i = 1; i < common_ctx->workers_count; i++) {
+		irc_worker_t * worker = &common_ctx->workers[i];
+		int result = pthread_create(&worker->thread, NULL, workerThread, worker);
+		if (result) {
+			log_error("could not start worker %d : %s.", i, strerror(result));
+			continue;
+		}
+		worker->started = 1;
+	}
+
+	maskSignals(SIG_UNBLOCK, NULL);
+
+	runWorker(&common_ctx->workers[0]);
+	log_info("Stopping program.");
+
+	for (i = 1; i < common_ctx->workers_count; i++) {
+		event_loop_wakeup(common_ctx->workers[i].loop);
+	}
+	for (i = 1; i < common_ctx->workers_count; i++) {
+		if (common_ctx->workers[i].started) {
+			pthread_join(common_ctx->workers[i].thread, NULL);
+		}
+	}
+}
+
+void freeCommonCtx(irc_common_ctx_t* common_ctx) {
+	// its result is posted to worker 0
+	joinReload(common_ctx);
+	int i, j;
+	// the sessions are handed to the workers along with their creation
+	if (common_ctx->workers) {
+		for (i = 0; i < common_ctx->workers_count; i++) {
+			irc_worker_t * worker = &common_ctx->workers[i];
+			for (j = 0; j < worker->sessions_count; j++) {
+				freeSession(worker->sessions[j]);
+			}
+			free(worker->sessions);
+		}
+	} else {
+		// not handed to workers yet
+		for (i = 0; i < common_ctx->servers_count; i++) {
+			if (common_ctx->servers_ctx[i]) {
+				freeSession(common_ctx->servers_ctx[i]);
+			}
+		}
+	}
+	free(common_ctx->servers_ctx);
+	// before the loop it is watched by
+	stats_server_free(common_ctx->stats_server);
+	// before the loops its results are posted to
+	resolver_free(common_ctx->resolver);
+	freeWorkers(common_ctx);
+	match_output_free(common_ctx->output);
+	archive_free(common_ctx->archive);
+	if (common_ctx->irc_conf) {
+		irc_conf_free(common_ctx->irc_conf);
+	}
+	memset (common_ctx, 0, sizeof(irc_common_ctx_t));
 }
 
 int main (int argc, char **argv) {
 	irc_common_ctx_t common_ctx;
 
+	if (argc == 2 && !strcmp(argv[1], "--compile-config")) {
+		return compileConf() ? 0 : 1;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--replay")) {
+		return replayLogs(argc - 1, argv + 1) ? 0 : 1;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--archive-query")) {
+		return queryArchive(argc - 1, argv + 1) ? 0 : 1;
+	}
+	if (argc > 1) {
+		fprintf(stderr, "usage: %s [--compile-config | --replay [-s server] [-f format] [-t threads] file..."
+				" | --archive-query [-s server] channel [from [to]]]\n", argv[0]);
+		return 1;
+	}
+
 	memset (&common_ctx, 0, sizeof(irc_common_ctx_t));
 
 	initCallbacks(&common_ctx.callbacks);
 
+	// Every thread started from now on inherits the blocked signals.
+	maskSignals(SIG_BLOCK, NULL);
+
 	// ----------
 
-	common_ctx.irc_conf = irc_conf_new();
-	if (!irc_conf_load(common_ctx.irc_conf, "testIrc.conf")) {
-		irc_conf_free(common_ctx.irc_conf);
+	common_ctx.irc_conf = loadConf();
+	if (!common_ctx.irc_conf) {
+		freeCommonCtx(&common_ctx);
+		return 1;
+	}
+
+	if (!log_start(irc_conf_get_log_level(common_ctx.irc_conf), irc_conf_get_log_path(common_ctx.irc_conf))) {
+		freeCommonCtx(&common_ctx);
 		return 1;
 	}
 
 	common_ctx.servers_count = irc_conf_get_servers_count(common_ctx.irc_conf);
-	common_ctx.servers_ctx = calloc(common_ctx.servers_count, sizeof(irc_ctx_t));
+	common_ctx.servers_ctx = calloc(common_ctx.servers_count ? common_ctx.servers_count : 1, sizeof(irc_ctx_t *));
 
 	int eachServer;
 	for (eachServer = 0; eachServer < common_ctx.servers_count; eachServer++) {
-		irc_ctx_t * irc_ctx = &common_ctx.servers_ctx[eachServer];
-		irc_ctx->state = STATE_UNCREATED;
-		irc_ctx->server_conf = irc_conf_get_server_at(common_ctx.irc_conf, eachServer);
+		filter_set_t ** channel_filters = compileFilters(irc_conf_get_server_at(common_ctx.irc_conf, eachServer));
+		if (!channel_filters) {
+			freeCommonCtx(&common_ctx);
+			log_stop();
+			return 1;
+		}
+		common_ctx.servers_ctx[eachServer] = newSession(&common_ctx, common_ctx.irc_conf, eachServer, channel_filters);
 	}
 
-	// ----------
+	if (!initWorkers(&common_ctx)) {
+		freeCommonCtx(&common_ctx);
+		log_stop();
+		return 1;
+	}
 
-	signal(SIGINT, SIGINThandler);
+	common_ctx.resolver = resolver_new(common_ctx.servers_count < RESOLVER_THREADS_MAX
+			? common_ctx.servers_count + 1 : RESOLVER_THREADS_MAX);
+	if (!common_ctx.resolver) {
+		freeCommonCtx(&common_ctx);
+		log_stop();
+		return 1;
+	}
+
+	if (!initStats(&common_ctx)) {
+		freeCommonCtx(&common_ctx);
+		log_stop();
+		return 1;
+	}
+
+	common_ctx.output = match_output_new(irc_conf_get_output_type(common_ctx.irc_conf),
+			irc_conf_get_output_path(common_ctx.irc_conf));
+	if (!common_ctx.output || !match_output_start(common_ctx.output)) {
+		freeCommonCtx(&common_ctx);
+		log_stop();
+		return 1;
+	}
+
+	const char * archive_path = irc_conf_get_archive_path(common_ctx.irc_conf);
+	if (archive_path) {
+		archive_limits_t limits;
+		getArchiveLimits(common_ctx.irc_conf, &limits);
+		common_ctx.archive = archive_new(archive_path, &limits);
+		if (!common_ctx.archive || !archive_start(common_ctx.archive)) {
+			freeCommonCtx(&common_ctx);
+			log_stop();
+			return 1;
+		}
+	}
 
 	// ----------
 
-	while (!g_askedToStop) {
-		doAction(&common_ctx, &doCreation);
-		doAction(&common_ctx, &doConnection);
+	signal(SIGINT, SIGINThandler);
+	signal(SIGHUP, SIGHUPhandler);
 
-		resetSelectData(&common_ctx);
-		doAction(&common_ctx, &doAddDescriptors);
-		doSelect(&common_ctx);
-		doAction(&common_ctx, &doProcessDescriptors);
+	// ----------
 
-		doAction(&common_ctx, &doDestroy);
-		doAction(&common_ctx, &doWait);
-	}
+	runWorkers(&common_ctx);
 
-	irc_conf_free(common_ctx.irc_conf);
-	free(common_ctx.servers_ctx);
+	freeCommonCtx(&common_ctx);
 
-	printf("End of program.\n");
+	log_info("End of program.");
+	log_stop();
 
 	return 0;
 }
-
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mpsc_queue.h"
+#include "mpsc_wait.h"
+#include "match_output.h"
+#include "log.h"
+
+// Events are written when that many bytes are pending, or when the queue is empty.
+#define MATCH_OUTPUT_BATCH_SIZE (64 * 1024)
+
+
+// ---
+
+struct _match_event_t {
+	char * buf;
+	size_t len;
+	size_t size;
+	int vars_count;
+};
+
+typedef struct {
+	mpsc_node_t node;
+	size_t len;
+	char buf[];
+} match_record_t;
+
+struct _match_output_t {
+	output_type_t type;
+	char * path;
+	int fd;
+
+	mpsc_queue_t queue;
+
+	mpsc_wait_t wait;
+	int stopping;
+
+	char * batch;
+	size_t batch_len;
+
+	pthread_t thread;
+	int started;
+};
+
+
+// ----- match_event
+
+match_event_t * match_event_new() {
+	match_event_t * result = calloc(1, sizeof(struct _match_event_t));
+	result->size = 1024;
+	result->buf = malloc(result->size);
+	return result;
+}
+
+void match_event_free(match_event_t * event) {
+	if (!event) {
+		return;
+	}
+	free(event->buf);
+	memset(event, 0, sizeof(struct _match_event_t));
+	free(event);
+}
+
+static void match_event_reserve(match_event_t * event, size_t len) {
+	if (event->len + len > event->size) {
+		while (event->len + len > event->size) {
+			event->size *= 2;
+		}
+		event->buf = realloc(event->buf, event->size);
+	}
+}
+
+static void match_event_append(match_event_t * event, const char * str, size_t len) {
+	match_event_reserve(event, len);
+	memcpy(event->buf + event->len, str, len);
+	event->len += len;
+}
+
+/*
+ * Append value as a JSON string.
+ */
+static void match_event_append_string(match_event_t * event, const char * value, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	// worst case : every byte escaped as \u00XX
+	match_event_reserve(event, len * 6 + 2);
+	char * dest = event->buf + event->len;
+	*dest++ = '"';
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) value[i];
+		if (c == '"' || c == '\\') {
+			*dest++ = '\\';
+			*dest++ = c;
+		} else if (c < 0x20) {
+			*dest++ = '\\';
+			*dest++ = 'u';
+			*dest++ = '0';
+			*dest++ = '0';
+			*dest++ = hex[c >> 4];
+			*dest++ = hex[c & 0xf];
+		} else {
+			*dest++ = c;
+		}
+	}
+	*dest++ = '"';
+	event->len = dest - event->buf;
+}
+
+static void match_event_append_field(match_event_t * event, const char * name, const char * value) {
+	match_event_append(event, ",\"", 2);
+	match_event_append(event, name, strlen(name));
+	match_event_append(event, "\":", 2);
+	value = value ? value : "";
+	match_event_append_string(event, value, strlen(value));
+}
+
+void match_event_begin(match_event_t * event, const char * server, const char * channel,
+		const char * nick, const char * filter) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	match_event_begin_at(event, (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec, server, channel, nick, filter);
+}
+
+void match_event_begin_at(match_event_t * event, uint64_t time_ns, const char * server, const char * channel,
+		const char * nick, const char * filter) {
+	time_t seconds = time_ns / 1000000000;
+	struct tm tm;
+	char time_buf[64];
+	gmtime_r(&seconds, &tm);
+	size_t time_len = strftime(time_buf, sizeof(time_buf), "{\"time\":\"%Y-%m-%dT%H:%M:%S", &tm);
+	time_len += snprintf(time_buf + time_len, sizeof(time_buf) - time_len, ".%03dZ\"",
+			(int) (time_ns / 1000000 % 1000));
+
+	event->len = 0;
+	event->vars_count = 0;
+	match_event_append(event, time_buf, time_len);
+	match_event_append_field(event, "server", server);
+	match_event_append_field(event, "channel", channel);
+	match_event_append_field(event, "nick", nick);
+	match_event_append_field(event, "filter", filter);
+	match_event_append(event, ",\"vars\":{", 9);
+}
+
+void match_event_add_var(match_event_t * event, const char * name, const char * value, int value_len) {
+	if (event->vars_count++) {
+		match_event_append(event, ",", 1);
+	}
+	name = name ? name : "";
+	match_event_append_string(event, name, strlen(name));
+	match_event_append(event, ":", 1);
+	match_event_append_string(event, value, value_len);
+}
+
+// ----- match_output
+
+match_output_t * match_output_new(output_type_t type, const char * path) {
+	match_output_t * result = calloc(1, sizeof(struct _match_output_t));
+	result->type = type;
+	result->path = path ? strdup(path) : NULL;
+	result->fd = -1;
+	mpsc_queue_init(&result->queue);
+	if (!mpsc_wait_init(&result->wait)) {
+		log_error("eventfd() : %s.", strerror(errno));
+		free(result->path);
+		free(result);
+		return NULL;
+	}
+	result->batch = malloc(MATCH_OUTPUT_BATCH_SIZE);
+	return result;
+}
+
+void match_output_free(match_output_t * output) {
+	if (!output) {
+		return;
+	}
+	match_output_stop(output);
+
+	// events published after the thread stopped
+	mpsc_node_t * node;
+	while ((node = mpsc_queue_pop(&output->queue))) {
+		free(node);
+	}
+	if (output->fd >= 0 && output->type != OUTPUT_STDOUT) {
+		close(output->fd);
+	}
+	mpsc_wait_destroy(&output->wait);
+	free(output->batch);
+	free(output->path);
+	memset(output, 0, sizeof(struct _match_output_t));
+	free(output);
+}
+
+static int match_output_open(match_output_t * output) {
+	switch (output->type) {
+	case OUTPUT_STDOUT:
+		output->fd = STDOUT_FILENO;
+		return 1;
+	case OUTPUT_FILE:
+		output->fd = open(output->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (output->fd < 0) {
+			log_error("could not open output %s : %s.", output->path, strerror(errno));
+			return 0;
+		}
+		return 1;
+	case OUTPUT_UNIX: {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(output->path) >= sizeof(addr.sun_path)) {
+			log_error("output socket path too long : %s.", output->path);
+			return 0;
+		}
+		strcpy(addr.sun_path, output->path);
+		output->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (output->fd < 0 || connect(output->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			log_error("could not connect to output %s : %s.", output->path, strerror(errno));
+			if (output->fd >= 0) {
+				close(output->fd);
+				output->fd = -1;
+			}
+			return 0;
+		}
+		return 1;
+	}
+	}
+	return 0;
+}
+
+static void match_output_flush(match_output_t * output) {
+	if (output->batch_len == 0) {
+		return;
+	}
+	if (output->type == OUTPUT_STDOUT) {
+		// through stdio, so that lines printed elsewhere are not interleaved
+		fwrite(output->batch, 1, output->batch_len, stdout);
+		fflush(stdout);
+		output->batch_len = 0;
+		return;
+	}
+
+	if (output->fd < 0 && !match_output_open(output)) {
+		log_error("%zu bytes of match events dropped.", output->batch_len);
+		output->batch_len = 0;
+		return;
+	}
+	size_t written = 0;
+	while (written < output->batch_len) {
+		// a socket whose consumer went away must not raise SIGPIPE
+		ssize_t result = output->type == OUTPUT_UNIX
+				? send(output->fd, output->batch + written, output->batch_len - written, MSG_NOSIGNAL)
+				: write(output->fd, output->batch + written, output->batch_len - written);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("could not write to output %s : %s, %zu bytes dropped.",
+					output->path, strerror(errno), output->batch_len - written);
+			// open it again for the next batch
+			close(output->fd);
+			output->fd = -1;
+			break;
+		}
+		written += result;
+	}
+	output->batch_len = 0;
+}
+
+static void match_output_write(match_output_t * output, match_record_t * record) {
+	if (output->batch_len + record->len > MATCH_OUTPUT_BATCH_SIZE) {
+		match_output_flush(output);
+	}
+	if (record->len > MATCH_OUTPUT_BATCH_SIZE) {
+		// larger than a batch : write it on its own
+		char * batch = output->batch;
+		output->batch = record->buf;
+		output->batch_len = record->len;
+		match_output_flush(output);
+		output->batch = batch;
+	} else {
+		memcpy(output->batch + output->batch_len, record->buf, record->len);
+		output->batch_len += record->len;
+	}
+	free(record);
+}
+
+static void * match_output_run(void * arg) {
+	match_output_t * output = (match_output_t *) arg;
+	for (;;) {
+		mpsc_node_t * node;
+		while ((node = mpsc_queue_pop(&output->queue))) {
+			match_output_write(output, (match_record_t *) node);
+		}
+		match_output_flush(output);
+
+		if (__atomic_load_n(&output->stopping, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+
+		node = mpsc_wait_pop(&output->wait, &output->queue, -1);
+		if (node) {
+			match_output_write(output, (match_record_t *) node);
+		}
+	}
+	return NULL;
+}
+
+int match_output_start(match_output_t * output) {
+	// a UNIX socket consumer may come later, the output retries on each batch
+	if (!match_output_open(output) && output->type != OUTPUT_UNIX) {
+		return 0;
+	}
+	int result = pthread_create(&output->thread, NULL, match_output_run, output);
+	if (result) {
+		log_error("could not start the output thread : %s.", strerror(result));
+		return 0;
+	}
+	output->started = 1;
+	return 1;
+}
+
+void match_output_stop(match_output_t * output) {
+	if (!output->started) {
+		return;
+	}
+	__atomic_store_n(&output->stopping, 1, __ATOMIC_SEQ_CST);
+	mpsc_wait_signal(&output->wait);
+	pthread_join(output->thread, NULL);
+	output->started = 0;
+}
+
+void match_output_publish(match_output_t * output, match_event_t * event) {
+	match_record_t * record = malloc(sizeof(match_record_t) + event->len + 3);
+	if (!record) {
+		log_error("match dropped, out of memory.");
+		return;
+	}
+	memcpy(record->buf, event->buf, event->len);
+	memcpy(record->buf + event->len, "}}\n", 3);
+	record->len = event->len + 3;
+
+	mpsc_queue_push(&output->queue, &record->node);
+	mpsc_wait_wake(&output->wait);
+}
@@ -0,0 +1,74 @@
+#ifndef MATCH_OUTPUT_H_
+#define MATCH_OUTPUT_H_
+
+#include <stdint.h>
+
+#include "conf.h"
+
+/*
+ * Output of the filter matches, as JSON lines :
+ * {"time":"...","server":"...","channel":"...","nick":"...","filter":"...","vars":{"name":"value",...}}
+ *
+ * Worker threads build their events in a reusable match_event_t and publish
+ * them through a lock-free queue. A single output thread writes them to the
+ * sink in batches, so matching never waits for the output.
+ */
+
+typedef struct _match_event_t match_event_t;
+typedef struct _match_output_t match_output_t;
+
+// ----- match_event
+
+/*
+ * An event builder. Its buffer is reused from one event to the next, it must
+ * only be used by one thread at a time.
+ */
+match_event_t * match_event_new();
+
+void match_event_free(match_event_t * event);
+
+/*
+ * Start a new event, timestamped now.
+ */
+void match_event_begin(match_event_t * event, const char * server, const char * channel,
+		const char * nick, const char * filter);
+
+/*
+ * Start a new event timestamped time_ns, since the epoch, e.g. the time of a
+ * replayed line.
+ */
+void match_event_begin_at(match_event_t * event, uint64_t time_ns, const char * server, const char * channel,
+		const char * nick, const char * filter);
+
+/*
+ * Add a captured variable, value does not need to be NUL terminated.
+ */
+void match_event_add_var(match_event_t * event, const char * name, const char * value, int value_len);
+
+// ----- match_output
+
+/*
+ * Create an output writing to stdout, or to the file or UNIX socket at path.
+ */
+match_output_t * match_output_new(output_type_t type, const char * path);
+
+void match_output_free(match_output_t * output);
+
+/*
+ * Open the sink and start the output thread. Return 0 on error.
+ */
+int match_output_start(match_output_t * output);
+
+/*
+ * Write the pending events, then stop the output thread.
+ */
+void match_output_stop(match_output_t * output);
+
+/*
+ * Queue a finished event. Can be called from any thread, event can be reused
+ * as soon as it returns.
+ */
+void match_output_publish(match_output_t * output, match_event_t * event);
+
+
+#endif /* MATCH_OUTPUT_H_ */
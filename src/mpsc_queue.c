@@ -0,0 +1,50 @@
+#include <stddef.h>
+
+#include "mpsc_queue.h"
+
+void mpsc_queue_init(mpsc_queue_t * queue) {
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(mpsc_queue_t * queue, mpsc_node_t * node) {
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	mpsc_node_t * prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+	// Between the exchange and this store, the queue is briefly disconnected.
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+mpsc_node_t * mpsc_queue_pop(mpsc_queue_t * queue) {
+	mpsc_node_t * tail = queue->tail;
+	mpsc_node_t * next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &queue->stub) {
+		if (!next) {
+			return NULL;
+		}
+		queue->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	mpsc_node_t * head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if (tail != head) {
+		// a push is in progress
+		return NULL;
+	}
+
+	// tail is the last node : put the stub behind it to be able to return it
+	mpsc_queue_push(queue, &queue->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+	return NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+/*
+ * Intrusive lock-free multi-producer single-consumer queue (D. Vyukov).
+ *
+ * Any thread may push, only one thread may pop. Nodes are embedded in the
+ * queued objects, the queue never allocates.
+ * The struct is public so that it can be embedded, its fields are private.
+ */
+
+typedef struct _mpsc_node_t {
+	struct _mpsc_node_t * next;
+} mpsc_node_t;
+
+typedef struct {
+	mpsc_node_t * head;
+	mpsc_node_t * tail;
+	mpsc_node_t stub;
+} mpsc_queue_t;
+
+void mpsc_queue_init(mpsc_queue_t * queue);
+
+void mpsc_queue_push(mpsc_queue_t * queue, mpsc_node_t * node);
+
+/*
+ * Return the oldest node, or NULL if the queue is empty or if a producer is
+ * in the middle of a push : the caller will see that node on a later call.
+ */
+mpsc_node_t * mpsc_queue_pop(mpsc_queue_t * queue);
+
+
+#endif /* MPSC_QUEUE_H_ */
@@ -0,0 +1,64 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "mpsc_wait.h"
+
+int mpsc_wait_init(mpsc_wait_t * wait) {
+	wait->sleeping = 0;
+	// non blocking : a producer must never wait for the consumer
+	wait->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	return wait->fd >= 0;
+}
+
+void mpsc_wait_destroy(mpsc_wait_t * wait) {
+	if (wait->fd >= 0) {
+		close(wait->fd);
+		wait->fd = -1;
+	}
+}
+
+void mpsc_wait_signal(mpsc_wait_t * wait) {
+	uint64_t one = 1;
+	if (write(wait->fd, &one, sizeof(one)) < 0) {
+		// the counter is full : already woken
+	}
+}
+
+void mpsc_wait_wake(mpsc_wait_t * wait) {
+	if (__atomic_exchange_n(&wait->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		mpsc_wait_signal(wait);
+	}
+}
+
+void mpsc_wait_prepare(mpsc_wait_t * wait) {
+	__atomic_store_n(&wait->sleeping, 1, __ATOMIC_SEQ_CST);
+}
+
+void mpsc_wait_cancel(mpsc_wait_t * wait) {
+	__atomic_store_n(&wait->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+void mpsc_wait_sleep(mpsc_wait_t * wait, int timeout_ms) {
+	struct pollfd pollfd = { wait->fd, POLLIN, 0 };
+	if (poll(&pollfd, 1, timeout_ms) > 0) {
+		uint64_t count;
+		if (read(wait->fd, &count, sizeof(count)) < 0) {
+			// EINTR, the caller checks its queue again anyway
+		}
+	}
+	mpsc_wait_cancel(wait);
+}
+
+mpsc_node_t * mpsc_wait_pop(mpsc_wait_t * wait, mpsc_queue_t * queue, int timeout_ms) {
+	mpsc_wait_prepare(wait);
+	mpsc_node_t * node = mpsc_queue_pop(queue);
+	if (node) {
+		mpsc_wait_cancel(wait);
+		return node;
+	}
+	mpsc_wait_sleep(wait, timeout_ms);
+	return NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef MPSC_WAIT_H_
+#define MPSC_WAIT_H_
+
+#include "mpsc_queue.h"
+
+/*
+ * Lets the consumer of a queue sleep when it is empty, and its producers wake
+ * it up without a system call while it is busy.
+ *
+ * The consumer announces it is going to sleep, then checks the queue again :
+ * a producer either sees the announce and wakes it up through an eventfd, or
+ * its push is seen by that last check.
+ * The struct is public so that it can be embedded, its fields are private.
+ */
+
+typedef struct {
+	int fd;
+	int sleeping;
+} mpsc_wait_t;
+
+/*
+ * Return 0 on error, with errno set.
+ */
+int mpsc_wait_init(mpsc_wait_t * wait);
+
+void mpsc_wait_destroy(mpsc_wait_t * wait);
+
+/*
+ * Producer side, after a push : wake the consumer up if it sleeps.
+ */
+void mpsc_wait_wake(mpsc_wait_t * wait);
+
+/*
+ * Wake the consumer up even if it is not sleeping yet, e.g. after asking it
+ * to stop : its next sleep returns at once.
+ */
+void mpsc_wait_signal(mpsc_wait_t * wait);
+
+/*
+ * Consumer side : return the next node of queue, or sleep until a producer
+ * wakes the consumer up or timeout_ms (-1 for none) elapses and return NULL.
+ */
+mpsc_node_t * mpsc_wait_pop(mpsc_wait_t * wait, mpsc_queue_t * queue, int timeout_ms);
+
+/*
+ * The steps of mpsc_wait_pop(), for a consumer whose queue is not an
+ * mpsc_queue_t : announce the sleep, check the queue again, then either
+ * cancel or sleep.
+ */
+void mpsc_wait_prepare(mpsc_wait_t * wait);
+
+void mpsc_wait_cancel(mpsc_wait_t * wait);
+
+void mpsc_wait_sleep(mpsc_wait_t * wait, int timeout_ms);
+
+
+#endif /* MPSC_WAIT_H_ */
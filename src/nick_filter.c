@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nick_filter.h"
+
+
+// ---
+
+typedef struct _nick_mask_t nick_mask_t;
+
+/*
+ * A case folded glob, matched against the user@host of an indexed nick, or
+ * against the whole sender (the nick alone if nick_only) of any nick.
+ */
+struct _nick_mask_t {
+	char * pattern;
+	int nick_only;
+	uint64_t * groups;
+	nick_mask_t * next;
+};
+
+typedef struct {
+	size_t hash;
+	// case folded
+	char * nick;
+	size_t nick_len;
+	// groups of the exact nick, NULL if it only has masks
+	uint64_t * groups;
+	nick_mask_t * masks;
+} nick_entry_t;
+
+struct _nick_filter_t {
+	irc_casemapping_t casemapping;
+	int words_count;
+
+	nick_entry_t * entries;
+	int entries_count;
+	int entries_capacity;
+
+	// open addressing, index + 1 of the entries, kept at most half full
+	int * slots;
+	size_t slots_mask;
+
+	// masks with a wildcard in the nick
+	nick_mask_t * wild_masks;
+};
+
+
+// -----
+
+static size_t nick_hash(irc_casemapping_t casemapping, const char * nick, size_t len) {
+	// FNV-1a on the case folded nick
+	size_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) irc_tolower(casemapping, (unsigned char) nick[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int nick_entry_equals(irc_casemapping_t casemapping, const nick_entry_t * entry, size_t hash,
+		const char * nick, size_t len) {
+	if (entry->hash != hash || entry->nick_len != len) {
+		return 0;
+	}
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if ((unsigned char) entry->nick[i] != irc_tolower(casemapping, (unsigned char) nick[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Match str, len bytes, against a case folded pattern.
+ */
+static int nick_glob(irc_casemapping_t casemapping, const char * pattern, const char * str, size_t len) {
+	const char * star = NULL;
+	size_t star_pos = 0;
+	size_t i = 0;
+	while (i < len) {
+		if (*pattern == '*') {
+			star = ++pattern;
+			star_pos = i;
+		} else if (*pattern && (*pattern == '?'
+				|| (unsigned char) *pattern == irc_tolower(casemapping, (unsigned char) str[i]))) {
+			pattern++;
+			i++;
+		} else if (star) {
+			// let the last star eat one more byte
+			pattern = star;
+			i = ++star_pos;
+		} else {
+			return 0;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return !*pattern;
+}
+
+static void nick_groups_set(uint64_t * groups, int group) {
+	groups[group / 64] |= (uint64_t) 1 << (group % 64);
+}
+
+static void nick_groups_or(uint64_t * groups, const uint64_t * other, int words_count) {
+	int i;
+	for (i = 0; i < words_count; i++) {
+		groups[i] |= other[i];
+	}
+}
+
+// ----- building
+
+static void nick_filter_grow(nick_filter_t * nick_filter) {
+	size_t slots_count = (nick_filter->slots_mask + 1) * 2;
+	free(nick_filter->slots);
+	nick_filter->slots = calloc(slots_count, sizeof(int));
+	nick_filter->slots_mask = slots_count - 1;
+	int i;
+	for (i = 0; i < nick_filter->entries_count; i++) {
+		size_t idx = nick_filter->entries[i].hash & nick_filter->slots_mask;
+		while (nick_filter->slots[idx]) {
+			idx = (idx + 1) & nick_filter->slots_mask;
+		}
+		nick_filter->slots[idx] = i + 1;
+	}
+}
+
+/*
+ * Entry of a case folded nick, created if needed.
+ */
+static nick_entry_t * nick_filter_get_entry(nick_filter_t * nick_filter, const char * nick, size_t len) {
+	size_t hash = nick_hash(nick_filter->casemapping, nick, len);
+	size_t idx = hash & nick_filter->slots_mask;
+	while (nick_filter->slots[idx]) {
+		nick_entry_t * entry = &nick_filter->entries[nick_filter->slots[idx] - 1];
+		if (nick_entry_equals(nick_filter->casemapping, entry, hash, nick, len)) {
+			return entry;
+		}
+		idx = (idx + 1) & nick_filter->slots_mask;
+	}
+
+	if (nick_filter->entries_count == nick_filter->entries_capacity) {
+		nick_filter->entries_capacity *= 2;
+		nick_filter->entries = realloc(nick_filter->entries, nick_filter->entries_capacity * sizeof(nick_entry_t));
+	}
+	nick_entry_t * entry = &nick_filter->entries[nick_filter->entries_count++];
+	memset(entry, 0, sizeof(nick_entry_t));
+	entry->hash = hash;
+	entry->nick = strndup(nick, len);
+	entry->nick_len = len;
+	nick_filter->slots[idx] = nick_filter->entries_count;
+	if ((size_t) nick_filter->entries_count * 2 > nick_filter->slots_mask) {
+		nick_filter_grow(nick_filter);
+	}
+	return entry;
+}
+
+/*
+ * Add group to the mask of pattern in the list, created if needed.
+ */
+static void nick_filter_add_mask(nick_filter_t * nick_filter, nick_mask_t ** masks, const char * pattern,
+		int nick_only, int group) {
+	nick_mask_t * mask;
+	for (mask = *masks; mask; mask = mask->next) {
+		if (mask->nick_only == nick_only && !strcmp(mask->pattern, pattern)) {
+			break;
+		}
+	}
+	if (!mask) {
+		mask = calloc(1, sizeof(nick_mask_t));
+		mask->pattern = strdup(pattern);
+		mask->nick_only = nick_only;
+		mask->groups = calloc(nick_filter->words_count, sizeof(uint64_t));
+		mask->next = *masks;
+		*masks = mask;
+	}
+	nick_groups_set(mask->groups, group);
+}
+
+static void nick_masks_free(nick_mask_t * mask) {
+	while (mask) {
+		nick_mask_t * next = mask->next;
+		free(mask->pattern);
+		free(mask->groups);
+		free(mask);
+		mask = next;
+	}
+}
+
+nick_filter_t * nick_filter_new(int groups_count, irc_casemapping_t casemapping) {
+	nick_filter_t * result = calloc(1, sizeof(struct _nick_filter_t));
+	result->casemapping = casemapping;
+	result->words_count = groups_count > 0 ? (groups_count + 63) / 64 : 1;
+	result->entries_capacity = 16;
+	result->entries = calloc(result->entries_capacity, sizeof(nick_entry_t));
+	result->slots = calloc(32, sizeof(int));
+	result->slots_mask = 31;
+	return result;
+}
+
+void nick_filter_free(nick_filter_t * nick_filter) {
+	if (!nick_filter) {
+		return;
+	}
+	int i;
+	for (i = 0; i < nick_filter->entries_count; i++) {
+		free(nick_filter->entries[i].nick);
+		free(nick_filter->entries[i].groups);
+		nick_masks_free(nick_filter->entries[i].masks);
+	}
+	free(nick_filter->entries);
+	free(nick_filter->slots);
+	nick_masks_free(nick_filter->wild_masks);
+	memset(nick_filter, 0, sizeof(struct _nick_filter_t));
+	free(nick_filter);
+}
+
+void nick_filter_add(nick_filter_t * nick_filter, const char * pattern, int group) {
+	char * folded = strdup(pattern);
+	char * p;
+	for (p = folded; *p; p++) {
+		*p = irc_tolower(nick_filter->casemapping, (unsigned char) *p);
+	}
+	char * bang = strchr(folded, '!');
+	size_t nick_len = bang ? (size_t) (bang - folded) : strlen(folded);
+
+	if (memchr(folded, '*', nick_len) || memchr(folded, '?', nick_len)) {
+		nick_filter_add_mask(nick_filter, &nick_filter->wild_masks, folded, !bang, group);
+	} else {
+		nick_entry_t * entry = nick_filter_get_entry(nick_filter, folded, nick_len);
+		if (!bang || !strcmp(bang + 1, "*") || !strcmp(bang + 1, "*@*")) {
+			if (!entry->groups) {
+				entry->groups = calloc(nick_filter->words_count, sizeof(uint64_t));
+			}
+			nick_groups_set(entry->groups, group);
+		} else {
+			nick_filter_add_mask(nick_filter, &entry->masks, bang + 1, 0, group);
+		}
+	}
+	free(folded);
+}
+
+// -----
+
+int nick_filter_get_words_count(const nick_filter_t * nick_filter) {
+	return nick_filter->words_count;
+}
+
+int nick_filter_match(const nick_filter_t * nick_filter, const char * prefix, uint64_t * groups) {
+	irc_casemapping_t casemapping = nick_filter->casemapping;
+	memset(groups, 0, nick_filter->words_count * sizeof(uint64_t));
+	size_t nick_len = strcspn(prefix, "!@");
+	const char * userhost = prefix[nick_len] == '!' ? prefix + nick_len + 1 : NULL;
+	int matched = 0;
+
+	size_t hash = nick_hash(casemapping, prefix, nick_len);
+	size_t idx = hash & nick_filter->slots_mask;
+	while (nick_filter->slots[idx]) {
+		const nick_entry_t * entry = &nick_filter->entries[nick_filter->slots[idx] - 1];
+		if (nick_entry_equals(casemapping, entry, hash, prefix, nick_len)) {
+			if (entry->groups) {
+				nick_groups_or(groups, entry->groups, nick_filter->words_count);
+				matched = 1;
+			}
+			const nick_mask_t * mask;
+			for (mask = entry->masks; mask && userhost; mask = mask->next) {
+				if (nick_glob(casemapping, mask->pattern, userhost, strlen(userhost))) {
+					nick_groups_or(groups, mask->groups, nick_filter->words_count);
+					matched = 1;
+				}
+			}
+			break;
+		}
+		idx = (idx + 1) & nick_filter->slots_mask;
+	}
+
+	const nick_mask_t * mask;
+	for (mask = nick_filter->wild_masks; mask; mask = mask->next) {
+		if (nick_glob(casemapping, mask->pattern, prefix, mask->nick_only ? nick_len : strlen(prefix))) {
+			nick_groups_or(groups, mask->groups, nick_filter->words_count);
+			matched = 1;
+		}
+	}
+	return matched;
+}
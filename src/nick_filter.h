@@ -0,0 +1,43 @@
+#ifndef NICK_FILTER_H_
+#define NICK_FILTER_H_
+
+#include <stdint.h>
+
+#include "casemap.h"
+
+/*
+ * Set of watched senders : nicks and nick!user@host masks, compared under the
+ * casemapping of the server. '*' and '?' are wildcards, a pattern without '!'
+ * only applies to the nick.
+ *
+ * Every pattern belongs to one or more groups, and matching a sender returns
+ * the groups of all its matching patterns as a bitset. Exact nicks and the
+ * masks of a literal nick are indexed by their case folded nick : a sender
+ * that is not watched costs one hash probe, only masks with a wildcard in the
+ * nick are tried on every line.
+ */
+
+typedef struct _nick_filter_t nick_filter_t;
+
+nick_filter_t * nick_filter_new(int groups_count, irc_casemapping_t casemapping);
+
+void nick_filter_free(nick_filter_t * nick_filter);
+
+/*
+ * Add pattern to group, 0 <= group < groups_count.
+ */
+void nick_filter_add(nick_filter_t * nick_filter, const char * pattern, int group);
+
+/*
+ * Words of the bitsets filled by nick_filter_match().
+ */
+int nick_filter_get_words_count(const nick_filter_t * nick_filter);
+
+/*
+ * Set the bits of groups, nick_filter_get_words_count() words, to the groups
+ * matching prefix, nick!user@host or a bare nick. Return 0 if none matches.
+ */
+int nick_filter_match(const nick_filter_t * nick_filter, const char * prefix, uint64_t * groups);
+
+
+#endif /* NICK_FILTER_H_ */
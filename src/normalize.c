@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NORMALIZE_X86 1
+#endif
+
+#include "normalize.h"
+
+// formatting codes
+#define IRC_BOLD 0x02
+#define IRC_COLOR 0x03
+#define IRC_HEX_COLOR 0x04
+#define IRC_RESET 0x0f
+#define IRC_MONOSPACE 0x11
+#define IRC_REVERSE 0x16
+#define IRC_ITALICS 0x1d
+#define IRC_STRIKETHROUGH 0x1e
+#define IRC_UNDERLINE 0x1f
+
+// colors are ^Cfg[,bg] with 1 or 2 digits, ^Drrggbb[,rrggbb]
+#define COLOR_DIGITS_MAX 2
+#define HEX_COLOR_DIGITS_MAX 6
+
+/*
+ * Normalize len bytes of src, return the length of the result.
+ * stripped and folded have room for len bytes.
+ */
+typedef size_t (*normalize_func_t)(const unsigned char * src, size_t len, char * stripped, char * folded);
+
+
+// -----
+
+static int fold(int c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static int is_digit(int c) {
+    return c >= '0' && c <= '9';
+}
+
+static int is_hex_digit(int c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/*
+ * Index after the at most max digits at src[i].
+ */
+static size_t skip_digits(const unsigned char * src, size_t i, size_t len, int max, int (*is_valid)(int)) {
+    size_t end = i;
+    while (end < len && end - i < (size_t) max && is_valid(src[end])) {
+        end++;
+    }
+    return end;
+}
+
+/*
+ * Index after a color code starting at src[i], past its control byte.
+ */
+static size_t skip_color(const unsigned char * src, size_t i, size_t len, int max, int (*is_valid)(int)) {
+    size_t end = skip_digits(src, i, len, max, is_valid);
+    // a background needs a foreground, and a comma alone is text
+    if (end > i && end + 1 < len && src[end] == ',' && is_valid(src[end + 1])) {
+        end = skip_digits(src, end + 1, len, max, is_valid);
+    }
+    return end;
+}
+
+/*
+ * Drop the formatting code at src[i], or copy the control byte if it is not
+ * one. Return the index after it.
+ */
+static size_t normalize_control(const unsigned char * src, size_t i, size_t len, char * stripped, char * folded,
+        size_t * out) {
+    unsigned char c = src[i++];
+    switch (c) {
+    case IRC_COLOR:
+        return skip_color(src, i, len, COLOR_DIGITS_MAX, is_digit);
+    case IRC_HEX_COLOR:
+        return skip_color(src, i, len, HEX_COLOR_DIGITS_MAX, is_hex_digit);
+    case IRC_BOLD:
+    case IRC_RESET:
+    case IRC_MONOSPACE:
+    case IRC_REVERSE:
+    case IRC_ITALICS:
+    case IRC_STRIKETHROUGH:
+    case IRC_UNDERLINE:
+        return i;
+    default:
+        stripped[*out] = c;
+        folded[*out] = c;
+        (*out)++;
+        return i;
+    }
+}
+
+static size_t normalize_scalar(const unsigned char * src, size_t len, char * stripped, char * folded) {
+    size_t i = 0;
+    size_t out = 0;
+    while (i < len) {
+        unsigned char c = src[i];
+        if (c < 0x20) {
+            i = normalize_control(src, i, len, stripped, folded, &out);
+            continue;
+        }
+        stripped[out] = c;
+        folded[out] = fold(c);
+        out++;
+        i++;
+    }
+    return out;
+}
+
+#ifdef NORMALIZE_X86
+
+/*
+ * A whole chunk is stored even when it holds a control byte : only the bytes
+ * before it are kept, the rest is written over. The output never gets ahead
+ * of the input, so the stores stay inside the len bytes of the buffers.
+ */
+
+static size_t normalize_sse2(const unsigned char * src, size_t len, char * stripped, char * folded) {
+    const __m128i control_max = _mm_set1_epi8(0x1f);
+    // 'A'..'Z' moved to the lowest signed bytes
+    const __m128i upper_base = _mm_set1_epi8((char) ('A' + 128));
+    const __m128i upper_limit = _mm_set1_epi8(-128 + 26);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    size_t out = 0;
+    while (i + 16 <= len) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i upper = _mm_cmplt_epi8(_mm_sub_epi8(chunk, upper_base), upper_limit);
+        _mm_storeu_si128((__m128i *) (stripped + out), chunk);
+        _mm_storeu_si128((__m128i *) (folded + out), _mm_add_epi8(chunk, _mm_and_si128(upper, case_bit)));
+
+        unsigned int controls = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(chunk, control_max), chunk));
+        if (!controls) {
+            i += 16;
+            out += 16;
+            continue;
+        }
+        int kept = __builtin_ctz(controls);
+        i += kept;
+        out += kept;
+        i = normalize_control(src, i, len, stripped, folded, &out);
+    }
+    return out + normalize_scalar(src + i, len - i, stripped + out, folded + out);
+}
+
+__attribute__((target("avx2")))
+static size_t normalize_avx2(const unsigned char * src, size_t len, char * stripped, char * folded) {
+    const __m256i control_max = _mm256_set1_epi8(0x1f);
+    const __m256i upper_base = _mm256_set1_epi8((char) ('A' + 128));
+    const __m256i upper_limit = _mm256_set1_epi8(-128 + 26);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    size_t out = 0;
+    while (i + 32 <= len) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i upper = _mm256_cmpgt_epi8(upper_limit, _mm256_sub_epi8(chunk, upper_base));
+        _mm256_storeu_si256((__m256i *) (stripped + out), chunk);
+        _mm256_storeu_si256((__m256i *) (folded + out), _mm256_add_epi8(chunk, _mm256_and_si256(upper, case_bit)));
+
+        unsigned int controls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control_max), chunk));
+        if (!controls) {
+            i += 32;
+            out += 32;
+            continue;
+        }
+        int kept = __builtin_ctz(controls);
+        i += kept;
+        out += kept;
+        i = normalize_control(src, i, len, stripped, folded, &out);
+    }
+    return out + normalize_sse2(src + i, len - i, stripped + out, folded + out);
+}
+
+#endif
+
+static normalize_func_t normalize_resolve() {
+#ifdef NORMALIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return normalize_avx2;
+    }
+    return normalize_sse2;
+#else
+    return normalize_scalar;
+#endif
+}
+
+// -----
+
+void normalize_line(normalized_line_t * line, const char * raw) {
+    // resolved on first use, every thread finds the same function
+    static normalize_func_t normalize_func;
+    normalize_func_t func = __atomic_load_n(&normalize_func, __ATOMIC_RELAXED);
+    if (!func) {
+        func = normalize_resolve();
+        __atomic_store_n(&normalize_func, func, __ATOMIC_RELAXED);
+    }
+
+    size_t len = strnlen(raw, NORMALIZE_LINE_MAX - 1);
+    line->raw = raw;
+    line->len = func((const unsigned char *) raw, len, line->stripped, line->folded);
+    line->stripped[line->len] = '\0';
+    line->folded[line->len] = '\0';
+}
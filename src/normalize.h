@@ -0,0 +1,40 @@
+#ifndef NORMALIZE_H_
+#define NORMALIZE_H_
+
+#include <stddef.h>
+
+/*
+ * Normalization of the text of channel lines before filter matching.
+ *
+ * A single pass drops the IRC formatting codes (bold, color, italics,
+ * underline, reverse, ...) and folds ASCII upper case, so that the filters
+ * are compiled case sensitively and match the folded text, whatever colors
+ * the sender used. The stripped text is kept along : folding does not move
+ * any byte, so the offsets of a match in the folded text are the offsets of
+ * the original case in the stripped one.
+ *
+ * 16 or 32 bytes are processed at once with SSE2 or AVX2 when the CPU has
+ * them, bytes at a time otherwise.
+ */
+
+// Longest text kept, an IRC message is at most 512 bytes.
+#define NORMALIZE_LINE_MAX 512
+
+typedef struct {
+    const char * raw;
+    // raw without its formatting codes
+    char stripped[NORMALIZE_LINE_MAX];
+    // stripped, ASCII case folded
+    char folded[NORMALIZE_LINE_MAX];
+    // of stripped and folded
+    size_t len;
+} normalized_line_t;
+
+/*
+ * Normalize raw into line, which keeps pointing to it. raw is truncated to
+ * NORMALIZE_LINE_MAX - 1 bytes.
+ */
+void normalize_line(normalized_line_t * line, const char * raw);
+
+
+#endif /* NORMALIZE_H_ */
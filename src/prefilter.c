@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "prefilter.h"
+
+#define PREFILTER_ROOT 0
+
+// Literals shorter than that would match nearly every line.
+#define PREFILTER_LITERAL_MIN 2
+
+
+// ---
+
+typedef struct {
+    char * literal;
+    int id;
+} prefilter_pattern_t;
+
+struct _prefilter_t {
+    prefilter_pattern_t * patterns;
+    int patterns_count;
+    int patterns_capacity;
+
+    // byte -> input class, class 0 is every byte absent from the literals
+    unsigned char classes[256];
+    int classes_count;
+
+    // transitions, states_count * classes_count, already resolved with the failure links
+    int * transitions;
+    int states_count;
+
+    // ids whose literal ends in a state : outputs[output_heads[s]], chained with output_next
+    int * output_heads;
+    int * output_next;
+    int * output_ids;
+    // closest state on the failure chain having outputs
+    int * dict_links;
+};
+
+
+// -----
+
+static int fold(int c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+prefilter_t * prefilter_new() {
+    prefilter_t * result = calloc(1, sizeof(struct _prefilter_t));
+    return result;
+}
+
+static void prefilter_clear_automaton(prefilter_t * prefilter) {
+    free(prefilter->transitions);
+    free(prefilter->output_heads);
+    free(prefilter->output_next);
+    free(prefilter->output_ids);
+    free(prefilter->dict_links);
+    prefilter->transitions = NULL;
+    prefilter->output_heads = NULL;
+    prefilter->output_next = NULL;
+    prefilter->output_ids = NULL;
+    prefilter->dict_links = NULL;
+    prefilter->states_count = 0;
+}
+
+void prefilter_free(prefilter_t * prefilter) {
+    if (!prefilter) {
+        return;
+    }
+    int i;
+    for (i = 0; i < prefilter->patterns_count; i++) {
+        free(prefilter->patterns[i].literal);
+    }
+    free(prefilter->patterns);
+    prefilter_clear_automaton(prefilter);
+    memset(prefilter, 0, sizeof(struct _prefilter_t));
+    free(prefilter);
+}
+
+void prefilter_add(prefilter_t * prefilter, const char * literal, int id) {
+    if (!literal[0]) {
+        return;
+    }
+    if (prefilter->patterns_count == prefilter->patterns_capacity) {
+        prefilter->patterns_capacity = prefilter->patterns_capacity ? prefilter->patterns_capacity * 2 : 8;
+        prefilter->patterns = realloc(prefilter->patterns, prefilter->patterns_capacity * sizeof(prefilter_pattern_t));
+    }
+    prefilter_pattern_t * pattern = &prefilter->patterns[prefilter->patterns_count++];
+    pattern->literal = strdup(literal);
+    pattern->id = id;
+
+    char * p;
+    for (p = pattern->literal; *p; p++) {
+        *p = fold((unsigned char) *p);
+    }
+}
+
+int prefilter_compile(prefilter_t * prefilter) {
+    prefilter_clear_automaton(prefilter);
+    if (prefilter->patterns_count == 0) {
+        return 0;
+    }
+
+    // Input classes
+    memset(prefilter->classes, 0, sizeof(prefilter->classes));
+    prefilter->classes_count = 1;
+    int max_states = 1;
+    int i;
+    for (i = 0; i < prefilter->patterns_count; i++) {
+        const unsigned char * p;
+        for (p = (const unsigned char *) prefilter->patterns[i].literal; *p; p++) {
+            if (!prefilter->classes[*p]) {
+                prefilter->classes[*p] = prefilter->classes_count++;
+            }
+            max_states++;
+        }
+    }
+    // upper case letters share the class of their lower case
+    int c;
+    for (c = 'A'; c <= 'Z'; c++) {
+        prefilter->classes[c] = prefilter->classes[fold(c)];
+    }
+
+    int classes_count = prefilter->classes_count;
+    prefilter->transitions = malloc((size_t) max_states * classes_count * sizeof(int));
+    for (i = 0; i < max_states * classes_count; i++) {
+        prefilter->transitions[i] = -1;
+    }
+    prefilter->output_heads = malloc(max_states * sizeof(int));
+    prefilter->dict_links = calloc(max_states, sizeof(int));
+    for (i = 0; i < max_states; i++) {
+        prefilter->output_heads[i] = -1;
+    }
+    prefilter->output_next = malloc(prefilter->patterns_count * sizeof(int));
+    prefilter->output_ids = malloc(prefilter->patterns_count * sizeof(int));
+
+    // Trie
+    int * transitions = prefilter->transitions;
+    prefilter->states_count = 1;
+    for (i = 0; i < prefilter->patterns_count; i++) {
+        int state = PREFILTER_ROOT;
+        const unsigned char * p;
+        for (p = (const unsigned char *) prefilter->patterns[i].literal; *p; p++) {
+            int * next = &transitions[state * classes_count + prefilter->classes[*p]];
+            if (*next < 0) {
+                *next = prefilter->states_count++;
+            }
+            state = *next;
+        }
+        prefilter->output_ids[i] = prefilter->patterns[i].id;
+        prefilter->output_next[i] = prefilter->output_heads[state];
+        prefilter->output_heads[state] = i;
+    }
+
+    // Failure links, breadth first, resolved into the transitions
+    int * fail = calloc(prefilter->states_count, sizeof(int));
+    int * queue = malloc(prefilter->states_count * sizeof(int));
+    int queue_head = 0, queue_tail = 0;
+    queue[queue_tail++] = PREFILTER_ROOT;
+    while (queue_head < queue_tail) {
+        int state = queue[queue_head++];
+        for (c = 0; c < classes_count; c++) {
+            int * next = &transitions[state * classes_count + c];
+            if (*next < 0) {
+                *next = state == PREFILTER_ROOT ? PREFILTER_ROOT : transitions[fail[state] * classes_count + c];
+                continue;
+            }
+            int child = *next;
+            fail[child] = state == PREFILTER_ROOT ? PREFILTER_ROOT : transitions[fail[state] * classes_count + c];
+            prefilter->dict_links[child] = prefilter->output_heads[fail[child]] >= 0
+                ? fail[child] : prefilter->dict_links[fail[child]];
+            queue[queue_tail++] = child;
+        }
+    }
+    free(queue);
+    free(fail);
+    return 1;
+}
+
+void prefilter_scan(const prefilter_t * prefilter, const char * text, unsigned int generation, unsigned int * marks) {
+    if (!prefilter->transitions) {
+        return;
+    }
+    const int * transitions = prefilter->transitions;
+    int classes_count = prefilter->classes_count;
+    int state = PREFILTER_ROOT;
+    const unsigned char * p;
+    for (p = (const unsigned char *) text; *p; p++) {
+        state = transitions[state * classes_count + prefilter->classes[*p]];
+        int output_state;
+        for (output_state = state; output_state != PREFILTER_ROOT; output_state = prefilter->dict_links[output_state]) {
+            int output;
+            for (output = prefilter->output_heads[output_state]; output >= 0; output = prefilter->output_next[output]) {
+                marks[prefilter->output_ids[output]] = generation;
+            }
+        }
+    }
+}
+
+// ----- literal extraction
+
+/*
+ * Skip a bracket expression starting at regex[i] == '['. Return the index after it.
+ */
+static size_t skip_bracket(const char * regex, size_t i) {
+    i++;
+    if (regex[i] == '^') {
+        i++;
+    }
+    if (regex[i] == ']') {
+        i++;
+    }
+    while (regex[i] && regex[i] != ']') {
+        if (regex[i] == '[' && (regex[i + 1] == ':' || regex[i + 1] == '.' || regex[i + 1] == '=')) {
+            char delimiter = regex[i + 1];
+            i += 2;
+            while (regex[i] && !(regex[i] == delimiter && regex[i + 1] == ']')) {
+                i++;
+            }
+            if (regex[i]) {
+                i += 2;
+            }
+        } else {
+            i++;
+        }
+    }
+    return regex[i] ? i + 1 : i;
+}
+
+/*
+ * Skip a bound starting at regex[i] == '{'. Return the index after it.
+ */
+static size_t skip_bound(const char * regex, size_t i) {
+    while (regex[i] && regex[i] != '}') {
+        i++;
+    }
+    return regex[i] ? i + 1 : i;
+}
+
+size_t prefilter_required_literal(const char * regex, char * literal, size_t size) {
+    char run[512];
+    size_t run_len = 0;
+    size_t best_len = 0;
+    int depth = 0;
+    size_t i = 0;
+
+    literal[0] = '\0';
+
+#define END_RUN() do { \
+        if (run_len > best_len && run_len < size) { \
+            memcpy(literal, run, run_len); \
+            literal[run_len] = '\0'; \
+            best_len = run_len; \
+        } \
+        run_len = 0; \
+    } while (0)
+
+    while (regex[i]) {
+        char c = regex[i];
+
+        if (depth > 0) {
+            // inside a group : it may be optional or hold alternatives, skip it
+            if (c == '\\' && regex[i + 1]) {
+                i += 2;
+            } else if (c == '[') {
+                i = skip_bracket(regex, i);
+            } else {
+                if (c == '(') {
+                    depth++;
+                } else if (c == ')') {
+                    depth--;
+                }
+                i++;
+            }
+            continue;
+        }
+
+        int literal_char = -1;
+        switch (c) {
+        case '|':
+            // top level alternatives : nothing is required
+            literal[0] = '\0';
+            return 0;
+        case '(':
+            END_RUN();
+            depth = 1;
+            i++;
+            continue;
+        case '[':
+            END_RUN();
+            i = skip_bracket(regex, i);
+            continue;
+        case '{':
+            END_RUN();
+            i = skip_bound(regex, i);
+            continue;
+        case '.': case '^': case '$': case '*': case '+': case '?': case ')':
+            END_RUN();
+            i++;
+            continue;
+        case '\\':
+            if (!regex[i + 1] || isalnum((unsigned char) regex[i + 1]) || regex[i + 1] == '<' || regex[i + 1] == '>'
+                    || regex[i + 1] == '`' || regex[i + 1] == '\'') {
+                // back reference or GNU operator
+                END_RUN();
+                i += regex[i + 1] ? 2 : 1;
+                continue;
+            }
+            literal_char = (unsigned char) regex[i + 1];
+            i += 2;
+            break;
+        default:
+            literal_char = (unsigned char) c;
+            i++;
+            break;
+        }
+
+        // the atom is a literal character, look at its quantifier
+        char quantifier = regex[i];
+        if (literal_char >= 0x80 || quantifier == '*' || quantifier == '?' || quantifier == '{') {
+            // optional or repeated an unknown number of times
+            END_RUN();
+            continue;
+        }
+        if (run_len < sizeof(run)) {
+            run[run_len++] = fold(literal_char);
+        }
+        if (quantifier == '+') {
+            // required once, but what follows is not adjacent to it
+            END_RUN();
+        }
+    }
+    END_RUN();
+
+#undef END_RUN
+
+    if (best_len < PREFILTER_LITERAL_MIN) {
+        literal[0] = '\0';
+        return 0;
+    }
+    return best_len;
+}
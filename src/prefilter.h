@@ -0,0 +1,44 @@
+#ifndef PREFILTER_H_
+#define PREFILTER_H_
+
+#include <stddef.h>
+
+/*
+ * Multi-pattern literal prefilter (Aho-Corasick).
+ *
+ * Each pattern is a literal that must appear in a line for a regex to match it.
+ * A single pass over the line finds every pattern it contains, so only the
+ * regexes whose literal was found need to run. Matching is ASCII case
+ * insensitive, like the filter regexes.
+ */
+
+typedef struct _prefilter_t prefilter_t;
+
+prefilter_t * prefilter_new();
+
+void prefilter_free(prefilter_t * prefilter);
+
+/*
+ * Add literal, reported as id by prefilter_scan(). Must be called before prefilter_compile().
+ */
+void prefilter_add(prefilter_t * prefilter, const char * literal, int id);
+
+/*
+ * Build the automaton. Return 0 if there is no pattern.
+ */
+int prefilter_compile(prefilter_t * prefilter);
+
+/*
+ * Set marks[id] to generation for each id whose literal appears in text.
+ */
+void prefilter_scan(const prefilter_t * prefilter, const char * text, unsigned int generation, unsigned int * marks);
+
+/*
+ * Find the longest literal that any match of the POSIX extended regex must
+ * contain, case folded, and copy it to literal.
+ * Return its length, 0 if none could be found.
+ */
+size_t prefilter_required_literal(const char * regex, char * literal, size_t size);
+
+
+#endif /* PREFILTER_H_ */
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define REGEX_BACKEND_X86 1
+#endif
+
+#include "regex_backend.h"
+
+// Longest literal handled by the literal backend, an IRC message is at most 512 bytes.
+#define LITERAL_MAX 512
+
+/*
+ * Return the first occurrence of the case folded needle, len > 0 bytes, in
+ * the text_len bytes of text, NULL if there is none. Text is folded first if
+ * icase.
+ */
+typedef const char * (*literal_search_func_t)(const char * text, size_t text_len, const char * needle, size_t len,
+        int icase);
+
+typedef struct {
+    regex_class_t regex_class;
+    // case folded if icase
+    char * literal;
+    size_t len;
+    int icase;
+    // the regex ends with ".*" : a match runs to the end of the text
+    int to_end;
+} literal_state_t;
+
+static const char * regex_class_names[] = { "regex", "substring", "prefix", "suffix", "exact" };
+
+
+// -----
+
+static int fold(int c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/*
+ * Compare len bytes of text with the case folded literal.
+ */
+static int literal_equals(const char * text, const char * literal, size_t len, int icase) {
+    if (!icase) {
+        return !memcmp(text, literal, len);
+    }
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (fold((unsigned char) text[i]) != (unsigned char) literal[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_quantifier(char c) {
+    return c == '*' || c == '+' || c == '?' || c == '{';
+}
+
+/*
+ * regex_classify(), also telling whether the regex ends with ".*".
+ */
+static regex_class_t classify(const char * regex, char * literal, size_t size, int * to_end) {
+    size_t len = 0;
+    int anchored_start = 0;
+    int anchored_end = 0;
+    size_t i = 0;
+
+    *to_end = 0;
+    if (regex[i] == '^') {
+        anchored_start = 1;
+        i++;
+    }
+    while (regex[i]) {
+        int c = (unsigned char) regex[i];
+        if (c == '.' && regex[i + 1] == '*' && (!regex[i + 2] || !strcmp(regex + i + 2, "$"))) {
+            // ".*" and ".*$" match the rest of the line
+            *to_end = 1;
+            break;
+        }
+        if (c == '$' && !regex[i + 1]) {
+            anchored_end = 1;
+            break;
+        }
+        if (c == '\\') {
+            c = (unsigned char) regex[i + 1];
+            if (!c || isalnum(c) || c == '<' || c == '>' || c == '`' || c == '\'') {
+                // back reference or GNU operator
+                return REGEX_CLASS_REGEX;
+            }
+            i += 2;
+        } else if (strchr(".[](){}|*+?^$", c)) {
+            return REGEX_CLASS_REGEX;
+        } else {
+            i++;
+        }
+        if (c >= 0x80 || is_quantifier(regex[i]) || len + 1 >= size) {
+            return REGEX_CLASS_REGEX;
+        }
+        literal[len++] = c;
+    }
+    if (len == 0) {
+        return REGEX_CLASS_REGEX;
+    }
+    literal[len] = '\0';
+
+    if (anchored_start) {
+        return anchored_end ? REGEX_CLASS_EXACT : REGEX_CLASS_PREFIX;
+    }
+    return anchored_end ? REGEX_CLASS_SUFFIX : REGEX_CLASS_SUBSTRING;
+}
+
+// ----- substring search
+
+static const char * literal_search_scalar(const char * text, size_t text_len, const char * needle, size_t len,
+        int icase) {
+    size_t i;
+    for (i = 0; i + len <= text_len; i++) {
+        if ((icase ? fold((unsigned char) text[i]) : (unsigned char) text[i]) == (unsigned char) needle[0]
+                && literal_equals(text + i, needle, len, icase)) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef REGEX_BACKEND_X86
+
+/*
+ * Every position of a chunk is tested at once against the first and the last
+ * byte of the needle, only the positions where both are found are compared.
+ */
+
+static __m128i fold_sse2(__m128i chunk) {
+    // 'A'..'Z' moved to the lowest signed bytes
+    __m128i upper = _mm_cmplt_epi8(_mm_sub_epi8(chunk, _mm_set1_epi8((char) ('A' + 128))),
+            _mm_set1_epi8(-128 + 26));
+    return _mm_add_epi8(chunk, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static const char * literal_search_sse2(const char * text, size_t text_len, const char * needle, size_t len,
+        int icase) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[len - 1]);
+    size_t i = 0;
+    while (i + len - 1 + 16 <= text_len) {
+        __m128i first_chunk = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i last_chunk = _mm_loadu_si128((const __m128i *) (text + i + len - 1));
+        if (icase) {
+            first_chunk = fold_sse2(first_chunk);
+            last_chunk = fold_sse2(last_chunk);
+        }
+        unsigned int candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first_chunk, first),
+                _mm_cmpeq_epi8(last_chunk, last)));
+        while (candidates) {
+            int offset = __builtin_ctz(candidates);
+            if (literal_equals(text + i + offset, needle, len, icase)) {
+                return text + i + offset;
+            }
+            candidates &= candidates - 1;
+        }
+        i += 16;
+    }
+    return literal_search_scalar(text + i, text_len - i, needle, len, icase);
+}
+
+__attribute__((target("avx2")))
+static __m256i fold_avx2(__m256i chunk) {
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26),
+            _mm256_sub_epi8(chunk, _mm256_set1_epi8((char) ('A' + 128))));
+    return _mm256_add_epi8(chunk, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static const char * literal_search_avx2(const char * text, size_t text_len, const char * needle, size_t len,
+        int icase) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+    size_t i = 0;
+    while (i + len - 1 + 32 <= text_len) {
+        __m256i first_chunk = _mm256_loadu_si256((const __m256i *) (text + i));
+        __m256i last_chunk = _mm256_loadu_si256((const __m256i *) (text + i + len - 1));
+        if (icase) {
+            first_chunk = fold_avx2(first_chunk);
+            last_chunk = fold_avx2(last_chunk);
+        }
+        unsigned int candidates = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first_chunk, first),
+                _mm256_cmpeq_epi8(last_chunk, last)));
+        while (candidates) {
+            int offset = __builtin_ctz(candidates);
+            if (literal_equals(text + i + offset, needle, len, icase)) {
+                return text + i + offset;
+            }
+            candidates &= candidates - 1;
+        }
+        i += 32;
+    }
+    return literal_search_sse2(text + i, text_len - i, needle, len, icase);
+}
+
+#endif
+
+static literal_search_func_t literal_search_resolve() {
+#ifdef REGEX_BACKEND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return literal_search_avx2;
+    }
+    return literal_search_sse2;
+#else
+    return literal_search_scalar;
+#endif
+}
+
+static const char * literal_search(const char * text, size_t text_len, const char * needle, size_t len, int icase) {
+    // resolved on first use, every thread finds the same function
+    static literal_search_func_t search_func;
+    literal_search_func_t func = __atomic_load_n(&search_func, __ATOMIC_RELAXED);
+    if (!func) {
+        func = literal_search_resolve();
+        __atomic_store_n(&search_func, func, __ATOMIC_RELAXED);
+    }
+    return func(text, text_len, needle, len, icase);
+}
+
+// ----- posix backend
+
+static int posix_compile(regex_program_t * program, const char * regex, int icase, char * error, size_t error_size) {
+    regex_t * compiled = calloc(1, sizeof(regex_t));
+    int result = regcomp(compiled, regex, REG_EXTENDED | (icase ? REG_ICASE : 0));
+    if (result) {
+        regerror(result, compiled, error, error_size);
+        free(compiled);
+        return 0;
+    }
+    program->state = compiled;
+    program->nsub = compiled->re_nsub;
+    return 1;
+}
+
+static int posix_exec(const regex_program_t * program, const char * text, size_t ngroups, regmatch_t * groups) {
+    return !regexec((const regex_t *) program->state, text, ngroups, ngroups ? groups : NULL, 0);
+}
+
+static void posix_free(regex_program_t * program) {
+    regfree((regex_t *) program->state);
+    free(program->state);
+}
+
+const regex_backend_t regex_backend_posix = { "posix", posix_compile, posix_exec, posix_free };
+
+// ----- literal backend
+
+static int literal_compile(regex_program_t * program, const char * regex, int icase, char * error,
+        size_t error_size) {
+    char literal[LITERAL_MAX];
+    int to_end;
+    regex_class_t regex_class = classify(regex, literal, sizeof(literal), &to_end);
+    if (regex_class == REGEX_CLASS_REGEX) {
+        snprintf(error, error_size, "not a literal");
+        return 0;
+    }
+
+    literal_state_t * state = calloc(1, sizeof(literal_state_t));
+    state->regex_class = regex_class;
+    state->len = strlen(literal);
+    state->icase = icase;
+    state->to_end = to_end;
+    if (icase) {
+        size_t i;
+        for (i = 0; i < state->len; i++) {
+            literal[i] = fold((unsigned char) literal[i]);
+        }
+    }
+    state->literal = strdup(literal);
+    program->state = state;
+    program->nsub = 0;
+    return 1;
+}
+
+static int literal_exec(const regex_program_t * program, const char * text, size_t ngroups, regmatch_t * groups) {
+    const literal_state_t * state = (const literal_state_t *) program->state;
+    size_t text_len = strlen(text);
+    size_t len = state->len;
+    size_t start;
+
+    if (text_len < len) {
+        return 0;
+    }
+    switch (state->regex_class) {
+    case REGEX_CLASS_PREFIX:
+        if (!literal_equals(text, state->literal, len, state->icase)) {
+            return 0;
+        }
+        start = 0;
+        break;
+    case REGEX_CLASS_SUFFIX:
+        start = text_len - len;
+        if (!literal_equals(text + start, state->literal, len, state->icase)) {
+            return 0;
+        }
+        break;
+    case REGEX_CLASS_EXACT:
+        if (text_len != len || !literal_equals(text, state->literal, len, state->icase)) {
+            return 0;
+        }
+        start = 0;
+        break;
+    default: {
+        const char * found = literal_search(text, text_len, state->literal, len, state->icase);
+        if (!found) {
+            return 0;
+        }
+        start = found - text;
+        break;
+    }
+    }
+
+    if (ngroups > 0) {
+        groups[0].rm_so = start;
+        groups[0].rm_eo = state->to_end ? text_len : start + len;
+        size_t i;
+        for (i = 1; i < ngroups; i++) {
+            groups[i].rm_so = -1;
+            groups[i].rm_eo = -1;
+        }
+    }
+    return 1;
+}
+
+static void literal_free(regex_program_t * program) {
+    literal_state_t * state = (literal_state_t *) program->state;
+    free(state->literal);
+    free(state);
+}
+
+const regex_backend_t regex_backend_literal = { "literal", literal_compile, literal_exec, literal_free };
+
+// -----
+
+const char * regex_class_get_name(regex_class_t regex_class) {
+    if (regex_class < 0 || regex_class >= REGEX_CLASSES_COUNT) {
+        return "?";
+    }
+    return regex_class_names[regex_class];
+}
+
+regex_class_t regex_classify(const char * regex, char * literal, size_t size) {
+    int to_end;
+    return classify(regex, literal, size, &to_end);
+}
+
+const regex_backend_t * regex_backend_select(const char * regex) {
+    char literal[LITERAL_MAX];
+    if (regex_classify(regex, literal, sizeof(literal)) != REGEX_CLASS_REGEX) {
+        return &regex_backend_literal;
+    }
+    return &regex_backend_posix;
+}
+
+int regex_program_compile(regex_program_t * program, const regex_backend_t * backend, const char * regex, int icase,
+        char * error, size_t error_size) {
+    memset(program, 0, sizeof(regex_program_t));
+    if (!backend->compile(program, regex, icase, error, error_size)) {
+        return 0;
+    }
+    program->backend = backend;
+    return 1;
+}
+
+int regex_program_exec(const regex_program_t * program, const char * text, size_t ngroups, regmatch_t * groups) {
+    return program->backend->exec(program, text, ngroups, groups);
+}
+
+void regex_program_free(regex_program_t * program) {
+    if (program->backend) {
+        program->backend->free(program);
+    }
+    memset(program, 0, sizeof(regex_program_t));
+}
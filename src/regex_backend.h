@@ -0,0 +1,87 @@
+#ifndef REGEX_BACKEND_H_
+#define REGEX_BACKEND_H_
+
+#include <stddef.h>
+#include <regex.h>
+
+/*
+ * Engines running the regexes of the filters.
+ *
+ * A regex is compiled by a backend into a regex_program_t, and matched
+ * through it. The posix backend is regcomp()/regexec(). The literal backend
+ * only accepts the POSIX extended regexes that are a plain string, optionally
+ * anchored at the start, at the end or both, optionally followed by ".*", and
+ * finds them with a SIMD substring search (SSE2 or AVX2 when the CPU has
+ * them). Its matches, including the offsets of the whole match, are the ones
+ * of regexec() in the C locale.
+ *
+ * regex_backend_select() picks the literal backend when the regex is one of
+ * those, the posix one otherwise.
+ */
+
+typedef enum {
+    // anything else, left to regexec()
+    REGEX_CLASS_REGEX = 0,
+    // literal anywhere in the text
+    REGEX_CLASS_SUBSTRING = 1,
+    // ^literal
+    REGEX_CLASS_PREFIX = 2,
+    // literal$
+    REGEX_CLASS_SUFFIX = 3,
+    // ^literal$
+    REGEX_CLASS_EXACT = 4,
+    REGEX_CLASSES_COUNT = 5
+} regex_class_t;
+
+typedef struct _regex_backend_t regex_backend_t;
+
+typedef struct {
+    const regex_backend_t * backend;
+    // owned by the backend
+    void * state;
+    // parenthesized subexpressions, like regex_t.re_nsub
+    size_t nsub;
+} regex_program_t;
+
+struct _regex_backend_t {
+    const char * name;
+    /*
+     * Compile regex into program, ASCII case insensitively if icase.
+     * Return 1 on success, 0 with a message in error otherwise.
+     */
+    int (*compile)(regex_program_t * program, const char * regex, int icase, char * error, size_t error_size);
+    /*
+     * Return 1 if text matches, and fill ngroups entries of groups if ngroups > 0.
+     */
+    int (*exec)(const regex_program_t * program, const char * text, size_t ngroups, regmatch_t * groups);
+    void (*free)(regex_program_t * program);
+};
+
+extern const regex_backend_t regex_backend_posix;
+extern const regex_backend_t regex_backend_literal;
+
+const char * regex_class_get_name(regex_class_t regex_class);
+
+/*
+ * Class of the POSIX extended regex. Unless it is REGEX_CLASS_REGEX, copy its
+ * literal, unescaped, to literal.
+ */
+regex_class_t regex_classify(const char * regex, char * literal, size_t size);
+
+/*
+ * Fastest backend producing the matches of regexec() for regex.
+ */
+const regex_backend_t * regex_backend_select(const char * regex);
+
+/*
+ * Compile regex with backend, see regex_backend_t.
+ */
+int regex_program_compile(regex_program_t * program, const regex_backend_t * backend, const char * regex, int icase,
+        char * error, size_t error_size);
+
+int regex_program_exec(const regex_program_t * program, const char * text, size_t ngroups, regmatch_t * groups);
+
+void regex_program_free(regex_program_t * program);
+
+
+#endif /* REGEX_BACKEND_H_ */
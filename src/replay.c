@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "filter.h"
+#include "channel_index.h"
+#include "casemap.h"
+#include "irc_message.h"
+#include "normalize.h"
+#include "stats.h"
+#include "log.h"
+
+// Longer lines are truncated, IRCv3 tags included.
+#define REPLAY_LINE_MAX 8192
+// Lines looked at to guess the format of a file.
+#define REPLAY_DETECT_LINES 32
+#define REPLAY_CHANNEL_MAX 256
+
+
+// ---
+
+typedef struct {
+	const char * path;
+	const char * data;
+	size_t size;
+	replay_format_t format;
+	// of the one channel formats, from the file name
+	char channel[REPLAY_CHANNEL_MAX];
+	// thread reading the file, -1 for all of them
+	int owner;
+} replay_file_t;
+
+typedef struct {
+	const server_conf_t * server_conf;
+	filter_set_t ** channel_filters;
+	int channels_count;
+	channel_index_t * channel_index;
+} replay_server_t;
+
+typedef struct _replay_t replay_t;
+
+typedef struct {
+	replay_t * replay;
+	int index;
+	pthread_t thread;
+	int started;
+	match_event_t * event;
+	normalized_line_t line;
+	char buffer[REPLAY_LINE_MAX];
+
+	// of the current line, in ns since the epoch, 0 if it has none
+	uint64_t time_ns;
+	// date of the irssi lines, from the last "Log opened" or "Day changed", 0 before
+	int year;
+	int month;
+	int day;
+	// hour last converted from the local time zone, and its start
+	int64_t hour_key;
+	time_t hour_start;
+
+	uint64_t lines;
+	uint64_t channel_lines;
+	uint64_t matches;
+} replay_worker_t;
+
+struct _replay_t {
+	replay_file_t * files;
+	int files_count;
+	replay_server_t * servers;
+	int servers_count;
+	replay_worker_t * workers;
+	int workers_count;
+	match_output_t * output;
+};
+
+typedef struct {
+	replay_worker_t * worker;
+	const replay_server_t * server;
+	const char * channel;
+	// nick!user@host or a bare nick, only the nick is published
+	const char * origin;
+} replay_match_t;
+
+
+// ----- files
+
+static int is_channel(const char * name) {
+	return name[0] == '#' || name[0] == '&' || name[0] == '+' || name[0] == '!';
+}
+
+static int is_digits(const char * text, size_t len, const char * pattern) {
+	size_t i;
+	for (i = 0; pattern[i]; i++) {
+		if (i >= len) {
+			return 0;
+		}
+		if (pattern[i] == 'd' ? (text[i] < '0' || text[i] > '9') : text[i] != pattern[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int parse_number(const char * text, int digits) {
+	int result = 0;
+	int i;
+	for (i = 0; i < digits; i++) {
+		result = result * 10 + text[i] - '0';
+	}
+	return result;
+}
+
+/*
+ * Time of a line dated in the local time zone, as irssi and weechat write
+ * them. mktime() is only called once per hour of logs.
+ */
+static uint64_t local_time_ns(replay_worker_t * worker, int year, int month, int day, int hour, int minute,
+		int second) {
+	int64_t hour_key = (((int64_t) year * 100 + month) * 100 + day) * 100 + hour;
+	if (hour_key != worker->hour_key) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = year - 1900;
+		tm.tm_mon = month - 1;
+		tm.tm_mday = day;
+		tm.tm_hour = hour;
+		tm.tm_isdst = -1;
+		worker->hour_start = mktime(&tm);
+		worker->hour_key = hour_key;
+	}
+	if (worker->hour_start < 0) {
+		return 0;
+	}
+	return (uint64_t) (worker->hour_start + minute * 60 + second) * 1000000000;
+}
+
+/*
+ * Value of the IRCv3 time tag, "2024-01-02T12:34:56.789Z" in UTC, 0 without one.
+ */
+static uint64_t tags_get_time_ns(const char * tags) {
+	const char * tag = tags;
+	while (tag && *tag) {
+		size_t tag_len = strcspn(tag, "; ");
+		if (tag_len > 5 && !strncmp(tag, "time=", 5) && is_digits(tag + 5, tag_len - 5, "dddd-dd-ddTdd:dd:dd")) {
+			const char * value = tag + 5;
+			struct tm tm;
+			memset(&tm, 0, sizeof(tm));
+			tm.tm_year = parse_number(value, 4) - 1900;
+			tm.tm_mon = parse_number(value + 5, 2) - 1;
+			tm.tm_mday = parse_number(value + 8, 2);
+			tm.tm_hour = parse_number(value + 11, 2);
+			tm.tm_min = parse_number(value + 14, 2);
+			tm.tm_sec = parse_number(value + 17, 2);
+			time_t seconds = timegm(&tm);
+			if (seconds < 0) {
+				return 0;
+			}
+			uint64_t result = (uint64_t) seconds * 1000000000;
+			// milliseconds usually, up to nanoseconds
+			const char * fraction = value + 19;
+			uint64_t unit = 100000000;
+			if (*fraction == '.') {
+				for (fraction++; *fraction >= '0' && *fraction <= '9' && unit; fraction++, unit /= 10) {
+					result += (*fraction - '0') * unit;
+				}
+			}
+			return result;
+		}
+		tag += tag_len;
+		tag = *tag == ';' ? tag + 1 : NULL;
+	}
+	return 0;
+}
+
+/*
+ * Format of the first lines of data, REPLAY_FORMAT_AUTO if none is recognized.
+ */
+static replay_format_t detect_format(const char * data, size_t size) {
+	const char * p = data;
+	const char * end = data + size;
+	int lines = 0;
+	while (p < end && lines < REPLAY_DETECT_LINES) {
+		const char * line_end = memchr(p, '\n', end - p);
+		size_t len = (line_end ? line_end : end) - p;
+		if (len) {
+			lines++;
+			if (is_digits(p, len, "dddd-dd-dd dd:dd:dd\t")) {
+				return REPLAY_FORMAT_WEECHAT;
+			}
+			if (is_digits(p, len, "--- Log ") || is_digits(p, len, "dd:dd ") || is_digits(p, len, "dd:dd:dd ")) {
+				return REPLAY_FORMAT_IRSSI;
+			}
+			if (p[0] == ':' || p[0] == '@') {
+				return REPLAY_FORMAT_RAW;
+			}
+		}
+		p += len + 1;
+	}
+	return REPLAY_FORMAT_AUTO;
+}
+
+/*
+ * Channel of a one channel log from its file name : "#channel.log" or
+ * "irc.server.#channel.weechatlog".
+ */
+static int channel_from_path(const char * path, char * channel, size_t size) {
+	const char * name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	const char * start = name;
+	while (*start && !(is_channel(start) && (start == name || start[-1] == '.'))) {
+		start++;
+	}
+	const char * end = strrchr(start, '.');
+	if (!*start || !end || end == start || (size_t) (end - start) >= size) {
+		return 0;
+	}
+	memcpy(channel, start, end - start);
+	channel[end - start] = '\0';
+	return 1;
+}
+
+static size_t hash_channel(const char * name, size_t len) {
+	// the channels are indexed with the default case mapping, no server told another one
+	size_t hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char) irc_tolower(CASEMAPPING_RFC1459, name[i])) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int open_file(replay_t * replay, replay_file_t * file, const char * path, replay_format_t format) {
+	file->path = path;
+	file->owner = -1;
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		log_error("could not open %s : %s.", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+	file->size = st.st_size;
+	if (file->size) {
+		void * data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			log_error("could not map %s : %s.", path, strerror(errno));
+			close(fd);
+			return 0;
+		}
+		madvise(data, file->size, MADV_SEQUENTIAL);
+		file->data = data;
+	}
+	close(fd);
+
+	file->format = format != REPLAY_FORMAT_AUTO ? format : detect_format(file->data, file->size);
+	if (file->format == REPLAY_FORMAT_AUTO) {
+		if (file->size) {
+			log_error("unknown log format of %s.", path);
+			return 0;
+		}
+		// nothing to replay
+		file->format = REPLAY_FORMAT_RAW;
+	}
+	if (file->format != REPLAY_FORMAT_RAW) {
+		if (!channel_from_path(path, file->channel, sizeof(file->channel))) {
+			log_error("no channel in the name of %s.", path);
+			return 0;
+		}
+		file->owner = hash_channel(file->channel, strlen(file->channel)) % replay->workers_count;
+	}
+	return 1;
+}
+
+static void close_file(replay_file_t * file) {
+	if (file->data) {
+		munmap((void *) file->data, file->size);
+	}
+}
+
+// ----- servers
+
+static int init_server(replay_server_t * server, const server_conf_t * server_conf) {
+	server->server_conf = server_conf;
+	server->channels_count = server_conf_get_channels_count(server_conf);
+	server->channel_filters = calloc(server->channels_count ? server->channels_count : 1, sizeof(filter_set_t *));
+	server->channel_index = channel_index_new(server->channels_count, CASEMAPPING_RFC1459);
+	int chan_idx;
+	for (chan_idx = 0; chan_idx < server->channels_count; chan_idx++) {
+		const channel_conf_t * channel_conf = server_conf_get_channel_at(server_conf, chan_idx);
+		server->channel_filters[chan_idx] = filter_set_new(channel_conf);
+		if (!server->channel_filters[chan_idx]) {
+			log_error("could not compile filters of %s on %s.",
+					channel_conf_get_name(channel_conf), server_conf_get_name(server_conf));
+			return 0;
+		}
+		channel_index_add(server->channel_index, channel_conf, server->channel_filters[chan_idx]);
+	}
+	return 1;
+}
+
+static void free_server(replay_server_t * server) {
+	channel_index_free(server->channel_index);
+	int chan_idx;
+	for (chan_idx = 0; server->channel_filters && chan_idx < server->channels_count; chan_idx++) {
+		if (server->channel_filters[chan_idx]) {
+			filter_set_free(server->channel_filters[chan_idx]);
+		}
+	}
+	free(server->channel_filters);
+}
+
+// ----- lines
+
+static void on_capture(const char * var, const char * value, int value_len, void * data) {
+	match_event_add_var((match_event_t *) data, var, value, value_len);
+}
+
+static void on_match(compiled_filter_t * filter, const char ** lines, int lines_count, void * data) {
+	replay_match_t * match = (replay_match_t *) data;
+	match_event_t * event = match->worker->event;
+	char nick[FILTER_LINE_MAX];
+	snprintf(nick, sizeof(nick), "%.*s", (int) strcspn(match->origin, "!@"), match->origin);
+
+	const char * server_name = server_conf_get_name(match->server->server_conf);
+	if (match->worker->time_ns) {
+		match_event_begin_at(event, match->worker->time_ns, server_name, match->channel, nick,
+				compiled_filter_get_name(filter));
+	} else {
+		match_event_begin(event, server_name, match->channel, nick, compiled_filter_get_name(filter));
+	}
+	compiled_filter_foreach_capture(filter, lines, lines_count, on_capture, event);
+	match_output_publish(match->worker->replay->output, event);
+}
+
+/*
+ * A channel line, as event_channel() gets it.
+ */
+static void dispatch(replay_worker_t * worker, const char * channel, const char * origin, const char * text) {
+	replay_t * replay = worker->replay;
+	int normalized = 0;
+	int server_idx;
+	for (server_idx = 0; server_idx < replay->servers_count; server_idx++) {
+		const replay_server_t * server = &replay->servers[server_idx];
+		channel_entry_t * entry = channel_index_find(server->channel_index, channel);
+		const uint64_t * filters;
+		if (!entry || !channel_entry_accept(entry, origin, &filters)) {
+			continue;
+		}
+		if (!normalized) {
+			normalize_line(&worker->line, text);
+			normalized = 1;
+		}
+		replay_match_t match;
+		match.worker = worker;
+		match.server = server;
+		match.channel = channel;
+		match.origin = origin;
+		worker->matches += filter_set_feed(channel_entry_get_filter_set(entry), &worker->line, filters, on_match,
+				&match);
+	}
+	worker->channel_lines += normalized;
+}
+
+/*
+ * Target of a raw PRIVMSG line, found without copying it. NULL for other commands.
+ */
+static const char * raw_get_target(const char * line, size_t len, size_t * target_len) {
+	const char * p = line;
+	const char * end = line + len;
+	if (p < end && *p == '@') {
+		p = memchr(p, ' ', end - p);
+		if (!p) {
+			return NULL;
+		}
+		while (p < end && *p == ' ') {
+			p++;
+		}
+	}
+	if (p < end && *p == ':') {
+		p = memchr(p, ' ', end - p);
+		if (!p) {
+			return NULL;
+		}
+		while (p < end && *p == ' ') {
+			p++;
+		}
+	}
+	if (end - p < 8 || memcmp(p, "PRIVMSG ", 8)) {
+		return NULL;
+	}
+	p += 8;
+	const char * target_end = memchr(p, ' ', end - p);
+	*target_len = (target_end ? target_end : end) - p;
+	return p;
+}
+
+static void replay_raw(replay_worker_t * worker, const char * line, size_t len) {
+	size_t target_len;
+	const char * target = raw_get_target(line, len, &target_len);
+	if (!target || !target_len || !is_channel(target)
+			|| (int) (hash_channel(target, target_len) % worker->replay->workers_count) != worker->index) {
+		return;
+	}
+	memcpy(worker->buffer, line, len);
+	worker->buffer[len] = '\0';
+	irc_message_t message;
+	if (!irc_message_parse(worker->buffer, &message) || !message.prefix || message.params_count != 2) {
+		return;
+	}
+	// CTCP, e.g. ACTION, are not channel lines
+	if (message.params[1][0] == '\001') {
+		return;
+	}
+	worker->time_ns = tags_get_time_ns(message.tags);
+	dispatch(worker, message.params[0], message.prefix, message.params[1]);
+}
+
+static int is_nick_start(char c) {
+	// letters and []\`_^{|}
+	return c >= 'A' && c <= '}';
+}
+
+static int parse_month(const char * name) {
+	static const char * const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	int i;
+	for (i = 0; i < 12; i++) {
+		if (!strcmp(name, months[i])) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Date of "--- Log opened Tue Jan 02 12:34:56 2024" and "--- Day changed Wed Jan 03 2024".
+ */
+static void irssi_parse_date(replay_worker_t * worker, const char * line) {
+	char month[4];
+	int day, year;
+	int hour, minute, second;
+	if (sscanf(line, "--- Log opened %*s %3s %d %d:%d:%d %d", month, &day, &hour, &minute, &second, &year) == 6
+			|| sscanf(line, "--- Day changed %*s %3s %d %d", month, &day, &year) == 3) {
+		worker->month = parse_month(month);
+		worker->year = worker->month ? year : 0;
+		worker->day = day;
+	}
+}
+
+/*
+ * 12:34 <@nick> text, or 12:34:56, on the date of the last date line.
+ */
+static void replay_irssi(replay_worker_t * worker, const replay_file_t * file, const char * line, size_t len) {
+	memcpy(worker->buffer, line, len);
+	worker->buffer[len] = '\0';
+	if (is_digits(worker->buffer, len, "--- ")) {
+		irssi_parse_date(worker, worker->buffer);
+		return;
+	}
+	if (worker->year && is_digits(worker->buffer, len, "dd:dd")) {
+		int second = is_digits(worker->buffer, len, "dd:dd:dd") ? parse_number(worker->buffer + 6, 2) : 0;
+		worker->time_ns = local_time_ns(worker, worker->year, worker->month, worker->day,
+				parse_number(worker->buffer, 2), parse_number(worker->buffer + 3, 2), second);
+	}
+	char * p = strchr(worker->buffer, ' ');
+	if (!p || p[1] != '<') {
+		return;
+	}
+	p += 2;
+	// mode of the nick, a space without
+	if (*p && strchr(" @+%&~!", *p)) {
+		p++;
+	}
+	char * nick_end = strchr(p, '>');
+	if (!nick_end || nick_end == p || !is_nick_start(*p) || nick_end[1] != ' ') {
+		return;
+	}
+	*nick_end = '\0';
+	dispatch(worker, file->channel, p, nick_end + 2);
+}
+
+/*
+ * 2024-01-02 12:34:56<TAB>@nick<TAB>text
+ */
+static void replay_weechat(replay_worker_t * worker, const replay_file_t * file, const char * line, size_t len) {
+	memcpy(worker->buffer, line, len);
+	worker->buffer[len] = '\0';
+	char * nick = strchr(worker->buffer, '\t');
+	if (!nick) {
+		return;
+	}
+	nick++;
+	char * text = strchr(nick, '\t');
+	if (!text) {
+		return;
+	}
+	*text++ = '\0';
+	if (*nick && strchr("@+%&~!", *nick)) {
+		nick++;
+	}
+	// joins, parts and actions have "-->", "<--", "--" or " *" instead of a nick
+	if (!is_nick_start(*nick) || strchr(nick, ' ')) {
+		return;
+	}
+	if (is_digits(worker->buffer, len, "dddd-dd-dd dd:dd:dd")) {
+		const char * date = worker->buffer;
+		worker->time_ns = local_time_ns(worker, parse_number(date, 4), parse_number(date + 5, 2),
+				parse_number(date + 8, 2), parse_number(date + 11, 2), parse_number(date + 14, 2),
+				parse_number(date + 17, 2));
+	}
+	dispatch(worker, file->channel, nick, text);
+}
+
+static void replay_file(replay_worker_t * worker, const replay_file_t * file) {
+	// the lines of a file read by every thread are counted once
+	int counting = file->owner >= 0 || worker->index == 0;
+	worker->year = 0;
+	const char * p = file->data;
+	const char * end = file->data + file->size;
+	while (p < end) {
+		const char * line_end = memchr(p, '\n', end - p);
+		if (!line_end) {
+			line_end = end;
+		}
+		size_t len = line_end - p;
+		if (len && p[len - 1] == '\r') {
+			len--;
+		}
+		if (len >= REPLAY_LINE_MAX) {
+			len = REPLAY_LINE_MAX - 1;
+		}
+		worker->lines += counting;
+		worker->time_ns = 0;
+
+		switch (file->format) {
+		case REPLAY_FORMAT_RAW:
+			replay_raw(worker, p, len);
+			break;
+		case REPLAY_FORMAT_IRSSI:
+			replay_irssi(worker, file, p, len);
+			break;
+		case REPLAY_FORMAT_WEECHAT:
+			replay_weechat(worker, file, p, len);
+			break;
+		default:
+			break;
+		}
+		p = line_end + 1;
+	}
+}
+
+static void * worker_thread(void * arg) {
+	replay_worker_t * worker = (replay_worker_t *) arg;
+	replay_t * replay = worker->replay;
+	int file_idx;
+	for (file_idx = 0; file_idx < replay->files_count; file_idx++) {
+		const replay_file_t * file = &replay->files[file_idx];
+		if (file->owner < 0 || file->owner == worker->index) {
+			replay_file(worker, file);
+		}
+	}
+	return NULL;
+}
+
+// -----
+
+int replay_format_parse(const char * name, replay_format_t * format) {
+	static const char * const names[] = { "auto", "raw", "irssi", "weechat" };
+	int i;
+	for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+		if (!strcmp(name, names[i])) {
+			*format = (replay_format_t) i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int replay_run(const irc_conf_t * irc_conf, const char * server_name, replay_format_t format,
+		const char ** paths, int paths_count, int threads_count, match_output_t * output, replay_stats_t * stats) {
+	replay_t replay;
+	memset(&replay, 0, sizeof(replay));
+	memset(stats, 0, sizeof(replay_stats_t));
+	replay.output = output;
+	replay.workers_count = threads_count > 0 ? threads_count : 1;
+	int ok = 1;
+
+	int servers_count = irc_conf_get_servers_count(irc_conf);
+	replay.servers = calloc(servers_count ? servers_count : 1, sizeof(replay_server_t));
+	int server_idx;
+	for (server_idx = 0; server_idx < servers_count && ok; server_idx++) {
+		const server_conf_t * server_conf = irc_conf_get_server_at(irc_conf, server_idx);
+		if (!server_name || !strcmp(server_conf_get_name(server_conf), server_name)) {
+			ok = init_server(&replay.servers[replay.servers_count++], server_conf);
+		}
+	}
+	if (ok && !replay.servers_count) {
+		log_error("no server %s in the configuration.", server_name ? server_name : "");
+		ok = 0;
+	}
+
+	replay.files = calloc(paths_count ? paths_count : 1, sizeof(replay_file_t));
+	int file_idx;
+	for (file_idx = 0; file_idx < paths_count && ok; file_idx++) {
+		ok = open_file(&replay, &replay.files[replay.files_count++], paths[file_idx], format);
+	}
+
+	if (ok) {
+		replay.workers = calloc(replay.workers_count, sizeof(replay_worker_t));
+		uint64_t start = stats_now_ns();
+		int i;
+		for (i = 0; i < replay.workers_count; i++) {
+			replay_worker_t * worker = &replay.workers[i];
+			worker->replay = &replay;
+			worker->index = i;
+			worker->event = match_event_new();
+			int result = pthread_create(&worker->thread, NULL, worker_thread, worker);
+			if (result) {
+				log_error("could not start replay thread %d : %s.", i, strerror(result));
+				// its channels are not replayed
+				ok = 0;
+				continue;
+			}
+			worker->started = 1;
+		}
+		for (i = 0; i < replay.workers_count; i++) {
+			replay_worker_t * worker = &replay.workers[i];
+			if (worker->started) {
+				pthread_join(worker->thread, NULL);
+			}
+			match_event_free(worker->event);
+			stats->lines += worker->lines;
+			stats->channel_lines += worker->channel_lines;
+			stats->matches += worker->matches;
+		}
+		stats->elapsed_ns = stats_now_ns() - start;
+		free(replay.workers);
+	}
+
+	for (file_idx = 0; file_idx < replay.files_count; file_idx++) {
+		close_file(&replay.files[file_idx]);
+	}
+	free(replay.files);
+	for (server_idx = 0; server_idx < replay.servers_count; server_idx++) {
+		free_server(&replay.servers[server_idx]);
+	}
+	free(replay.servers);
+	return ok;
+}
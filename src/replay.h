@@ -0,0 +1,65 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "match_output.h"
+
+/*
+ * Offline replay of IRC logs through the filters of a configuration, to try
+ * filters on past traffic. The channel lines go through the channel index and
+ * the filter sets as in live mode, and the matches are published as the same
+ * events, timestamped with the time of their line : the IRCv3 time tag of a
+ * raw line, as --archive-query writes them, the date and time of a weechat
+ * line, the time of an irssi line on the date of the last "Log opened" or
+ * "Day changed" line before it. Both are in the local time zone. A line
+ * without a time is timestamped when it matches.
+ *
+ * Log formats :
+ *   raw      protocol lines, ":nick!user@host PRIVMSG #channel :text", several channels per file
+ *   irssi    "12:34 <@nick> text", one channel per file : #channel.log
+ *   weechat  "2024-01-02 12:34:56<TAB>@nick<TAB>text", one channel per file : irc.server.#channel.weechatlog
+ *
+ * The files are memory mapped and replayed in the given order. Every channel
+ * belongs to one thread, found by hashing its name, so the lines of a channel
+ * reach its filters in order, and multi-line filters see the same history as
+ * live. A one channel file is read by the thread of its channel only, a raw
+ * file by every thread, each keeping the lines of its channels.
+ *
+ * Only the raw format has the whole prefix of the senders : with the others,
+ * nick masks are matched against the bare nick.
+ */
+
+typedef enum {
+	// guessed from the first lines of each file
+	REPLAY_FORMAT_AUTO = 0,
+	REPLAY_FORMAT_RAW = 1,
+	REPLAY_FORMAT_IRSSI = 2,
+	REPLAY_FORMAT_WEECHAT = 3
+} replay_format_t;
+
+typedef struct {
+	uint64_t lines;
+	// lines of a configured channel fed to its filters
+	uint64_t channel_lines;
+	uint64_t matches;
+	uint64_t elapsed_ns;
+} replay_stats_t;
+
+/*
+ * Format called name, e.g. "irssi". Return 0 if there is none.
+ */
+int replay_format_parse(const char * name, replay_format_t * format);
+
+/*
+ * Replay the files at paths on threads_count threads, through the filters of
+ * every server of irc_conf, or of the one named server_name if not NULL, and
+ * publish the matches to output. Return 0 if a file could not be read or
+ * the filters not compiled, nothing is replayed then.
+ */
+int replay_run(const irc_conf_t * irc_conf, const char * server_name, replay_format_t format,
+		const char ** paths, int paths_count, int threads_count, match_output_t * output, replay_stats_t * stats);
+
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "resolver.h"
+#include "log.h"
+
+
+// ---
+
+struct _resolver_request_t {
+	// posted to loop once resolved
+	event_task_t task;
+	event_loop_t * loop;
+	char * host;
+	int port;
+	resolver_handler_t handler;
+	void * data;
+	int cancelled;
+	struct addrinfo * addresses;
+
+	resolver_request_t * next;
+};
+
+struct _resolver_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// requests not started yet, first in first out
+	resolver_request_t * head;
+	resolver_request_t * tail;
+	int stopping;
+
+	pthread_t * threads;
+	int threads_count;
+};
+
+
+// -----
+
+/*
+ * Called from the loop of the requester.
+ */
+static void resolver_request_done(event_loop_t * loop, void * data) {
+	resolver_request_t * request = (resolver_request_t *) data;
+	if (request->cancelled) {
+		if (request->addresses) {
+			freeaddrinfo(request->addresses);
+		}
+	} else {
+		request->handler(request->addresses, request->data);
+	}
+	free(request->host);
+	free(request);
+}
+
+static void resolver_lookup(resolver_request_t * request) {
+	struct addrinfo hints;
+	char service[16];
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", request->port);
+
+	int result = getaddrinfo(request->host, service, &hints, &request->addresses);
+	if (result) {
+		log_error("could not resolve %s : %s.", request->host, gai_strerror(result));
+		request->addresses = NULL;
+	}
+}
+
+static void * resolver_run(void * arg) {
+	resolver_t * resolver = (resolver_t *) arg;
+	pthread_mutex_lock(&resolver->lock);
+	for (;;) {
+		while (!resolver->head && !resolver->stopping) {
+			pthread_cond_wait(&resolver->cond, &resolver->lock);
+		}
+		resolver_request_t * request = resolver->head;
+		if (!request) {
+			break;
+		}
+		resolver->head = request->next;
+		if (!resolver->head) {
+			resolver->tail = NULL;
+		}
+		int stopping = resolver->stopping;
+		pthread_mutex_unlock(&resolver->lock);
+
+		if (!stopping) {
+			resolver_lookup(request);
+		}
+		event_loop_post(request->loop, &request->task, resolver_request_done, request);
+
+		pthread_mutex_lock(&resolver->lock);
+	}
+	pthread_mutex_unlock(&resolver->lock);
+	return NULL;
+}
+
+resolver_t * resolver_new(int threads_count) {
+	resolver_t * resolver = calloc(1, sizeof(struct _resolver_t));
+	pthread_mutex_init(&resolver->lock, NULL);
+	pthread_cond_init(&resolver->cond, NULL);
+	resolver->threads = calloc(threads_count, sizeof(pthread_t));
+
+	int i;
+	for (i = 0; i < threads_count; i++) {
+		int result = pthread_create(&resolver->threads[i], NULL, resolver_run, resolver);
+		if (result) {
+			log_error("could not start resolver thread %d : %s.", i, strerror(result));
+			break;
+		}
+		resolver->threads_count++;
+	}
+	if (!resolver->threads_count) {
+		resolver_free(resolver);
+		return NULL;
+	}
+	return resolver;
+}
+
+void resolver_free(resolver_t * resolver) {
+	if (!resolver) {
+		return;
+	}
+	pthread_mutex_lock(&resolver->lock);
+	resolver->stopping = 1;
+	pthread_cond_broadcast(&resolver->cond);
+	pthread_mutex_unlock(&resolver->lock);
+
+	int i;
+	for (i = 0; i < resolver->threads_count; i++) {
+		pthread_join(resolver->threads[i], NULL);
+	}
+	pthread_cond_destroy(&resolver->cond);
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver->threads);
+	free(resolver);
+}
+
+resolver_request_t * resolver_resolve(resolver_t * resolver, event_loop_t * loop, const char * host, int port,
+		resolver_handler_t handler, void * data) {
+	resolver_request_t * request = calloc(1, sizeof(struct _resolver_request_t));
+	request->loop = loop;
+	request->host = strdup(host);
+	request->port = port;
+	request->handler = handler;
+	request->data = data;
+
+	pthread_mutex_lock(&resolver->lock);
+	if (resolver->tail) {
+		resolver->tail->next = request;
+	} else {
+		resolver->head = request;
+	}
+	resolver->tail = request;
+	pthread_cond_signal(&resolver->cond);
+	pthread_mutex_unlock(&resolver->lock);
+	return request;
+}
+
+void resolver_cancel(resolver_request_t * request) {
+	if (request) {
+		request->cancelled = 1;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <netdb.h>
+
+#include "event_loop.h"
+
+/*
+ * Asynchronous name resolution.
+ *
+ * getaddrinfo() blocks, so it runs on a pool of threads. The result is handed
+ * back to the event loop of the requester, whose thread calls the handler.
+ */
+
+typedef struct _resolver_t resolver_t;
+typedef struct _resolver_request_t resolver_request_t;
+
+/*
+ * addresses is NULL if host could not be resolved. Otherwise the handler owns
+ * it and must release it with freeaddrinfo().
+ */
+typedef void (*resolver_handler_t)(struct addrinfo * addresses, void * data);
+
+resolver_t * resolver_new(int threads_count);
+
+/*
+ * Wait for the lookups in progress. The requests not started yet fail.
+ * Must be called before the event loops of the requesters are freed.
+ */
+void resolver_free(resolver_t * resolver);
+
+/*
+ * Resolve host and port for TCP, then call handler from loop.
+ */
+resolver_request_t * resolver_resolve(resolver_t * resolver, event_loop_t * loop, const char * host, int port,
+		resolver_handler_t handler, void * data);
+
+/*
+ * Do not call the handler of request. Must be called from the thread of its loop,
+ * before its handler was called.
+ */
+void resolver_cancel(resolver_request_t * request);
+
+
+#endif /* RESOLVER_H_ */
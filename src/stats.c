@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stats.h"
+#include "log.h"
+
+#define STATS_SUB_BUCKETS (1 << STATS_HISTOGRAM_SUB_BITS)
+
+
+// ---
+
+struct _stats_report_t {
+	char * buf;
+	size_t len;
+	size_t size;
+};
+
+typedef struct _stats_reply_t stats_reply_t;
+
+/*
+ * A report being sent to a client.
+ */
+struct _stats_reply_t {
+	stats_server_t * server;
+	int fd;
+	event_watch_t * watch;
+	stats_report_t * report;
+	size_t sent;
+	stats_reply_t * prev;
+	stats_reply_t * next;
+};
+
+struct _stats_server_t {
+	event_loop_t * loop;
+	char * path;
+	int fd;
+	event_watch_t * watch;
+	stats_request_handler_t handler;
+	void * data;
+	stats_reply_t * replies;
+};
+
+
+// -----
+
+uint64_t stats_now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// ----- stats_histogram
+
+static int stats_histogram_index(uint64_t value) {
+	if (value < STATS_SUB_BUCKETS) {
+		return value;
+	}
+	int shift = 63 - __builtin_clzll(value) - STATS_HISTOGRAM_SUB_BITS;
+	int index = ((shift + 1) << STATS_HISTOGRAM_SUB_BITS) + ((value >> shift) & (STATS_SUB_BUCKETS - 1));
+	return index < STATS_HISTOGRAM_BUCKETS ? index : STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * Highest value recorded in the bucket at index.
+ */
+static uint64_t stats_histogram_value_at(int index) {
+	if (index < STATS_SUB_BUCKETS) {
+		return index;
+	}
+	int shift = (index >> STATS_HISTOGRAM_SUB_BITS) - 1;
+	uint64_t lowest = (uint64_t) (STATS_SUB_BUCKETS + (index & (STATS_SUB_BUCKETS - 1))) << shift;
+	return lowest + ((uint64_t) 1 << shift) - 1;
+}
+
+void stats_histogram_record(stats_histogram_t * histogram, uint64_t value) {
+	histogram->counts[stats_histogram_index(value)]++;
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
+uint64_t stats_histogram_percentile(const stats_histogram_t * histogram, double percentile) {
+	if (!histogram->count) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t) (histogram->count * percentile / 100);
+	if (rank < 1) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	int i;
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= rank) {
+			uint64_t value = stats_histogram_value_at(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+// ----- stats_report
+
+stats_report_t * stats_report_new() {
+	stats_report_t * result = calloc(1, sizeof(struct _stats_report_t));
+	result->size = 4096;
+	result->buf = malloc(result->size);
+	return result;
+}
+
+void stats_report_free(stats_report_t * report) {
+	if (!report) {
+		return;
+	}
+	free(report->buf);
+	memset(report, 0, sizeof(struct _stats_report_t));
+	free(report);
+}
+
+static void stats_report_reserve(stats_report_t * report, size_t len) {
+	if (report->len + len > report->size) {
+		while (report->len + len > report->size) {
+			report->size *= 2;
+		}
+		report->buf = realloc(report->buf, report->size);
+	}
+}
+
+void stats_report_append(stats_report_t * report, const char * fmt, ...) {
+	va_list va_alist;
+	va_start(va_alist, fmt);
+	int len = vsnprintf(report->buf + report->len, report->size - report->len, fmt, va_alist);
+	va_end(va_alist);
+	if (len < 0) {
+		return;
+	}
+	if (report->len + len >= report->size) {
+		stats_report_reserve(report, len + 1);
+		va_start(va_alist, fmt);
+		vsnprintf(report->buf + report->len, report->size - report->len, fmt, va_alist);
+		va_end(va_alist);
+	}
+	report->len += len;
+}
+
+void stats_report_append_string(stats_report_t * report, const char * str) {
+	static const char hex[] = "0123456789abcdef";
+	str = str ? str : "";
+	size_t len = strlen(str);
+	// worst case : every byte escaped as \u00XX
+	stats_report_reserve(report, len * 6 + 2);
+	char * dest = report->buf + report->len;
+	*dest++ = '"';
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) str[i];
+		if (c == '"' || c == '\\') {
+			*dest++ = '\\';
+			*dest++ = c;
+		} else if (c < 0x20) {
+			*dest++ = '\\';
+			*dest++ = 'u';
+			*dest++ = '0';
+			*dest++ = '0';
+			*dest++ = hex[c >> 4];
+			*dest++ = hex[c & 0xf];
+		} else {
+			*dest++ = c;
+		}
+	}
+	*dest++ = '"';
+	report->len = dest - report->buf;
+}
+
+void stats_report_append_histogram(stats_report_t * report, const stats_histogram_t * histogram) {
+	stats_report_append(report,
+			"{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+			(unsigned long long) histogram->count,
+			(unsigned long long) (histogram->count ? histogram->sum / histogram->count : 0),
+			(unsigned long long) stats_histogram_percentile(histogram, 50),
+			(unsigned long long) stats_histogram_percentile(histogram, 90),
+			(unsigned long long) stats_histogram_percentile(histogram, 99),
+			(unsigned long long) stats_histogram_percentile(histogram, 99.9),
+			(unsigned long long) histogram->max);
+}
+
+int stats_report_write_file(const stats_report_t * report, const char * path) {
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_error("could not open %s : %s.", tmp_path, strerror(errno));
+		return 0;
+	}
+	size_t written = 0;
+	while (written < report->len) {
+		ssize_t result = write(fd, report->buf + written, report->len - written);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("could not write %s : %s.", tmp_path, strerror(errno));
+			close(fd);
+			unlink(tmp_path);
+			return 0;
+		}
+		written += result;
+	}
+	close(fd);
+	if (rename(tmp_path, path) < 0) {
+		log_error("could not rename %s : %s.", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return 0;
+	}
+	return 1;
+}
+
+// ----- stats_server
+
+static void stats_reply_free(stats_reply_t * reply) {
+	stats_server_t * server = reply->server;
+	if (reply->prev) {
+		reply->prev->next = reply->next;
+	} else {
+		server->replies = reply->next;
+	}
+	if (reply->next) {
+		reply->next->prev = reply->prev;
+	}
+	event_loop_unwatch(server->loop, reply->watch);
+	close(reply->fd);
+	stats_report_free(reply->report);
+	free(reply);
+}
+
+/*
+ * Send what the socket accepts. Return 0 once the reply is over.
+ */
+static int stats_reply_send(stats_reply_t * reply) {
+	while (reply->sent < reply->report->len) {
+		ssize_t result = send(reply->fd, reply->report->buf + reply->sent, reply->report->len - reply->sent,
+				MSG_NOSIGNAL);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			log_warn("could not send stats : %s.", strerror(errno));
+			return 0;
+		}
+		reply->sent += result;
+	}
+	return 0;
+}
+
+static void stats_reply_event(event_loop_t * loop, int fd, int events, void * data) {
+	stats_reply_t * reply = (stats_reply_t *) data;
+	if ((events & EVENT_ERROR) || !stats_reply_send(reply)) {
+		stats_reply_free(reply);
+	}
+}
+
+void stats_server_reply(stats_server_t * server, int client_fd, stats_report_t * report) {
+	stats_reply_t * reply = calloc(1, sizeof(stats_reply_t));
+	reply->server = server;
+	reply->fd = client_fd;
+	reply->report = report;
+	reply->next = server->replies;
+	if (server->replies) {
+		server->replies->prev = reply;
+	}
+	server->replies = reply;
+
+	if (!stats_reply_send(reply)) {
+		stats_reply_free(reply);
+		return;
+	}
+	// the rest goes when the client reads
+	reply->watch = event_loop_watch(server->loop, client_fd, stats_reply_event, reply);
+	if (!reply->watch) {
+		stats_reply_free(reply);
+	}
+}
+
+static void stats_server_accept(event_loop_t * loop, int fd, int events, void * data) {
+	stats_server_t * server = (stats_server_t *) data;
+	for (;;) {
+		int client_fd = accept(fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				log_warn("stats socket accept() : %s.", strerror(errno));
+			}
+			return;
+		}
+		fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+		fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+		server->handler(server, client_fd, server->data);
+	}
+}
+
+stats_server_t * stats_server_new(event_loop_t * loop, const char * path, stats_request_handler_t handler, void * data) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("stats socket path too long : %s.", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		log_error("stats socket() : %s.", strerror(errno));
+		return NULL;
+	}
+	// left by a previous run
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		log_error("could not listen on %s : %s.", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	stats_server_t * server = calloc(1, sizeof(struct _stats_server_t));
+	server->loop = loop;
+	server->path = strdup(path);
+	server->fd = fd;
+	server->handler = handler;
+	server->data = data;
+	server->watch = event_loop_watch(loop, fd, stats_server_accept, server);
+	if (!server->watch) {
+		stats_server_free(server);
+		return NULL;
+	}
+	return server;
+}
+
+void stats_server_free(stats_server_t * server) {
+	if (!server) {
+		return;
+	}
+	while (server->replies) {
+		stats_reply_free(server->replies);
+	}
+	event_loop_unwatch(server->loop, server->watch);
+	close(server->fd);
+	unlink(server->path);
+	free(server->path);
+	memset(server, 0, sizeof(struct _stats_server_t));
+	free(server);
+}
@@ -0,0 +1,117 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "event_loop.h"
+
+/*
+ * Performance counters.
+ *
+ * Every counter belongs to a session, and a session to a single worker : its
+ * thread updates them without atomics. A report is built by visiting the
+ * workers in turn, each one appending its own sessions, so counters are only
+ * ever read by the thread that writes them.
+ *
+ * A report is a JSON document, served on a local UNIX socket to any client
+ * that connects (e.g. socat - UNIX-CONNECT:path) and dumped periodically.
+ */
+
+// Buckets of a histogram : 8 per power of 2, up to 2^36 ns.
+#define STATS_HISTOGRAM_SUB_BITS 3
+#define STATS_HISTOGRAM_BUCKETS ((36 - STATS_HISTOGRAM_SUB_BITS + 1) << STATS_HISTOGRAM_SUB_BITS)
+
+/*
+ * Log-linear histogram, HDR style : values are recorded with a relative error
+ * of at most 1 / 2^STATS_HISTOGRAM_SUB_BITS, larger ones are clamped.
+ */
+typedef struct {
+	uint32_t counts[STATS_HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+} stats_histogram_t;
+
+typedef struct {
+	// regexes run on a line
+	uint64_t evaluations;
+	uint64_t matches;
+	// time spent running them
+	uint64_t eval_ns;
+} filter_stats_t;
+
+typedef struct {
+	// lines fed to the filters of the channel
+	uint64_t lines;
+	uint64_t matches;
+	// time to match a line against all the filters
+	stats_histogram_t latency;
+} channel_stats_t;
+
+typedef struct _stats_report_t stats_report_t;
+typedef struct _stats_server_t stats_server_t;
+
+/*
+ * Monotonic time, in ns.
+ */
+uint64_t stats_now_ns();
+
+// ----- stats_histogram
+
+void stats_histogram_record(stats_histogram_t * histogram, uint64_t value);
+
+/*
+ * Value below which percentile % of the recorded values are, 0 if there is none.
+ */
+uint64_t stats_histogram_percentile(const stats_histogram_t * histogram, double percentile);
+
+// ----- stats_report
+
+stats_report_t * stats_report_new();
+
+void stats_report_free(stats_report_t * report);
+
+void stats_report_append(stats_report_t * report, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Append str as a JSON string, "" if it is NULL.
+ */
+void stats_report_append_string(stats_report_t * report, const char * str);
+
+/*
+ * Append the summary of histogram as a JSON object : count, mean, p50, p90, p99, p999 and max.
+ */
+void stats_report_append_histogram(stats_report_t * report, const stats_histogram_t * histogram);
+
+/*
+ * Write the report to path, replacing it atomically. Return 0 on error.
+ */
+int stats_report_write_file(const stats_report_t * report, const char * path);
+
+// ----- stats_server
+
+/*
+ * A client connected : build a report and pass it to stats_server_reply().
+ */
+typedef void (*stats_request_handler_t)(stats_server_t * server, int client_fd, void * data);
+
+/*
+ * Listen on the UNIX socket at path, from loop. Return NULL on error.
+ */
+stats_server_t * stats_server_new(event_loop_t * loop, const char * path, stats_request_handler_t handler, void * data);
+
+/*
+ * Stop listening and drop the replies being sent. Must be called from the
+ * thread of its loop, or once it stopped.
+ */
+void stats_server_free(stats_server_t * server);
+
+/*
+ * Send report to client_fd, then close it. Takes the report. Must be called
+ * from the thread of the loop of the server.
+ */
+void stats_server_reply(stats_server_t * server, int client_fd, stats_report_t * report);
+
+
+#endif /* STATS_H_ */
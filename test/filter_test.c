@@ -0,0 +1,233 @@
+/*
+ * Checks of the filter sets, run by make check.
+ *
+ *   filter_test     run every check, exit 1 if one fails
+ *
+ * Build with -fsanitize=address to also catch the reads of a freed
+ * configuration.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "filter.h"
+#include "normalize.h"
+#include "log.h"
+
+#define TEST_CONF_TEMPLATE "/tmp/filter_test.XXXXXX"
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed : %s\n", __FILE__, __LINE__, #cond); \
+			return 0; \
+		} \
+	} while (0)
+
+
+// ---
+
+typedef struct {
+	int matches;
+	char name[64];
+	char var[64];
+	char value[FILTER_LINE_MAX];
+} test_match_t;
+
+/*
+ * Write json to a temporary file, return its name.
+ */
+static char * writeConf(const char * json) {
+	char * filename = strdup(TEST_CONF_TEMPLATE);
+	int fd = mkstemp(filename);
+	FILE * file = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!file) {
+		perror("mkstemp");
+		free(filename);
+		return NULL;
+	}
+	fputs(json, file);
+	fclose(file);
+	return filename;
+}
+
+/*
+ * Configuration of one server with one channel, of the filters in filters_json.
+ */
+static irc_conf_t * loadConf(const char * filters_json, int from_image) {
+	char json[4096];
+	snprintf(json, sizeof(json), "{\"servers\": [{\"name\": \"test\", \"ip\": \"127.0.0.1\", \"port\": 6667,"
+			" \"nick\": \"test\", \"channels\": [{\"name\": \"#test\", \"filters\": [%s]}]}]}", filters_json);
+	char * filename = writeConf(json);
+	if (!filename) {
+		return NULL;
+	}
+	irc_conf_t * irc_conf = irc_conf_new();
+	int ok = irc_conf_load(irc_conf, filename);
+	if (ok && from_image) {
+		char image_filename[64];
+		snprintf(image_filename, sizeof(image_filename), "%s.bin", filename);
+		ok = irc_conf_write_image(irc_conf, image_filename);
+		irc_conf_free(irc_conf);
+		irc_conf = irc_conf_new();
+		ok = ok && irc_conf_load_image(irc_conf, filename, image_filename);
+		unlink(image_filename);
+	}
+	unlink(filename);
+	free(filename);
+	if (!ok) {
+		irc_conf_free(irc_conf);
+		return NULL;
+	}
+	return irc_conf;
+}
+
+static const channel_conf_t * getChannel(const irc_conf_t * irc_conf) {
+	return server_conf_get_channel_at(irc_conf_get_server_at(irc_conf, 0), 0);
+}
+
+static filter_set_t * newFilterSet(const char * filters_json) {
+	irc_conf_t * irc_conf = loadConf(filters_json, 0);
+	if (!irc_conf) {
+		return NULL;
+	}
+	filter_set_t * filter_set = filter_set_new(getChannel(irc_conf));
+	irc_conf_free(irc_conf);
+	return filter_set;
+}
+
+static void onCapture(const char * var, const char * value, int value_len, void * data) {
+	test_match_t * match = (test_match_t *) data;
+	snprintf(match->var, sizeof(match->var), "%s", var);
+	snprintf(match->value, sizeof(match->value), "%.*s", value_len, value);
+}
+
+static void onMatch(compiled_filter_t * filter, const char ** lines, int lines_count, void * data) {
+	test_match_t * match = (test_match_t *) data;
+	match->matches++;
+	snprintf(match->name, sizeof(match->name), "%s", compiled_filter_get_name(filter));
+	compiled_filter_foreach_capture(filter, lines, lines_count, onCapture, match);
+}
+
+static int feed(filter_set_t * filter_set, const char * raw, test_match_t * match) {
+	normalized_line_t line;
+	normalize_line(&line, raw);
+	memset(match, 0, sizeof(test_match_t));
+	return filter_set_feed(filter_set, &line, NULL, onMatch, match);
+}
+
+// -----
+
+/*
+ * A set kept over a reload, as onSessionUpdate() does, outlives the
+ * configuration it was built from.
+ */
+static int checkReloadKeepsFilterSet(int from_image) {
+	static const char * filters = "{\"name\": \"upload\", \"regexes\": [{\"regex\": \"^Accepted ([^ ]+)\","
+			" \"vars\": [\"package\"]}]}";
+	irc_conf_t * old_conf = loadConf(filters, from_image);
+	CHECK(old_conf);
+	filter_set_t * filter_set = filter_set_new(getChannel(old_conf));
+	CHECK(filter_set);
+
+	irc_conf_t * new_conf = loadConf(filters, from_image);
+	CHECK(new_conf);
+	CHECK(channel_conf_same_filters(getChannel(old_conf), getChannel(new_conf)));
+	irc_conf_free(old_conf);
+
+	test_match_t match;
+	CHECK(feed(filter_set, "Accepted testIrc (1.0)", &match) == 1);
+	CHECK(!strcmp(match.name, "upload"));
+	CHECK(!strcmp(match.var, "package"));
+	CHECK(!strcmp(match.value, "testIrc"));
+	// the stats report
+	compiled_filter_t * filter = filter_set_get_at(filter_set, 0);
+	CHECK(!strcmp(compiled_filter_get_name(filter), "upload"));
+	CHECK(compiled_filter_get_stats(filter)->matches == 1);
+	CHECK(filter_set_get_stats(filter_set)->matches == 1);
+
+	filter_set_free(filter_set);
+	irc_conf_free(new_conf);
+	return 1;
+}
+
+/*
+ * Whether text matches regex, in a normalized filter, and once compiled.
+ */
+static int matches(const char * regex, const char * text, int * compiled) {
+	char filters[512];
+	snprintf(filters, sizeof(filters), "{\"name\": \"bracket\", \"regexes\": [{\"regex\": \"%s\"}]}", regex);
+	filter_set_t * filter_set = newFilterSet(filters);
+	*compiled = filter_set != NULL;
+	if (!filter_set) {
+		return 0;
+	}
+	test_match_t match;
+	int result = feed(filter_set, text, &match);
+	filter_set_free(filter_set);
+	return result;
+}
+
+#define CHECK_MATCH(regex, text, expected) do { \
+		int compiled; \
+		int matched = matches(regex, text, &compiled); \
+		if (!compiled || matched != (expected)) { \
+			fprintf(stderr, "%s:%d: check failed : %s on \"%s\" %s\n", __FILE__, __LINE__, regex, text, \
+					!compiled ? "does not compile" : (expected) ? "does not match" : "matches"); \
+			return 0; \
+		} \
+	} while (0)
+
+/*
+ * The bracket expressions of a normalized filter match case insensitively,
+ * without changing their set.
+ */
+static int checkFoldedBrackets() {
+	// a range spanning both cases, and the punctuation between them
+	CHECK_MATCH("^[A-z]$", "a", 1);
+	CHECK_MATCH("^[A-z]$", "Q", 1);
+	CHECK_MATCH("^[A-z]$", "_", 1);
+	CHECK_MATCH("^[A-z]$", "[", 1);
+	CHECK_MATCH("^[A-z]$", "`", 1);
+	CHECK_MATCH("^[A-z]$", "1", 0);
+	CHECK_MATCH("^[Z-a]$", "^", 1);
+	CHECK_MATCH("^[Z-a]$", "z", 1);
+	CHECK_MATCH("^[Z-a]$", "A", 1);
+	CHECK_MATCH("^[Z-a]$", "b", 0);
+	// negated : no letter in either case
+	CHECK_MATCH("^[^A-Z]$", "a", 0);
+	CHECK_MATCH("^[^A-Z]$", "A", 0);
+	CHECK_MATCH("^[^A-Z]$", "_", 1);
+	CHECK_MATCH("^[^A-Z]+$", "1 2-3", 1);
+	CHECK_MATCH("^[^a]$", "A", 0);
+	CHECK_MATCH("^[^a]$", "b", 1);
+	// classes
+	CHECK_MATCH("^[[:upper:]]+$", "Sid", 1);
+	CHECK_MATCH("^[[:upper:]]$", "1", 0);
+	CHECK_MATCH("^[^[:lower:]]$", "A", 0);
+	CHECK_MATCH("^[[:digit:]_]+$", "1_2", 1);
+	// the characters special in a list
+	CHECK_MATCH("^[]^-]+$", "]^-", 1);
+	CHECK_MATCH("^[^^]$", "^", 0);
+	CHECK_MATCH("^[^^]$", "x", 1);
+	// a backslash is literal in a list, written \\ in json
+	CHECK_MATCH("^[\\\\^]$", "^", 1);
+	CHECK_MATCH("^[\\\\^]$", "\\", 1);
+	// literals around them still folded
+	CHECK_MATCH("^Accepted [A-Z]+$", "ACCEPTED pkg", 1);
+	return 1;
+}
+
+// -----
+
+int main(int argc, char ** argv) {
+	log_set_level(LOG_LEVEL_WARN);
+	int ok = 1;
+	ok &= checkReloadKeepsFilterSet(0);
+	ok &= checkReloadKeepsFilterSet(1);
+	ok &= checkFoldedBrackets();
+	printf("filter_test : %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}